@@ -4,25 +4,166 @@
  * hemlock, May 2021
  */
 
+#define _POSIX_C_SOURCE 200809L  // mmap, fstat
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
-#include <ctype.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include "mem.h"
 #include "file.h"
 #include "grid.h"
 
+/**************** local types ********************/
+/* one entry of the visibility index: the cells visible from one position,
+ * stored as a bitset over the bounding box of those cells.
+ */
+typedef struct visEntry {
+  int r0, c0;           // top-left corner of the bounding box
+  int nrow, ncol;       // size of the bounding box
+  unsigned char bits[]; // nrow*ncol bits, row-major within the box
+} visEntry_t;
+
+/* the header of a precompiled map, as written by grid_save.
+ * Each section follows at an offset from the start of the file that is a
+ * multiple of 8, so the file can be mapped and used in place:
+ *   map       nrow*ncol characters
+ *   region    nrow*ncol ints, as grid->region
+ *   regionBox numRegions rectangles
+ *   empty     nrow*ncol ints, the first numEmpty in use, as grid->empty
+ *   emptyPos  nrow*ncol ints, as grid->emptyPos
+ *   runs      8*nrow*ncol bytes, as grid->runs
+ *   vis       nrow*ncol offsets of visibility entries, 0 for none;
+ *             the section itself is at offset 0 if the map has no index.
+ * Numbers are in the byte order of the machine that wrote the file.
+ */
+typedef struct gridBlob {
+  char magic[8];           // GridBlobMagic
+  uint32_t byteOrder;      // GridBlobByteOrder, as written
+  int32_t nrow, ncol;
+  int32_t numRegions;
+  int32_t numEmpty;
+  int32_t sightRadius;     // radius the visibility entries were computed for
+  uint64_t size;           // bytes in the file
+  uint64_t map, region, regionBox, empty, emptyPos, runs, vis; // section offsets
+} gridBlob_t;
+
+/* what a character is, from one lookup in grid_class rather than a chain
+ * of comparisons; '^' is what grid_getchar returns off the grid.
+ */
+enum {
+  cellRock = 0x01,       // ' '
+  cellBoundary = 0x02,   // '|', '-', '+'
+  cellEmpty = 0x04,      // '.'
+  cellGold = 0x08,       // '*'
+  cellPlayer = 0x10,     // a letter, or '@'
+  cellSolid = 0x20,      // rock, boundary, or '^': nobody moves there
+};
+static const int cellClear = cellEmpty | cellGold | cellPlayer; // does not block sight
+
+static const unsigned char grid_class[256] = {
+  [' '] = cellRock | cellSolid,
+  ['|'] = cellBoundary | cellSolid, ['-'] = cellBoundary | cellSolid, ['+'] = cellBoundary | cellSolid,
+  ['^'] = cellSolid,
+  ['.'] = cellEmpty,
+  ['*'] = cellGold,
+  ['@'] = cellPlayer,
+  ['A'] = cellPlayer, ['B'] = cellPlayer, ['C'] = cellPlayer, ['D'] = cellPlayer, ['E'] = cellPlayer, ['F'] = cellPlayer, ['G'] = cellPlayer, ['H'] = cellPlayer, ['I'] = cellPlayer, ['J'] = cellPlayer, ['K'] = cellPlayer, ['L'] = cellPlayer, ['M'] = cellPlayer,
+  ['N'] = cellPlayer, ['O'] = cellPlayer, ['P'] = cellPlayer, ['Q'] = cellPlayer, ['R'] = cellPlayer, ['S'] = cellPlayer, ['T'] = cellPlayer, ['U'] = cellPlayer, ['V'] = cellPlayer, ['W'] = cellPlayer, ['X'] = cellPlayer, ['Y'] = cellPlayer, ['Z'] = cellPlayer,
+  ['a'] = cellPlayer, ['b'] = cellPlayer, ['c'] = cellPlayer, ['d'] = cellPlayer, ['e'] = cellPlayer, ['f'] = cellPlayer, ['g'] = cellPlayer, ['h'] = cellPlayer, ['i'] = cellPlayer, ['j'] = cellPlayer, ['k'] = cellPlayer, ['l'] = cellPlayer, ['m'] = cellPlayer,
+  ['n'] = cellPlayer, ['o'] = cellPlayer, ['p'] = cellPlayer, ['q'] = cellPlayer, ['r'] = cellPlayer, ['s'] = cellPlayer, ['t'] = cellPlayer, ['u'] = cellPlayer, ['v'] = cellPlayer, ['w'] = cellPlayer, ['x'] = cellPlayer, ['y'] = cellPlayer, ['z'] = cellPlayer,
+};
+
+static const char GridBlobMagic[8] = "NUGGRID2";
+static const uint32_t GridBlobByteOrder = 0x01020304;
+
 /**************** global type ********************/
 typedef struct grid {
  char* map; //pointer to the character at (0,0)
  int nrow; 
  int ncol;
+ visEntry_t** vis; //visibility index, one slot per cell; NULL if not indexed
+ grid_rect_t visBox; //bounding box of the cells visible at the last visibility update
+ bool* visible; //scratch of grid_updateVisibility, all false between calls; NULL until used
+ unsigned long version; //bumped whenever a character changes
+ unsigned short* occupant; //id+1 of the entity on each cell, 0 if none; NULL until used
+ int* region; //region of each room spot, -1 elsewhere; NULL unless loaded from a map
+ grid_rect_t* regionBox; //bounding box of each region and the cells around it
+ int numRegions; //number of entries in regionBox
+ int sightRadius; //farthest distance a player sees, 0 for no limit
+ int* empty; //cell index of every empty room spot, in no order; NULL unless loaded from a map
+ int* emptyPos; //position of each cell in empty, -1 if it is not an empty room spot
+ int numEmpty; //number of entries in empty
+ void* blob; //mapping of a precompiled map holding map, region, regionBox, empty, emptyPos and runs; NULL if none
+ size_t blobSize; //bytes mapped at blob
+ const uint32_t* blobVis; //offsets of the visibility entries in blob; NULL if it has none
+ int blobRadius; //sight radius the entries in blob were computed for
+ unsigned char* runs; //steps a player can take from each cell in each direction, at most 255; NULL unless loaded
 } grid_t;
 
+/* index in a cell's runs of each direction (dr+1)*3 + (dc+1); -1 for no direction */
+static const int grid_runDir[9] = { 0, 1, 2, 3, -1, 4, 5, 6, 7 };
+static const int RunMax = 255;
+
+/* byte i of grid_seenMask[b] is 0xff if bit i of b is set, else 0:
+ * a mask over 8 cells for one byte of seen bits, in memory order
+ */
+#define SEEN_BYTE(b, i) (((b) >> (i) & 1) ? 0xff : 0)
+#define SEEN_MASK(b) { SEEN_BYTE(b, 0), SEEN_BYTE(b, 1), SEEN_BYTE(b, 2), SEEN_BYTE(b, 3), \
+                       SEEN_BYTE(b, 4), SEEN_BYTE(b, 5), SEEN_BYTE(b, 6), SEEN_BYTE(b, 7) }
+#define SEEN_MASK4(b) SEEN_MASK(b), SEEN_MASK(b + 1), SEEN_MASK(b + 2), SEEN_MASK(b + 3)
+#define SEEN_MASK16(b) SEEN_MASK4(b), SEEN_MASK4(b + 4), SEEN_MASK4(b + 8), SEEN_MASK4(b + 12)
+#define SEEN_MASK64(b) SEEN_MASK16(b), SEEN_MASK16(b + 16), SEEN_MASK16(b + 32), SEEN_MASK16(b + 48)
+static const unsigned char grid_seenMask[256][8] = {
+  SEEN_MASK64(0), SEEN_MASK64(64), SEEN_MASK64(128), SEEN_MASK64(192)
+};
+
+/* the cells one player has seen, and the gold and players they see now */
+struct grid_seen {
+  grid_t* raw;           //map the player moves on
+  unsigned char* bits;   //one bit per cell, row-major: set once the cell has been visible
+  int stride;            //bits per row, a multiple of 64 so rows start on a word
+  int* cells;            //cells shown other than as in raw, in row-major order
+  char* chars;           //what each of them shows: gold, a player, or '@'
+  int numCells;
+  int cellsSize;         //slots allocated in cells and chars
+  int* spareCells;       //the list before last, its slots reused for the next one
+  char* spareChars;
+  int spareSize;         //slots allocated in spareCells and spareChars
+  unsigned long version; //bumped whenever what the player sees changes
+};
+
 /************* Local Function Prototypes ******************/
+static inline int grid_classOf(grid_t* grid, int r, int c);
+static inline char grid_at(grid_t* grid, int r, int c);
+static inline int grid_classAt(grid_t* grid, int r, int c);
+static int grid_cleanBlocks(const char* raw, char* known, int size, unsigned long* version);
+static bool grid_sameLayout(grid_t* master, grid_t* raw, grid_t* known, int pr, int pc);
+static void grid_seenAdd(grid_seen_t* seen, int cell, char ch);
 static bool grid_isVisible(grid_t* master, int pr, int pc, int r, int c);
 static bool grid_isBlockable(grid_t* grid, int r, int c);
+static visEntry_t* grid_visEntry(grid_t* raw, int pr, int pc);
+static visEntry_t* grid_traceEntry(grid_t* raw, int pr, int pc);
+static bool grid_entryHas(visEntry_t* entry, int r, int c);
+static void grid_rectAdd(grid_rect_t* rect, int r, int c);
+static void grid_findRegions(grid_t* grid);
+static void grid_findEmpty(grid_t* grid);
+static void grid_findRuns(grid_t* grid);
+static grid_t* grid_parseText(const char* text, size_t size);
+static grid_t* grid_mapBlob(void* blob, size_t size);
+static bool grid_runsMatch(const char* map, const unsigned char* runs, int nrow, int ncol);
+static bool grid_blobFits(size_t size, uint64_t offset, uint64_t length);
+static bool grid_writeSection(FILE* fp, const void* data, size_t length);
+static grid_rect_t grid_sightBox(grid_t* raw, int pr, int pc, bool useRegions);
+static bool grid_inSight(grid_t* raw, int pr, int pc, int r, int c);
 
 /********************** grid_new **************************/
 /* initializes a grid, caller responsible for freeing the grid by grid_delete()
@@ -40,6 +181,23 @@ grid_new (int nrow, int ncol)
 
   grid->nrow = nrow;
   grid->ncol = ncol;
+  grid->vis = NULL;
+  grid->visBox = (grid_rect_t){ 0, 0, -1, -1 };
+  grid->visible = NULL;
+  grid->version = 0;
+  grid->occupant = NULL;
+  grid->region = NULL;
+  grid->regionBox = NULL;
+  grid->numRegions = 0;
+  grid->sightRadius = 0;
+  grid->empty = NULL;
+  grid->emptyPos = NULL;
+  grid->numEmpty = 0;
+  grid->blob = NULL;
+  grid->blobSize = 0;
+  grid->blobVis = NULL;
+  grid->blobRadius = 0;
+  grid->runs = NULL;
 
   grid->map = mem_calloc_assert(nrow*ncol, sizeof(char), "out of memory"); //allocate size for nrow*ncol characters
 
@@ -53,66 +211,323 @@ grid_new (int nrow, int ncol)
 }
 
 /*********************** grid_load ************************/
-/* loads a grid from a given filename.
+/* loads a grid from a given filename: a map text file, or a map
+ * precompiled by grid_save.
  * returns a pointer to a grid.
- * returns NULL if failed to open file or filename is invalid.
+ * returns NULL if failed to open file, or it holds no map.
  * caller is responsible for later freeing the grid using grid_delete()
  */
 grid_t*
 grid_load (char* mapFilename)
 {
-  FILE* fp;
-  char* pathname = NULL;
-  pathname = mem_malloc_assert(strlen(mapFilename)+1, "out of memory\n");
-  
-  //read file name and consturct directory path
-  if(sprintf(pathname, "%s", mapFilename) < 0){
-    fprintf(stdout, "invalid file name.\n");
-    mem_free(pathname);
+  if (mapFilename == NULL) {
     return NULL;
   }
-  
+
   //try open file
-  if ((fp = fopen(pathname, "r")) == NULL) {
+  int fd = open(mapFilename, O_RDONLY);
+  if (fd < 0) {
     fprintf(stdout, "invalid file name\n");
-    mem_free(pathname);
     return NULL;
   }
 
-  int ncol = 0;
-  int nrow = 0;
+  //map the whole file; a precompiled map is used in place, a text map is copied
+  struct stat st;
+  void* data = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && st.st_size > 0) {
+    data = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  }
+  close(fd);
+  if (data == MAP_FAILED) {
+    return NULL;
+  }
+
+  size_t size = st.st_size;
+  if (size >= sizeof(gridBlob_t) && memcmp(data, GridBlobMagic, sizeof(GridBlobMagic)) == 0) {
+    grid_t* grid = grid_mapBlob(data, size);
+    if (grid == NULL) {
+      munmap(data, size);
+    }
+    return grid;
+  }
+
+  grid_t* grid = grid_parseText(data, size);
+  munmap(data, size);
+  return grid;
+}
 
-  nrow = file_numLines(fp); //num of lines in the map file
-  char* firstline = file_readLine(fp); 
-  ncol = strlen(firstline); //num of characters in each line
-  fclose(fp);
-  free(firstline);
+/*********************** grid_parseText ************************/
+/* makes a grid from the text of a map: one row per line, as wide as the
+ * first line. Shorter lines are padded with rock and longer ones cut.
+ * returns NULL if the text has no complete line.
+ */
+static grid_t*
+grid_parseText(const char* text, size_t size)
+{
+  const char* end = text + size;
+  int nrow = 0;
+  for (const char* p = text; (p = memchr(p, '\n', end - p)) != NULL; p++) {
+    nrow++;
+  }
+  if (nrow == 0) {
+    return NULL;
+  }
+  int ncol = (const char*)memchr(text, '\n', size) - text;
 
   grid_t* grid = grid_new(nrow, ncol);
-  
-  //open file again to load map
-  if ((fp = fopen(pathname, "r")) == NULL) {
-    mem_free(pathname);
+  const char* line = text;
+  for (int r = 0; r < nrow; r++) {
+    const char* eol = memchr(line, '\n', end - line);
+    int length = eol - line < ncol ? eol - line : ncol;
+    memcpy(grid->map + r*ncol, line, length);
+    line = eol + 1;
+  }
+  grid->version++;
+
+  grid_findRegions(grid);
+  grid_findEmpty(grid);
+  grid_findRuns(grid);
+  return grid;
+}
+
+/*********************** grid_mapBlob ************************/
+/* makes a grid over a mapped precompiled map, after checking that every
+ * section, index and visibility entry of it lies inside the file, that
+ * every region box lies on the map, and that empty and emptyPos list
+ * exactly the '.' of the map, each the other's inverse, as grid_update
+ * relies on.
+ * The mapping is private, so the grid may be updated like any other;
+ * only the pages it changes are copied, the others stay shared with
+ * every other mapping of the file.
+ * returns NULL, leaving the mapping to the caller, if the file is not
+ * a map written by grid_save on a machine like this one.
+ */
+static grid_t*
+grid_mapBlob(void* blob, size_t size)
+{
+  gridBlob_t* head = blob;
+  if (head->byteOrder != GridBlobByteOrder || head->size != size
+      || head->nrow <= 0 || head->ncol <= 0 || head->numRegions < 0
+      || head->numEmpty < 0 || head->sightRadius < 0) {
     return NULL;
   }
-  
-  //for each character in the file, store in grid
-  for(int r = 0; r < nrow; r++){
-    for(int c = 0; c < ncol; c++){
-      char ch = fgetc(fp);
-      if(ch == '\n'){
-        ch = fgetc(fp); //skip new line character
+  uint64_t cells = (uint64_t)head->nrow * head->ncol;
+  if (cells > INT32_MAX || head->numEmpty > cells
+      || !grid_blobFits(size, head->map, cells)
+      || !grid_blobFits(size, head->region, cells*sizeof(int))
+      || !grid_blobFits(size, head->regionBox, head->numRegions*sizeof(grid_rect_t))
+      || !grid_blobFits(size, head->empty, cells*sizeof(int))
+      || !grid_blobFits(size, head->emptyPos, cells*sizeof(int))
+      || !grid_blobFits(size, head->runs, 8*cells)
+      || (head->vis != 0 && !grid_blobFits(size, head->vis, cells*sizeof(uint32_t)))) {
+    return NULL;
+  }
+
+  char* base = blob;
+  int* region = (int*)(base + head->region);
+  int* empty = (int*)(base + head->empty);
+  int* emptyPos = (int*)(base + head->emptyPos);
+  int numDots = 0;
+  for (int i = 0; i < cells; i++) {
+    bool dot = base[head->map + i] == '.';
+    numDots += dot;
+    if (region[i] < -1 || region[i] >= head->numRegions
+        || emptyPos[i] < -1 || emptyPos[i] >= head->numEmpty
+        || dot != (emptyPos[i] >= 0)
+        || (dot && empty[emptyPos[i]] != i)) {
+      return NULL;
+    }
+  }
+  if (numDots != head->numEmpty) {
+    return NULL; // so every entry of empty is some dot's, and none twice
+  }
+  const grid_rect_t* regionBox = (const grid_rect_t*)(base + head->regionBox);
+  for (int i = 0; i < head->numRegions; i++) {
+    const grid_rect_t* box = &regionBox[i];
+    if (box->r0 < 0 || box->c0 < 0 || box->r0 > box->r1 || box->c0 > box->c1
+        || box->r1 >= head->nrow || box->c1 >= head->ncol) {
+      return NULL;
+    }
+  }
+  if (!grid_runsMatch(base + head->map, (const unsigned char*)(base + head->runs),
+                      head->nrow, head->ncol)) {
+    return NULL; // player_sprint trusts the runs not to cross a wall
+  }
+  const uint32_t* vis = head->vis != 0 ? (const uint32_t*)(base + head->vis) : NULL;
+  for (int i = 0; vis != NULL && i < cells; i++) {
+    if (vis[i] != 0) {
+      const visEntry_t* entry = (const visEntry_t*)(base + vis[i]);
+      if (!grid_blobFits(size, vis[i], sizeof(visEntry_t))
+          || entry->nrow <= 0 || entry->ncol <= 0 || entry->r0 < 0 || entry->c0 < 0
+          || entry->r0 + entry->nrow > head->nrow || entry->c0 + entry->ncol > head->ncol
+          || !grid_blobFits(size, vis[i], sizeof(visEntry_t) + (entry->nrow*entry->ncol + 7)/8)) {
+        return NULL;
       }
-      grid_update(grid, r, c, ch);      
     }
-  }    
-  
-  fclose(fp);
-  mem_free(pathname);
+  }
 
+  grid_t* grid = grid_new(0, 0);
+  free(grid->map);
+  grid->nrow = head->nrow;
+  grid->ncol = head->ncol;
+  grid->version = 1;
+  grid->map = base + head->map;
+  grid->region = region;
+  grid->regionBox = (grid_rect_t*)(base + head->regionBox);
+  grid->numRegions = head->numRegions;
+  grid->empty = empty;
+  grid->emptyPos = emptyPos;
+  grid->numEmpty = head->numEmpty;
+  grid->blob = blob;
+  grid->blobSize = size;
+  grid->blobVis = vis;
+  grid->blobRadius = head->sightRadius;
+  grid->runs = (unsigned char*)(base + head->runs);
   return grid;
 }
 
+/*********************** grid_blobFits ************************/
+/* returns true if length bytes at offset lie inside a file of size bytes,
+ * and the offset is aligned for any section.
+ */
+static bool
+grid_blobFits(size_t size, uint64_t offset, uint64_t length)
+{
+  return offset >= sizeof(gridBlob_t) && offset % 8 == 0
+    && offset <= size && length <= size - offset;
+}
+
+/*********************** grid_runsMatch ************************/
+/* returns true if a table of runs, as grid_findRuns makes, fits the map:
+ * in each direction a cell's run is 0 if the next cell is off the map
+ * or solid, else one more than the next cell's, up to RunMax.
+ */
+static bool
+grid_runsMatch(const char* map, const unsigned char* runs, int nrow, int ncol)
+{
+  for (int d = 0; d < 9; d++) {
+    int dir = grid_runDir[d];
+    int dr = d / 3 - 1;
+    int dc = d % 3 - 1;
+    if (dir < 0) {
+      continue;
+    }
+    int step = dr*ncol + dc; //to the next cell in this direction
+    for (int r = 0; r < nrow; r++) {
+      bool lastRow = r + dr < 0 || r + dr >= nrow;
+      for (int c = 0; c < ncol; c++) {
+        int cell = r*ncol + c;
+        int run = 0;
+        if (!lastRow && c + dc >= 0 && c + dc < ncol
+            && !(grid_class[(unsigned char)map[cell + step]] & cellSolid)) {
+          int next = runs[8*(cell + step) + dir];
+          run = next < RunMax ? next + 1 : RunMax;
+        }
+        if (runs[8*cell + dir] != run) {
+          return false;
+        }
+      }
+    }
+  }
+  return true;
+}
+
+/*********************** grid_save ************************/
+/* writes a loaded grid, and the index entry of every spot a player can
+ * stand on if the grid is indexed, to a precompiled map file.
+ * returns false if the grid was not loaded from a map, or on a write error.
+ */
+bool
+grid_save(grid_t* raw, const char* filename)
+{
+  if (raw == NULL || filename == NULL || raw->region == NULL || raw->empty == NULL || raw->runs == NULL) {
+    return false;
+  }
+  int cells = raw->nrow*raw->ncol;
+
+  //lay out the sections, 8-byte aligned, then the entries
+  gridBlob_t head;
+  memset(&head, 0, sizeof(head));
+  memcpy(head.magic, GridBlobMagic, sizeof(GridBlobMagic));
+  head.byteOrder = GridBlobByteOrder;
+  head.nrow = raw->nrow;
+  head.ncol = raw->ncol;
+  head.numRegions = raw->numRegions;
+  head.numEmpty = raw->numEmpty;
+  head.sightRadius = raw->sightRadius;
+  uint64_t offset = (sizeof(head) + 7) / 8 * 8;
+  head.map = offset;
+  offset += (cells + 7) / 8 * 8;
+  head.region = offset;
+  offset += (cells*sizeof(int) + 7) / 8 * 8;
+  head.regionBox = offset;
+  offset += (raw->numRegions*sizeof(grid_rect_t) + 7) / 8 * 8;
+  head.empty = offset;
+  offset += (cells*sizeof(int) + 7) / 8 * 8;
+  head.emptyPos = offset;
+  offset += (cells*sizeof(int) + 7) / 8 * 8;
+  head.runs = offset;
+  offset += 8*cells;
+
+  uint32_t* vis = NULL;
+  if (raw->vis != NULL) {
+    head.vis = offset;
+    offset += (cells*sizeof(uint32_t) + 7) / 8 * 8;
+    vis = mem_calloc_assert(cells > 0 ? cells : 1, sizeof(uint32_t), "out of memory");
+    for (int i = 0; i < cells; i++) {
+      visEntry_t* entry = grid_visEntry(raw, i / raw->ncol, i % raw->ncol);
+      if (entry != NULL) {
+        if (offset > UINT32_MAX) {
+          free(vis);
+          return false;
+        }
+        vis[i] = offset;
+        offset += (sizeof(visEntry_t) + (entry->nrow*entry->ncol + 7)/8 + 7) / 8 * 8;
+      }
+    }
+  }
+  head.size = offset;
+
+  FILE* fp = fopen(filename, "w");
+  if (fp == NULL) {
+    free(vis);
+    return false;
+  }
+  bool ok = grid_writeSection(fp, &head, sizeof(head))
+    && grid_writeSection(fp, raw->map, cells)
+    && grid_writeSection(fp, raw->region, cells*sizeof(int))
+    && grid_writeSection(fp, raw->regionBox, raw->numRegions*sizeof(grid_rect_t))
+    && grid_writeSection(fp, raw->empty, cells*sizeof(int))
+    && grid_writeSection(fp, raw->emptyPos, cells*sizeof(int))
+    && grid_writeSection(fp, raw->runs, 8*cells);
+  if (vis != NULL) {
+    ok = ok && grid_writeSection(fp, vis, cells*sizeof(uint32_t));
+    for (int i = 0; ok && i < cells; i++) {
+      if (vis[i] != 0) {
+        visEntry_t* entry = grid_visEntry(raw, i / raw->ncol, i % raw->ncol);
+        ok = grid_writeSection(fp, entry, sizeof(visEntry_t) + (entry->nrow*entry->ncol + 7)/8);
+      }
+    }
+  }
+  free(vis);
+  if (fclose(fp) != 0) {
+    ok = false;
+  }
+  return ok;
+}
+
+/*********************** grid_writeSection ************************/
+/* writes length bytes, then zeros up to the next multiple of 8.
+ * returns false on a write error.
+ */
+static bool
+grid_writeSection(FILE* fp, const void* data, size_t length)
+{
+  static const char zeros[8] = { 0 };
+  return (length == 0 || fwrite(data, 1, length, fp) == length)
+    && fwrite(zeros, 1, (8 - length % 8) % 8, fp) == (8 - length % 8) % 8;
+}
+
 /******************** grid_nrow ************************/
 /* returns number of row for the given grid
  * returns -1 if grid is NULL
@@ -158,6 +573,7 @@ grid_getchar (grid_t* grid, int r, int c)
 /********************** grid_update ************************/
 /* Updates the character at the given row and col.
  * Does nothing if grid is NULL, or if row and col is out of bounds.
+ * Bumps the version only if the character actually changes.
  */
 void 
 grid_update(grid_t* grid, int r, int c, char ch)
@@ -167,11 +583,67 @@ grid_update(grid_t* grid, int r, int c, char ch)
     int ncol = grid->ncol;
 
     if (r >= 0 && r < nrow && c >= 0 && c < ncol) { 
-        *(grid->map + r*ncol + c) = ch;
+      char* cell = grid->map + r*ncol + c;
+      if (*cell != ch) {
+        //keep the empty room spots listed: swap-remove the spot, or append it
+        if (grid->empty != NULL && (*cell == '.') != (ch == '.')) {
+          int i = r*ncol + c;
+          if (ch == '.') {
+            grid->emptyPos[i] = grid->numEmpty;
+            grid->empty[grid->numEmpty++] = i;
+          } else {
+            int last = grid->empty[--grid->numEmpty];
+            grid->empty[grid->emptyPos[i]] = last;
+            grid->emptyPos[last] = grid->emptyPos[i];
+            grid->emptyPos[i] = -1;
+          }
+        }
+        *cell = ch;
+        grid->version++;
+      }
+    }
+  }
+}
+
+/********************** grid_version ************************/
+/* returns the version of the grid, 0 if grid is NULL.
+ */
+unsigned long
+grid_version(grid_t* grid)
+{
+  if(grid == NULL){
+    return 0;
+  }
+  return grid->version;
+}
+
+/********************** grid_setOccupant ************************/
+/* Records the entity id at the given row and col; negative id clears it.
+ * Does nothing if grid is NULL, or if row and col is out of bounds.
+ */
+void
+grid_setOccupant(grid_t* grid, int r, int c, int id)
+{
+  if (grid != NULL && r >= 0 && r < grid->nrow && c >= 0 && c < grid->ncol) {
+    if (grid->occupant == NULL) {
+      grid->occupant = mem_calloc_assert(grid->nrow*grid->ncol, sizeof(unsigned short), "out of memory");
     }
+    grid->occupant[r*grid->ncol + c] = id < 0 ? 0 : id + 1;
   }
 }
 
+/********************** grid_occupant ************************/
+/* Returns the entity id at the given row and col, -1 if none.
+ */
+int
+grid_occupant(grid_t* grid, int r, int c)
+{
+  if (grid == NULL || grid->occupant == NULL || r < 0 || r >= grid->nrow || c < 0 || c >= grid->ncol) {
+    return -1;
+  }
+  return grid->occupant[r*grid->ncol + c] - 1;
+}
+
 /******************** grid_isBlockable *******************/
 /* returns true if the character at given row and col is a valid room space.
  * returns false otherwise.
@@ -180,7 +652,7 @@ grid_update(grid_t* grid, int r, int c, char ch)
 static bool 
 grid_isBlockable(grid_t* grid, int r, int c)
 {
-  return grid_getchar(grid, r, c) != '.' && grid_getchar(grid, r, c) != '*' && !grid_isPlayer(grid, r, c);
+  return (grid_classOf(grid, r, c) & cellClear) == 0;
 }
 
 /******************** grid_isEmptyRoomSpot *******************/
@@ -191,7 +663,33 @@ grid_isBlockable(grid_t* grid, int r, int c)
 bool 
 grid_isEmptyRoomSpot(grid_t* grid, int r, int c)
 {
-  return grid_getchar(grid, r, c) == '.';
+  return (grid_classOf(grid, r, c) & cellEmpty) != 0;
+}
+
+/******************** grid_numEmpty *******************/
+/* returns the number of empty room spots of a grid loaded from a map,
+ * kept up to date by grid_update; 0 if grid is NULL or was not loaded.
+ */
+int
+grid_numEmpty(grid_t* grid)
+{
+  return grid == NULL ? 0 : grid->numEmpty;
+}
+
+/******************** grid_emptySpot *******************/
+/* stores in (*r,*c) the k'th empty room spot, 0 <= k < grid_numEmpty(grid);
+ * the order is arbitrary and changes as the grid does.
+ * returns false, storing nothing, if there is no such spot.
+ */
+bool
+grid_emptySpot(grid_t* grid, int k, int* r, int* c)
+{
+  if (grid == NULL || k < 0 || k >= grid->numEmpty || r == NULL || c == NULL) {
+    return false;
+  }
+  *r = grid->empty[k] / grid->ncol;
+  *c = grid->empty[k] % grid->ncol;
+  return true;
 }
 
 /******************** grid_isPlayer *******************/
@@ -202,7 +700,7 @@ grid_isEmptyRoomSpot(grid_t* grid, int r, int c)
 bool 
 grid_isPlayer(grid_t* grid, int r, int c)
 {
-  return isalpha(grid_getchar(grid, r, c)) != 0 || grid_getchar(grid, r, c) == '@';
+  return (grid_classOf(grid, r, c) & cellPlayer) != 0;
 }
 
 /********************* grid_isGold ***********************/
@@ -213,7 +711,7 @@ grid_isPlayer(grid_t* grid, int r, int c)
 bool
 grid_isGold(grid_t* grid, int r, int c)
 {   
-  return grid_getchar(grid, r, c) == '*';
+  return (grid_classOf(grid, r, c) & cellGold) != 0;
 }
 
 /********************* grid_isBoundary ***********************/
@@ -224,7 +722,7 @@ grid_isGold(grid_t* grid, int r, int c)
 bool
 grid_isBoundary(grid_t* grid, int r, int c)
 {
-  return grid_getchar(grid, r, c) == '|' || grid_getchar(grid, r, c) == '-' || grid_getchar(grid, r, c) == '+';
+  return (grid_classOf(grid, r, c) & cellBoundary) != 0;
 }
 
 /********************* grid_isRock ***********************/
@@ -235,7 +733,7 @@ grid_isBoundary(grid_t* grid, int r, int c)
 bool
 grid_isRock(grid_t* grid, int r, int c)
 {
-  return grid_getchar(grid, r, c) == ' ';
+  return (grid_classOf(grid, r, c) & cellRock) != 0;
 }
 
 /********************* grid_canMoveTo ***********************/
@@ -246,7 +744,47 @@ grid_isRock(grid_t* grid, int r, int c)
 bool
 grid_canMoveTo(grid_t* grid, int r, int c)
 {
-  return !grid_isBoundary(grid, r, c)&&!grid_isRock(grid, r, c) && grid_getchar(grid, r, c) != '^';
+  return (grid_classOf(grid, r, c) & cellSolid) == 0;
+}
+
+/********************* grid_runLength ***********************/
+/* returns the number of steps from (r,c) in direction (dr,dc) before a
+ * cell one cannot move to, from the table of a loaded grid; a run longer
+ * than the table holds is read in pieces. Other grids are stepped along.
+ * returns 0 if (r,c) is off the grid or the direction is not one of the 8.
+ */
+int
+grid_runLength(grid_t* grid, int r, int c, int dr, int dc)
+{
+  if (grid == NULL || r < 0 || r >= grid->nrow || c < 0 || c >= grid->ncol
+      || dr < -1 || dr > 1 || dc < -1 || dc > 1 || (dr == 0 && dc == 0)) {
+    return 0;
+  }
+
+  int dir = grid_runDir[(dr + 1)*3 + (dc + 1)];
+  int steps = 0;
+  if (grid->runs != NULL) {
+    //never past the edge, whatever a precompiled table says
+    int edge = grid->nrow + grid->ncol;
+    if (dr != 0) {
+      edge = dr > 0 ? grid->nrow - 1 - r : r;
+    }
+    if (dc != 0) {
+      int cedge = dc > 0 ? grid->ncol - 1 - c : c;
+      edge = cedge < edge ? cedge : edge;
+    }
+    int run;
+    do {
+      run = grid->runs[8*((r + steps*dr)*grid->ncol + c + steps*dc) + dir];
+      steps = steps + run < edge ? steps + run : edge;
+    } while (run == RunMax && steps < edge);
+  }
+  else {
+    while (grid_canMoveTo(grid, r + (steps + 1)*dr, c + (steps + 1)*dc)) {
+      steps++;
+    }
+  }
+  return steps;
 }
 
 /********************* grid_setVisibility ***********************/
@@ -255,21 +793,728 @@ grid_canMoveTo(grid_t* grid, int r, int c)
  */
 void
 grid_setVisibility(grid_t* master, grid_t* raw, grid_t* known, int pr, int pc){
-  if (master != NULL || raw != NULL || known != NULL) {   
+  if (grid_sameLayout(master, raw, known, pr, pc)) {
     grid_clean(raw, known); //clean grid of player and gold information
 
-    //update "known" grid according to master
-    for(int r = 0; r < master->nrow; r++){
-      for(int c = 0; c < master->ncol; c++){
-        if(!grid_isRock(master, r, c)){ //ignore ' '
-          if(grid_isVisible(master, pr, pc, r, c)){ //if point in map is visible to the player
-            grid_update(known, r, c, grid_getchar(master, r, c)); //update known
+    visEntry_t* entry = grid_visEntry(raw, pr, pc);
+    grid_rect_t box = { pr, pc, pr, pc }; //bounding box of visible cells
+    if (entry != NULL) {
+      //update "known" grid from the cells recorded in the index
+      for (int i = 0; i < entry->nrow; i++) {
+        for (int j = 0; j < entry->ncol; j++) {
+          int bit = i*entry->ncol + j;
+          if (entry->bits[bit/8] & (1 << (bit%8))) {
+            int r = entry->r0 + i;
+            int c = entry->c0 + j;
+            grid_update(known, r, c, grid_getchar(master, r, c));
+            grid_rectAdd(&box, r, c);
+          }
+        }
+      }
+    }
+    else {
+      //update "known" grid according to master, within sight of the player
+      grid_rect_t sight = grid_sightBox(raw, pr, pc, false);
+      for(int r = sight.r0; r <= sight.r1; r++){
+        for(int c = sight.c0; c <= sight.c1; c++){
+          if(!(grid_classAt(master, r, c) & cellRock) && grid_inSight(raw, pr, pc, r, c)){ //ignore ' '
+            if(grid_isVisible(master, pr, pc, r, c)){ //if point in map is visible to the player
+              grid_update(known, r, c, grid_at(master, r, c)); //update known
+              grid_rectAdd(&box, r, c);
+            }
           }
         }
       }
     }
     grid_update(known, pr, pc, '@');
+    known->visBox = box;
+  }
+}
+
+/********************* grid_updateVisibility ***********************/
+/* incrementally updates the "known" grid for the player's location (pr,pc).
+ * Gold and player glyphs can only be left in known inside the box visible
+ * at the previous update, so only that box and the newly visible one are
+ * examined. Each cell is written only if its character actually changes,
+ * which is what makes the reported dirty rectangle exact.
+ */
+void
+grid_updateVisibility(grid_t* master, grid_t* raw, grid_t* known,
+                      int pr, int pc, grid_rect_t* dirty)
+{
+  grid_rect_t changed = { 0, 0, -1, -1 };
+
+  if (grid_sameLayout(master, raw, known, pr, pc)) {
+    //find the cells visible from (pr,pc), from the index if possible
+    visEntry_t* entry = grid_visEntry(raw, pr, pc);
+    bool* visible = NULL;
+    grid_rect_t box = { pr, pc, pr, pc };
+    if (entry != NULL) {
+      grid_rectAdd(&box, entry->r0, entry->c0);
+      grid_rectAdd(&box, entry->r0 + entry->nrow - 1, entry->c0 + entry->ncol - 1);
+    }
+    else {
+      //the known grid's own scratch, so players updated on other threads never share it
+      if (known->visible == NULL) {
+        known->visible = mem_calloc_assert(known->nrow*known->ncol, sizeof(bool), "out of memory");
+      }
+      visible = known->visible;
+      grid_rect_t sight = grid_sightBox(raw, pr, pc, false);
+      for(int r = sight.r0; r <= sight.r1; r++){
+        for(int c = sight.c0; c <= sight.c1; c++){
+          if(!(grid_classAt(master, r, c) & cellRock) && grid_inSight(raw, pr, pc, r, c)
+             && grid_isVisible(master, pr, pc, r, c)){
+            visible[r*master->ncol + c] = true;
+            grid_rectAdd(&box, r, c);
+          }
+        }
+      }
+    }
+
+    //examine the union of the previous and the new visible box
+    grid_rect_t area = box;
+    grid_rectUnion(&area, &known->visBox);
+    for(int r = area.r0; r <= area.r1; r++){
+      for(int c = area.c0; c <= area.c1; c++){
+        bool isVisible = entry != NULL ? grid_entryHas(entry, r, c) : visible[r*master->ncol + c];
+        char old = grid_at(known, r, c);
+        char ch = old;
+        if(r == pr && c == pc){
+          ch = '@';
+        }
+        else if(isVisible){
+          ch = grid_at(master, r, c);
+        }
+        else if(grid_class[(unsigned char)old] & (cellGold | cellPlayer)){
+          ch = grid_at(raw, r, c); //no longer visible; forget the gold or player
+        }
+        if(ch != old){
+          grid_update(known, r, c, ch);
+          grid_rectAdd(&changed, r, c);
+        }
+      }
+    }
+    known->visBox = box;
+
+    //clear what was set, all inside box, for the next call
+    for(int r = box.r0; visible != NULL && r <= box.r1; r++){
+      memset(visible + r*known->ncol + box.c0, false, (box.c1 - box.c0 + 1)*sizeof(bool));
+    }
+  }
+
+  if (dirty != NULL) {
+    *dirty = changed;
+  }
+}
+
+/********************* grid_seenNew ***********************/
+/* makes the seen state of a player on the raw grid, who has seen nothing yet.
+ * returns NULL if raw is NULL.
+ */
+grid_seen_t*
+grid_seenNew(grid_t* raw)
+{
+  if (raw == NULL) {
+    return NULL;
+  }
+  grid_seen_t* seen = mem_malloc_assert(sizeof(grid_seen_t), "out of memory");
+  seen->raw = raw;
+  seen->stride = (raw->ncol + 63) / 64 * 64;
+  seen->bits = mem_calloc_assert(raw->nrow*seen->stride/8 + 1, 1, "out of memory");
+  //rock renders the same seen or not; count it seen, so runs of seen cells stay long
+  for (int r = 0; r < raw->nrow; r++) {
+    for (int c = 0; c < raw->ncol; c++) {
+      int bit = r*seen->stride + c;
+      if (grid_classAt(raw, r, c) & cellRock) {
+        seen->bits[bit/8] |= 1 << (bit%8);
+      }
+    }
+  }
+  seen->cells = NULL;
+  seen->chars = NULL;
+  seen->numCells = 0;
+  seen->cellsSize = 0;
+  seen->spareCells = NULL;
+  seen->spareChars = NULL;
+  seen->spareSize = 0;
+  seen->version = 0;
+  return seen;
+}
+
+/********************* grid_seenUpdate ***********************/
+/* marks the cells visible from (pr,pc) as seen, and lists the cells there
+ * where master differs from raw, plus '@' at (pr,pc). The new list is
+ * compared with the old one, both in row-major order, so the dirty
+ * rectangle takes in exactly the cells whose rendered character changes.
+ */
+void
+grid_seenUpdate(grid_t* master, grid_seen_t* seen, int pr, int pc, grid_rect_t* dirty)
+{
+  grid_rect_t changed = { 0, 0, -1, -1 };
+
+  if (seen != NULL && grid_sameLayout(master, seen->raw, seen->raw, pr, pc)) {
+    grid_t* raw = seen->raw;
+    int ncol = raw->ncol;
+    visEntry_t* entry = grid_visEntry(raw, pr, pc);
+    visEntry_t* traced = entry == NULL ? grid_traceEntry(raw, pr, pc) : NULL;
+    if (traced != NULL) {
+      entry = traced;
+    }
+
+    //set the old list aside, and build the new one in the spare slots
+    int* oldCells = seen->cells;
+    char* oldChars = seen->chars;
+    int oldSize = seen->cellsSize;
+    int numOld = seen->numCells;
+    seen->cells = seen->spareCells;
+    seen->chars = seen->spareChars;
+    seen->cellsSize = seen->spareSize;
+    seen->numCells = 0;
+    seen->spareCells = oldCells;
+    seen->spareChars = oldChars;
+    seen->spareSize = oldSize;
+
+    grid_rect_t box = { pr, pc, pr, pc };
+    grid_rectAdd(&box, entry->r0, entry->c0);
+    grid_rectAdd(&box, entry->r0 + entry->nrow - 1, entry->c0 + entry->ncol - 1);
+    int k = 0; //next cell of the old list
+    for (int r = box.r0; r <= box.r1; r++) {
+      for (int c = box.c0; c <= box.c1; c++) {
+        int cell = r*ncol + c;
+        int bit = r*seen->stride + c;
+        char ch = 0; //shown as in raw
+        if (r == pr && c == pc) {
+          ch = '@';
+        }
+        else if (grid_entryHas(entry, r, c)) {
+          if (!(seen->bits[bit/8] & (1 << (bit%8)))) {
+            seen->bits[bit/8] |= 1 << (bit%8);
+            grid_rectAdd(&changed, r, c);
+          }
+          if (master->map[cell] != raw->map[cell]) {
+            ch = master->map[cell];
+          }
+        }
+        if (ch != 0) {
+          seen->bits[bit/8] |= 1 << (bit%8);
+          grid_seenAdd(seen, cell, ch);
+        }
+
+        //the old list up to this cell: gone unless shown the same now
+        for (; k < numOld && oldCells[k] <= cell; k++) {
+          if (oldCells[k] < cell || oldChars[k] != ch) {
+            grid_rectAdd(&changed, oldCells[k] / ncol, oldCells[k] % ncol);
+          }
+        }
+        if (ch != 0 && (k == 0 || oldCells[k-1] != cell || oldChars[k-1] != ch)) {
+          grid_rectAdd(&changed, r, c);
+        }
+      }
+    }
+    for (; k < numOld; k++) {
+      grid_rectAdd(&changed, oldCells[k] / ncol, oldCells[k] % ncol);
+    }
+    free(traced);
+
+    if (changed.r0 <= changed.r1) {
+      seen->version++;
+    }
+  }
+
+  if (dirty != NULL) {
+    *dirty = changed;
+  }
+}
+
+/********************* grid_seenMark ***********************/
+/* marks the cells visible from (pr,pc) as seen, and nothing else.
+ */
+void
+grid_seenMark(grid_seen_t* seen, int pr, int pc, grid_rect_t* dirty)
+{
+  grid_rect_t changed = { 0, 0, -1, -1 };
+
+  if (seen != NULL && pr >= 0 && pr < seen->raw->nrow && pc >= 0 && pc < seen->raw->ncol) {
+    grid_t* raw = seen->raw;
+    visEntry_t* entry = grid_visEntry(raw, pr, pc);
+    visEntry_t* traced = entry == NULL ? grid_traceEntry(raw, pr, pc) : NULL;
+    if (traced != NULL) {
+      entry = traced;
+    }
+    //OR each row of the entry into the seen bits, up to a byte of them at a time
+    for (int r = 0; r < entry->nrow; r++) {
+      int from = r*entry->ncol;                     //entry bit of the row's first cell
+      int to = (entry->r0 + r)*seen->stride + entry->c0; //seen bit of that cell
+      for (int j = 0; j < entry->ncol; ) {
+        int n = 8 - to%8 < entry->ncol - j ? 8 - to%8 : entry->ncol - j;
+        unsigned v = entry->bits[from/8] >> (from%8);
+        if (from%8 + n > 8) {
+          v |= entry->bits[from/8 + 1] << (8 - from%8);
+        }
+        unsigned fresh = ((v & ((1u << n) - 1)) << (to%8)) & ~seen->bits[to/8];
+        if (fresh != 0) {
+          seen->bits[to/8] |= fresh;
+          for (int k = 0; k < n; k++) {
+            if (fresh & (1u << (to%8 + k))) {
+              grid_rectAdd(&changed, entry->r0 + r, entry->c0 + j + k);
+            }
+          }
+        }
+        from += n;
+        to += n;
+        j += n;
+      }
+    }
+    free(traced);
+    if (changed.r0 <= changed.r1) {
+      seen->version++;
+    }
+  }
+
+  if (dirty != NULL) {
+    *dirty = changed;
+  }
+}
+
+/********************* grid_seenAdd ***********************/
+/* appends a cell to the list of those shown other than as in raw,
+ * growing it only past the most it has held.
+ */
+static void
+grid_seenAdd(grid_seen_t* seen, int cell, char ch)
+{
+  if (seen->numCells == seen->cellsSize) {
+    seen->cellsSize = seen->cellsSize == 0 ? 16 : 2 * seen->cellsSize;
+    seen->cells = mem_assert(realloc(seen->cells, seen->cellsSize*sizeof(int)), "out of memory");
+    seen->chars = mem_assert(realloc(seen->chars, seen->cellsSize), "out of memory");
+  }
+  seen->cells[seen->numCells] = cell;
+  seen->chars[seen->numCells] = ch;
+  seen->numCells++;
+}
+
+/********************* grid_seenVersion ***********************/
+/* returns a counter that grows whenever what the player sees changes.
+ * returns 0 if seen is NULL.
+ */
+unsigned long
+grid_seenVersion(grid_seen_t* seen)
+{
+  return seen == NULL ? 0 : seen->version;
+}
+
+/********************* grid_seenRenderInto ***********************/
+/* writes what the player sees into buf, as grid_renderInto would: the raw
+ * character of every cell seen, rock elsewhere, then the listed cells.
+ * Runs of 64 cells all seen or all unseen are copied or cleared at once,
+ * and other cells taken eight at a time, masking a word of raw with grid_seenMask.
+ * returns the string length, or -1 if it does not fit in cap bytes.
+ */
+int
+grid_seenRenderInto(grid_seen_t* seen, char* buf, int cap)
+{
+  if (seen == NULL || buf == NULL || cap < grid_renderSize(seen->raw)) {
+    return -1;
+  }
+
+  grid_t* raw = seen->raw;
+  int ncol = raw->ncol;
+  uint64_t spaces;
+  memset(&spaces, ' ', sizeof(spaces));
+  char* p = buf;
+  for (int r = 0; r < raw->nrow; r++) {
+    const char* row = raw->map + r*ncol;
+    const unsigned char* bits = seen->bits + r*seen->stride/8;
+    int c = 0;
+    while (c + 8 <= ncol) {
+      uint64_t word;
+      if (c % 64 == 0 && c + 64 <= ncol
+          && (memcpy(&word, bits + c/8, sizeof(word)), word == 0 || word == UINT64_MAX)) {
+        int run = 64;
+        uint64_t next;
+        while (c + run + 64 <= ncol && (memcpy(&next, bits + (c + run)/8, sizeof(next)), next == word)) {
+          run += 64;
+        }
+        if (word == 0) {
+          memset(p, ' ', run);
+        } else {
+          memcpy(p, row + c, run);
+        }
+        p += run;
+        c += run;
+        continue;
+      }
+      uint64_t mask, chars;
+      memcpy(&mask, grid_seenMask[bits[c/8]], sizeof(mask));
+      memcpy(&chars, row + c, sizeof(chars));
+      chars = (chars & mask) | (spaces & ~mask);
+      memcpy(p, &chars, sizeof(chars));
+      p += 8;
+      c += 8;
+    }
+    for (; c < ncol; c++) {
+      *p++ = (bits[c/8] & (1 << (c%8))) ? row[c] : ' ';
+    }
+    *p++ = '\n';
+  }
+  *p = '\0';
+
+  for (int k = 0; k < seen->numCells; k++) {
+    int cell = seen->cells[k];
+    buf[cell / ncol * (ncol + 1) + cell % ncol] = seen->chars[k];
+  }
+  return p - buf;
+}
+
+/********************* grid_seenDelete ***********************/
+/* frees the seen state; the raw grid is the caller's.
+ */
+void
+grid_seenDelete(grid_seen_t* seen)
+{
+  if (seen != NULL) {
+    free(seen->bits);
+    free(seen->cells);
+    free(seen->chars);
+    free(seen->spareCells);
+    free(seen->spareChars);
+    free(seen);
+  }
+}
+
+/********************* grid_sameLayout ***********************/
+/* returns true if the three grids exist, are the same size, and have
+ * (pr,pc) on them, so visibility updates may index them unchecked.
+ */
+static bool
+grid_sameLayout(grid_t* master, grid_t* raw, grid_t* known, int pr, int pc)
+{
+  return master != NULL && raw != NULL && known != NULL
+    && master->nrow == raw->nrow && master->ncol == raw->ncol
+    && known->nrow == raw->nrow && known->ncol == raw->ncol
+    && pr >= 0 && pr < raw->nrow && pc >= 0 && pc < raw->ncol;
+}
+
+/********************* grid_rectUnion ***********************/
+/* grows rect to also cover other.
+ */
+void
+grid_rectUnion(grid_rect_t* rect, const grid_rect_t* other)
+{
+  if (rect != NULL && other != NULL && other->r0 <= other->r1) {
+    grid_rectAdd(rect, other->r0, other->c0);
+    grid_rectAdd(rect, other->r1, other->c1);
+  }
+}
+
+/********************* grid_indexVisibility ***********************/
+/* enables the visibility index on the raw grid.
+ * Entries are computed by grid_visEntry the first time a position is
+ * looked up, and reused by every later call to grid_setVisibility.
+ */
+void
+grid_indexVisibility(grid_t* raw)
+{
+  if (raw != NULL && raw->vis == NULL) {
+    raw->vis = mem_calloc_assert(raw->nrow*raw->ncol, sizeof(visEntry_t*), "out of memory");
+  }
+}
+
+/********************* grid_visEntry ***********************/
+/* returns the index entry for position (pr,pc) of the raw grid,
+ * computing and storing it if this is the first lookup.
+ * Returns NULL if the grid is not indexed, or (pr,pc) is not a spot
+ * a player can stand on; the caller then falls back to raytracing.
+ */
+static visEntry_t*
+grid_visEntry(grid_t* raw, int pr, int pc)
+{
+  if (raw == NULL || raw->vis == NULL || !grid_canMoveTo(raw, pr, pc)) {
+    return NULL;
+  }
+  //a precompiled entry, if the map has one for this sight radius
+  if (raw->blobVis != NULL && raw->blobRadius == raw->sightRadius
+      && raw->blobVis[pr*raw->ncol + pc] != 0) {
+    return (visEntry_t*)((char*)raw->blob + raw->blobVis[pr*raw->ncol + pc]);
+  }
+
+  visEntry_t** slot = raw->vis + pr*raw->ncol + pc;
+  if (*slot == NULL) {
+    *slot = grid_traceEntry(raw, pr, pc);
+  }
+  return *slot;
+}
+
+/********************* grid_traceEntry ***********************/
+/* raytraces the cells visible from (pr,pc) of the raw grid, which is on
+ * the grid, into a new entry; the caller frees it.
+ */
+static visEntry_t*
+grid_traceEntry(grid_t* raw, int pr, int pc)
+{
+  //raytrace every non-rock cell the player could see once, remembering the bounding box
+  grid_rect_t sight = grid_sightBox(raw, pr, pc, true);
+  int sightCol = sight.c1 - sight.c0 + 1;
+  bool* visible = mem_calloc_assert((sight.r1 - sight.r0 + 1)*sightCol, sizeof(bool), "out of memory");
+  int r0 = pr, c0 = pc, r1 = pr, c1 = pc;
+  for(int r = sight.r0; r <= sight.r1; r++){
+    for(int c = sight.c0; c <= sight.c1; c++){
+      if(!(grid_classAt(raw, r, c) & cellRock) && grid_inSight(raw, pr, pc, r, c)
+         && grid_isVisible(raw, pr, pc, r, c)){
+        visible[(r - sight.r0)*sightCol + c - sight.c0] = true;
+        if (r < r0) r0 = r;
+        if (r > r1) r1 = r;
+        if (c < c0) c0 = c;
+        if (c > c1) c1 = c;
+      }
+    }
+  }
+
+  //pack the visible cells into a bitset over the bounding box
+  int boxRow = r1 - r0 + 1;
+  int boxCol = c1 - c0 + 1;
+  visEntry_t* entry = mem_calloc_assert(1, sizeof(visEntry_t) + (boxRow*boxCol + 7)/8, "out of memory");
+  entry->r0 = r0;
+  entry->c0 = c0;
+  entry->nrow = boxRow;
+  entry->ncol = boxCol;
+  for (int i = 0; i < boxRow; i++) {
+    for (int j = 0; j < boxCol; j++) {
+      if (visible[(r0 + i - sight.r0)*sightCol + c0 + j - sight.c0]) {
+        int bit = i*boxCol + j;
+        entry->bits[bit/8] |= 1 << (bit%8);
+      }
+    }
+  }
+  free(visible);
+  return entry;
+}
+
+/********************* grid_indexSpot ***********************/
+/* computes the index entry for (pr,pc) ahead of its first use.
+ */
+void
+grid_indexSpot(grid_t* raw, int pr, int pc)
+{
+  grid_visEntry(raw, pr, pc);
+}
+
+/********************* grid_setSightRadius ***********************/
+/* limits what a player sees to the given distance; 0 removes the limit.
+ * Index entries computed under the old radius are discarded.
+ */
+void
+grid_setSightRadius(grid_t* raw, int radius)
+{
+  if (raw != NULL && radius >= 0 && radius != raw->sightRadius) {
+    raw->sightRadius = radius;
+    if (raw->vis != NULL) {
+      for (int i = 0; i < raw->nrow*raw->ncol; i++) {
+        free(raw->vis[i]);
+        raw->vis[i] = NULL;
+      }
+    }
+  }
+}
+
+/********************* grid_findRegions ***********************/
+/* labels the regions of a loaded grid: the groups of room spots joined
+ * side by side or corner to corner. A line of sight only passes through
+ * room spots, so from inside a region a player sees no farther than the
+ * region and the walls, doorways and passages right around it.
+ */
+static void
+grid_findRegions(grid_t* grid)
+{
+  int nrow = grid->nrow;
+  int ncol = grid->ncol;
+  grid->region = mem_malloc_assert(nrow*ncol*sizeof(int), "out of memory");
+  for (int i = 0; i < nrow*ncol; i++) {
+    grid->region[i] = -1;
+  }
+
+  int* stack = mem_malloc_assert(nrow*ncol*sizeof(int), "out of memory");
+  int nregions = 0;
+  int boxSize = 0;
+  for (int start = 0; start < nrow*ncol; start++) {
+    if (grid->region[start] >= 0 || grid->map[start] != '.') {
+      continue;
+    }
+    if (nregions == boxSize) {
+      boxSize = boxSize == 0 ? 16 : 2 * boxSize;
+      grid->regionBox = mem_assert(realloc(grid->regionBox, boxSize*sizeof(grid_rect_t)), "out of memory");
+    }
+
+    //flood fill the region, growing its box by one cell all around
+    grid_rect_t box = { 0, 0, -1, -1 };
+    int top = 0;
+    stack[top++] = start;
+    grid->region[start] = nregions;
+    while (top > 0) {
+      int cell = stack[--top];
+      int r = cell / ncol;
+      int c = cell % ncol;
+      grid_rectAdd(&box, r > 0 ? r - 1 : r, c > 0 ? c - 1 : c);
+      grid_rectAdd(&box, r < nrow - 1 ? r + 1 : r, c < ncol - 1 ? c + 1 : c);
+      for (int i = r - 1; i <= r + 1; i++) {
+        for (int j = c - 1; j <= c + 1; j++) {
+          if (i >= 0 && i < nrow && j >= 0 && j < ncol
+              && grid->region[i*ncol + j] < 0 && grid->map[i*ncol + j] == '.') {
+            grid->region[i*ncol + j] = nregions;
+            stack[top++] = i*ncol + j;
+          }
+        }
+      }
+    }
+    grid->regionBox[nregions++] = box;
+  }
+  grid->numRegions = nregions;
+  free(stack);
+}
+
+/********************* grid_findEmpty ***********************/
+/* lists the empty room spots of a freshly loaded grid, for grid_emptySpot.
+ */
+static void
+grid_findEmpty(grid_t* grid)
+{
+  int size = grid->nrow*grid->ncol;
+  grid->empty = mem_malloc_assert((size > 0 ? size : 1)*sizeof(int), "out of memory");
+  grid->emptyPos = mem_malloc_assert((size > 0 ? size : 1)*sizeof(int), "out of memory");
+  grid->numEmpty = 0;
+  for(int i = 0; i < size; i++){
+    grid->emptyPos[i] = -1;
+    if(grid->map[i] == '.'){
+      grid->emptyPos[i] = grid->numEmpty;
+      grid->empty[grid->numEmpty++] = i;
+    }
+  }
+}
+
+/********************* grid_findRuns ***********************/
+/* fills the table of grid_runLength for a freshly loaded grid. In each
+ * direction, every line of cells along it is walked back from the edge,
+ * a cell's run being one more than the next cell's if one can move there.
+ */
+static void
+grid_findRuns(grid_t* grid)
+{
+  int nrow = grid->nrow;
+  int ncol = grid->ncol;
+  grid->runs = mem_malloc_assert(8*nrow*ncol + 1, "out of memory");
+  bool* open = mem_malloc_assert(nrow*ncol + 1, "out of memory");
+  for (int i = 0; i < nrow*ncol; i++) {
+    open[i] = !(grid_class[(unsigned char)grid->map[i]] & cellSolid);
+  }
+
+  for (int dr = -1; dr <= 1; dr++) {
+    for (int dc = -1; dc <= 1; dc++) {
+      int dir = grid_runDir[(dr + 1)*3 + (dc + 1)];
+      if (dir < 0) {
+        continue;
+      }
+      //the lines start on the last row and the last column in this direction
+      int rEnd = dr > 0 ? nrow - 1 : 0;
+      int cEnd = dc > 0 ? ncol - 1 : 0;
+      int numStarts = (dr != 0 ? ncol : 0) + (dc != 0 ? nrow : 0);
+      for (int k = 0; k < numStarts; k++) {
+        int r = dr != 0 && k < ncol ? rEnd : k - (dr != 0 ? ncol : 0);
+        int c = dr != 0 && k < ncol ? k : cEnd;
+        if (dr != 0 && k >= ncol && r == rEnd) {
+          continue; //the corner, already walked from the last row
+        }
+        int run = 0;
+        while (true) {
+          int cell = r*ncol + c;
+          grid->runs[8*cell + dir] = run;
+          r -= dr;
+          c -= dc;
+          if (r < 0 || r >= nrow || c < 0 || c >= ncol) {
+            break;
+          }
+          run = !open[cell] ? 0 : run < RunMax ? run + 1 : RunMax;
+        }
+      }
+    }
+  }
+  free(open);
+}
+
+/********************* grid_sightBox ***********************/
+/* returns the rectangle holding every cell that could be visible from
+ * (pr,pc): the cells around the player and, if useRegions, the boxes of
+ * the regions the player is in or next to; otherwise the whole grid.
+ * The rectangle is then clipped to the sight radius.
+ */
+static grid_rect_t
+grid_sightBox(grid_t* raw, int pr, int pc, bool useRegions)
+{
+  grid_rect_t box = { 0, 0, raw->nrow - 1, raw->ncol - 1 };
+
+  if (useRegions && raw->region != NULL) {
+    box = (grid_rect_t){ pr, pc, pr, pc };
+    for (int i = pr - 1; i <= pr + 1; i++) {
+      for (int j = pc - 1; j <= pc + 1; j++) {
+        if (i >= 0 && i < raw->nrow && j >= 0 && j < raw->ncol) {
+          grid_rectAdd(&box, i, j);
+          int region = raw->region[i*raw->ncol + j];
+          if (region >= 0) {
+            grid_rectUnion(&box, &raw->regionBox[region]);
+          }
+        }
+      }
+    }
+  }
+
+  if (raw->sightRadius > 0) {
+    int radius = raw->sightRadius;
+    if (box.r0 < pr - radius) box.r0 = pr - radius;
+    if (box.r1 > pr + radius) box.r1 = pr + radius;
+    if (box.c0 < pc - radius) box.c0 = pc - radius;
+    if (box.c1 > pc + radius) box.c1 = pc + radius;
+  }
+  return box;
+}
+
+/********************* grid_inSight ***********************/
+/* returns true if (r,c) is within the sight radius of (pr,pc).
+ */
+static bool
+grid_inSight(grid_t* raw, int pr, int pc, int r, int c)
+{
+  int radius = raw->sightRadius;
+  return radius == 0 || (r - pr)*(r - pr) + (c - pc)*(c - pc) <= radius*radius;
+}
+
+/********************* grid_entryHas ***********************/
+/* returns true if the index entry records (r,c) as visible.
+ */
+static bool
+grid_entryHas(visEntry_t* entry, int r, int c)
+{
+  int i = r - entry->r0;
+  int j = c - entry->c0;
+  if (i < 0 || i >= entry->nrow || j < 0 || j >= entry->ncol) {
+    return false;
+  }
+  int bit = i*entry->ncol + j;
+  return (entry->bits[bit/8] & (1 << (bit%8))) != 0;
+}
+
+/********************* grid_rectAdd ***********************/
+/* grows the rectangle to include (r,c).
+ */
+static void
+grid_rectAdd(grid_rect_t* rect, int r, int c)
+{
+  if (rect->r0 > rect->r1) {
+    *rect = (grid_rect_t){ r, c, r, c };
+    return;
   }
+  if (r < rect->r0) rect->r0 = r;
+  if (r > rect->r1) rect->r1 = r;
+  if (c < rect->c0) rect->c0 = c;
+  if (c > rect->c1) rect->c1 = c;
 }
 
 /********************* grid_isVisible ***********************/
@@ -370,21 +1615,47 @@ grid_toString(grid_t* grid)
     return NULL;
   }
 
+  int size = grid_renderSize(grid);
+  char* result = mem_malloc_assert(size, "out of memory");
+  grid_renderInto(grid, result, size);
+   
+  return result;
+}
+
+/********************** grid_renderInto *************************/
+/* write the string representing the grid into buf, one row per line.
+ * returns the string length, or -1 if it does not fit in cap bytes.
+ */
+int
+grid_renderInto(grid_t* grid, char* buf, int cap)
+{
+  if(grid == NULL || buf == NULL || cap < grid_renderSize(grid)){
+    return -1;
+  }
+
   int nrow = grid->nrow;
   int ncol = grid->ncol;
-  int size = nrow * ncol + nrow; //size for the resulting string. include newline characters.
-  char* result = mem_malloc_assert(size + 1, "out of memory");
-  
+  char* p = buf;
   for(int r = 0; r < nrow; r++){
-    for(int c = 0; c < ncol; c++){
-        int index = ncol*r + r + c;
-        result[index] = grid_getchar(grid, r, c); //append each character
-    }
-    result[r*ncol + r + ncol] = '\n'; //newline after each row
+    memcpy(p, grid->map + r*ncol, ncol); //copy each row
+    p += ncol;
+    *p++ = '\n'; //newline after each row
   }
-  result[size] = '\0'; //terminating character at the end of the string
-   
-  return result;
+  *p = '\0'; //terminating character at the end of the string
+  return p - buf;
+}
+
+/********************** grid_renderSize *************************/
+/* return the bytes needed to render the grid: each row, its newline,
+ * and the terminating character.
+ */
+int
+grid_renderSize(grid_t* grid)
+{
+  if(grid == NULL){
+    return -1;
+  }
+  return grid->nrow * (grid->ncol + 1) + 1;
 }
 
 
@@ -396,17 +1667,98 @@ void
 grid_clean(grid_t* raw, grid_t* known){
   
   if(raw != NULL && known != NULL){
-    //reset gold and player in the "known" grid
-    for(int r = 0; r < known->nrow; r++){
-      for(int c = 0; c <known->ncol; c++){
-        if(grid_isGold(known, r, c) || grid_isPlayer(known, r, c)){
-          grid_update(known, r, c, grid_getchar(raw, r, c)); 
+    if(raw->nrow == known->nrow && raw->ncol == known->ncol && known->empty == NULL){
+      //reset gold and player in the "known" grid, a block of cells at a time
+      int size = known->nrow*known->ncol;
+      for(int i = grid_cleanBlocks(raw->map, known->map, size, &known->version); i < size; i++){
+        if((grid_class[(unsigned char)known->map[i]] & (cellGold | cellPlayer)) && known->map[i] != raw->map[i]){
+          known->map[i] = raw->map[i];
+          known->version++;
         }
       }
     }
+    else{
+      //reset gold and player in the "known" grid
+      for(int r = 0; r < known->nrow; r++){
+        for(int c = 0; c <known->ncol; c++){
+          if(grid_classAt(known, r, c) & (cellGold | cellPlayer)){
+            grid_update(known, r, c, grid_getchar(raw, r, c)); 
+          }
+        }
+      }
+    }
+    known->visBox = (grid_rect_t){ 0, 0, -1, -1 }; //nothing left to clean
   }
 }
 
+/********************** grid_cleanBlocks *************************/
+/* puts the raw character back in every cell of known holding gold or a
+ * player, 16 cells at a time with SSE2, bumping the version once per
+ * cell changed. Both maps hold size cells.
+ * Returns the number of cells done, from the first; the caller does the
+ * rest, all of them where SSE2 is not available.
+ */
+#ifdef __SSE2__
+static int
+grid_cleanBlocks(const char* raw, char* known, int size, unsigned long* version)
+{
+  const __m128i gold = _mm_set1_epi8('*');
+  const __m128i at = _mm_set1_epi8('@');
+  const __m128i lower = _mm_set1_epi8(0x20);
+  const __m128i bias = _mm_set1_epi8((char)(-128 - 'a')); //'a'..'z' to -128..-103
+  const __m128i limit = _mm_set1_epi8(-128 + 26);
+  int i = 0;
+  for(; i + 16 <= size; i += 16){
+    __m128i k = _mm_loadu_si128((const __m128i*)(known + i));
+    __m128i letter = _mm_cmplt_epi8(_mm_add_epi8(_mm_or_si128(k, lower), bias), limit);
+    __m128i dynamic = _mm_or_si128(letter, _mm_or_si128(_mm_cmpeq_epi8(k, gold), _mm_cmpeq_epi8(k, at)));
+    if(_mm_movemask_epi8(dynamic) != 0){ //most blocks hold neither
+      __m128i w = _mm_loadu_si128((const __m128i*)(raw + i));
+      int changed = _mm_movemask_epi8(_mm_andnot_si128(_mm_cmpeq_epi8(k, w), dynamic));
+      if(changed != 0){
+        __m128i merged = _mm_or_si128(_mm_and_si128(dynamic, w), _mm_andnot_si128(dynamic, k));
+        _mm_storeu_si128((__m128i*)(known + i), merged);
+        *version += __builtin_popcount(changed);
+      }
+    }
+  }
+  return i;
+}
+#else
+static int
+grid_cleanBlocks(const char* raw, char* known, int size, unsigned long* version)
+{
+  return 0;
+}
+#endif
+
+/********************* grid_classOf ***********************/
+/* returns the cell class of the character at (r,c), which is that of
+ * '^' off the grid or if grid is NULL.
+ */
+static inline int
+grid_classOf(grid_t* grid, int r, int c)
+{
+  return grid_class[(unsigned char)grid_getchar(grid, r, c)];
+}
+
+/********************* grid_at ***********************/
+/* returns the character at (r,c), which the caller guarantees is on the grid.
+ */
+static inline char
+grid_at(grid_t* grid, int r, int c)
+{
+  return grid->map[r*grid->ncol + c];
+}
+
+/********************* grid_classAt ***********************/
+/* returns the cell class at (r,c), which the caller guarantees is on the grid.
+ */
+static inline int
+grid_classAt(grid_t* grid, int r, int c)
+{
+  return grid_class[(unsigned char)grid_at(grid, r, c)];
+}
 
 /********************** grid_delete *************************/
 /* free non NULL grid
@@ -415,7 +1767,25 @@ void
 grid_delete(grid_t* grid)
 {
   if(grid != NULL){
-    free(grid->map);
+    if(grid->vis != NULL){
+      for(int i = 0; i < grid->nrow*grid->ncol; i++){
+        free(grid->vis[i]);
+      }
+      free(grid->vis);
+    }
+    free(grid->occupant);
+    free(grid->visible);
+    if(grid->blob != NULL){
+      munmap(grid->blob, grid->blobSize); //holds the map, regions, empty spots and runs
+    }
+    else{
+      free(grid->runs);
+      free(grid->region);
+      free(grid->regionBox);
+      free(grid->empty);
+      free(grid->emptyPos);
+      free(grid->map);
+    }
     free(grid);
   }
 }
@@ -14,6 +14,17 @@
 /*********** global types *************/
 typedef struct grid grid_t;
 
+/* what one player has seen of a map; see grid_seenNew */
+typedef struct grid_seen grid_seen_t;
+
+/* a rectangle of cells, rows r0..r1 and cols c0..c1 inclusive.
+ * The rectangle is empty if r0 > r1.
+ */
+typedef struct grid_rect {
+  int r0, c0;
+  int r1, c1;
+} grid_rect_t;
+
 /*********** grid_new *************/
 /* initializes a grid sized nrow*ncol.
  * returns a pointer to a grid.
@@ -26,10 +37,27 @@ grid_t* grid_new(int nrow, int ncol);
 /* loads a grid from a given filename.
  * returns pointer to a grid.
  * returns NULL if failed to open file or filename is invalid.
- * expects to recieve a valid map (textfile) as a parameter.
+ * expects to recieve a valid map (textfile) as a parameter,
+ * or a map precompiled by grid_save.
+ * The file is read through mmap. A text map is copied into the grid,
+ * one row per line as wide as the first line. A precompiled map is used
+ * in place, privately mapped, so that its pages are shared by every grid
+ * loaded from it until a grid changes them; it brings its regions, empty
+ * room spots, run lengths and visibility index along, with no work at load time.
  */
 grid_t* grid_load(char* mapFilename);
 
+/*********** grid_save *************/
+/* writes a grid loaded with grid_load to a precompiled map file, for later
+ * grid_load calls. If the grid is indexed (grid_indexVisibility), the index
+ * entry of every spot a player can stand on is computed and written too,
+ * for the grid's sight radius; a grid loaded from the file uses those
+ * entries while its sight radius is the same, and indexes on first use
+ * otherwise. The file is in this machine's byte order.
+ * returns false if grid was not loaded from a map, or the file cannot be written.
+ */
+bool grid_save(grid_t* raw, const char* filename);
+
 /*********** grid_nrow *************/
 /* returns the number of row for the grid.
  * returns negative number if grid is NULL.
@@ -51,9 +79,46 @@ char grid_getchar(grid_t* grid, int r, int c);
 /*********** grid_update *************/
 /* updates the character at the given row and col
  * Does nothing if grid is NULL, or if row and col is out of bounds.
+ * Bumps the grid's version if the character changes.
  */
 void grid_update(grid_t* grid, int r, int c, char ch);
 
+/*********** grid_version *************/
+/* returns a counter that grows every time a character of the grid changes,
+ * so a caller holding an earlier version knows whether anything changed.
+ * returns 0 if grid is NULL.
+ */
+unsigned long grid_version(grid_t* grid);
+
+/*********** grid_setOccupant *************/
+/* records that the entity with the given id (0 <= id < 65535) occupies
+ * the given row and col, or that nobody does if id is negative.
+ * The occupancy layer lives beside the characters and is allocated on first use.
+ * Does nothing if grid is NULL, or if row and col is out of bounds.
+ */
+void grid_setOccupant(grid_t* grid, int r, int c, int id);
+
+/*********** grid_occupant *************/
+/* returns the id of the entity occupying the given row and col.
+ * returns -1 if nobody does, if out of bounds, or if grid is NULL.
+ */
+int grid_occupant(grid_t* grid, int r, int c);
+
+/******************** grid_numEmpty *******************/
+/* returns the number of empty room spots ('.') of a grid loaded with grid_load,
+ * which keeps a list of them up to date on every grid_update.
+ * returns 0 if grid is NULL, or was made by grid_new.
+ */
+int grid_numEmpty(grid_t* grid);
+
+/******************** grid_emptySpot *******************/
+/* stores in (*r,*c) the k'th empty room spot, for 0 <= k < grid_numEmpty(grid),
+ * so that a uniformly random k gives a uniformly random empty spot at once.
+ * The order is arbitrary and changes as the grid is updated.
+ * returns false, storing nothing, if there is no such spot.
+ */
+bool grid_emptySpot(grid_t* grid, int k, int* r, int* c);
+
 /******************** grid_isEmptyRoomSpot *******************/
 /* returns true if the character at given row and col is an empty room space.
  * returns false otherwise.
@@ -97,13 +162,129 @@ bool grid_isRock(grid_t* grid, int r, int c);
  */
 bool grid_canMoveTo(grid_t* grid, int r, int c);
 
+/********************* grid_runLength ***********************/
+/* returns how many steps a player at (r,c) can take in direction (dr,dc),
+ * each of them -1, 0 or 1, before a cell grid_canMoveTo refuses.
+ * grid_load works out the runs of every cell in all 8 directions from the
+ * walls of the map, so on a loaded grid this is one lookup; gold and
+ * players on the way do not stop a run, and walls put down later with
+ * grid_update do not shorten one. Other grids are stepped along.
+ * returns 0 if grid is NULL, (r,c) is off the grid, or (dr,dc) is (0,0)
+ * or not a direction.
+ */
+int grid_runLength(grid_t* grid, int r, int c, int dr, int dc);
+
 /********************* grid_setVisibility ***********************/
 /* updates the "known" grid based on the player's location (pr,pc)
- * Uses helper function grid_isVisible
+ * Uses helper function grid_isVisible, or the visibility index
+ * if one has been enabled on the raw grid with grid_indexVisibility.
+ * Does nothing if any grid is NULL, the grids differ in size,
+ * or (pr,pc) is off the grid.
  */
 void
 grid_setVisibility(grid_t* master, grid_t* raw, grid_t* known, int pr, int pc);
 
+/********************* grid_updateVisibility ***********************/
+/* incrementally updates the "known" grid for the player's new location (pr,pc).
+ * The result is the same as grid_setVisibility, but only the cells that were
+ * visible after the previous update, and those visible now, are examined;
+ * the known grid remembers the bounding box of its last visible cells.
+ * If dirty is not NULL, it receives the bounding box of the cells that
+ * actually changed (empty if none did).
+ * Does nothing, and reports an empty rectangle, if any grid is NULL,
+ * the grids differ in size, or (pr,pc) is off the grid.
+ */
+void grid_updateVisibility(grid_t* master, grid_t* raw, grid_t* known,
+                           int pr, int pc, grid_rect_t* dirty);
+
+/********************* grid_seenNew ***********************/
+/* makes the seen state of a player on a raw map, a compact stand-in for a
+ * known grid: one bit per cell of the map, set once the cell has been
+ * visible, and a short list of the cells shown other than as in raw,
+ * the gold and players in sight and the player's own '@'. What the
+ * player sees is raw masked by those bits, with the listed cells on top.
+ * The raw grid must outlive the seen state.
+ * returns NULL if raw is NULL.
+ * caller is responsible for freeing it using grid_seenDelete().
+ */
+grid_seen_t* grid_seenNew(grid_t* raw);
+
+/********************* grid_seenUpdate ***********************/
+/* what grid_updateVisibility does to a known grid, for a seen state:
+ * marks what the player at (pr,pc) sees of master, and if dirty is not
+ * NULL, gives it the bounding box of the cells that changed.
+ * Only (pr,pc) and the cells visible from it are examined, and the old
+ * list of gold and players; marking cells seen is a bitwise OR.
+ * Does nothing, and reports an empty rectangle, if seen or master is NULL,
+ * master differs in size from the raw grid, or (pr,pc) is off the grid.
+ */
+void grid_seenUpdate(grid_t* master, grid_seen_t* seen, int pr, int pc, grid_rect_t* dirty);
+
+/********************* grid_seenMark ***********************/
+/* marks the cells visible from (pr,pc) as seen, and nothing else: the
+ * list of gold and players is left for grid_seenUpdate. For the spots a
+ * player passes on the way to where a move ends. If dirty is not NULL,
+ * it gets the bounding box of the cells newly seen.
+ * Does nothing if seen is NULL or (pr,pc) is off the grid.
+ */
+void grid_seenMark(grid_seen_t* seen, int pr, int pc, grid_rect_t* dirty);
+
+/********************* grid_seenVersion ***********************/
+/* returns a counter that grows every time grid_seenUpdate changes what
+ * the player sees. returns 0 if seen is NULL.
+ */
+unsigned long grid_seenVersion(grid_seen_t* seen);
+
+/********************* grid_seenRenderInto ***********************/
+/* writes what the player sees into the caller's buffer, in the form of
+ * grid_renderInto; the buffer needs grid_renderSize(raw) bytes.
+ * Returns the length of the string, or -1 if seen or buf is NULL, or cap is too small.
+ */
+int grid_seenRenderInto(grid_seen_t* seen, char* buf, int cap);
+
+/********************* grid_seenDelete ***********************/
+/* Deletes a seen state.
+ */
+void grid_seenDelete(grid_seen_t* seen);
+
+/********************* grid_rectUnion ***********************/
+/* grows rect to also cover other; either may be empty.
+ * Does nothing if rect or other is NULL.
+ */
+void grid_rectUnion(grid_rect_t* rect, const grid_rect_t* other);
+
+/********************* grid_indexVisibility ***********************/
+/* enables a visibility index on a raw (unchanging) map grid.
+ * For each spot a player can stand on, the set of visible cells is
+ * raytraced once, on first use, and stored as a compact bitset over its
+ * bounding box; grid_setVisibility then copies those cells instead of
+ * raytracing the whole map on every call.
+ * Note the index is computed against the raw map, so other players
+ * standing in a passage do not let the player see past them.
+ * Each entry only raytraces the cells around the player's region, the
+ * connected room spots labelled by grid_load, so its cost follows what
+ * the player can see rather than the size of the map.
+ * Does nothing if grid is NULL or already indexed.
+ */
+void grid_indexVisibility(grid_t* raw);
+
+/********************* grid_indexSpot ***********************/
+/* computes the index entry for (pr,pc) now, rather than on first use.
+ * From then on a visibility update from (pr,pc) only reads the raw grid,
+ * so updates for several known grids may run on different threads.
+ * Does nothing if grid is NULL or not indexed.
+ */
+void grid_indexSpot(grid_t* raw, int pr, int pc);
+
+/********************* grid_setSightRadius ***********************/
+/* limits visibility from the raw grid to cells within radius of the
+ * player (Euclidean distance), and limits the raytracing to match;
+ * 0, the default, means no limit.
+ * Index entries already computed are discarded.
+ * Does nothing if grid is NULL or radius is negative.
+ */
+void grid_setSightRadius(grid_t* raw, int radius);
+
 /*********** grid_toString *************/
 /* Converts a grid to a string.
  * Returns a pointer to a string.
@@ -112,6 +293,21 @@ grid_setVisibility(grid_t* master, grid_t* raw, grid_t* known, int pr, int pc);
  */
 char* grid_toString(grid_t* grid);
 
+/*********** grid_renderInto *************/
+/* Writes the same string as grid_toString into the caller's buffer,
+ * which holds cap bytes; nothing is allocated.
+ * Returns the length of the string (not counting the terminating '\0'),
+ * or -1 if grid or buf is NULL, or cap is too small;
+ * grid_renderSize gives the cap needed.
+ */
+int grid_renderInto(grid_t* grid, char* buf, int cap);
+
+/*********** grid_renderSize *************/
+/* Returns the number of bytes grid_renderInto needs, including the '\0'.
+ * returns negative number if grid is NULL.
+ */
+int grid_renderSize(grid_t* grid);
+
 /********************** grid_clean *************************/
 /* cleans the "known" grid based on the raw grid 
  * Used at the bgeinning of grid_updateKnown
@@ -0,0 +1,308 @@
+/*
+ * gridbench.c - microbenchmark for the grid module
+ *
+ * Usage: ./gridbench [-t min-ms] map...
+ *
+ * Times the grid functions the server leans on, on each map given. The
+ * visibility functions are called from every empty room spot of the map,
+ * in row-major order, on a copy of the map with gold on every 7th spot.
+ * Each function is run once untimed, then as many times as it takes to
+ * fill min-ms milliseconds (default 20).
+ *
+ * Output is one tab-separated line per map and function, after a header
+ * line starting with '#', so runs can be diffed across commits:
+ *   map  function  calls  ns/call  cells/sec  allocs/call
+ * cells/sec counts the cells of the whole map per call; allocs/call
+ * counts every malloc, calloc and realloc per call, however made.
+ *
+ * hemlock, May 2021
+ */
+
+#define _POSIX_C_SOURCE 200809L  // getopt, clock_gettime
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "mem.h"
+#include "grid.h"
+
+#define Usage "usage: ./gridbench [-t min-ms] map...\n"
+
+static const char* BlobName = "gridbench.grid"; // precompiled copy of the map being timed
+
+/* every malloc, calloc and realloc is counted, passed on to glibc's own,
+ * as the server's are with -DMEMTEST; mem_malloc and the rest come here too.
+ */
+extern void* __libc_malloc(size_t size);
+extern void* __libc_calloc(size_t count, size_t size);
+extern void* __libc_realloc(void* ptr, size_t size);
+
+static unsigned long heapAllocs;
+
+void* malloc(size_t size) { heapAllocs++; return __libc_malloc(size); }
+void* calloc(size_t count, size_t size) { heapAllocs++; return __libc_calloc(count, size); }
+void* realloc(void* ptr, size_t size) { heapAllocs++; return __libc_realloc(ptr, size); }
+
+/* the grids and scratch space of the map being timed */
+typedef struct bench {
+  char* path;
+  grid_t* raw;      // as loaded
+  grid_t* indexed;  // as loaded, with a visibility index
+  grid_t* master;   // as loaded, with gold scattered
+  grid_t* known;
+  grid_seen_t* seen;
+  int* spots;       // cell index of every empty room spot
+  int numSpots;
+  char* buf;        // grid_renderSize(raw) bytes
+  int size;
+} bench_t;
+
+/* one timed function: does a round of calls, and returns how many */
+typedef struct benchFunc {
+  const char* name;
+  int (*round)(bench_t* b);
+} benchFunc_t;
+
+/************* Local Function Prototypes ******************/
+static bool bench_init(bench_t* b, char* path);
+static void bench_free(bench_t* b);
+static void bench_run(bench_t* b, const benchFunc_t* f, double minSeconds);
+static double bench_now(void);
+static int round_load(bench_t* b);
+static int round_loadBlob(bench_t* b);
+static int round_toString(bench_t* b);
+static int round_clean(bench_t* b);
+static int round_setVisibility(bench_t* b);
+static int round_setVisibilityIndexed(bench_t* b);
+static int round_updateVisibility(bench_t* b);
+static int round_seenUpdate(bench_t* b);
+static int round_seenRenderInto(bench_t* b);
+
+static const benchFunc_t Funcs[] = {
+  { "grid_load", round_load },
+  { "grid_load_precompiled", round_loadBlob },
+  { "grid_toString", round_toString },
+  { "grid_clean", round_clean },
+  { "grid_setVisibility", round_setVisibility },
+  { "grid_setVisibility_indexed", round_setVisibilityIndexed },
+  { "grid_updateVisibility", round_updateVisibility },
+  { "grid_seenUpdate", round_seenUpdate },
+  { "grid_seenRenderInto", round_seenRenderInto },
+};
+
+int
+main(int argc, char* argv[])
+{
+  int minMs = 20;
+  int opt;
+  while ((opt = getopt(argc, argv, "t:")) != -1) {
+    switch (opt) {
+      case 't':
+        minMs = atoi(optarg);
+        if (minMs <= 0) {
+          fprintf(stderr, "Error: min-ms should be a positive integer\n");
+          exit(2);
+        }
+        break;
+      default:
+        fprintf(stderr, Usage);
+        exit(1);
+    }
+  }
+  if (optind == argc) {
+    fprintf(stderr, Usage);
+    exit(1);
+  }
+
+  printf("# map\tfunction\tcalls\tns/call\tcells/sec\tallocs/call\n");
+  int status = 0;
+  for (int i = optind; i < argc; i++) {
+    bench_t b;
+    if (!bench_init(&b, argv[i])) {
+      fprintf(stderr, "Error: fail to load map: %s\n", argv[i]);
+      status = 3;
+      continue;
+    }
+    for (int k = 0; k < sizeof(Funcs)/sizeof(Funcs[0]); k++) {
+      bench_run(&b, &Funcs[k], minMs / 1000.0);
+    }
+    bench_free(&b);
+  }
+  remove(BlobName);
+  return status;
+}
+
+/********************* bench_init ***********************/
+/* loads the map at path and sets up everything the rounds use.
+ * returns false if the map does not load, or cannot be precompiled.
+ */
+static bool
+bench_init(bench_t* b, char* path)
+{
+  b->path = path;
+  b->raw = grid_load(path);
+  if (b->raw == NULL) {
+    return false;
+  }
+  b->indexed = grid_load(path);
+  grid_indexVisibility(b->indexed);
+  if (!grid_save(b->indexed, BlobName)) {
+    grid_delete(b->indexed);
+    grid_delete(b->raw);
+    return false;
+  }
+  b->master = grid_load(path);
+
+  int nrow = grid_nrow(b->raw);
+  int ncol = grid_ncol(b->raw);
+  b->spots = mem_malloc_assert((nrow*ncol + 1)*sizeof(int), "out of memory");
+  b->numSpots = 0;
+  for (int r = 0; r < nrow; r++) {
+    for (int c = 0; c < ncol; c++) {
+      if (grid_isEmptyRoomSpot(b->raw, r, c)) {
+        if (b->numSpots % 7 == 0) {
+          grid_update(b->master, r, c, '*');
+        }
+        b->spots[b->numSpots++] = r*ncol + c;
+      }
+    }
+  }
+  b->known = grid_new(nrow, ncol);
+  b->seen = grid_seenNew(b->indexed);
+  b->size = grid_renderSize(b->raw);
+  b->buf = mem_malloc_assert(b->size, "out of memory");
+  return true;
+}
+
+/********************* bench_free ***********************/
+static void
+bench_free(bench_t* b)
+{
+  free(b->buf);
+  grid_seenDelete(b->seen);
+  grid_delete(b->known);
+  free(b->spots);
+  grid_delete(b->master);
+  grid_delete(b->indexed);
+  grid_delete(b->raw);
+}
+
+/********************* bench_run ***********************/
+/* runs one round of f untimed, then rounds until minSeconds have passed,
+ * and prints a line of results.
+ */
+static void
+bench_run(bench_t* b, const benchFunc_t* f, double minSeconds)
+{
+  f->round(b);
+
+  long calls = 0;
+  unsigned long allocs = heapAllocs;
+  double start = bench_now();
+  double elapsed;
+  do {
+    calls += f->round(b);
+    elapsed = bench_now() - start;
+  } while (elapsed < minSeconds);
+  allocs = heapAllocs - allocs;
+
+  double cells = (double)grid_nrow(b->raw) * grid_ncol(b->raw);
+  if (calls == 0) {
+    printf("%s\t%s\t0\t-\t-\t-\n", b->path, f->name);
+  } else {
+    printf("%s\t%s\t%ld\t%.1f\t%.0f\t%.3f\n", b->path, f->name, calls,
+           elapsed * 1e9 / calls, cells * calls / elapsed, (double)allocs / calls);
+  }
+  fflush(stdout);
+}
+
+/********************* bench_now ***********************/
+static double
+bench_now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/********************* the rounds ***********************/
+/* each returns the number of calls it made to the function it times */
+
+static int
+round_load(bench_t* b)
+{
+  grid_delete(grid_load(b->path));
+  return 1;
+}
+
+static int
+round_loadBlob(bench_t* b)
+{
+  grid_delete(grid_load((char*)BlobName));
+  return 1;
+}
+
+static int
+round_toString(bench_t* b)
+{
+  free(grid_toString(b->master));
+  return 1;
+}
+
+static int
+round_clean(bench_t* b)
+{
+  grid_clean(b->raw, b->known);
+  return 1;
+}
+
+static int
+round_setVisibility(bench_t* b)
+{
+  int ncol = grid_ncol(b->raw);
+  for (int i = 0; i < b->numSpots; i++) {
+    grid_setVisibility(b->master, b->raw, b->known, b->spots[i] / ncol, b->spots[i] % ncol);
+  }
+  return b->numSpots;
+}
+
+static int
+round_setVisibilityIndexed(bench_t* b)
+{
+  int ncol = grid_ncol(b->raw);
+  for (int i = 0; i < b->numSpots; i++) {
+    grid_setVisibility(b->master, b->indexed, b->known, b->spots[i] / ncol, b->spots[i] % ncol);
+  }
+  return b->numSpots;
+}
+
+static int
+round_updateVisibility(bench_t* b)
+{
+  int ncol = grid_ncol(b->raw);
+  grid_rect_t dirty;
+  for (int i = 0; i < b->numSpots; i++) {
+    grid_updateVisibility(b->master, b->indexed, b->known, b->spots[i] / ncol, b->spots[i] % ncol, &dirty);
+  }
+  return b->numSpots;
+}
+
+static int
+round_seenUpdate(bench_t* b)
+{
+  int ncol = grid_ncol(b->raw);
+  grid_rect_t dirty;
+  for (int i = 0; i < b->numSpots; i++) {
+    grid_seenUpdate(b->master, b->seen, b->spots[i] / ncol, b->spots[i] % ncol, &dirty);
+  }
+  return b->numSpots;
+}
+
+static int
+round_seenRenderInto(bench_t* b)
+{
+  grid_seenRenderInto(b->seen, b->buf, b->size);
+  return 1;
+}
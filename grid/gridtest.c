@@ -6,10 +6,13 @@
  */
 
 //include files
+#define _POSIX_C_SOURCE 200809L  // truncate
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
+#include <unistd.h>
 #include "grid.h"
 
 int
@@ -129,6 +132,160 @@ main(const int argc, char* argv[])
     exit(1);
   }
 
+  //TEST GRID_VERSION
+  fprintf(stdout, "\ntest grid_version.\n");
+  unsigned long version = grid_version(grid);
+  grid_update(grid, 0, 0, '+'); //same character, no change
+  if(grid_version(grid) != version){
+    fprintf(stdout, "grid_version changed without a change.\n");
+    exit(1);
+  }
+  grid_update(grid, 0, 0, '-');
+  grid_update(grid, 0, 0, '+');
+  if(grid_version(grid) != version + 2){
+    fprintf(stdout, "grid_version missed a change.\n");
+    exit(1);
+  }
+
+  //TEST OCCUPANCY
+  fprintf(stdout, "\ntest grid_occupant.\n");
+  if(grid_occupant(grid, 19, 6) != -1 || grid_occupant(NULL, 19, 6) != -1){
+    fprintf(stdout, "grid_occupant found an occupant on an empty grid.\n");
+    exit(1);
+  }
+  grid_setOccupant(grid, 19, 6, 0);
+  grid_setOccupant(grid, 19, 7, 25);
+  grid_setOccupant(grid, -1, 7, 3); //out of bounds, ignored
+  if(grid_occupant(grid, 19, 6) != 0 || grid_occupant(grid, 19, 7) != 25 || grid_occupant(grid, -1, 7) != -1){
+    fprintf(stdout, "grid_occupant failed.\n");
+    exit(1);
+  }
+  grid_setOccupant(grid, 19, 6, -1);
+  grid_setOccupant(grid, 19, 7, -1);
+  if(grid_occupant(grid, 19, 6) != -1 || grid_occupant(grid, 19, 7) != -1){
+    fprintf(stdout, "grid_setOccupant failed to clear.\n");
+    exit(1);
+  }
+
+  //TEST CELL CLASSES
+  fprintf(stdout, "\ntest the predicates on every character, and grid_clean.\n");
+  grid_t* cell = grid_new(1, 1);
+  for(int i = 0; i < 256; i++){
+    char ch = (char)i;
+    bool letter = (ch >= 'A' && ch <= 'Z') || (ch >= 'a' && ch <= 'z');
+    bool boundary = ch == '|' || ch == '-' || ch == '+';
+    grid_update(cell, 0, 0, ch);
+    if(grid_isRock(cell, 0, 0) != (ch == ' ') || grid_isBoundary(cell, 0, 0) != boundary
+       || grid_isGold(cell, 0, 0) != (ch == '*') || grid_isPlayer(cell, 0, 0) != (letter || ch == '@')
+       || grid_isEmptyRoomSpot(cell, 0, 0) != (ch == '.')
+       || grid_canMoveTo(cell, 0, 0) != (ch != ' ' && !boundary && ch != '^')){
+      fprintf(stdout, "a predicate is wrong for character %d.\n", i);
+      exit(1);
+    }
+  }
+  grid_delete(cell);
+  if(grid_canMoveTo(NULL, 0, 0) || grid_isRock(NULL, 0, 0)){
+    fprintf(stdout, "a predicate is wrong for a NULL grid.\n");
+    exit(1);
+  }
+
+  //gold and players, and only they, go back to the raw character, in
+  //grids of sizes that do and do not fill whole blocks of cells
+  int sizes[][2] = { { 1, 1 }, { 3, 7 }, { 4, 8 }, { 5, 33 }, { 21, 79 } };
+  unsigned int cleanSeed = 7;
+  for(int k = 0; k < sizeof(sizes)/sizeof(sizes[0]); k++){
+    int srow = sizes[k][0];
+    int scol = sizes[k][1];
+    grid_t* rawCells = grid_new(srow, scol);
+    grid_t* knownCells = grid_new(srow, scol);
+    char* expectedCells = malloc(srow*scol);
+    int changes = 0;
+    for(int r = 0; r < srow; r++){
+      for(int c = 0; c < scol; c++){
+        cleanSeed = cleanSeed*1103515245 + 12345;
+        char rawCh = " .|-+#"[(cleanSeed >> 16) % 6];
+        cleanSeed = cleanSeed*1103515245 + 12345;
+        char knownCh = (cleanSeed >> 16) % 2 ? rawCh : (char)((cleanSeed >> 20) % 256);
+        grid_update(rawCells, r, c, rawCh);
+        grid_update(knownCells, r, c, knownCh);
+        bool dynamic = grid_isGold(knownCells, r, c) || grid_isPlayer(knownCells, r, c);
+        expectedCells[r*scol + c] = dynamic ? rawCh : knownCh;
+        changes += dynamic && rawCh != knownCh;
+      }
+    }
+    unsigned long before = grid_version(knownCells);
+    grid_clean(rawCells, knownCells);
+    for(int r = 0; r < srow; r++){
+      for(int c = 0; c < scol; c++){
+        if(grid_getchar(knownCells, r, c) != expectedCells[r*scol + c]){
+          fprintf(stdout, "grid_clean is wrong at (%d,%d) of a %dx%d grid.\n", r, c, srow, scol);
+          exit(1);
+        }
+      }
+    }
+    if(grid_version(knownCells) != before + changes){
+      fprintf(stdout, "grid_clean counted %lu changes, not %d.\n", grid_version(knownCells) - before, changes);
+      exit(1);
+    }
+    free(expectedCells);
+    grid_delete(knownCells);
+    grid_delete(rawCells);
+  }
+  fprintf(stdout, "predicates and grid_clean agree with their definitions.\n");
+
+  //TEST EMPTY ROOM SPOTS
+  fprintf(stdout, "\ntest grid_numEmpty and grid_emptySpot.\n");
+  grid_t* spots = grid_load(pathname);
+  grid_t* blank = grid_new(1, 1);
+  grid_update(blank, 0, 0, '.');
+  if(grid_numEmpty(blank) != 0 || grid_numEmpty(NULL) != 0){
+    fprintf(stdout, "grid_numEmpty found spots on a grid that was not loaded.\n");
+    exit(1);
+  }
+  grid_delete(blank);
+  //fill and empty spots at random; the list must always match the map
+  char glyphs[] = { '*', 'A', '.', '#', '.' };
+  unsigned int seed = 1;
+  bool* listed = malloc(nrow*ncol*sizeof(bool));
+  for(int step = 0; step < 2000; step++){
+    seed = seed*1103515245 + 12345;
+    int r = (seed >> 8) % nrow;
+    seed = seed*1103515245 + 12345;
+    int c = (seed >> 8) % ncol;
+    if(!grid_isRock(spots, r, c)){
+      grid_update(spots, r, c, glyphs[step % 5]);
+    }
+    if(step % 100 != 0){
+      continue;
+    }
+    int count = 0;
+    for(int i = 0; i < nrow*ncol; i++){
+      listed[i] = false;
+      count += grid_isEmptyRoomSpot(spots, i / ncol, i % ncol);
+    }
+    if(grid_numEmpty(spots) != count){
+      fprintf(stdout, "grid_numEmpty is %d, not %d.\n", grid_numEmpty(spots), count);
+      exit(1);
+    }
+    for(int k = 0; k < count; k++){
+      int er, ec;
+      if(!grid_emptySpot(spots, k, &er, &ec) || !grid_isEmptyRoomSpot(spots, er, ec)
+         || listed[er*ncol + ec]){
+        fprintf(stdout, "grid_emptySpot gave a wrong or repeated spot.\n");
+        exit(1);
+      }
+      listed[er*ncol + ec] = true;
+    }
+  }
+  int er, ec;
+  if(grid_emptySpot(spots, grid_numEmpty(spots), &er, &ec) || grid_emptySpot(spots, -1, &er, &ec)){
+    fprintf(stdout, "grid_emptySpot accepted an index out of range.\n");
+    exit(1);
+  }
+  free(listed);
+  grid_delete(spots);
+  fprintf(stdout, "the list of empty room spots follows every update.\n");
+
   //TEST VISIBILITY
   fprintf(stdout, "\ntest visbility.\n");
   
@@ -181,6 +338,535 @@ main(const int argc, char* argv[])
   fprintf(stdout, "%s\n", visible6);
   free(visible6);
   
+  //TEST VISIBILITY INDEX
+  fprintf(stdout, "\ntest grid_indexVisibility.\n");
+
+  grid_t* raw = grid_load(pathname);
+  grid_t* indexed = grid_load(pathname);
+  grid_indexVisibility(indexed);
+  grid_t* expected = grid_new(nrow, ncol);
+  grid_t* actual = grid_new(nrow, ncol);
+
+  //the index must agree with raytracing at every spot a player can stand on
+  for(int r = 0; r < nrow; r++){
+    for(int c = 0; c < ncol; c++){
+      if(grid_canMoveTo(raw, r, c)){
+        grid_setVisibility(raw, raw, expected, r, c);
+        grid_setVisibility(raw, indexed, actual, r, c);
+        char* expectedS = grid_toString(expected);
+        char* actualS = grid_toString(actual);
+        if(strcmp(expectedS, actualS) != 0){
+          fprintf(stdout, "grid_indexVisibility disagrees at (%d,%d).\n", r, c);
+          exit(1);
+        }
+        free(expectedS);
+        free(actualS);
+      }
+    }
+  }
+  fprintf(stdout, "index agrees with raytracing at every room spot.\n");
+
+  //TEST INCREMENTAL VISIBILITY
+  fprintf(stdout, "\ntest grid_updateVisibility.\n");
+
+  //scatter some gold so there are glyphs to forget after each step
+  grid_t* master = grid_load(pathname);
+  int spot = 0;
+  for(int r = 0; r < nrow; r++){
+    for(int c = 0; c < ncol; c++){
+      if(grid_isEmptyRoomSpot(master, r, c) && spot++ % 7 == 0){
+        grid_update(master, r, c, '*');
+      }
+    }
+  }
+
+  //walk every room spot, with and without the index
+  grid_t* raws[] = { raw, indexed };
+  for(int k = 0; k < 2; k++){
+    grid_t* walked = grid_new(nrow, ncol);
+    grid_t* full = grid_new(nrow, ncol);
+    for(int r = 0; r < nrow; r++){
+      for(int c = 0; c < ncol; c++){
+        if(grid_canMoveTo(raw, r, c)){
+          char* before = grid_toString(walked);
+          grid_rect_t dirty;
+          grid_updateVisibility(master, raws[k], walked, r, c, &dirty);
+          grid_setVisibility(master, raws[k], full, r, c);
+          char* walkedS = grid_toString(walked);
+          char* fullS = grid_toString(full);
+          if(strcmp(walkedS, fullS) != 0){
+            fprintf(stdout, "grid_updateVisibility disagrees at (%d,%d).\n", r, c);
+            exit(1);
+          }
+          //every changed cell must lie in the dirty rectangle
+          for(int i = 0; walkedS[i] != '\0'; i++){
+            int dr = i / (ncol + 1);
+            int dc = i % (ncol + 1);
+            if(before[i] != walkedS[i] && (dr < dirty.r0 || dr > dirty.r1 || dc < dirty.c0 || dc > dirty.c1)){
+              fprintf(stdout, "grid_updateVisibility missed (%d,%d) in its dirty rectangle.\n", dr, dc);
+              exit(1);
+            }
+          }
+          free(before);
+          free(walkedS);
+          free(fullS);
+        }
+      }
+    }
+    grid_delete(full);
+    grid_delete(walked);
+  }
+  grid_delete(master);
+  fprintf(stdout, "incremental updates agree with full updates at every room spot.\n");
+
+  //TEST REGION CULLING AND SIGHT RADIUS
+  fprintf(stdout, "\ntest region culling and grid_setSightRadius.\n");
+
+  //the culled index must agree with raytracing the whole map, on every map;
+  //with a radius, it must see exactly the unlimited cells within that radius
+  char* maps[] = { "../maps/main.txt", "../maps/big.txt", "../maps/challenge.txt",
+                   "../maps/edges.txt", "../maps/fewspots.txt", "../maps/hole.txt",
+                   "../maps/narrow.txt", "../maps/small.txt" };
+  int radius = 6;
+  for(int m = 0; m < sizeof(maps)/sizeof(maps[0]); m++){
+    grid_t* full = grid_load(maps[m]);
+    grid_t* culled = grid_load(maps[m]);
+    grid_t* near = grid_load(maps[m]);
+    grid_indexVisibility(culled);
+    grid_indexVisibility(near);
+    grid_setSightRadius(near, radius);
+    int mrow = grid_nrow(full);
+    int mcol = grid_ncol(full);
+    for(int r = 0; r < mrow; r++){
+      for(int c = 0; c < mcol; c++){
+        if(!grid_canMoveTo(full, r, c)){
+          continue;
+        }
+        grid_t* knownFull = grid_new(mrow, mcol);
+        grid_t* knownCulled = grid_new(mrow, mcol);
+        grid_t* knownNear = grid_new(mrow, mcol);
+        grid_setVisibility(full, full, knownFull, r, c);
+        grid_setVisibility(full, culled, knownCulled, r, c);
+        grid_setVisibility(full, near, knownNear, r, c);
+        for(int i = 0; i < mrow; i++){
+          for(int j = 0; j < mcol; j++){
+            char all = grid_getchar(knownFull, i, j);
+            bool inRadius = (i - r)*(i - r) + (j - c)*(j - c) <= radius*radius;
+            if(grid_getchar(knownCulled, i, j) != all){
+              fprintf(stdout, "region culling disagrees on %s at (%d,%d).\n", maps[m], r, c);
+              exit(1);
+            }
+            if(grid_getchar(knownNear, i, j) != (inRadius ? all : ' ')){ //new grids are all ' '
+              fprintf(stdout, "grid_setSightRadius disagrees on %s at (%d,%d).\n", maps[m], r, c);
+              exit(1);
+            }
+          }
+        }
+        grid_delete(knownNear);
+        grid_delete(knownCulled);
+        grid_delete(knownFull);
+      }
+    }
+    grid_delete(near);
+    grid_delete(culled);
+    grid_delete(full);
+  }
+  fprintf(stdout, "culled visibility agrees with full visibility on every map.\n");
+
+  //TEST RUN LENGTHS
+  fprintf(stdout, "\ntest grid_runLength.\n");
+
+  //the table of a loaded map must agree with stepping along a copy of it
+  for(int m = 0; m < sizeof(maps)/sizeof(maps[0]); m++){
+    grid_t* loaded = grid_load(maps[m]);
+    int mrow = grid_nrow(loaded);
+    int mcol = grid_ncol(loaded);
+    grid_t* copy = grid_new(mrow, mcol);
+    for(int r = 0; r < mrow; r++){
+      for(int c = 0; c < mcol; c++){
+        grid_update(copy, r, c, grid_getchar(loaded, r, c));
+      }
+    }
+    for(int r = 0; r < mrow; r++){
+      for(int c = 0; c < mcol; c++){
+        for(int dr = -1; dr <= 1; dr++){
+          for(int dc = -1; dc <= 1; dc++){
+            int steps = 0;
+            while((dr != 0 || dc != 0) && grid_canMoveTo(copy, r + (steps + 1)*dr, c + (steps + 1)*dc)){
+              steps++;
+            }
+            if(grid_runLength(loaded, r, c, dr, dc) != steps || grid_runLength(copy, r, c, dr, dc) != steps){
+              fprintf(stdout, "grid_runLength disagrees on %s at (%d,%d) going (%d,%d).\n", maps[m], r, c, dr, dc);
+              exit(1);
+            }
+          }
+        }
+      }
+    }
+    grid_delete(copy);
+    grid_delete(loaded);
+  }
+
+  //runs longer than the table holds, and directions that are not
+  char* longname = "gridtest.txt";
+  FILE* longfp = fopen(longname, "w");
+  for(int i = 0; i < 700; i++){
+    fputc(i == 0 || i == 699 ? '|' : '#', longfp);
+  }
+  fputc('\n', longfp);
+  fclose(longfp);
+  grid_t* corridor = grid_load(longname);
+  remove(longname);
+  if(grid_runLength(corridor, 0, 1, 0, 1) != 697 || grid_runLength(corridor, 0, 698, 0, -1) != 697
+     || grid_runLength(corridor, 0, 300, 0, 1) != 398 || grid_runLength(corridor, 0, 300, 1, 0) != 0
+     || grid_runLength(corridor, 0, 300, 0, 0) != 0 || grid_runLength(corridor, 0, 300, 0, 2) != 0
+     || grid_runLength(corridor, 0, 700, 0, -1) != 0 || grid_runLength(NULL, 0, 0, 0, 1) != 0){
+    fprintf(stdout, "grid_runLength is wrong along a 700-cell corridor.\n");
+    exit(1);
+  }
+  grid_delete(corridor);
+  fprintf(stdout, "run lengths agree with stepping on every map.\n");
+
+  //TEST INDEXING SPOTS AHEAD OF TIME
+  fprintf(stdout, "\ntest grid_indexSpot.\n");
+
+  grid_t* warmed = grid_load(pathname);
+  grid_indexSpot(warmed, 0, 0); //not indexed yet: does nothing
+  grid_indexSpot(NULL, 0, 0);
+  grid_indexVisibility(warmed);
+  for(int r = 0; r < nrow; r++){
+    for(int c = 0; c < ncol; c++){
+      grid_indexSpot(warmed, r, c); //rock and walls are ignored
+    }
+  }
+  for(int r = 0; r < nrow; r++){
+    for(int c = 0; c < ncol; c++){
+      if(grid_canMoveTo(raw, r, c)){
+        grid_setVisibility(raw, raw, expected, r, c);
+        grid_setVisibility(raw, warmed, actual, r, c);
+        char* expectedS = grid_toString(expected);
+        char* actualS = grid_toString(actual);
+        if(strcmp(expectedS, actualS) != 0){
+          fprintf(stdout, "grid_indexSpot disagrees at (%d,%d).\n", r, c);
+          exit(1);
+        }
+        free(expectedS);
+        free(actualS);
+      }
+    }
+  }
+  grid_delete(warmed);
+  fprintf(stdout, "spots indexed ahead of time agree with raytracing.\n");
+
+  //TEST PRECOMPILED MAPS
+  fprintf(stdout, "\ntest grid_save and loading precompiled maps.\n");
+
+  //a precompiled map must load as the same grid, and see the same as the text
+  //map, both with the sight radius it was compiled for and with another one
+  char* blobname = "gridtest.grid";
+  grid_t* unloaded = grid_new(3, 3);
+  if(grid_save(unloaded, blobname)){
+    fprintf(stdout, "grid_save should fail for a grid that was not loaded.\n");
+    exit(1);
+  }
+  grid_delete(unloaded);
+  for(int m = 0; m < sizeof(maps)/sizeof(maps[0]); m++){
+    grid_t* text = grid_load(maps[m]);
+    grid_indexVisibility(text);
+    grid_setSightRadius(text, radius);
+    if(!grid_save(text, blobname)){
+      fprintf(stdout, "grid_save failed for %s.\n", maps[m]);
+      exit(1);
+    }
+    grid_t* blob = grid_load(blobname);
+    grid_t* other = grid_load(blobname);
+    if(blob == NULL || other == NULL){
+      fprintf(stdout, "grid_load failed for the precompiled %s.\n", maps[m]);
+      exit(1);
+    }
+    char* textS = grid_toString(text);
+    char* blobS = grid_toString(blob);
+    if(strcmp(textS, blobS) != 0 || grid_numEmpty(blob) != grid_numEmpty(text)){
+      fprintf(stdout, "the precompiled %s differs from the text map.\n", maps[m]);
+      exit(1);
+    }
+    free(blobS);
+    free(textS);
+    for(int i = 0; i < grid_nrow(text)*grid_ncol(text)*9; i++){
+      int r = i / 9 / grid_ncol(text);
+      int c = i / 9 % grid_ncol(text);
+      int dr = i % 9 / 3 - 1;
+      int dc = i % 3 - 1;
+      if(grid_runLength(blob, r, c, dr, dc) != grid_runLength(text, r, c, dr, dc)){
+        fprintf(stdout, "the precompiled %s has other run lengths at (%d,%d).\n", maps[m], r, c);
+        exit(1);
+      }
+    }
+
+    grid_indexVisibility(blob);
+    grid_setSightRadius(blob, radius);
+    grid_indexVisibility(other);
+    grid_setSightRadius(other, radius + 1); //not the compiled radius: indexed on use
+    grid_t* wide = grid_load(maps[m]);
+    grid_setSightRadius(wide, radius + 1);
+    int mrow = grid_nrow(text);
+    int mcol = grid_ncol(text);
+    for(int r = 0; r < mrow; r++){
+      for(int c = 0; c < mcol; c++){
+        if(!grid_canMoveTo(text, r, c)){
+          continue;
+        }
+        grid_t* knownText = grid_new(mrow, mcol);
+        grid_t* knownBlob = grid_new(mrow, mcol);
+        grid_t* knownWide = grid_new(mrow, mcol);
+        grid_t* knownOther = grid_new(mrow, mcol);
+        grid_setVisibility(text, text, knownText, r, c);
+        grid_setVisibility(text, blob, knownBlob, r, c);
+        grid_setVisibility(text, wide, knownWide, r, c);
+        grid_setVisibility(text, other, knownOther, r, c);
+        char* expectedS = grid_toString(knownText);
+        char* actualS = grid_toString(knownBlob);
+        char* wideS = grid_toString(knownWide);
+        char* otherS = grid_toString(knownOther);
+        if(strcmp(expectedS, actualS) != 0 || strcmp(wideS, otherS) != 0){
+          fprintf(stdout, "the precompiled %s sees differently at (%d,%d).\n", maps[m], r, c);
+          exit(1);
+        }
+        free(otherS);
+        free(wideS);
+        free(actualS);
+        free(expectedS);
+        grid_delete(knownOther);
+        grid_delete(knownWide);
+        grid_delete(knownBlob);
+        grid_delete(knownText);
+      }
+    }
+
+    //a precompiled map is updated like any other, without changing the file
+    int before = grid_numEmpty(other);
+    int er, ec;
+    if(before > 0 && grid_emptySpot(other, 0, &er, &ec)){
+      grid_update(other, er, ec, '*');
+      grid_t* again = grid_load(blobname);
+      if(grid_numEmpty(other) != before - 1 || grid_getchar(other, er, ec) != '*'
+         || grid_getchar(again, er, ec) != '.' || grid_numEmpty(again) != before){
+        fprintf(stdout, "updating the precompiled %s went wrong.\n", maps[m]);
+        exit(1);
+      }
+      grid_delete(again);
+    }
+    grid_delete(wide);
+    grid_delete(other);
+    grid_delete(blob);
+    grid_delete(text);
+  }
+
+  //a file cut short is not a map
+  FILE* fp = fopen(blobname, "r+");
+  fseek(fp, 0, SEEK_END);
+  long length = ftell(fp);
+  fclose(fp);
+  if(truncate(blobname, length - 8) != 0 || grid_load(blobname) != NULL){
+    fprintf(stdout, "grid_load should return NULL for a truncated precompiled map.\n");
+    exit(1);
+  }
+
+  //nor is one whose map has a room spot its list of empty spots lacks
+  grid_t* text = grid_load(maps[0]);
+  int mrow = grid_nrow(text);
+  int mcol = grid_ncol(text);
+  char* cells = malloc(mrow*mcol);
+  for(int i = 0; i < mrow*mcol; i++){
+    cells[i] = grid_getchar(text, i / mcol, i % mcol);
+  }
+  grid_save(text, blobname);
+  grid_delete(text);
+  fp = fopen(blobname, "r");
+  fseek(fp, 0, SEEK_END);
+  length = ftell(fp);
+  char* file = malloc(length);
+  fseek(fp, 0, SEEK_SET);
+  fread(file, 1, length, fp);
+  fclose(fp);
+  long at = 0;
+  while(at + mrow*mcol <= length && memcmp(file + at, cells, mrow*mcol) != 0){
+    at++;
+  }
+  char* dot = at + mrow*mcol <= length ? memchr(file + at, '.', mrow*mcol) : NULL;
+  if(dot == NULL){
+    fprintf(stdout, "the precompiled %s has no map section to damage.\n", maps[0]);
+    exit(1);
+  }
+  *dot = '#';
+  fp = fopen(blobname, "w");
+  fwrite(file, 1, length, fp);
+  fclose(fp);
+  if(grid_load(blobname) != NULL){
+    fprintf(stdout, "grid_load should return NULL for a precompiled map whose empty spots disagree with it.\n");
+    exit(1);
+  }
+  free(file);
+
+  //nor is one whose run lengths would sprint through a wall; saved
+  //without an index, the runs are the last 8 bytes per cell of the file
+  text = grid_load(maps[0]);
+  grid_save(text, blobname);
+  grid_delete(text);
+  int first = (char*)memchr(cells, '.', mrow*mcol) - cells;
+  fp = fopen(blobname, "r+");
+  fseek(fp, 0, SEEK_END);
+  length = ftell(fp);
+  fseek(fp, length - 8L*mrow*mcol + 8*first, SEEK_SET);
+  unsigned char runs[8];
+  fread(runs, 1, sizeof(runs), fp);
+  runs[0]++;
+  fseek(fp, length - 8L*mrow*mcol + 8*first, SEEK_SET);
+  fwrite(runs, 1, sizeof(runs), fp);
+  fclose(fp);
+  if(grid_load(blobname) != NULL){
+    fprintf(stdout, "grid_load should return NULL for a precompiled map whose runs disagree with it.\n");
+    exit(1);
+  }
+  free(cells);
+  remove(blobname);
+  fprintf(stdout, "precompiled maps agree with text maps.\n");
+
+  //TEST SEEN BITMASK
+  fprintf(stdout, "\ntest grid_seenUpdate and grid_seenRenderInto.\n");
+
+  //walk at random with gold and players coming and going; what a seen
+  //state renders must match a known grid, with and without the index
+  for(int m = 0; m < sizeof(maps)/sizeof(maps[0]); m++){
+    for(int k = 0; k < 3; k++){
+      grid_t* base = grid_load(maps[m]);
+      grid_t* world = grid_load(maps[m]);
+      if(k > 0){
+        grid_indexVisibility(base);
+      }
+      if(k == 2){
+        grid_setSightRadius(base, radius);
+      }
+      int mrow = grid_nrow(base);
+      int mcol = grid_ncol(base);
+      int size = grid_renderSize(base);
+      grid_t* known = grid_new(mrow, mcol);
+      grid_seen_t* seen = grid_seenNew(base);
+      grid_seen_t* marked = grid_seenNew(base); //only marked, and updated every 5th step
+      char* before = malloc(size);
+      char* after = malloc(size);
+      char* markedS = malloc(size);
+      grid_seenRenderInto(seen, before, size);
+      unsigned int walk = m + 1;
+      int pr = -1, pc = -1;
+      for(int step = 0; step < 400; step++){
+        //move the player to a random spot near the last one, or anywhere
+        for(int tries = 0; tries < 100; tries++){
+          walk = walk*1103515245 + 12345;
+          int r = pr < 0 || tries > 50 ? (int)((walk >> 8) % mrow) : pr + (int)((walk >> 8) % 5) - 2;
+          walk = walk*1103515245 + 12345;
+          int c = pc < 0 || tries > 50 ? (int)((walk >> 8) % mcol) : pc + (int)((walk >> 8) % 5) - 2;
+          if(grid_canMoveTo(base, r, c)){
+            pr = r;
+            pc = c;
+            break;
+          }
+        }
+        //drop or pick up gold, and move other players
+        for(int n = 0; n < 10; n++){
+          walk = walk*1103515245 + 12345;
+          int r = (walk >> 8) % mrow;
+          walk = walk*1103515245 + 12345;
+          int c = (walk >> 8) % mcol;
+          if(grid_isEmptyRoomSpot(base, r, c) && (r != pr || c != pc)){
+            char glyph = "*B.C."[(walk >> 4) % 5];
+            grid_update(world, r, c, glyph);
+          }
+        }
+        if(pr < 0){
+          break;
+        }
+        grid_rect_t dirty;
+        grid_updateVisibility(world, base, known, pr, pc, NULL);
+        unsigned long version = grid_seenVersion(seen);
+        grid_seenUpdate(world, seen, pr, pc, &dirty);
+        char* knownS = grid_toString(known);
+        if(grid_seenRenderInto(seen, after, size) != size - 1 || strcmp(knownS, after) != 0){
+          fprintf(stdout, "grid_seenRenderInto disagrees with a known grid on %s at (%d,%d).\n", maps[m], pr, pc);
+          exit(1);
+        }
+        //every changed cell must lie in the dirty rectangle, and bump the version
+        bool changed = false;
+        for(int i = 0; after[i] != '\0'; i++){
+          int dr = i / (mcol + 1);
+          int dc = i % (mcol + 1);
+          if(before[i] != after[i]){
+            changed = true;
+            if(dr < dirty.r0 || dr > dirty.r1 || dc < dirty.c0 || dc > dirty.c1){
+              fprintf(stdout, "grid_seenUpdate missed (%d,%d) in its dirty rectangle.\n", dr, dc);
+              exit(1);
+            }
+          }
+        }
+        if(changed != (grid_seenVersion(seen) != version) || changed != (dirty.r0 <= dirty.r1)){
+          fprintf(stdout, "grid_seenUpdate changed its version without changing, or the other way.\n");
+          exit(1);
+        }
+        //marking passes on newly seen cells in its dirty rectangle
+        grid_seenRenderInto(marked, markedS, size);
+        grid_seenMark(marked, pr, pc, &dirty);
+        grid_seenRenderInto(marked, after, size);
+        for(int i = 0; after[i] != '\0'; i++){
+          int dr = i / (mcol + 1);
+          int dc = i % (mcol + 1);
+          if(markedS[i] != after[i] && (dr < dirty.r0 || dr > dirty.r1 || dc < dirty.c0 || dc > dirty.c1)){
+            fprintf(stdout, "grid_seenMark missed (%d,%d) in its dirty rectangle.\n", dr, dc);
+            exit(1);
+          }
+        }
+        if(step % 5 == 4){
+          grid_seenUpdate(world, marked, pr, pc, NULL);
+          grid_seenRenderInto(marked, markedS, size);
+          if(strcmp(knownS, markedS) != 0){
+            fprintf(stdout, "grid_seenMark on the way does not add up on %s at (%d,%d).\n", maps[m], pr, pc);
+            exit(1);
+          }
+        }
+        grid_seenRenderInto(seen, after, size);
+        free(knownS);
+        char* swap = before;
+        before = after;
+        after = swap;
+      }
+      //sizes that do not match are left alone
+      grid_t* other = grid_new(mrow + 1, mcol);
+      unsigned long version = grid_seenVersion(seen);
+      grid_rect_t dirty;
+      grid_seenUpdate(other, seen, pr, pc, &dirty);
+      grid_seenUpdate(world, NULL, pr, pc, NULL);
+      if(grid_seenVersion(seen) != version || dirty.r0 <= dirty.r1
+         || grid_seenRenderInto(seen, after, size - 1) != -1 || grid_seenNew(NULL) != NULL){
+        fprintf(stdout, "grid_seenUpdate should ignore a master of another size.\n");
+        exit(1);
+      }
+      grid_delete(other);
+      free(markedS);
+      free(after);
+      free(before);
+      grid_seenDelete(marked);
+      grid_seenDelete(seen);
+      grid_delete(known);
+      grid_delete(world);
+      grid_delete(base);
+    }
+  }
+  fprintf(stdout, "seen states render as known grids do on every map.\n");
+
+  grid_delete(actual);
+  grid_delete(expected);
+  grid_delete(indexed);
+  grid_delete(raw);
+
   //delete 
   grid_delete(visible);
   grid_delete(grid);
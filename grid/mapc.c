@@ -0,0 +1,62 @@
+/*
+ * mapc.c - precompile a nuggets map
+ *
+ * Usage: ./mapc [-r sight-radius] map.txt map.grid
+ *
+ * Loads a map text file, computes the visibility of every spot a player
+ * can stand on, and writes the map with its regions, empty room spots and
+ * visibility index to a file that grid_load maps and uses in place.
+ * Give the server the same -r as mapc, or the index is rebuilt as players
+ * move, as it would be for the text map.
+ *
+ * hemlock, May 2021
+ */
+
+#define _POSIX_C_SOURCE 200809L  // getopt
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "grid.h"
+
+#define Usage "usage: ./mapc [-r sight-radius] map.txt map.grid\n"
+
+int
+main(int argc, char* argv[])
+{
+  int radius = 0;
+  int opt;
+  while ((opt = getopt(argc, argv, "r:")) != -1) {
+    switch (opt) {
+      case 'r':
+        radius = atoi(optarg);
+        if (radius < 0) {
+          fprintf(stderr, "Error: sight radius should be a non-negative integer\n");
+          exit(2);
+        }
+        break;
+      default:
+        fprintf(stderr, Usage);
+        exit(1);
+    }
+  }
+  if (argc - optind != 2) {
+    fprintf(stderr, Usage);
+    exit(1);
+  }
+
+  grid_t* raw = grid_load(argv[optind]);
+  if (raw == NULL) {
+    fprintf(stderr, "Error: fail to load map: %s\n", argv[optind]);
+    exit(3);
+  }
+  grid_indexVisibility(raw);
+  grid_setSightRadius(raw, radius);
+  if (!grid_save(raw, argv[optind + 1])) {
+    fprintf(stderr, "Error: fail to write %s\n", argv[optind + 1]);
+    grid_delete(raw);
+    exit(4);
+  }
+  grid_delete(raw);
+  return 0;
+}
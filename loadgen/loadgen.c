@@ -0,0 +1,685 @@
+/*
+ * loadgen.c - a headless load generator for the nuggets server
+ *
+ * Usage: ./loadgen [-p players] [-s spectators] [-k walk|sprint|gold]
+ *                  [-r keys-per-sec] [-d seconds] hostname port
+ *
+ * Runs many bot clients in one process, each on a socket of its own, so
+ * the server sees them as separate clients. Players send keystrokes in
+ * one of three patterns, at a steady rate, and keep their own copy of the
+ * map, as the player client does; spectators only receive. At the end of
+ * the run every bot quits, and the client-side view of the server's
+ * performance is printed on stdout, one "metric<TAB>value" line each:
+ * keys sent, the round-trip latency from a KEY to the first map update
+ * that shows the player moved (p50, p90, p99, max), and the messages
+ * and bytes received per second.
+ *
+ * Patterns: walk steps in random directions; sprint mostly runs to the
+ * end of the line (capital keys); gold steps along the shortest known
+ * path to the nearest visible pile, or walks when none is in sight.
+ * Keys only ever go toward a cell the bot's map shows it can enter, so
+ * every key moves the player and can be timed. A player keeps one key
+ * out at a time: a key that falls due while one is out waits for it to
+ * be answered, so an overloaded server shows as fewer keys per second,
+ * not as lost keys; a key unanswered for a second is counted lost.
+ * With -r 0 each player sends its next key as soon as the last one is
+ * answered.
+ *
+ * hemlock, May 2021
+ */
+
+#define _GNU_SOURCE  // getopt, clock_gettime
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include "message.h"
+#include "protocol.h"
+#include "log.h"
+
+/**************** constants ****************/
+#define Usage "usage: ./loadgen [-p players] [-s spectators] [-k walk|sprint|gold] [-r keys-per-sec] [-d seconds] hostname port\n"
+#define TickSeconds 0.001    // pacing timer interval
+#define QuitSeconds 2.0      // how long to wait for the QUITs at the end
+#define LostSeconds 1.0      // a key unanswered this long is lost
+#define MaxNameLength 50
+
+/**************** types ****************/
+typedef enum pattern { pattern_WALK, pattern_SPRINT, pattern_GOLD } pattern_t;
+
+struct loadgen;
+
+/* one simulated client, on its own socket */
+typedef struct bot {
+  struct loadgen* lg;       // the run this bot is part of
+  int socket;               // from message_openSocket
+  bool isPlayer;
+  bool done;                // QUIT received
+  int nrows, ncols;         // from GRID
+  char* frame;              // the map, nrows lines of ncols+1; NULL until GRID
+  int row, col;             // where the map shows '@'; -1 if nowhere
+  bool pending;             // a KEY is out, waiting for the player to move
+  int sentRow, sentCol;     // where the player was when it went out
+  double sentAt;            // when it went out
+  double nextKey;           // when to send the next one
+} bot_t;
+
+/* the whole run */
+typedef struct loadgen {
+  addr_t server;
+  pattern_t pattern;
+  double rate;              // keys per second per player; 0 for closed loop
+  double duration;          // seconds of load
+  bot_t* bots;
+  int numBots;
+  int numPlayers;
+  int numDone;              // bots that have received QUIT
+  double start, stop;       // when the load started, and is to stop
+  bool stopping;            // KEY Q sent to every bot
+
+  int* stamp;               // BFS scratch, per cell, for the gold pattern
+  int* queue;
+  char* firstStep;
+  int stampNow;
+  int scratchCells;
+
+  long keysSent, keysAnswered, keysLost;
+  double* samples;          // latencies of answered keys, in seconds
+  long numSamples, samplesSize;
+  long msgs, bytes;         // received, everything
+  long numDisplay, numRDisplay, numDelta, numGold, numOther;
+  double lastMessage;       // when the last message arrived
+} loadgen_t;
+
+/* the eight moves, as keys and offsets */
+static const char moveKeys[8] = { 'h', 'l', 'j', 'k', 'y', 'u', 'b', 'n' };
+static const int moveRows[8]  = {  0,   0,   1,  -1,  -1,  -1,   1,   1  };
+static const int moveCols[8]  = { -1,   1,   0,   0,  -1,   1,  -1,   1  };
+
+/**************** function prototypes ****************/
+static void parseArgs(const int argc, char* argv[], loadgen_t* lg, int* numSpectators);
+static bool startBots(loadgen_t* lg, const int numSpectators);
+static bool handleTick(void* arg);
+static bool handleTimeout(void* arg);
+static bool handleMessage(void* arg, const addr_t from, const char* message);
+static void bot_grid(bot_t* bot, const protocol_msg_t* msg);
+static void bot_display(bot_t* bot, const char* map, const bool encoded);
+static void bot_delta(bot_t* bot, const char* runs);
+static void bot_findSelf(bot_t* bot);
+static void bot_moved(bot_t* bot);
+static void bot_sendKey(bot_t* bot, const double t);
+static int bot_chooseMove(bot_t* bot);
+static int bot_randomMove(bot_t* bot);
+static int bot_goldMove(bot_t* bot);
+static bool bot_canEnter(bot_t* bot, const int r, const int c);
+static void addSample(loadgen_t* lg, const double latency);
+static void report(loadgen_t* lg, const int numSpectators);
+static int compareDoubles(const void* a, const void* b);
+static double now(void);
+
+/**************** main ****************/
+int
+main(int argc, char* argv[])
+{
+  loadgen_t lg;
+  memset(&lg, 0, sizeof(lg));
+  int numSpectators = 0;
+  parseArgs(argc, argv, &lg, &numSpectators);
+
+  // errors and notes only; every datagram would swamp the log
+  log_init(stderr);
+  log_setLevel(log_INFO);
+  if (message_init(stderr) == 0) {     // its own socket goes unused
+    fprintf(stderr, "Error: cannot initialize the message module\n");
+    exit(3);
+  }
+  if (!startBots(&lg, numSpectators)) {
+    fprintf(stderr, "Error: cannot open a socket for every bot\n");
+    message_done();
+    exit(4);
+  }
+
+  // pace keys with a timer; without one, with the loop's own timeout,
+  // which only fires when the loop is quiet
+  if (message_addTimer(TickSeconds, handleTick, &lg) >= 0) {
+    message_loop(&lg, 0, NULL, NULL, NULL);
+  } else {
+    message_loop(&lg, TickSeconds, handleTimeout, NULL, NULL);
+  }
+
+  report(&lg, numSpectators);
+  message_done();
+  log_done();
+  for (int i = 0; i < lg.numBots; i++) {
+    free(lg.bots[i].frame);
+  }
+  free(lg.bots);
+  free(lg.stamp);
+  free(lg.queue);
+  free(lg.firstStep);
+  free(lg.samples);
+  return 0;
+}
+
+/**************** parseArgs ****************/
+/* fill in the run from the command line, or exit on error */
+static void
+parseArgs(const int argc, char* argv[], loadgen_t* lg, int* numSpectators)
+{
+  lg->numPlayers = 1;
+  lg->pattern = pattern_WALK;
+  lg->rate = 10;
+  lg->duration = 10;
+  int opt;
+  while ((opt = getopt(argc, argv, "p:s:k:r:d:")) != -1) {
+    switch (opt) {
+      case 'p':
+        lg->numPlayers = atoi(optarg);
+        break;
+      case 's':
+        *numSpectators = atoi(optarg);
+        break;
+      case 'k':
+        if (strcmp(optarg, "walk") == 0) {
+          lg->pattern = pattern_WALK;
+        } else if (strcmp(optarg, "sprint") == 0) {
+          lg->pattern = pattern_SPRINT;
+        } else if (strcmp(optarg, "gold") == 0) {
+          lg->pattern = pattern_GOLD;
+        } else {
+          fprintf(stderr, "Error: pattern should be walk, sprint or gold\n");
+          exit(2);
+        }
+        break;
+      case 'r':
+        lg->rate = atof(optarg);
+        break;
+      case 'd':
+        lg->duration = atof(optarg);
+        break;
+      default:
+        fprintf(stderr, Usage);
+        exit(1);
+    }
+  }
+  if (argc - optind != 2) {
+    fprintf(stderr, Usage);
+    exit(1);
+  }
+  if (lg->numPlayers < 0 || *numSpectators < 0 || lg->numPlayers + *numSpectators == 0
+      || lg->rate < 0 || lg->duration <= 0) {
+    fprintf(stderr, "Error: need at least one bot, a rate >= 0 and a duration > 0\n");
+    exit(2);
+  }
+  if (!message_setAddr(argv[optind], argv[optind + 1], &lg->server)) {
+    fprintf(stderr, "Error: bad hostname or port: %s %s\n", argv[optind], argv[optind + 1]);
+    exit(2);
+  }
+}
+
+/**************** startBots ****************/
+/* open a socket per bot, and have each join the game */
+static bool
+startBots(loadgen_t* lg, const int numSpectators)
+{
+  lg->numBots = lg->numPlayers + numSpectators;
+  lg->bots = calloc(lg->numBots, sizeof(bot_t));
+  if (lg->bots == NULL) {
+    return false;
+  }
+  lg->start = now();
+  lg->stop = lg->start + lg->duration;
+  lg->lastMessage = lg->start;
+  double period = lg->rate > 0 ? 1.0 / lg->rate : 0;
+
+  for (int i = 0; i < lg->numBots; i++) {
+    bot_t* bot = &lg->bots[i];
+    bot->lg = lg;
+    bot->isPlayer = i < lg->numPlayers;
+    bot->row = bot->col = -1;
+    // spread the players' keys over one period, so they do not all land at once
+    bot->nextKey = lg->start + period * i / (lg->numPlayers > 0 ? lg->numPlayers : 1);
+    bot->socket = message_openSocket(handleMessage, bot);
+    if (bot->socket < 0) {
+      lg->numBots = i;
+      return false;
+    }
+
+    char join[message_MaxBytes];
+    if (bot->isPlayer) {
+      char name[MaxNameLength + 1];
+      snprintf(name, sizeof(name), "bot%d", i);
+      protocol_encodePLAY(join, sizeof(join), name, protocol_CapRLE);
+    } else {
+      protocol_encodeSPECTATE(join, sizeof(join), protocol_CapRLE);
+    }
+    message_sendOn(bot->socket, lg->server, join);
+  }
+  return true;
+}
+
+/**************** handleTick ****************/
+/* the pacing timer: send the keys that are due, and end the run on time */
+static bool
+handleTick(void* arg)
+{
+  loadgen_t* lg = arg;
+  double t = now();
+
+  if (lg->stopping) {
+    // stop once every bot has quit, or the server has gone quiet
+    return lg->numDone == lg->numBots || t - lg->lastMessage > QuitSeconds;
+  }
+  if (t >= lg->stop) {
+    char quit[16];
+    protocol_encodeKEY(quit, sizeof(quit), 'Q');
+    for (int i = 0; i < lg->numBots; i++) {
+      if (!lg->bots[i].done) {
+        message_sendOn(lg->bots[i].socket, lg->server, quit);
+      }
+    }
+    lg->stopping = true;
+    lg->stop = t;
+    lg->lastMessage = t;
+    return false;
+  }
+
+  for (int i = 0; i < lg->numPlayers; i++) {
+    bot_t* bot = &lg->bots[i];
+    if (bot->done || bot->row < 0) {
+      continue;
+    }
+    if (bot->pending) {
+      if (t - bot->sentAt < LostSeconds) {
+        continue;
+      }
+      lg->keysLost++;
+      bot->pending = false;
+    }
+    if (lg->rate == 0) {
+      bot_sendKey(bot, t);
+    } else if (t >= bot->nextKey) {
+      bot_sendKey(bot, t);
+      bot->nextKey += 1.0 / lg->rate;
+      if (bot->nextKey < t) {
+        bot->nextKey = t;   // fell behind; do not send a burst to catch up
+      }
+    }
+  }
+  return false;
+}
+
+/**************** handleTimeout ****************/
+/* the fallback where there is no timer: tick whenever the loop is quiet */
+static bool
+handleTimeout(void* arg)
+{
+  return handleTick(arg);
+}
+
+/**************** handleMessage ****************/
+/* a message from the server to one bot; 'arg' is the bot */
+static bool
+handleMessage(void* arg, const addr_t from, const char* message)
+{
+  bot_t* bot = arg;
+  loadgen_t* lg = bot->lg;
+  lg->msgs++;
+  lg->bytes += strlen(message);
+  lg->lastMessage = now();
+
+  protocol_msg_t msg;
+  switch (protocol_parse(message, &msg)) {
+    case protocol_GRID:
+      lg->numOther++;
+      bot_grid(bot, &msg);
+      break;
+    case protocol_DISPLAY:
+      lg->numDisplay++;
+      bot_display(bot, msg.text, false);
+      break;
+    case protocol_RDISPLAY:
+      lg->numRDisplay++;
+      bot_display(bot, msg.text, true);
+      break;
+    case protocol_DELTA:
+      lg->numDelta++;
+      bot_delta(bot, msg.text);
+      break;
+    case protocol_GOLD:
+      lg->numGold++;
+      break;
+    case protocol_QUIT:
+      lg->numOther++;
+      if (!bot->done) {
+        bot->done = true;
+        lg->numDone++;
+        if (!lg->stopping && strncmp(msg.text, "GAME OVER", 9) != 0) {
+          log_s("loadgen: a bot quit early: %s", msg.text);
+        }
+      }
+      // all done, perhaps early, when the game is over: end the run
+      if (lg->numDone == lg->numBots) {
+        if (!lg->stopping) {
+          lg->stop = now();
+          lg->stopping = true;
+        }
+        return true;
+      }
+      return false;
+    case protocol_ERROR:
+      lg->numOther++;
+      log_s("loadgen: server error: %s", msg.text);
+      break;
+    default:
+      lg->numOther++;
+      break;
+  }
+  return false;
+}
+
+/**************** bot_grid ****************/
+/* size the bot's map, and the shared BFS scratch, for the grid */
+static void
+bot_grid(bot_t* bot, const protocol_msg_t* msg)
+{
+  free(bot->frame);
+  bot->nrows = msg->grid.nrows;
+  bot->ncols = msg->grid.ncols;
+  bot->frame = calloc(bot->nrows * (bot->ncols + 1) + 1, sizeof(char));
+  if (bot->frame == NULL) {
+    log_v("loadgen: out of memory for the map");
+    exit(5);
+  }
+  bot->row = bot->col = -1;
+
+  loadgen_t* lg = bot->lg;
+  int cells = bot->nrows * bot->ncols;
+  if (lg->pattern == pattern_GOLD && cells > lg->scratchCells) {
+    free(lg->stamp);
+    free(lg->queue);
+    free(lg->firstStep);
+    lg->stamp = calloc(cells, sizeof(int));
+    lg->queue = malloc(cells * sizeof(int));
+    lg->firstStep = malloc(cells);
+    if (lg->stamp == NULL || lg->queue == NULL || lg->firstStep == NULL) {
+      log_v("loadgen: out of memory for the path search");
+      exit(5);
+    }
+    lg->scratchCells = cells;
+    lg->stampNow = 0;
+  }
+}
+
+/**************** bot_display ****************/
+/* a whole map, plain or run-length encoded */
+static void
+bot_display(bot_t* bot, const char* map, const bool encoded)
+{
+  if (bot->frame == NULL) {
+    log_v("loadgen: map received before GRID");
+    return;
+  }
+  size_t size = bot->nrows * (bot->ncols + 1) + 1;
+  if (encoded) {
+    if (protocol_decodeRDISPLAY(map, bot->frame, size) < 0) {
+      log_v("loadgen: malformed RDISPLAY");
+      return;
+    }
+  } else {
+    strncpy(bot->frame, map, size - 1);
+  }
+  bot_findSelf(bot);
+}
+
+/**************** bot_delta ****************/
+/* patch the map; the '@' can only have moved into one of the runs */
+static void
+bot_delta(bot_t* bot, const char* runs)
+{
+  if (bot->frame == NULL) {
+    log_v("loadgen: DELTA received before GRID");
+    return;
+  }
+  const char* cursor = runs;
+  protocol_run_t run;
+  bool found = false;
+  while (protocol_nextRun(&cursor, &run)) {
+    if (run.row >= bot->nrows || run.col > bot->ncols || run.count > bot->ncols - run.col) {
+      log_v("loadgen: malformed DELTA run");
+      return;
+    }
+    char* dest = bot->frame + run.row * (bot->ncols + 1) + run.col;
+    memcpy(dest, run.chars, run.count);
+    const char* self = memchr(run.chars, '@', run.count);
+    if (self != NULL) {
+      bot->row = run.row;
+      bot->col = run.col + (self - run.chars);
+      found = true;
+    }
+  }
+  if (found) {
+    bot_moved(bot);
+  }
+}
+
+/**************** bot_findSelf ****************/
+/* find the '@' in a whole map */
+static void
+bot_findSelf(bot_t* bot)
+{
+  const char* self = strchr(bot->frame, '@');
+  if (self == NULL) {
+    bot->row = bot->col = -1;
+    return;
+  }
+  int offset = self - bot->frame;
+  bot->row = offset / (bot->ncols + 1);
+  bot->col = offset % (bot->ncols + 1);
+  bot_moved(bot);
+}
+
+/**************** bot_moved ****************/
+/* the map shows the '@'; if it has left where it was, the key is answered */
+static void
+bot_moved(bot_t* bot)
+{
+  if (!bot->pending || (bot->row == bot->sentRow && bot->col == bot->sentCol)) {
+    return;
+  }
+  loadgen_t* lg = bot->lg;
+  double t = now();
+  bot->pending = false;
+  lg->keysAnswered++;
+  addSample(lg, t - bot->sentAt);
+  if (lg->rate == 0 && !lg->stopping) {
+    bot_sendKey(bot, t);
+  }
+}
+
+/**************** bot_sendKey ****************/
+/* choose and send a player's next key */
+static void
+bot_sendKey(bot_t* bot, const double t)
+{
+  int move = bot_chooseMove(bot);
+  if (move < 0) {
+    return;   // boxed in, as far as the map shows
+  }
+  loadgen_t* lg = bot->lg;
+  char key[16];
+  protocol_encodeKEY(key, sizeof(key), move >= 8 ? moveKeys[move - 8] - 'a' + 'A' : moveKeys[move]);
+  message_sendOn(bot->socket, lg->server, key);
+  lg->keysSent++;
+  bot->pending = true;
+  bot->sentRow = bot->row;
+  bot->sentCol = bot->col;
+  bot->sentAt = t;
+}
+
+/**************** bot_chooseMove ****************/
+/* the next move in the run's pattern: 0..7 a step, 8..15 a sprint; -1 if none */
+static int
+bot_chooseMove(bot_t* bot)
+{
+  switch (bot->lg->pattern) {
+    case pattern_SPRINT: {
+      int move = bot_randomMove(bot);
+      return move >= 0 && rand() % 4 != 0 ? move + 8 : move;
+    }
+    case pattern_GOLD: {
+      int move = bot_goldMove(bot);
+      return move >= 0 ? move : bot_randomMove(bot);
+    }
+    default:
+      return bot_randomMove(bot);
+  }
+}
+
+/**************** bot_randomMove ****************/
+/* a random one of the steps the player can take */
+static int
+bot_randomMove(bot_t* bot)
+{
+  int moves[8];
+  int numMoves = 0;
+  for (int d = 0; d < 8; d++) {
+    if (bot_canEnter(bot, bot->row + moveRows[d], bot->col + moveCols[d])) {
+      moves[numMoves++] = d;
+    }
+  }
+  return numMoves == 0 ? -1 : moves[rand() % numMoves];
+}
+
+/**************** bot_goldMove ****************/
+/* the first step of a shortest path, over the cells the map shows,
+ * to the nearest pile of gold; -1 if none is in sight
+ */
+static int
+bot_goldMove(bot_t* bot)
+{
+  loadgen_t* lg = bot->lg;
+  if (lg->stamp == NULL) {
+    return -1;
+  }
+  if (++lg->stampNow == 0) {     // wrapped: clear the stamps
+    memset(lg->stamp, 0, lg->scratchCells * sizeof(int));
+    lg->stampNow = 1;
+  }
+  int ncols = bot->ncols;
+  int head = 0, tail = 0;
+  int start = bot->row * ncols + bot->col;
+  lg->stamp[start] = lg->stampNow;
+  lg->queue[tail++] = start;
+  while (head < tail) {
+    int cell = lg->queue[head++];
+    int r = cell / ncols, c = cell % ncols;
+    for (int d = 0; d < 8; d++) {
+      int nr = r + moveRows[d], nc = c + moveCols[d];
+      if (!bot_canEnter(bot, nr, nc)) {
+        continue;
+      }
+      int next = nr * ncols + nc;
+      if (lg->stamp[next] == lg->stampNow) {
+        continue;
+      }
+      lg->stamp[next] = lg->stampNow;
+      lg->firstStep[next] = cell == start ? d : lg->firstStep[cell];
+      if (bot->frame[nr * (ncols + 1) + nc] == '*') {
+        return lg->firstStep[next];
+      }
+      lg->queue[tail++] = next;
+    }
+  }
+  return -1;
+}
+
+/**************** bot_canEnter ****************/
+/* whether the map shows a cell the player can move into: a spot,
+ * a passage, gold, or another player, who would swap places
+ */
+static bool
+bot_canEnter(bot_t* bot, const int r, const int c)
+{
+  if (r < 0 || r >= bot->nrows || c < 0 || c >= bot->ncols) {
+    return false;
+  }
+  char cell = bot->frame[r * (bot->ncols + 1) + c];
+  return cell == '.' || cell == '#' || cell == '*' || (cell >= 'A' && cell <= 'Z');
+}
+
+/**************** addSample ****************/
+static void
+addSample(loadgen_t* lg, const double latency)
+{
+  if (lg->numSamples == lg->samplesSize) {
+    long size = lg->samplesSize == 0 ? 1024 : 2 * lg->samplesSize;
+    double* bigger = realloc(lg->samples, size * sizeof(double));
+    if (bigger == NULL) {
+      return;   // keep the samples we have
+    }
+    lg->samples = bigger;
+    lg->samplesSize = size;
+  }
+  lg->samples[lg->numSamples++] = latency;
+}
+
+/**************** report ****************/
+/* print the metrics of the run, "metric<TAB>value" a line */
+static void
+report(loadgen_t* lg, const int numSpectators)
+{
+  double seconds = lg->stop - lg->start;
+  qsort(lg->samples, lg->numSamples, sizeof(double), compareDoubles);
+  const double pct[] = { 0.50, 0.90, 0.99 };
+  const char* names[] = { "latency_p50_us", "latency_p90_us", "latency_p99_us" };
+
+  printf("players\t%d\n", lg->numPlayers);
+  printf("spectators\t%d\n", numSpectators);
+  printf("seconds\t%.3f\n", seconds);
+  printf("keys_sent\t%ld\n", lg->keysSent);
+  printf("keys_answered\t%ld\n", lg->keysAnswered);
+  printf("keys_lost\t%ld\n", lg->keysLost);
+  printf("keys_per_sec\t%.1f\n", lg->keysAnswered / seconds);
+  for (int i = 0; i < 3; i++) {
+    double value = 0;
+    if (lg->numSamples > 0) {
+      long rank = (long)(pct[i] * lg->numSamples);
+      value = lg->samples[rank < lg->numSamples ? rank : lg->numSamples - 1];
+    }
+    printf("%s\t%.0f\n", names[i], value * 1e6);
+  }
+  printf("latency_max_us\t%.0f\n",
+         lg->numSamples > 0 ? lg->samples[lg->numSamples - 1] * 1e6 : 0);
+  printf("msgs_recv\t%ld\n", lg->msgs);
+  printf("msgs_per_sec\t%.1f\n", lg->msgs / seconds);
+  printf("bytes_recv\t%ld\n", lg->bytes);
+  printf("bytes_per_sec\t%.0f\n", lg->bytes / seconds);
+  printf("msgs_display\t%ld\n", lg->numDisplay);
+  printf("msgs_rdisplay\t%ld\n", lg->numRDisplay);
+  printf("msgs_delta\t%ld\n", lg->numDelta);
+  printf("msgs_gold\t%ld\n", lg->numGold);
+  printf("msgs_other\t%ld\n", lg->numOther);
+}
+
+/**************** compareDoubles ****************/
+static int
+compareDoubles(const void* a, const void* b)
+{
+  double x = *(const double*) a, y = *(const double*) b;
+  return (x > y) - (x < y);
+}
+
+/**************** now ****************/
+/* seconds on the monotonic clock */
+static double
+now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
@@ -5,6 +5,7 @@
 #include <ncurses.h>
 #include <ctype.h>
 #include "message.h"
+#include "protocol.h"
 #include "log.h"
 
 typedef struct gameInfo{
@@ -15,6 +16,9 @@ typedef struct gameInfo{
     bool isPlayer; //true if is player, false if is spectator
     char letter; //letter that represents the player
     char* portStr; //string pointer for the portstr
+    char* frame; //copy of the map as drawn on the screen, NULL until GRID arrives
+    char* next; //a full map is decoded here, then drawn where it differs from frame
+    bool pending; //drawn since the last doupdate
 } gameInfo_t;
 
 static gameInfo_t game; //global struct that holds information
@@ -25,8 +29,15 @@ static bool handleMessage(void* arg, const addr_t from, const char* message);
 static bool handleInput(void* arg);
 static void game_init(void);
 static void parseArgs(const int argc, const char* argv[]);
-static void parse_GRID(char* msg);
-static void parse_GOLD(char* msg);
+static void parse_GRID(const protocol_msg_t* msg);
+static void parse_GOLD(const protocol_msg_t* msg);
+static void parse_DISPLAY(const char* msg);
+static void parse_RDISPLAY(const char* msg);
+static void parse_DELTA(const char* msg);
+static void draw_cell(int row, int col, char c);
+static void draw_map(const char* map);
+static void draw_done(void);
+static void screen_flush(void* arg);
 /*************************************/
 
 /*
@@ -46,9 +57,12 @@ int main(const int argc, const char* argv[])
     message_init(stderr);
 
     parseArgs(argc, argv);
+    message_setFlush(&screen_flush, NULL);
     message_loop(NULL, 0, NULL, &handleInput, &handleMessage);
     message_done();
     log_done();
+    free(game.frame);
+    free(game.next);
     
 
 }
@@ -93,6 +107,7 @@ game_init(void)
 
     }
 
+    erase();
     move(0,0);
     refresh();
 
@@ -137,18 +152,18 @@ parseArgs(const int argc, const char* argv[])
     
     if (game.isPlayer){
         //sends the player message with name
-        char* temp = "PLAY ";
-        char* fullName = malloc(sizeof(char)*1000);
-        if (fullName == NULL){
-            log_e("Out of memory for name\n");
+        char fullName[message_MaxBytes];
+        //and asks for run-length encoded maps, which are much smaller
+        if (protocol_encodePLAY(fullName, sizeof(fullName), realName, protocol_CapRLE) < 0){
+            fprintf(stderr, "player name is too long\n");
             exit(1);
-        }   
-        sprintf(fullName, "%s%s", temp, realName);
+        }
         message_send(tempAddr, fullName);
-        free(fullName);
     } else {
-        //sends the spectator message
-        message_send(game.serverAddr, "SPECTATE");
+        //sends the spectator message, asking for run-length encoded maps
+        char spectate[100];
+        protocol_encodeSPECTATE(spectate, sizeof(spectate), protocol_CapRLE);
+        message_send(game.serverAddr, spectate);
     }    
 }
 
@@ -162,34 +177,34 @@ handleInput(void* arg)
     int c = getch();
     if(game.isPlayer){
         switch(c) {
-        case ('h'):   message_send(game.serverAddr, "KEY h"); refresh(); return false; //move left
-        case ('l'):   message_send(game.serverAddr, "KEY l"); refresh(); return false; // move right
-        case ('j'):   message_send(game.serverAddr, "KEY j"); refresh(); return false; // move down
-        case ('k'):   message_send(game.serverAddr, "KEY k"); refresh(); return false; // move up
-        case ('y'):   message_send(game.serverAddr, "KEY y"); refresh(); return false; //move diagonally up and left
-        case ('u'):   message_send(game.serverAddr, "KEY u"); refresh(); return false; // move diagonally up and right
-        case ('b'):   message_send(game.serverAddr, "KEY b"); refresh(); return false; //move diagonally down and left
-        case ('n'):   message_send(game.serverAddr, "KEY n"); refresh(); return false; //move diagonally down and right
-        case ('H'):   message_send(game.serverAddr, "KEY H"); refresh(); return false; //move left
-        case ('L'):   message_send(game.serverAddr, "KEY L"); refresh(); return false; // move right
-        case ('J'):   message_send(game.serverAddr, "KEY J"); refresh(); return false; // move down
-        case ('K'):   message_send(game.serverAddr, "KEY K"); refresh(); return false; // move up
-        case ('Y'):   message_send(game.serverAddr, "KEY Y"); refresh(); return false; //move diagonally up and left
-        case ('U'):   message_send(game.serverAddr, "KEY U"); refresh(); return false; // move diagonally up and right
-        case ('B'):   message_send(game.serverAddr, "KEY B"); refresh(); return false; //move diagonally down and left
-        case ('N'):   message_send(game.serverAddr, "KEY N"); refresh(); return false; //move diagonally down and right
-        case ('Q'):   message_send(game.serverAddr, "KEY Q"); refresh(); return false; //move diagonally down and right
+        case ('h'):   message_send(game.serverAddr, "KEY h"); return false; //move left
+        case ('l'):   message_send(game.serverAddr, "KEY l"); return false; // move right
+        case ('j'):   message_send(game.serverAddr, "KEY j"); return false; // move down
+        case ('k'):   message_send(game.serverAddr, "KEY k"); return false; // move up
+        case ('y'):   message_send(game.serverAddr, "KEY y"); return false; //move diagonally up and left
+        case ('u'):   message_send(game.serverAddr, "KEY u"); return false; // move diagonally up and right
+        case ('b'):   message_send(game.serverAddr, "KEY b"); return false; //move diagonally down and left
+        case ('n'):   message_send(game.serverAddr, "KEY n"); return false; //move diagonally down and right
+        case ('H'):   message_send(game.serverAddr, "KEY H"); return false; //move left
+        case ('L'):   message_send(game.serverAddr, "KEY L"); return false; // move right
+        case ('J'):   message_send(game.serverAddr, "KEY J"); return false; // move down
+        case ('K'):   message_send(game.serverAddr, "KEY K"); return false; // move up
+        case ('Y'):   message_send(game.serverAddr, "KEY Y"); return false; //move diagonally up and left
+        case ('U'):   message_send(game.serverAddr, "KEY U"); return false; // move diagonally up and right
+        case ('B'):   message_send(game.serverAddr, "KEY B"); return false; //move diagonally down and left
+        case ('N'):   message_send(game.serverAddr, "KEY N"); return false; //move diagonally down and right
+        case ('Q'):   message_send(game.serverAddr, "KEY Q"); return false; //move diagonally down and right
         default: 
                       mvprintw(0, 50,"unknown keystroke", c);
                       char temp[100];
-                      sprintf(temp, "KEY %c",c);
-                      message_send(game.serverAddr, temp); refresh(); return false; //not allowed   
+                      protocol_encodeKEY(temp, sizeof(temp), c);
+                      message_send(game.serverAddr, temp); draw_done(); return false; //not allowed   
 
         }
     } else {
         switch(c){
 
-            case ('Q'):   message_send(game.serverAddr, "KEY Q"); refresh(); return false; //move diagonally down and right
+            case ('Q'):   message_send(game.serverAddr, "KEY Q"); return false; //move diagonally down and right
             default: return false;
         }
     }
@@ -202,87 +217,77 @@ handleInput(void* arg)
 static bool 
 handleMessage(void* arg, const addr_t from, const char* message)
 {
-    if (message == NULL){return false;}
-
-        if (strncmp(message, "GRID ", strlen("GRID ")) == 0) {
-            char *content = (char*)message + strlen("GRID ");
-            parse_GRID(content);
+    protocol_msg_t msg;
+    switch (protocol_parse(message, &msg)) {
+        case protocol_GRID:
+            parse_GRID(&msg);
             return false;
-        }
-        if (strncmp(message, "GOLD ", strlen("GOLD ")) == 0) {
-            char *content = (char*)message + strlen("GOLD ");
-            parse_GOLD(content);
+        case protocol_GOLD:
+            parse_GOLD(&msg);
             return false;
-        }
-        if (strncmp(message, "DISPLAY\n", strlen("DISPLAY\n")) == 0) {
-            char *content = (char*)message + strlen("DISPLAY\n");
-            mvprintw(1,0, "%s", content);
-            refresh();
+        case protocol_DISPLAY:
+            parse_DISPLAY(msg.text);
             return false;
-        }
-        if (strncmp(message, "QUIT ", strlen("QUIT ")) == 0) {
-             char *content = (char*)message + strlen("QUIT ");
-             endwin(); // turn off curses display
-             printf("%s\n", content); //prints endgame table
-             return true;
-        }
-        if (strncmp(message, "ERROR ", strlen("ERROR ")) == 0) {
-             char *content = (char*)message + strlen("ERROR ");
-             refresh();
-             log_e(content);
-             return false;
-        }
-        if (strncmp(message, "OK ", strlen("OK ")) == 0) {
-             char *content = (char*)message + strlen("OK ");
-             char letter;
-             sscanf(content, "%c", &letter);
-             game.letter = letter;
-             return false;
-        }
-        return false;
-
+        case protocol_RDISPLAY:
+            parse_RDISPLAY(msg.text);
+            return false;
+        case protocol_DELTA:
+            parse_DELTA(msg.text);
+            return false;
+        case protocol_QUIT:
+            endwin(); // turn off curses display
+            printf("%s\n", msg.text); //prints endgame table
+            return true;
+        case protocol_ERROR:
+            log_e(msg.text);
+            return false;
+        case protocol_OK:
+            game.letter = msg.letter;
+            return false;
+        default:
+            return false;
+    }
 }
 
 /* 
- * breaks down the grid message to set up gridcols and gridrows
+ * sets up gridcols and gridrows from the grid message
  */
 static void
-parse_GRID(char* msg)
+parse_GRID(const protocol_msg_t* msg)
 {
-    char* str;
-    str = strtok(msg, " ");
- 
-    int rows = atoi(str);
+    int rows = msg->grid.nrows;
     game.GridRows = rows;
-    str = strtok(NULL, " ");
 
-    int cols = atoi(str);
+    int cols = msg->grid.ncols;
     game.GridCols = cols;
 
+    //copy of the screen, which starts with no cell drawn, so the first map is drawn whole
+    free(game.frame);
+    free(game.next);
+    game.frame = calloc(rows*(cols+1) + 1, sizeof(char));
+    game.next = calloc(rows*(cols+1) + 1, sizeof(char));
+    if (game.frame == NULL || game.next == NULL){
+        log_v("Out of memory for the map\n");
+        exit(1);
+    }
+
     //initialize game
     game_init();
-    refresh();
 }
 
 /*
  * breaks down the gold message and displays on screen
  */
 static void
-parse_GOLD(char* msg)
+parse_GOLD(const protocol_msg_t* msg)
 {
-    char* str;
-    str = strtok(msg, " ");
-    int justCollected = atoi(str);
-    str = strtok(NULL, " ");
-    int totalCollected = atoi(str);
-    str = strtok(NULL, " ");
-    int goldLeft = atoi(str);
-    move(0,0);
+    int justCollected = msg->gold.n;
+    int totalCollected = msg->gold.p;
+    int goldLeft = msg->gold.r;
 
     //clears line 1
-    refresh();
+    move(0,0);
     clrtoeol();
-    refresh();
 
     if(game.isPlayer){
 
@@ -296,7 +301,120 @@ parse_GOLD(char* msg)
         //spectator displays gold message
         mvprintw(0,0, "Spectator: %d nuggets unclaimed. Play at plank %s", goldLeft, game.portStr);
     }
-    refresh();
+    draw_done();
 }
 
+/*
+ * draws the cells of a full map that differ from the screen
+ */
+static void
+parse_DISPLAY(const char* msg)
+{
+    if (game.frame != NULL){
+        draw_map(msg);
+    } else {
+        mvprintw(1,0, "%s", msg);
+    }
+    draw_done();
+}
+
+/*
+ * expands a run-length encoded map and draws the cells that differ from the screen
+ */
+static void
+parse_RDISPLAY(const char* msg)
+{
+    if (game.frame == NULL){
+        log_v("RDISPLAY received before GRID\n");
+        return;
+    }
+    if (protocol_decodeRDISPLAY(msg, game.next, game.GridRows*(game.GridCols+1) + 1) < 0){
+        log_v("malformed RDISPLAY\n");
+        return;
+    }
+    draw_map(game.next);
+    draw_done();
+}
 
+/*
+ * draws the runs of changed cells in a DELTA message straight onto the screen.
+ * each line of the message is "r c n:chars", n new characters starting at row r, column c.
+ */
+static void
+parse_DELTA(const char* msg)
+{
+    if (game.frame == NULL){
+        log_v("DELTA received before GRID\n");
+        return;
+    }
+
+    const char* cursor = msg;
+    protocol_run_t run;
+    bool inMap = true;
+    while (inMap && protocol_nextRun(&cursor, &run)){
+        inMap = run.row < game.GridRows && run.col <= game.GridCols
+            && run.count <= game.GridCols - run.col; // no sum to overflow
+        for (int i = 0; inMap && i < run.count; i++){
+            draw_cell(run.row, run.col + i, run.chars[i]);
+        }
+    }
+    if (!inMap || *cursor != '\0'){
+        log_v("malformed DELTA run\n");
+    }
+    draw_done();
+}
+
+/*
+ * draws one cell of the map, at row+1 below the status line, if it is not already on the screen
+ */
+static void
+draw_cell(int row, int col, char c)
+{
+    char* cell = game.frame + row*(game.GridCols+1) + col;
+    if (*cell != c){
+        *cell = c;
+        mvaddch(row + 1, col, c);
+    }
+}
+
+/*
+ * draws a full map, rows separated by newlines, where it differs from the screen;
+ * anything beyond the grid is ignored
+ */
+static void
+draw_map(const char* map)
+{
+    int row = 0;
+    int col = 0;
+    for (const char* p = map; *p != '\0' && row < game.GridRows; p++){
+        if (*p == '\n'){
+            row++;
+            col = 0;
+        } else if (col < game.GridCols){
+            draw_cell(row, col++, *p);
+        }
+    }
+}
+
+/*
+ * marks the screen as changed: stdscr goes to the virtual screen now,
+ * and the terminal is written once the whole batch of messages is handled
+ */
+static void
+draw_done(void)
+{
+    wnoutrefresh(stdscr);
+    game.pending = true;
+}
+
+/*
+ * called by message_loop before it waits again: one doupdate for everything drawn since
+ */
+static void
+screen_flush(void* arg)
+{
+    if (game.pending){
+        doupdate();
+        game.pending = false;
+    }
+}
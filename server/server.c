@@ -1,46 +1,203 @@
 /*
  * server.c - Nuggest's server
  *
- * Usage: ./server map.txt [seed]
+ * Usage: ./server [-t tick-ms] [-r sight-radius] [-g games] [-w workers] [-p view-threads] [-l log-level] [-s stats-seconds] [-v spectator-ms] [-j journal] [-R journal] map.txt [seed]
  *
  * Team - Hemlock, May 2021
  *
  */
 
+#define _GNU_SOURCE  // getopt, clock_gettime, random_r
+
 #include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdbool.h>
 #include <string.h>
 #include <ctype.h>
+#include <limits.h>
 #include "message.h"
+#include "protocol.h"
 #include "log.h"
+#include "stats.h"
+#include "arena.h"
+#include "journal.h"
 #include "grid.h"
+#include "mem.h"
+#include "hashtable.h"
 
 /***************************************************************************************/
 #define MaxNameLength 50   // max number of chars in playerName
-#define MaxPlayers 26      // maximum number of players
+#define MaxPlayers 65534   // maximum number of players; ids must fit the grid's 16-bit occupancy
+#define PlayerSlots 1021   // slots in the address -> player hashtable
+#define MaxSpectators 4096 // maximum number of spectators of one game
 #define GoldTotal 250      // amount of gold in the game
 #define GoldMinNumPiles 10 // minimum number of gold piles
 #define GoldMaxNumPiles 30 // maximum number of gold piles
+#define DeltaMaxGap 4      // unchanged cells a DELTA run may absorb
+#define FullFrameEvery 32  // DELTAs to a client between full maps, which repair a lost one
+#define DisplayHeader "DISPLAY\n"
+#define AddrKeyLength 20   // "%08x:%04x" address keys, with room to spare
+#define RandStateSize 128  // bytes of random_r state; what rand() uses
+#define StatsBytes 8192    // room for the STATS answer of one game
+#define InboxMaxBytes (PIPE_BUF - sizeof(inboxEntry_t)) // longest message passed to a worker; clients' are a few bytes
+#define InboxPipeBytes (1 << 20) // room asked for in each worker's inbox
+#define ArenaChunkBytes 65536 // bytes a game takes from the heap at a time
+#define Usage "usage: ./server [-t tick-ms] [-r sight-radius] [-g games] [-w workers] [-p view-threads] [-l log-level] [-s stats-seconds] [-v spectator-ms] [-j journal] [-R journal] map.txt [seed]"
+
+/******************************* heap counter *****************************************/
+/* with -DMEMTEST, every malloc, calloc and realloc of a thread is counted,
+ * passed on to glibc's own; the counts of a game's threads are reported
+ * as heap_allocs in its STATS, which stay put during steady play.
+ */
+#ifdef MEMTEST
+extern void* __libc_malloc(size_t size);
+extern void* __libc_calloc(size_t count, size_t size);
+extern void* __libc_realloc(void* ptr, size_t size);
+
+static _Thread_local unsigned long heapAllocs;
+
+void* malloc(size_t size) { heapAllocs++; return __libc_malloc(size); }
+void* calloc(size_t count, size_t size) { heapAllocs++; return __libc_calloc(count, size); }
+void* realloc(void* ptr, size_t size) { heapAllocs++; return __libc_realloc(ptr, size); }
+#endif
+
+/******************************* replay clock *****************************************/
+/* while a journal is replayed, server_now reads the journal's clock, in
+ * ms, so ticks and spectator frames fall as they did when it was made;
+ * -1 on the real clock. Only replay sets it, with one game and no threads.
+ */
+static long replayNow = -1;
+
+/******************************* view struct *****************************************/
+/* the maps rendered for one client. Both buffers hold DisplayHeader
+ * followed by a map, so a full map is sent straight from the buffer;
+ * after each send the two are swapped rather than copied.
+ * lastFrame is a cache keyed on the grid version it was rendered from:
+ * while the grid keeps that version, there is nothing to render or send.
+ */
+typedef struct view {
+  char* frame;                     // buffer the next map is rendered into
+  char* lastFrame;                 // map last sent to the client
+  bool sent;                       // whether lastFrame has been sent yet
+  unsigned long version;           // grid version lastFrame was rendered from
+  int deltas;                      // DELTAs sent since the last full map
+  unsigned caps;                   // protocol_Cap* bits the client asked for
+} view_t;
+
+/******************************* stats struct *****************************************/
+/* where a game's time goes, and what it sends and receives, answered to
+ * STATS and logged every -s seconds. Only the thread playing the game
+ * touches them, so plain counters do; the view pool's helpers time
+ * grid_seenUpdate into histograms of their own, added in when reported.
+ */
+typedef enum gameTimer {
+  TimeMessage,                     // handleMessage, the whole of one message
+  TimeKey,                         // handleKEY
+  TimeMove,                        // player_move, one step
+  TimeSprint,                      // player_sprint, a whole run
+  TimeUpdate,                      // server_update_all_clients
+  TimeSee,                         // grid_seenUpdate, for one player
+  TimeSend,                        // one message_send, or message_send_batch
+  NumTimers
+} gameTimer_t;
+
+static const char* timerNames[NumTimers] = {
+  "handleMessage", "handleKEY", "player_move", "player_sprint",
+  "server_update_all_clients", "grid_seenUpdate", "message_send",
+};
+
+typedef struct traffic {
+  unsigned long messages;
+  unsigned long bytes;
+} traffic_t;
+
+typedef struct gameStats {
+  long start;                      // server_now() when the game began
+  long nextLog;                    // when to log them next
+  stats_hist_t time[NumTimers];
+  traffic_t recv[protocol_NumTypes]; // by type of message
+  traffic_t sent[protocol_NumTypes];
+  unsigned long heapAllocs;        // made playing the game, with -DMEMTEST
+} gameStats_t;
 
 /******************************* player struct *****************************************/
 typedef struct player {
   addr_t IP;                       // IP address
   char realName[MaxNameLength + 1];
-  char alias;                       // letter assigned
+  char alias;                       // letter displayed; 'A' + id, wrapping after 'Z'
+  int id;                          // index in game->players, and occupant id in masterGrid
   int gold;                        // gold in purse
   int justCollected;
+  char goldSent[50];               // last GOLD message sent to the player
   int row;                         // row
   int col;                         // column 
-  grid_t* seenGrid;
+  grid_seen_t* seen;               // what the player has seen of the map, and sees now
+  grid_rect_t dirty;               // cells of seen changed since the last update
+  view_t view;                     // maps rendered for the player
+  const char* pending;             // map message made by the view stage, or NULL
 } player_t;
 
+/******************************* spectator struct *****************************************/
+/* a spectator shares the game's one rendering of the master grid. Once
+ * it has been sent the whole map last rendered it is synced, and from
+ * then on it gets the shared DELTA of each new rendering.
+ */
+typedef struct spectator {
+  addr_t IP;
+  unsigned caps;                   // protocol_Cap* bits the spectator asked for
+  bool synced;                     // has the map last rendered for spectators
+  char goldSent[50];               // last GOLD message sent to the spectator
+  struct spectator* next;          // on the game's free list, once it quits
+} spectator_t;
+
+/******************************* view pool struct *****************************************/
+/* helper threads for the view stage of a game's updates. In each round,
+ * the loop thread and the helpers each bring the views of every
+ * (numThreads+1)th player up to date, then the loop thread sends them.
+ */
+typedef struct viewPool viewPool_t;
+
+typedef struct viewHelper {
+  viewPool_t* pool;
+  int index;                       // 0 .. numThreads-1; handles players index+1, ...
+  stats_hist_t seeTime;            // grid_seenUpdate, on this thread
+  unsigned long heapAllocs;        // made by this thread, with -DMEMTEST
+} viewHelper_t;
+
+struct viewPool {
+  struct game* game;
+  int numThreads;                  // helper threads; the loop thread makes one more
+  pthread_t* threads;
+  viewHelper_t* helpers;
+  char** deltaBufs;                // one DELTA scratch buffer per helper
+  pthread_mutex_t lock;
+  pthread_cond_t start;            // a round has begun, or the pool is stopping
+  pthread_cond_t finish;           // the helpers are done with the round
+  unsigned long round;             // bumped to begin a round
+  int busy;                        // helpers still working on this round
+  bool stop;
+};
+
 
 
 /******************************* game struct *****************************************/
-struct game
+/* whether a PLAY or SPECTATE got in; the dispatcher lets a client
+ * turned away try another game.
+ */
+typedef enum join { JoinNone, JoinAccepted, JoinRefused } join_t;
+
+typedef struct game
 {
+  int id;                        // index among the games of this server
+  arena_t* arena;                // the game itself, its players and buffers
+
   // grid
   grid_t* masterGrid;
   grid_t* rawGrid;
@@ -53,379 +210,1953 @@ struct game
   int goldLeft;                  // gold left
     
   // player
-  player_t* players[MaxPlayers]; //array of player struct
+  player_t** players;            // array of player struct, grown as players join
   int numPlayer; 
+  int playersSize;               // slots allocated in players
+  hashtable_t* playersByAddr;    // address key -> player
     
-  // spectator
-  addr_t spectatorIP;
-
-  // seed
+  // spectators
+  spectator_t** spectators;      // array of spectator struct, grown as spectators join
+  int numSpectators;
+  int spectatorsSize;            // slots allocated in spectators
+  spectator_t* freeSpectators;   // left by spectators who quit, for new ones
+  int spectatorInterval;         // ms between maps to spectators; 0 for every update
+  long spectatorNextFrame;       // earliest time (ms) of the next map rendered for them
+  long spectatorCatchUp;         // when an update they skipped is due; 0 if none
+  view_t spectatorView;          // maps rendered once for all spectators
+  char* spectatorRLE;            // the last map as an RDISPLAY, made when first needed
+  char spectatorGold[50];        // GOLD message for spectators
+
+  // seed, and this game's random number state
   int seed;
-};
+  struct random_data rng;
+  char rngState[RandStateSize];
+
+  // scratch buffer for DELTA messages, as big as a full DISPLAY
+  char* deltaBuf;
+  int displaySize;
+  viewPool_t* viewPool;          // threads sharing the view stage; NULL to do it alone
+
+  // messages queued during an update, sent together by server_flush
+  addr_t* outAddrs;
+  const char** outMessages;
+  int outCount;
+  int outSize;
+
+  // broadcast scheduling
+  int tickInterval;              // ms between broadcasts; 0 to broadcast on every change
+  int sightRadius;               // how far players see; 0 for no limit
+  bool updatePending;            // some change has not been broadcast yet
+  long nextTick;                 // earliest time (ms) of the next broadcast
+
+  // instrumentation
+  int statsInterval;             // ms between stats in the log; 0 for none
+  gameStats_t stats;
+  journal_t* journal;            // records the messages received; NULL for none
+  bool offline;                  // replaying a journal: nothing goes on the network
+  join_t join;                   // how the message just handled went, if a PLAY or SPECTATE
+} game_t;
+
+/******************************* config struct *****************************************/
+/* the command line, shared by every game.
+ */
+typedef struct config {
+  char* map;                     // map every game is played on
+  int seed;                      // seed given, or 0 to seed from the pid
+  int tickInterval;              // ms between broadcasts; 0 to broadcast on every change
+  int sightRadius;               // how far players see; 0 for no limit
+  int numGames;                  // games hosted by this server
+  int numWorkers;                // threads the games are shared out to
+  int viewThreads;               // threads per game computing players' views
+  int logLevel;                  // log_ERROR, log_INFO or log_DEBUG
+  int statsInterval;             // ms between stats in the log; 0 for none
+  int spectatorInterval;         // ms between maps to spectators; 0 for every update
+  char* journal;                 // file each game's messages are journaled to, or NULL
+  char* replay;                  // journal to replay, offline, or NULL to play live
+} config_t;
+
+/******************************* worker struct *****************************************/
+/* a thread playing games id, id + stride, id + 2*stride, ...
+ * It owns those games: no other thread touches them once it starts.
+ */
+typedef struct worker {
+  pthread_t thread;
+  int inbox[2];                  // pipe of inboxEntry_t + message, from the dispatcher
+  int done;                      // write end of the dispatcher's done pipe
+  game_t** games;                // its games, NULL once over; game id is games[id / stride]
+  int numGames;
+  int stride;                    // number of workers
+  int tickInterval;
+  int statsInterval;
+  int spectatorInterval;
+} worker_t;
+
+/* header of a datagram routed to a worker; the message follows.
+ */
+typedef struct inboxEntry {
+  int game;                      // id of the game it is for
+  addr_t from;
+  size_t length;                 // bytes of message following
+} inboxEntry_t;
+
+/* what a worker tells the dispatcher: a game is over, or a client's
+ * PLAY or SPECTATE was answered. Smaller than PIPE_BUF, so the workers'
+ * notices never interleave.
+ */
+typedef struct notice {
+  int game;                      // game id
+  bool over;                     // the game has ended; nothing else is set
+  bool accepted;                 // whether the client got in
+  addr_t from;                   // the client
+} notice_t;
+
+/******************************* dispatcher struct *****************************************/
+/* which game each client address plays in; used by the dispatching thread only.
+ */
+typedef struct route {
+  int game;                      // game id
+  bool over;                     // the game has ended
+} route_t;
+
+typedef struct client {
+  route_t* route;                // its game; NULL until it sends PLAY or SPECTATE
+  int joins;                     // PLAY and SPECTATE passed on, not answered yet
+  bool joined;                   // one of them got in
+} client_t;
+
+typedef struct dispatcher {
+  route_t* routes;               // one per game
+  int numGames;
+  int gamesLeft;                 // games not over yet
+  int next;                      // next game to give a new client, round robin
+  hashtable_t* clientByAddr;     // address key -> client
+  worker_t* workers;
+  int numWorkers;
+  int done[2];                   // pipe of notices, from the workers
+  unsigned long dropped;         // messages dropped because an inbox was full
+} dispatcher_t;
 
 
 /******************************* function declaration ********************************/
-static void parseArgs(const int argc, char* argv[]);
+static void parseArgs(const int argc, char* argv[], config_t* config);
+
+static game_t* game_new(const config_t* config, int id);
+
+static int server_rand(game_t* game);
+
+static bool server_run(game_t* game);
+
+static bool server_dispatch(game_t** games, const config_t* config);
+
+static void server_replay(config_t* config);
+
+static bool handleDispatch(void* arg, const addr_t from, const char* message);
+
+static bool dispatcher_post(dispatcher_t* dispatcher, int game, const addr_t from,
+                            const char* message);
+
+static bool handleNotice(void* arg, int fd);
+
+static void* worker_run(void* arg);
+
+static void worker_finish(worker_t* worker, int i);
+
+static bool server_write(int fd, const void* buf, size_t size);
+
+static bool server_read(int fd, void* buf, size_t size);
+
+static bool server_nonblocking(int fd);
+
+static void server_view_stage(game_t* game, int first, int stride, char* deltaBuf,
+                              stats_hist_t* seeTime);
+
+static viewPool_t* viewPool_new(game_t* game, int numThreads);
+
+static void viewPool_run(viewPool_t* pool);
+
+static void* viewPool_helper(void* arg);
+
+static void viewPool_delete(viewPool_t* pool);
+
+static void server_drop_gold(game_t* game);
+
+static bool server_drop_player(game_t* game, int* row, int* col);
 
-static void server_drop_gold(void);
+static void server_update_all_clients(game_t* game);
 
-static void server_drop_player(player_t* player);
+static void server_schedule_update(game_t* game);
 
-static void server_update_all_clients(void);
+static void server_tick(game_t* game, bool timedOut);
+
+static long server_now(void);
+
+static void server_send_gold(game_t* game, const addr_t to, char* goldSent, char* message);
+
+static void server_queue(game_t* game, const addr_t to, const char* message);
+
+static void server_flush(game_t* game);
+
+static void server_send(game_t* game, const addr_t to, const char* message);
+
+static void server_count(traffic_t* traffic, const char* message, size_t length);
+
+static int server_format_stats(game_t* game, char* buf, int size);
+
+static void server_send_stats(game_t* game, const addr_t to);
+
+static void server_log_stats(game_t* game, bool force);
+
+static void server_addrKey(const addr_t addr, char* key);
+
+static player_t* server_find_player(game_t* game, const addr_t addr);
+
+bool handleTimeout(void* arg);
+
+static void player_see(game_t* game, player_t* player, stats_hist_t* seeTime);
+
+static void player_occupy(game_t* game, player_t* player, int old_row, int old_col);
+
+static void view_init(game_t* game, view_t* view);
+
+static void* game_alloc(game_t* game, size_t size);
+
+static void server_update_spectators(game_t* game);
+
+static int server_wake(int tickInterval, int statsInterval, int spectatorInterval);
+
+static spectator_t* server_find_spectator(game_t* game, const addr_t addr, int* index);
+
+static const char* server_render_frame(game_t* game, view_t* view, grid_t* grid, grid_seen_t* seen,
+                                       char* deltaBuf);
+
+static int server_encode_delta(game_t* game, const char* lastFrame, const char* frame,
+                               char* message, int size);
 
 bool handleMessage(void* arg, const addr_t from, const char* message);
 
-bool handlePlay(void* arg, const addr_t from, const char* name);
+bool handlePlay(void* arg, const addr_t from, const char* name, size_t nameLength,
+                unsigned caps);
 
-bool handleSPECTATE(void* arg, const addr_t from);
+bool handleSPECTATE(void* arg, const addr_t from, unsigned caps);
 
-bool handleQUIT(addr_t IP);
+bool handleQUIT(game_t* game, addr_t IP);
 
 bool handleKEY(void* arg, const addr_t from, const char* key);
 
-bool player_move(player_t* player, int new_row, int new_col);
+bool player_move(game_t* game, player_t* player, int new_row, int new_col);
+
+static void player_sprint(game_t* game, player_t* player, int dr, int dc);
+
+static void player_place(game_t* game, player_t* player, int new_row, int new_col);
+
+static void pickup_gold(game_t* game, player_t* player);
+
+bool helper_nameIsEmpty(const char* name, size_t nameLength);
+
+static void* game_grow(game_t* game, void* ptr, size_t oldSize, size_t newSize);
+
+static void game_over(game_t* game);
+
+/*************************************************************************************/
+
+/************************************** main *****************************************/
+int
+main(const int argc, char* argv[]) {
+
+  // parse the arguments
+  // 1. verify the argument
+  // 2. settle the seed, tick, sight radius, games and workers
+  config_t config;
+  parseArgs(argc, argv, &config);
+
+  // initialize error log  
+  //log using log_c, log_v, log_s, log_e, written by a thread of its own
+  log_setLevel(config.logLevel);
+  log_startAsync();
+  log_init(stderr);
+
+  // a journal is replayed with no network at all
+  if (config.replay != NULL) {
+    server_replay(&config);
+    log_done();
+    log_stopAsync();
+    return 0;
+  }
+
+  // load the map and drop the gold of every game
+  game_t** games = mem_malloc_assert(config.numGames * sizeof(game_t*), "out of memory");
+  for (int i = 0; i < config.numGames; i++) {
+    games[i] = game_new(&config, i);
+  }
+
+  // initalize the network and announce the port number
+  int serverPort = message_init(stdout);
+
+  if (serverPort == 0){
+    log_e("Error: serverPort initialization failed\n");
+    exit(-6);
+  } else {
+    printf("Ready to play, waiting at port %d", serverPort);
+  }
+
+  // start the message loop
+  // return type bool
+  // true for success return (true)
+  // false on error
+  bool status;
+  if (config.numGames == 1) {
+    status = server_run(games[0]);
+  } else {
+    status = server_dispatch(games, &config);
+  }
+  printf("%d",status);
+  mem_free(games);
+
+  message_done();
 
-static void pickup_gold(player_t* player);
+  log_done();
+  log_stopAsync();
+} 
 
-bool helper_nameIsEmpty(const char* name);
+/******************************** parseArgs ***********************************/
+static void
+parseArgs(const int argc, char* argv[], config_t* config)
+{
+  // options
+  config->tickInterval = 0;
+  config->sightRadius = 0;
+  config->numGames = 1;
+  config->numWorkers = 0;
+  config->viewThreads = 1;
+  config->logLevel = log_DEBUG;
+  config->statsInterval = 0;
+  config->spectatorInterval = 0;
+  config->journal = NULL;
+  config->replay = NULL;
+  int opt;
+  while ((opt = getopt(argc, argv, "t:r:g:w:p:l:s:v:j:R:")) != -1) {
+    switch (opt) {
+      case 't':
+        config->tickInterval = atoi(optarg);
+        if (config->tickInterval <= 0) {
+          fprintf(stderr, "Error: tick interval should be a positive number of milliseconds\n");
+          exit(-4);
+        }
+        break;
+      case 'r':
+        config->sightRadius = atoi(optarg);
+        if (config->sightRadius <= 0) {
+          fprintf(stderr, "Error: sight radius should be a positive number of cells\n");
+          exit(-5);
+        }
+        break;
+      case 'g':
+        config->numGames = atoi(optarg);
+        if (config->numGames <= 0) {
+          fprintf(stderr, "Error: number of games should be a positive integer\n");
+          exit(-7);
+        }
+        break;
+      case 'w':
+        config->numWorkers = atoi(optarg);
+        if (config->numWorkers <= 0) {
+          fprintf(stderr, "Error: number of workers should be a positive integer\n");
+          exit(-7);
+        }
+        break;
+      case 'p':
+        config->viewThreads = atoi(optarg);
+        if (config->viewThreads <= 0) {
+          fprintf(stderr, "Error: number of view threads should be a positive integer\n");
+          exit(-7);
+        }
+        break;
+      case 'l':
+        config->logLevel = atoi(optarg);
+        if (config->logLevel < log_ERROR || config->logLevel > log_DEBUG
+            || optarg[strspn(optarg, "0123456789")] != '\0') {
+          fprintf(stderr, "Error: log level should be 0 (errors), 1 (events) or 2 (every message)\n");
+          exit(-7);
+        }
+        break;
+      case 's':
+        config->statsInterval = atoi(optarg) * 1000;
+        if (config->statsInterval <= 0) {
+          fprintf(stderr, "Error: stats interval should be a positive number of seconds\n");
+          exit(-7);
+        }
+        break;
+      case 'v':
+        config->spectatorInterval = atoi(optarg);
+        if (config->spectatorInterval <= 0) {
+          fprintf(stderr, "Error: spectator interval should be a positive number of milliseconds\n");
+          exit(-7);
+        }
+        break;
+      case 'j':
+        config->journal = optarg;
+        break;
+      case 'R':
+        config->replay = optarg;
+        break;
+      default:
+        fprintf(stderr, Usage);
+        exit(-3);
+    }
+  }
+  int nargs = argc - optind;
+
+  if (nargs == 1) {
+    config->map = argv[optind];
+    config->seed = 0;
+  }
+  else if (nargs == 2) {
+    config->map = argv[optind];
+    config->seed = atoi(argv[optind + 1]);
+  
+    if (config->seed <= 0) {
+      fprintf(stderr, "Error: Seed should be a positive integer\n");
+      exit(-2);
+    }
+  } else {
+    fprintf(stderr, Usage);
+    exit(-3);
+  }
+
+  if (config->replay != NULL && config->numGames > 1) {
+    fprintf(stderr, "Error: a journal is the replay of one game; -R cannot go with -g\n");
+    exit(-7);
+  }
+
+  // by default, one worker per core, but no more workers than games
+  if (config->numWorkers == 0) {
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    config->numWorkers = cores > 0 ? cores : 1;
+  }
+  if (config->numWorkers > config->numGames) {
+    config->numWorkers = config->numGames;
+  }
+}
+
+/********************************** game_new ************************************/
+/* create game number id: load the map, seed the game's own random numbers,
+ * and drop the gold. Game id plays with seed + id, so that games differ.
+ */
+static game_t*
+game_new(const config_t* config, int id)
+{
+  // everything of the game's own comes from its arena, freed with it
+  arena_t* arena = mem_assert(arena_new(ArenaChunkBytes), "out of memory");
+  game_t* game = mem_assert(arena_alloc(arena, sizeof(game_t)), "out of memory");
+  game->arena = arena;
+  game->id = id;
+
+  game->numPlayer = 0;
+  game->playersSize = 0;
+  game->players = NULL;
+  game->playersByAddr = hashtable_new(PlayerSlots);
+
+  game->spectators = NULL;
+  game->numSpectators = 0;
+  game->spectatorsSize = 0;
+  game->freeSpectators = NULL;
+  game->spectatorInterval = config->spectatorInterval;
+  game->spectatorNextFrame = 0;
+  game->spectatorCatchUp = 0;
+  game->spectatorGold[0] = '\0';
+  game->tickInterval = config->tickInterval;
+  game->sightRadius = config->sightRadius;
+  game->updatePending = false;
+  game->nextTick = 0;
+  game->statsInterval = config->statsInterval;
+  memset(&game->stats, 0, sizeof(game->stats));
+  game->stats.start = server_now();
+  game->stats.nextLog = game->stats.start + game->statsInterval;
+
+  // load the map
+  game->masterGrid = grid_load(config->map);
+  game->rawGrid = grid_load(config->map);
+  if (game->masterGrid == NULL || game->rawGrid == NULL) {
+    fprintf(stderr, "Error: fail to load map: %s \n", config->map);
+    exit(-1);
+  }
+  game->GridCol = grid_ncol(game->masterGrid);
+  game->GridRow = grid_nrow(game->masterGrid);
+
+  // random numbers of this game only, as rand() would give after srand(seed)
+  game->seed = (config->seed > 0 ? config->seed : getpid()) + id;
+  memset(&game->rng, 0, sizeof(game->rng));
+  initstate_r(game->seed, game->rngState, sizeof(game->rngState), &game->rng);
+
+  // journal what the game receives, game i of several to journal.i
+  game->journal = NULL;
+  game->offline = config->replay != NULL;
+  if (config->journal != NULL) {
+    char* path = mem_malloc_assert(strlen(config->journal) + 16, "out of memory");
+    if (config->numGames > 1) {
+      sprintf(path, "%s.%d", config->journal, id);
+    } else {
+      strcpy(path, config->journal);
+    }
+    game->journal = journal_new(path, game->seed, game->GridRow, game->GridCol);
+    if (game->journal == NULL) {
+      fprintf(stderr, "Error: cannot write journal %s\n", path);
+      exit(-9);
+    }
+    mem_free(path);
+  }
+
+  // index the raw map so visibility updates need not raytrace every cell
+  grid_indexVisibility(game->rawGrid);
+  grid_setSightRadius(game->rawGrid, game->sightRadius);
+
+  // buffers reused by every update
+  game->displaySize = strlen(DisplayHeader) + grid_renderSize(game->masterGrid);
+  game->deltaBuf = game_alloc(game, game->displaySize);
+  game->outAddrs = NULL;
+  game->outMessages = NULL;
+  game->outCount = 0;
+  game->outSize = 0;
+  view_init(game, &game->spectatorView);
+  game->spectatorRLE = game_alloc(game, game->displaySize);
+  game->viewPool = config->viewThreads > 1 ? viewPool_new(game, config->viewThreads - 1) : NULL;
+
+  // drop the gold
+  server_drop_gold(game);
+  return game;
+}
+
+/********************************** server_rand *********************************/
+/* return the game's next random number; like rand(), but each game keeps
+ * its own state, so games on different threads need not share one.
+ */
+static int
+server_rand(game_t* game)
+{
+  int32_t result;
+  random_r(&game->rng, &result);
+  return result;
+}
+
+/********************************** server_run **********************************/
+/* play one game on this thread, until its gold is gone.
+ */
+static bool
+server_run(game_t* game)
+{
+  // in tick mode, the loop wakes at least once per tick to flush updates,
+  // with a stats interval at least that often to log them, and with a
+  // spectator interval to send spectators the updates they skipped:
+  // on a periodic timer if there is one, else on the loop's quiet timeout
+  int wake = server_wake(game->tickInterval, game->statsInterval, game->spectatorInterval);
+  bool status;
+  if (wake > 0 && message_addTimer(wake / 1000.0, handleTimeout, game) >= 0) {
+    status = message_loop(game, 0, NULL, NULL, handleMessage);
+  } else if (wake > 0) {
+    status = message_loop(game, wake / 1000.0, handleTimeout, NULL, handleMessage);
+  } else {
+    status = message_loop(game, 0, NULL, NULL, handleMessage);
+  }
+
+  // clients see the final state before the summary
+  server_tick(game, true);
+  server_log_stats(game, true);
+  
+  // print summery table and send back final quit message
+  game_over(game);
+  return status;
+}
+
+/********************************** server_replay *********************************/
+/* play a game again from its journal, as fast as it goes, with nothing
+ * sent: the journal's messages go through handleMessage in order on the
+ * journal's clock, with the loop's timer firing in between as it would
+ * have, and the game plays out as it did. Print how long that took, and
+ * the game's stats, to stdout.
+ */
+static void
+server_replay(config_t* config)
+{
+  journal_header_t header;
+  journal_reader_t* reader = journal_openReader(config->replay, &header);
+  if (reader == NULL) {
+    fprintf(stderr, "Error: cannot read journal %s\n", config->replay);
+    exit(-10);
+  }
+
+  // the game as it began, with the journal's seed
+  replayNow = 0;
+  config->seed = header.seed;
+  game_t* game = game_new(config, 0);
+  if (game->GridRow != header.nrows || game->GridCol != header.ncols) {
+    fprintf(stderr, "Error: journal %s was recorded on a %dx%d map\n",
+            config->replay, header.nrows, header.ncols);
+    exit(-10);
+  }
 
-static void game_over(void);
+  int wake = server_wake(game->tickInterval, game->statsInterval, game->spectatorInterval);
+  long nextWake = wake;
+  uint64_t clock = 0;            // ns on the journal's clock
+  int events = 0;
+  int read;
+  bool over = false;
+  journal_event_t event;
+  uint64_t start = stats_now();
+  while (!over && (read = journal_next(reader, &event)) > 0) {
+    clock += event.ns;
+    for (; wake > 0 && nextWake <= clock / 1000000; nextWake += wake) {
+      replayNow = nextWake;
+      handleTimeout(game);
+    }
+    replayNow = clock / 1000000;
+    over = handleMessage(game, event.from, event.message);
+    events++;
+  }
+  uint64_t elapsed = stats_now() - start;
+  if (!over && read < 0) {
+    fprintf(stderr, "Error: journal %s is damaged after %d messages; replayed those\n",
+            config->replay, events);
+  }
+
+  // as server_run ends the game
+  server_tick(game, true);
+  server_log_stats(game, true);
+  printf("replay events=%d elapsed_ns=%llu events_per_sec=%.0f game_over=%s\n",
+         events, (unsigned long long) elapsed,
+         elapsed > 0 ? events * 1e9 / elapsed : 0.0, over ? "yes" : "no");
+  char stats[StatsBytes];
+  server_format_stats(game, stats, sizeof(stats));
+  fputs(stats, stdout);
+
+  game_over(game);
+  journal_closeReader(reader);
+}
+
+/******************************** server_dispatch ********************************/
+/* host several games: start the workers, each playing its share of the
+ * games on its own thread, then route every datagram to its game until
+ * all games are over. Routes are only touched on this thread, and games
+ * only on their worker's, so no locks are needed.
+ */
+static bool
+server_dispatch(game_t** games, const config_t* config)
+{
+  dispatcher_t dispatcher;
+  dispatcher.numGames = config->numGames;
+  dispatcher.gamesLeft = config->numGames;
+  dispatcher.next = 0;
+  dispatcher.routes = mem_calloc_assert(config->numGames, sizeof(route_t), "out of memory");
+  dispatcher.clientByAddr = hashtable_new(PlayerSlots);
+  dispatcher.dropped = 0;
+  dispatcher.numWorkers = config->numWorkers;
+  dispatcher.workers = mem_calloc_assert(config->numWorkers, sizeof(worker_t), "out of memory");
+  if (pipe(dispatcher.done) < 0 || !server_nonblocking(dispatcher.done[0])) {
+    log_e("server_dispatch: pipe");
+    return false;
+  }
+
+  // game i is played by worker i % numWorkers
+  for (int i = 0; i < config->numGames; i++) {
+    dispatcher.routes[i].game = i;
+    dispatcher.routes[i].over = false;
+  }
+  for (int w = 0; w < dispatcher.numWorkers; w++) {
+    worker_t* worker = &dispatcher.workers[w];
+    worker->numGames = 0;
+    worker->games = mem_malloc_assert(config->numGames * sizeof(game_t*), "out of memory");
+    for (int i = w; i < config->numGames; i += dispatcher.numWorkers) {
+      worker->games[worker->numGames++] = games[i];
+    }
+    worker->stride = dispatcher.numWorkers;
+    worker->tickInterval = config->tickInterval;
+    worker->statsInterval = config->statsInterval;
+    worker->spectatorInterval = config->spectatorInterval;
+    worker->done = dispatcher.done[1];
+    if (pipe(worker->inbox) < 0 || !server_nonblocking(worker->inbox[1])
+        || pthread_create(&worker->thread, NULL, worker_run, worker) != 0) {
+      log_e("server_dispatch: cannot start worker");
+      return false;
+    }
+#ifdef F_SETPIPE_SZ
+    fcntl(worker->inbox[1], F_SETPIPE_SZ, InboxPipeBytes); // best effort; the default will do
+#endif
+  }
+
+  message_watch(dispatcher.done[0], handleNotice, &dispatcher);
+  bool status = message_loop(&dispatcher, 0, NULL, NULL, handleDispatch);
+  message_unwatch(dispatcher.done[0]);
+
+  // every game is over, so every worker has returned
+  for (int w = 0; w < dispatcher.numWorkers; w++) {
+    worker_t* worker = &dispatcher.workers[w];
+    close(worker->inbox[1]);
+    pthread_join(worker->thread, NULL);
+    close(worker->inbox[0]);
+    mem_free(worker->games);
+  }
+  close(dispatcher.done[0]);
+  close(dispatcher.done[1]);
+  if (dispatcher.dropped > 0) {
+    log_d("%d messages dropped because a worker fell behind", (int)dispatcher.dropped);
+  }
+  hashtable_delete(dispatcher.clientByAddr, mem_free);
+  mem_free(dispatcher.routes);
+  mem_free(dispatcher.workers);
+  return status;
+}
+
+/******************************** handleDispatch *********************************/
+/* route one datagram to its game's worker. An address is given a game
+ * when it sends PLAY or SPECTATE, round robin over the games still going,
+ * and loses it if that game turns it away, so that it may try another.
+ * STATS goes to every game still going, and each answers for itself.
+ */
+static bool
+handleDispatch(void* arg, const addr_t from, const char* message)
+{
+  dispatcher_t* dispatcher = arg;
+  protocol_msg_t msg;
+  if (strlen(message) > InboxMaxBytes) {
+    log_v("message too long for a game; ignored");
+    return false;
+  }
+  // only these few need parsing here; every KEY goes straight through
+  protocol_type_t type = protocol_UNKNOWN;
+  if (message[0] == 'S' || message[0] == 'P') {
+    type = protocol_parse(message, &msg);
+  }
+  if (type == protocol_STATS) {
+    for (int i = 0; i < dispatcher->numGames; i++) {
+      if (!dispatcher->routes[i].over) {
+        dispatcher_post(dispatcher, i, from, message);
+      }
+    }
+    return false;
+  }
+  bool join = type == protocol_PLAY || type == protocol_SPECTATE;
+
+  char key[AddrKeyLength];
+  server_addrKey(from, key);
+  client_t* client = hashtable_find(dispatcher->clientByAddr, key);
+
+  if (client == NULL || client->route == NULL) {
+    if (!join) {
+      log_v("message from an address with no game; ignored");
+      return false;
+    }
+    if (client == NULL) {
+      client = mem_malloc_assert(sizeof(client_t), "out of memory");
+      *client = (client_t){ NULL, 0, false };
+      hashtable_insert(dispatcher->clientByAddr, key, client);
+    }
+    do {
+      client->route = &dispatcher->routes[dispatcher->next];
+      dispatcher->next = (dispatcher->next + 1) % dispatcher->numGames;
+    } while (client->route->over);
+  }
+  if (client->route->over) {
+    return false; // that game is over; its clients have had their summary
+  }
+  if (dispatcher_post(dispatcher, client->route->game, from, message) && join) {
+    client->joins++;
+  }
+  return false;
+}
+
+/******************************** dispatcher_post ********************************/
+/* pass one message to the inbox of the worker playing the game, header
+ * and message in one write no longer than PIPE_BUF, so it goes in whole
+ * or not at all. The inbox never blocks: a worker that has fallen a pipe
+ * behind has its messages dropped, as the network might have, rather
+ * than stall every other game. Return false if it was dropped.
+ */
+static bool
+dispatcher_post(dispatcher_t* dispatcher, int game, const addr_t from, const char* message)
+{
+  char buf[PIPE_BUF];
+  inboxEntry_t entry = { game, from, strlen(message) };
+  memcpy(buf, &entry, sizeof(entry));
+  memcpy(buf + sizeof(entry), message, entry.length);
+
+  int fd = dispatcher->workers[game % dispatcher->numWorkers].inbox[1];
+  ssize_t n;
+  do {
+    n = write(fd, buf, sizeof(entry) + entry.length);
+  } while (n < 0 && errno == EINTR);
+  if (n < 0 && errno == EAGAIN) {
+    dispatcher->dropped++;
+    log_v("a worker's inbox is full; message dropped");
+    return false;
+  }
+  if (n < 0) {
+    log_e("dispatcher_post: writing to a worker");
+    return false;
+  }
+  return true;
+}
+
+/********************************* handleNotice **********************************/
+/* workers write a notice to the done pipe for each game they finish, and
+ * for each PLAY or SPECTATE they answer; a client turned away, with no
+ * other join in flight, loses its route. Stop once every game is over.
+ */
+static bool
+handleNotice(void* arg, int fd)
+{
+  dispatcher_t* dispatcher = arg;
+  notice_t notice;
+  while (read(fd, &notice, sizeof(notice)) == sizeof(notice)) {
+    if (notice.over) {
+      dispatcher->routes[notice.game].over = true;
+      dispatcher->gamesLeft--;
+      continue;
+    }
+    char key[AddrKeyLength];
+    server_addrKey(notice.from, key);
+    client_t* client = hashtable_find(dispatcher->clientByAddr, key);
+    if (client == NULL) {
+      continue;
+    }
+    client->joins--;
+    if (notice.accepted) {
+      client->joined = true;
+    } else if (!client->joined && client->joins == 0) {
+      client->route = NULL;
+    }
+  }
+  return dispatcher->gamesLeft == 0;
+}
+
+/********************************** worker_run ***********************************/
+/* the body of a worker thread: handle the datagrams routed to its games,
+ * and their ticks, until all of them are over.
+ */
+static void*
+worker_run(void* arg)
+{
+  worker_t* worker = arg;
+  size_t size = 256;              // of message, grown to the longest read
+  char* message = mem_malloc_assert(size, "out of memory");
+  int live = worker->numGames;
+
+  int wake = server_wake(worker->tickInterval, worker->statsInterval, worker->spectatorInterval);
+
+  while (live > 0) {
+    struct pollfd inbox = { worker->inbox[0], POLLIN, 0 };
+    int ready = poll(&inbox, 1, wake > 0 ? wake : -1);
+    if (ready < 0 && errno != EINTR) {
+      log_e("worker_run: poll");
+      break;
+    }
+
+    if (ready > 0) {
+      inboxEntry_t entry;
+      if (!server_read(worker->inbox[0], &entry, sizeof(entry))) {
+        break; // the dispatcher has gone
+      }
+      if (entry.length > InboxMaxBytes) {
+        log_e("worker_run: a message too long for the inbox");
+        break; // the pipe can no longer be read in step
+      }
+      if (entry.length + 1 > size) {
+        size = entry.length + 1;
+        message = mem_assert(realloc(message, size), "out of memory");
+      }
+      if (!server_read(worker->inbox[0], message, entry.length)) {
+        break;
+      }
+      message[entry.length] = '\0';
+      game_t* game = worker->games[entry.game / worker->stride];
+      if (game != NULL) {
+        bool over = handleMessage(game, entry.from, message);
+        if (game->join != JoinNone) {
+          notice_t notice = { game->id, false, game->join == JoinAccepted, entry.from };
+          if (!server_write(worker->done, &notice, sizeof(notice))) {
+            log_e("worker_run: writing to the dispatcher");
+          }
+        }
+        if (over) {
+          worker_finish(worker, entry.game / worker->stride);
+          live--;
+        }
+      }
+    }
+
+    // a quiet tick went by, or the tick, or the stats, may be due
+    for (int i = 0; i < worker->numGames; i++) {
+      if (worker->games[i] != NULL) {
+        server_tick(worker->games[i], ready == 0);
+        server_log_stats(worker->games[i], false);
+      }
+    }
+  }
+  mem_free(message);
+  return NULL;
+}
+
+/******************************** worker_finish **********************************/
+/* the worker's game i is over: send the summary, free it, and tell the
+ * dispatcher.
+ */
+static void
+worker_finish(worker_t* worker, int i)
+{
+  game_t* game = worker->games[i];
+  notice_t notice = { .game = game->id, .over = true };
+  server_tick(game, true);
+  server_log_stats(game, true);
+  game_over(game);
+  worker->games[i] = NULL;
+  if (!server_write(worker->done, &notice, sizeof(notice))) {
+    log_e("worker_finish: writing to the dispatcher");
+  }
+}
+
+/****************************** server_write, server_read ****************************/
+/* write, or read, exactly size bytes; return false on error or end of file.
+ */
+static bool
+server_write(int fd, const void* buf, size_t size)
+{
+  const char* p = buf;
+  while (size > 0) {
+    ssize_t n = write(fd, p, size);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return false;
+    }
+    p += n;
+    size -= n;
+  }
+  return true;
+}
+
+static bool
+server_read(int fd, void* buf, size_t size)
+{
+  char* p = buf;
+  while (size > 0) {
+    ssize_t n = read(fd, p, size);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return false;
+    }
+    p += n;
+    size -= n;
+  }
+  return true;
+}
+
+/******************************* server_nonblocking ******************************/
+static bool
+server_nonblocking(int fd)
+{
+  int flags = fcntl(fd, F_GETFL);
+  return flags >= 0 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) >= 0;
+}
+
+/******************************* server_drop_gold ************************************/
+static void
+server_drop_gold(game_t* game)
+{
+  game->GoldNumPilesLeft = server_rand(game) % (GoldMaxNumPiles - GoldMinNumPiles);
+  game->GoldNumPilesLeft = game->GoldNumPilesLeft + GoldMinNumPiles;
+
+  game->goldCollected = 0;
+  game->goldLeft = GoldTotal;
+
+  // one uniform pick per pile; a map with fewer spots than piles gets fewer piles
+  for (int i = 0; i < game->GoldNumPilesLeft; i++) {
+    int row, col;
+    int numEmpty = grid_numEmpty(game->masterGrid);
+    if (numEmpty == 0) {
+      game->GoldNumPilesLeft = i;
+      break;
+    }
+    grid_emptySpot(game->masterGrid, server_rand(game) % numEmpty, &row, &col);
+    grid_update(game->masterGrid, row, col, '*');
+  }
+}
+
+/****************************** server_drop_player *********************************/
+/* pick a random empty room spot for a new player, uniformly from the
+ * masterGrid's list of them, into row and col;
+ * return false if there is no empty room spot left.
+ */
+static bool
+server_drop_player(game_t* game, int* row, int* col)
+{
+  int numEmpty = grid_numEmpty(game->masterGrid);
+  if (numEmpty == 0) {
+    return false;
+  }
+  return grid_emptySpot(game->masterGrid, server_rand(game) % numEmpty, row, col);
+}
+
+/***************************** server_update_all_clients **************************/
+static void
+server_update_all_clients(game_t* game) {
+
+  uint64_t start = stats_now();
+  char message[100];
+
+  if (game->numSpectators > 0) {
+    server_update_spectators(game);
+  }
+
+  // bring every player's view up to date, on the view pool if there is one;
+  // players only read the grids then, once each of their spots is indexed
+  if (game->viewPool != NULL && game->numPlayer > 1) {
+    for (int i = 0; i < game->numPlayer; i++) {
+      grid_indexSpot(game->rawGrid, game->players[i]->row, game->players[i]->col);
+    }
+    viewPool_run(game->viewPool);
+  } else {
+    server_view_stage(game, 0, 1, game->deltaBuf, &game->stats.time[TimeSee]);
+  }
+
+  for (int i = 0; i < game->numPlayer; i++) {
+    
+    player_t* player = game->players[i];
+    
+    /// GOLD n p r 
+    protocol_encodeGOLD(message, sizeof(message), player->justCollected, player->gold,
+                        game->goldLeft);
+    server_send_gold(game, player->IP, player->goldSent, message);
+    player->justCollected = 0;
+
+    // DISPLAY/nstring, skipped when nothing the player can see has changed
+    if (player->pending != NULL) {
+      server_queue(game, player->IP, player->pending);
+    }
+  }
+
+  // one batch for every GOLD and map message of this update
+  server_flush(game);
+  stats_since(&game->stats.time[TimeUpdate], start);
+}
+
+/******************************* server_view_stage ********************************/
+/* update what players first, first + stride, ... and render
+ * the map message to send them, if any, into player->pending.
+ * Touches nothing shared but the grids it reads, so the view pool runs
+ * several of these at once, each with its own deltaBuf and seeTime.
+ */
+static void
+server_view_stage(game_t* game, int first, int stride, char* deltaBuf,
+                  stats_hist_t* seeTime)
+{
+  for (int i = first; i < game->numPlayer; i += stride) {
+    player_t* player = game->players[i];
+    player->pending = NULL;
+    player_see(game, player, seeTime);
+    if (player->dirty.r0 <= player->dirty.r1) {
+      player->pending = server_render_frame(game, &player->view, NULL, player->seen, deltaBuf);
+      player->dirty = (grid_rect_t){ 0, 0, -1, -1 };
+    }
+  }
+}
+
+/********************************* viewPool_new ***********************************/
+/* start numThreads helper threads for the game's view stage.
+ */
+static viewPool_t*
+viewPool_new(game_t* game, int numThreads)
+{
+  viewPool_t* pool = game_alloc(game, sizeof(viewPool_t));
+  pool->game = game;
+  pool->numThreads = numThreads;
+  pool->threads = game_alloc(game, numThreads * sizeof(pthread_t));
+  pool->helpers = game_alloc(game, numThreads * sizeof(viewHelper_t));
+  pool->deltaBufs = game_alloc(game, numThreads * sizeof(char*));
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->start, NULL);
+  pthread_cond_init(&pool->finish, NULL);
+  pool->round = 0;
+  pool->busy = 0;
+  pool->stop = false;
+
+  for (int i = 0; i < numThreads; i++) {
+    pool->deltaBufs[i] = game_alloc(game, game->displaySize);
+    pool->helpers[i] = (viewHelper_t){ .pool = pool, .index = i };
+    if (pthread_create(&pool->threads[i], NULL, viewPool_helper, &pool->helpers[i]) != 0) {
+      log_e("viewPool_new: cannot start a view thread");
+      exit(-8);
+    }
+  }
+  return pool;
+}
+
+/********************************* viewPool_run ***********************************/
+/* run one view stage: the loop thread takes its share of the players
+ * while the helpers take theirs, and returns once all are done.
+ */
+static void
+viewPool_run(viewPool_t* pool)
+{
+  pthread_mutex_lock(&pool->lock);
+  pool->busy = pool->numThreads;
+  pool->round++;
+  pthread_cond_broadcast(&pool->start);
+  pthread_mutex_unlock(&pool->lock);
+
+  server_view_stage(pool->game, 0, pool->numThreads + 1, pool->game->deltaBuf,
+                    &pool->game->stats.time[TimeSee]);
+
+  pthread_mutex_lock(&pool->lock);
+  while (pool->busy > 0) {
+    pthread_cond_wait(&pool->finish, &pool->lock);
+  }
+  pthread_mutex_unlock(&pool->lock);
+}
+
+/******************************* viewPool_helper **********************************/
+/* the body of a view thread: wait for each round and do its share.
+ */
+static void*
+viewPool_helper(void* arg)
+{
+  viewHelper_t* helper = arg;
+  viewPool_t* pool = helper->pool;
+  unsigned long done = 0; // last round done
+
+  pthread_mutex_lock(&pool->lock);
+  while (true) {
+    while (!pool->stop && pool->round == done) {
+      pthread_cond_wait(&pool->start, &pool->lock);
+    }
+    if (pool->stop) {
+      break;
+    }
+    done = pool->round;
+    pthread_mutex_unlock(&pool->lock);
+
+    server_view_stage(pool->game, helper->index + 1, pool->numThreads + 1,
+                      pool->deltaBufs[helper->index], &helper->seeTime);
+#ifdef MEMTEST
+    helper->heapAllocs = heapAllocs;
+#endif
+
+    pthread_mutex_lock(&pool->lock);
+    if (--pool->busy == 0) {
+      pthread_cond_signal(&pool->finish);
+    }
+  }
+  pthread_mutex_unlock(&pool->lock);
+  return NULL;
+}
 
-/*************************************************************************************/  
-struct game GAME;
+/******************************** viewPool_delete *********************************/
+/* stop the helper threads; their memory goes with the game's arena.
+ */
+static void
+viewPool_delete(viewPool_t* pool)
+{
+  if (pool == NULL) {
+    return;
+  }
+  pthread_mutex_lock(&pool->lock);
+  pool->stop = true;
+  pthread_cond_broadcast(&pool->start);
+  pthread_mutex_unlock(&pool->lock);
 
-/************************************** main *****************************************/
-int
-main(const int argc, char* argv[]) {
+  for (int i = 0; i < pool->numThreads; i++) {
+    pthread_join(pool->threads[i], NULL);
+  }
+  pthread_mutex_destroy(&pool->lock);
+  pthread_cond_destroy(&pool->start);
+  pthread_cond_destroy(&pool->finish);
+}
 
-  GAME.numPlayer = 0;
+/******************************* server_send_gold *********************************/
+/* send a GOLD message unless it repeats the last one sent to that client;
+ * goldSent holds the last one sent, and is updated.
+ */
+static void
+server_send_gold(game_t* game, const addr_t to, char* goldSent, char* message)
+{
+  if (strcmp(goldSent, message) != 0) {
+    strcpy(goldSent, message);
+    server_queue(game, to, goldSent);
+  }
+}
 
-  GAME.spectatorIP = message_noAddr();
+/********************************* server_queue ***********************************/
+/* queue a message for the next server_flush; the message must stay
+ * unchanged until then.
+ */
+static void
+server_queue(game_t* game, const addr_t to, const char* message)
+{
+  if (game->outCount == game->outSize) {
+    int size = game->outSize == 0 ? 64 : 2 * game->outSize;
+    game->outAddrs = game_grow(game, game->outAddrs, game->outSize * sizeof(addr_t),
+                               size * sizeof(addr_t));
+    game->outMessages = game_grow(game, game->outMessages, game->outSize * sizeof(char*),
+                                  size * sizeof(char*));
+    game->outSize = size;
+  }
+  game->outAddrs[game->outCount] = to;
+  game->outMessages[game->outCount] = message;
+  game->outCount++;
+}
 
-  // parse the arguments
-  // 1. verify the argument
-  // 2. initialize the random number generator srand
-  // 3. load the map
-  parseArgs(argc, argv);
+/********************************* server_flush ***********************************/
+/* send every queued message, in the order queued.
+ */
+static void
+server_flush(game_t* game)
+{
+  if (game->outCount > 0) {
+    for (int i = 0; i < game->outCount; i++) {
+      server_count(game->stats.sent, game->outMessages[i], strlen(game->outMessages[i]));
+    }
+    if (!game->offline) {
+      uint64_t start = stats_now();
+      message_send_batch(game->outAddrs, game->outMessages, game->outCount);
+      stats_since(&game->stats.time[TimeSend], start);
+    }
+    game->outCount = 0;
+  }
+}
 
-  // drop the gold
-  server_drop_gold();
+/********************************* server_send ************************************/
+/* send one message right away, outside any update, counting it.
+ */
+static void
+server_send(game_t* game, const addr_t to, const char* message)
+{
+  server_count(game->stats.sent, message, strlen(message));
+  if (!game->offline) {
+    uint64_t start = stats_now();
+    message_send(to, message);
+    stats_since(&game->stats.time[TimeSend], start);
+  }
+}
 
-  // initialize error log  
-  //log using log_c, log_v, log_s, log_e
-  log_init(stderr);
+/********************************* server_count ***********************************/
+/* add a message sent to the traffic of its type. It is one of our own,
+ * so well formed: its keyword alone tells the type.
+ */
+static void
+server_count(traffic_t* traffic, const char* message, size_t length)
+{
+  protocol_type_t type = protocol_keyword(message);
+  traffic[type].messages++;
+  traffic[type].bytes += length;
+}
 
-  // initalize the network and announce the port number
-  int serverPort = message_init(stdout);
+/****************************** server_format_stats *******************************/
+/* write the game's stats into buf, one line each, scraped as
+ *   game id=0 uptime_ms=N players=N spectators=N gold_left=N
+ *   time <function> calls=N total_ns=N max_ns=N p50_ns=N p90_ns=N p99_ns=N
+ *   recv <type> messages=N bytes=N
+ *   sent <type> messages=N bytes=N
+ * with time lines for every timer, and traffic lines for the types seen.
+ * Return the length written; lines that do not fit are left off.
+ */
+static int
+server_format_stats(game_t* game, char* buf, int size)
+{
+  gameStats_t* stats = &game->stats;
+  int len = snprintf(buf, size, "game id=%d uptime_ms=%ld players=%d spectators=%d gold_left=%d\n",
+                     game->id, server_now() - stats->start, game->numPlayer,
+                     game->numSpectators, game->goldLeft);
+  if (len < 0 || len >= size) {
+    buf[0] = '\0';
+    return 0;
+  }
 
-  if (serverPort == 0){
-    log_e("Error: serverPort initialization failed\n");
-    exit(-6);
+  // the helpers are between rounds, so their histograms can be read
+  stats_hist_t see = stats->time[TimeSee];
+  unsigned long heapAllocs = stats->heapAllocs;
+  if (game->viewPool != NULL) {
+    for (int i = 0; i < game->viewPool->numThreads; i++) {
+      stats_merge(&see, &game->viewPool->helpers[i].seeTime);
+      heapAllocs += game->viewPool->helpers[i].heapAllocs;
+    }
+  }
+  int n = snprintf(buf + len, size - len, "memory arena_bytes=%zu arena_chunks=%d",
+                   arena_bytes(game->arena), arena_chunks(game->arena));
+#ifdef MEMTEST
+  n += n > 0 && n < size - len ? snprintf(buf + len + n, size - len - n, " heap_allocs=%lu",
+                                          heapAllocs) : 0;
+#endif
+  if (n > 0 && n + 1 < size - len) {
+    len += n;
+    buf[len++] = '\n';
+    buf[len] = '\0';
   } else {
-    printf("Ready to play, waiting at port %d", serverPort);
+    buf[len] = '\0';
+  }
+  for (int t = 0; t < NumTimers; t++) {
+    char name[64];
+    snprintf(name, sizeof(name), "time %s", timerNames[t]);
+    int n = stats_formatHist(buf + len, size - len, name, t == TimeSee ? &see : &stats->time[t]);
+    len += n > 0 ? n : 0;
   }
 
-  // start the message loop
-  // return type bool
-  // true for success return (true)
-  // false on error
-
-  bool status = message_loop(NULL, 0, NULL, NULL, handleMessage);
-  printf("%d",status);
-  
-  // print summery table and send back final quit message
-  game_over();
+  for (int direction = 0; direction < 2; direction++) {
+    traffic_t* traffic = direction == 0 ? stats->recv : stats->sent;
+    for (int type = 0; type < protocol_NumTypes; type++) {
+      if (traffic[type].messages > 0) {
+        int n = snprintf(buf + len, size - len, "%s %s messages=%lu bytes=%lu\n",
+                         direction == 0 ? "recv" : "sent", protocol_name(type),
+                         traffic[type].messages, traffic[type].bytes);
+        if (n > 0 && n < size - len) {
+          len += n;
+        } else {
+          buf[len] = '\0';
+        }
+      }
+    }
+  }
+  return len;
+}
 
-  message_done();
+/******************************* server_send_stats ********************************/
+/* answer a STATS request: STATS, a newline, and the game's stats.
+ */
+static void
+server_send_stats(game_t* game, const addr_t to)
+{
+  char message[StatsBytes];
+  int len = protocol_encodeHeader(message, sizeof(message), protocol_STATS);
+  message[len++] = '\n';
+  server_format_stats(game, message + len, sizeof(message) - len);
+  server_send(game, to, message);
+}
 
-  log_done();
-} 
+/******************************* server_log_stats *********************************/
+/* log the game's stats, a line at a time, once the stats interval has
+ * gone by since they were last logged, or now if force; with no interval
+ * they are never logged.
+ */
+static void
+server_log_stats(game_t* game, bool force)
+{
+  long now = server_now();
+  if (game->statsInterval == 0 || (!force && now < game->stats.nextLog)) {
+    return;
+  }
+  game->stats.nextLog = now + game->statsInterval;
+
+  char report[StatsBytes];
+  server_format_stats(game, report, sizeof(report));
+  char prefix[32];
+  snprintf(prefix, sizeof(prefix), "stats: %d %%s", game->id);
+  char* save = NULL;
+  for (char* line = strtok_r(report, "\n", &save); line != NULL; line = strtok_r(NULL, "\n", &save)) {
+    log_s(prefix, line);
+  }
+}
 
-/******************************** parseArgs ***********************************/
+/**************************** server_schedule_update ******************************/
+/* note that clients need an update. Without a tick interval the update
+ * is sent right away; otherwise it waits for the next tick, so that
+ * at most one update goes out per tick however fast keys arrive.
+ */
 static void
-parseArgs(const int argc, char* argv[])
+server_schedule_update(game_t* game)
 {
-  if (argc == 2) {
-    char* map = argv[1];
-    GAME.masterGrid = grid_load(map);
-    GAME.rawGrid = grid_load(map);
+  game->updatePending = true;
+  if (game->tickInterval == 0) {
+    server_tick(game, true);
+  }
+}
 
-    if ((GAME.masterGrid) == NULL) {
-      fprintf(stderr, "Error: fail to load map: %s \n", map);
-      exit(-1);
+/********************************** server_tick ***********************************/
+/* send the pending update, if any, once the tick has come, or right away
+ * if timedOut; without a tick timer message_loop only times out after a
+ * quiet tick interval, so handleMessage also checks the clock after every
+ * message.
+ */
+static void
+server_tick(game_t* game, bool timedOut)
+{
+  if (game->updatePending) {
+    long now = server_now();
+    if (timedOut || now >= game->nextTick) {
+      server_update_all_clients(game);
+      game->updatePending = false;
+      game->nextTick = now + game->tickInterval;
     }
-
-    GAME.GridCol = grid_ncol(GAME.masterGrid);
-    GAME.GridRow = grid_nrow(GAME.masterGrid);
-    srand(getpid());
   }
-  else if (argc == 3) {
-    char* map = argv[1];
-    GAME.masterGrid = grid_load(map);
-    GAME.rawGrid = grid_load(map);
-    if ((GAME.masterGrid) == NULL) {
-      fprintf(stderr, "Error: fail to load map: %s \n", map);
-      exit(-1);
-    }
+  if (game->spectatorCatchUp > 0 && server_now() >= game->spectatorCatchUp) {
+    // spectators skipped an update, and it is their turn, with no update to bring it
+    server_update_spectators(game);
+    server_flush(game);
+  }
+}
 
-    int seed = atoi(argv[2]);
-  
-    if (seed <= 0) {
-      fprintf(stderr, "Error: Seed should be a positive integer\n");
-      exit(-2);
+/********************************** server_wake ***********************************/
+/* return how often (ms) a game's loop must wake, with nothing arriving,
+ * to send its ticks, log its stats and catch up its spectators: the
+ * shortest of the intervals in use, or 0 if none is.
+ */
+static int
+server_wake(int tickInterval, int statsInterval, int spectatorInterval)
+{
+  int wake = 0;
+  int intervals[] = { tickInterval, statsInterval, spectatorInterval };
+  for (int i = 0; i < 3; i++) {
+    if (intervals[i] > 0 && (wake == 0 || intervals[i] < wake)) {
+      wake = intervals[i];
     }
+  }
+  return wake;
+}
 
-    GAME.GridCol = grid_ncol(GAME.masterGrid);
-    GAME.GridRow = grid_nrow(GAME.masterGrid);
-    srand(GAME.seed);
-
-  } else {
-    fprintf(stderr, "usage: ./server map.txt [seed]");
-    exit(-3);
+/********************************** server_now ************************************/
+/* return the monotonic time in milliseconds.
+ */
+static long
+server_now(void)
+{
+  if (replayNow >= 0) {
+    return replayNow;
   }
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000L + now.tv_nsec / 1000000L;
 }
 
-/******************************* server_drop_gold ************************************/
+/******************************* server_addrKey ***********************************/
+/* format an address as a hashtable key, at most AddrKeyLength bytes.
+ */
 static void
-server_drop_gold(void)
+server_addrKey(const addr_t addr, char* key)
 {
-  GAME.GoldNumPilesLeft = rand() % (GoldMaxNumPiles - GoldMinNumPiles);
-  GAME.GoldNumPilesLeft = GAME.GoldNumPilesLeft + GoldMinNumPiles;
+  snprintf(key, AddrKeyLength, "%08x:%04x",
+           (unsigned)ntohl(addr.sin_addr.s_addr), (unsigned)ntohs(addr.sin_port));
+}
 
-  GAME.goldCollected = 0;
-  GAME.goldLeft = GoldTotal;
+/***************************** server_find_player *********************************/
+/* return the player who plays from the given address, or NULL if none.
+ */
+static player_t*
+server_find_player(game_t* game, const addr_t addr)
+{
+  char key[AddrKeyLength];
+  server_addrKey(addr, key);
+  return hashtable_find(game->playersByAddr, key);
+}
 
-  for (int i = 0; i < GAME.GoldNumPilesLeft; i++) {
-    int row = rand() % GAME.GridRow;
-    int col = rand() % GAME.GridCol;
-    while (!grid_isEmptyRoomSpot(GAME.masterGrid, row, col)) {
-      row = rand() % GAME.GridRow;
-      col = rand() % GAME.GridCol;
-    }
-    grid_update(GAME.masterGrid, row, col, '*');
+/******************************** player_occupy ***********************************/
+/* move the player's occupancy in the masterGrid from the old location
+ * to their current one; the old cell is only cleared if it was still theirs.
+ */
+static void
+player_occupy(game_t* game, player_t* player, int old_row, int old_col)
+{
+  if (grid_occupant(game->masterGrid, old_row, old_col) == player->id) {
+    grid_setOccupant(game->masterGrid, old_row, old_col, -1);
   }
+  grid_setOccupant(game->masterGrid, player->row, player->col, player->id);
 }
 
-/****************************** server_drop_player *********************************/
+/******************************** player_see **************************************/
+/* update what the player has seen for their current location, and remember
+ * which cells changed until the next update is sent.
+ */
 static void
-server_drop_player(player_t* player)
+player_see(game_t* game, player_t* player, stats_hist_t* seeTime)
 {
-  int row = rand() % GAME.GridRow;
-  int col = rand() % GAME.GridCol;
+  grid_rect_t dirty;
+  uint64_t start = stats_now();
+  grid_seenUpdate(game->masterGrid, player->seen, player->row, player->col, &dirty);
+  stats_since(seeTime, start);
+  grid_rectUnion(&player->dirty, &dirty);
+}
 
-  while (!grid_isEmptyRoomSpot(GAME.masterGrid, row, col)) {
-    row = rand() % GAME.GridRow;
-    col = rand() % GAME.GridCol;
+/**************************** server_update_spectators ***************************/
+/* render the master grid once for all spectators, and queue it for each:
+ * the shared DELTA (or DISPLAY) for those synced, and the whole map for
+ * the rest, the RDISPLAY made at most once. Under -v the shared map is
+ * rendered at most once per interval; updates in between send it to no
+ * one (but spectators just joined), and their changes go out in the next
+ * DELTA, which server_tick sends then if no update does.
+ */
+static void
+server_update_spectators(game_t* game)
+{
+  // GOLD n p r, the same for every spectator
+  protocol_encodeGOLD(game->spectatorGold, sizeof(game->spectatorGold), 0, 0, game->goldLeft);
+
+  // the spectators' view is kept for the DELTA alone; it never asks for RLE
+  view_t* view = &game->spectatorView;
+  const char* delta = NULL;
+  long now = server_now();
+  if (now >= game->spectatorNextFrame) {
+    delta = server_render_frame(game, view, game->masterGrid, NULL, game->deltaBuf);
+    game->spectatorNextFrame = now + game->spectatorInterval;
+    game->spectatorCatchUp = 0;
+  } else {
+    game->spectatorCatchUp = game->spectatorNextFrame;
   }
+  const char* display = view->lastFrame;  // the whole map last rendered
+  const char* rle = NULL;                 // made for the first RLE spectator to need it
+  bool rleTried = false;
+
+  for (int i = 0; i < game->numSpectators; i++) {
+    spectator_t* spectator = game->spectators[i];
+    server_send_gold(game, spectator->IP, spectator->goldSent, game->spectatorGold);
+
+    const char* message = delta;
+    if (!spectator->synced || message == display) { // RLE spectators get a full map as RLE
+      if ((spectator->caps & protocol_CapRLE) && !rleTried) {
+        rleTried = true;
+        int headerLen = strlen(DisplayHeader);
+        int displayLen = strlen(display);
+        if (protocol_encodeRDISPLAY(game->spectatorRLE, displayLen, display + headerLen,
+                                    displayLen - headerLen) >= 0) {
+          rle = game->spectatorRLE;
+        }
+      }
+      message = (spectator->caps & protocol_CapRLE) && rle != NULL ? rle : display;
+      spectator->synced = true;
+    }
+    if (message != NULL) {
+      server_queue(game, spectator->IP, message);
+    }
+  }
+}
 
-  player->row = row;
-  player->col = col;
+/***************************** server_find_spectator *****************************/
+/* return the spectator at that address, and its index in game->spectators,
+ * or NULL if there is none.
+ */
+static spectator_t*
+server_find_spectator(game_t* game, const addr_t addr, int* index)
+{
+  for (int i = 0; i < game->numSpectators; i++) {
+    if (message_eqAddr(game->spectators[i]->IP, addr)) {
+      *index = i;
+      return game->spectators[i];
+    }
+  }
+  return NULL;
+}
 
+/****************************** server_render_frame ******************************/
+/* render the grid, or what a player has seen if seen is not NULL, into
+ * the view, and return the message to send: the
+ * smallest of a DELTA against the last map sent, an RDISPLAY if the client
+ * accepts run-length maps, and the full DISPLAY.
+ * Returns NULL, with nothing to send, if the grid version has not changed
+ * (nothing is rendered) or the rendered map turns out the same.
+ * The message lives in the view's buffers until the view is rendered again;
+ * deltaBuf is only scratch space, as big as a full DISPLAY.
+ */
+static const char*
+server_render_frame(game_t* game, view_t* view, grid_t* grid, grid_seen_t* seen, char* deltaBuf)
+{
+  unsigned long version = seen != NULL ? grid_seenVersion(seen) : grid_version(grid);
+  if (view->sent && view->version == version) {
+    return NULL; // the grid has not changed since lastFrame was rendered
+  }
+  view->version = version;
+
+  int headerLen = strlen(DisplayHeader);
+  memcpy(view->frame, DisplayHeader, headerLen); // the spare buffer may hold a DELTA
+  char* map = view->frame + headerLen;
+  int mapLen = seen != NULL ? grid_seenRenderInto(seen, map, game->displaySize - headerLen)
+                            : grid_renderInto(grid, map, game->displaySize - headerLen);
+
+  // a delta is only worth sending if it beats the full DISPLAY
+  int len = -1;
+  if (view->sent) {
+    len = server_encode_delta(game, view->lastFrame + headerLen, view->frame + headerLen,
+                              deltaBuf, headerLen + mapLen + 1);
+    if (len >= 0 && len <= strlen("DELTA\n")) {
+      return NULL; // unchanged; lastFrame is still current
+    }
+    // DELTAs go by UDP, so one may be lost; a full map now and then puts
+    // right a client left out of step, instead of leaving it wrong for good
+    if (view->deltas >= FullFrameEvery) {
+      len = -1;
+    }
+  }
+  view->sent = true;
+
+  char* rendered = view->frame;
+  view->frame = view->lastFrame;
+  view->lastFrame = rendered;
+
+  // the message must outlive deltaBuf, which the next client reuses;
+  // the spare buffer is free until this view is rendered again.
+  // An RDISPLAY is only written if it is shorter than the best so far
+  if ((view->caps & protocol_CapRLE)
+      && protocol_encodeRDISPLAY(view->frame, len >= 0 ? len : headerLen + mapLen,
+                                 view->lastFrame + headerLen, mapLen) >= 0) {
+    view->deltas = 0;
+    return view->frame;
+  }
+  if (len < 0) {
+    view->deltas = 0;
+    return view->lastFrame;
+  }
+  memcpy(view->frame, deltaBuf, len + 1);
+  view->deltas++;
+  return view->frame;
 }
 
-/***************************** server_update_all_clients **************************/
+/************************************ view_init ************************************/
+/* allocate both map buffers of a view from the game's arena, each
+ * starting with DisplayHeader.
+ */
 static void
-server_update_all_clients(void) {
+view_init(game_t* game, view_t* view)
+{
+  view->frame = game_alloc(game, game->displaySize);
+  view->lastFrame = game_alloc(game, game->displaySize);
+  strcpy(view->frame, DisplayHeader);
+  strcpy(view->lastFrame, DisplayHeader);
+  view->sent = false;
+  view->deltas = 0;
+  view->caps = 0;
+}
+
+/*********************************** game_alloc ************************************/
+/* allocate zeroed memory that lasts as long as the game; exit if there
+ * is none to be had.
+ */
+static void*
+game_alloc(game_t* game, size_t size)
+{
+  return mem_assert(arena_alloc(game->arena, size), "out of memory");
+}
 
-  int size = (GAME.GridRow) * (GAME.GridCol) + 500;
-  char message[size];
+/*********************************** game_grow ************************************/
+/* grow memory from game_alloc, as realloc would; the old memory is spent.
+ */
+static void*
+game_grow(game_t* game, void* ptr, size_t oldSize, size_t newSize)
+{
+  return mem_assert(arena_grow(game->arena, ptr, oldSize, newSize), "out of memory");
+}
 
-  if (message_isAddr(GAME.spectatorIP)) {
-    // GOLD n p r
-    sprintf(message, "GOLD %d %d %d", 0, 0, GAME.goldLeft);
-    message_send(GAME.spectatorIP, message);
-    // DISPLAY/nstring
-    char* disp_string = grid_toString(GAME.masterGrid);
-    sprintf(message, "DISPLAY\n%s", disp_string);
-    message_send(GAME.spectatorIP, message);
-    free(disp_string);
+/****************************** server_encode_delta ******************************/
+/* encode the cells that differ between two rendered maps as a DELTA message:
+ *   DELTA
+ *   r c n:chars
+ *   ...
+ * one line per run of n cells starting at row r, column c, followed by
+ * the new characters of the run. Runs absorb gaps of up to DeltaMaxGap
+ * unchanged cells, which is cheaper than starting a new line.
+ * returns the message length, or -1 if it does not fit in 'size' bytes.
+ */
+static int
+server_encode_delta(game_t* game, const char* lastFrame, const char* frame, char* message, int size)
+{
+  int ncol = game->GridCol;
+  int len = protocol_encodeHeader(message, size, protocol_DELTA);
+  if (len < 0) {
+    return -1;
   }
 
-  for (int i = 0; i < GAME.numPlayer; i++) {
-    
-    player_t* player = GAME.players[i];
-    
-    /// GOLD n p r 
-    sprintf(message, "GOLD %d %d %d", player->justCollected, player->gold, GAME.goldLeft);
-    message_send(player->IP, message);
-    player->justCollected = 0;
+  for (int r = 0; r < game->GridRow; r++) {
+    const char* oldRow = lastFrame + r*(ncol + 1);
+    const char* newRow = frame + r*(ncol + 1);
+    if (memcmp(oldRow, newRow, ncol) == 0) {
+      continue;
+    }
+
+    int c = 0;
+    while (c < ncol) {
+      if (oldRow[c] == newRow[c]) {
+        c++;
+        continue;
+      }
+      // extend the run while the gap since the last change stays small
+      int start = c;
+      int end = c + 1;
+      for (int k = end; k < ncol && k - end <= DeltaMaxGap; k++) {
+        if (oldRow[k] != newRow[k]) {
+          end = k + 1;
+        }
+      }
 
-    // DISPLAY/nstring
-    grid_setVisibility(GAME.masterGrid, GAME.rawGrid, player->seenGrid, player->row, player->col);
-    char* disp_string = grid_toString(player->seenGrid);
-    sprintf(message, "DISPLAY\n%s", disp_string);
-    message_send(player->IP, message);
-    free(disp_string);
+      int n = protocol_encodeRun(message + len, size - len, r, start, end - start,
+                                 newRow + start);
+      if (n < 0) {
+        return -1;
+      }
+      len += n;
+      c = end;
+    }
   }
-    
+  return len;
 }
 
 /********************************** handleMessage **********************************/
 bool handleMessage(void* arg, const addr_t from, const char* message)
 {
-  // copy the message into local string
-  char msg[strlen(message)];
-  strcpy(msg, message);
-
-  if (strncmp(msg, "PLAY ", strlen("PLAY ")) == 0) {
-    char *name = msg + strlen("PLAY ");
-    return handlePlay(arg, from, name);
-  }
-  else if (strncmp(msg, "SPECTATE", strlen("SPECTATE")) == 0) {
-    return handleSPECTATE(arg, from);
+  game_t* game = arg;
+  uint64_t start = stats_now();
+#ifdef MEMTEST
+  unsigned long allocs = heapAllocs;
+#endif
+
+  // journaled as received, before it is acted on
+  if (game->journal != NULL && !journal_record(game->journal, start, from, message)) {
+    log_e("handleMessage: cannot write the journal; journaling stops");
+    journal_delete(game->journal);
+    game->journal = NULL;
   }
-  else if (strncmp(msg, "KEY ", strlen("KEY ")) == 0) {
-    char *key = msg + strlen("KEY ");
-    return handleKEY(arg, from, key);
-  }
-  else {
-    // Invalid message
-    log_e("Invalid message"); 
-    //continur
-    return false;
+
+  // decoded in place: the name and key are read straight from the message
+  protocol_msg_t msg;
+  bool done = false;
+  game->join = JoinNone;
+  protocol_type_t type = protocol_parse(message, &msg);
+  game->stats.recv[type].messages++;
+  game->stats.recv[type].bytes += strlen(message);
+  switch (type) {
+    case protocol_PLAY:
+      done = handlePlay(arg, from, msg.text, msg.length, msg.caps);
+      break;
+    case protocol_SPECTATE:
+      done = handleSPECTATE(arg, from, msg.caps);
+      break;
+    case protocol_KEY: {
+      uint64_t keyStart = stats_now();
+      done = handleKEY(arg, from, msg.text);
+      stats_since(&game->stats.time[TimeKey], keyStart);
+      break;
+    }
+    case protocol_STATS:
+      server_send_stats(game, from);
+      break;
+    default:
+      // Invalid message
+      log_e("Invalid message"); 
+      //continur
+      break;
   }
+
+  // in tick mode, a busy loop may never time out; flush if the tick is due
+  server_tick(game, false);
+  server_log_stats(game, false);
+  stats_since(&game->stats.time[TimeMessage], start);
+#ifdef MEMTEST
+  game->stats.heapAllocs += heapAllocs - allocs;
+#endif
+  return done;
+}
+
+/********************************** handleTimeout **********************************/
+bool handleTimeout(void* arg)
+{
+  game_t* game = arg;
+#ifdef MEMTEST
+  unsigned long allocs = heapAllocs;
+#endif
+
+  // a quiet tick went by; send any pending update, and the stats if due
+  server_tick(game, true);
+  server_log_stats(game, false);
+#ifdef MEMTEST
+  game->stats.heapAllocs += heapAllocs - allocs;
+#endif
+  return false;
 }
 
 /********************************* handlePlay ***************************************/
-bool handlePlay(void* arg, const addr_t from, const char* name) {
-  if (GAME.numPlayer == MaxPlayers) {
-    message_send(from, "QUIT Game is full: no more players can join.");
+bool handlePlay(void* arg, const addr_t from, const char* name, size_t nameLength,
+                unsigned caps) {
+  game_t* game = arg;
+
+  game->join = JoinRefused;
+  if (game->numPlayer == MaxPlayers) {
+    server_send(game, from, "QUIT Game is full: no more players can join.");
   }
-  else if (helper_nameIsEmpty(name)) {
-    message_send(from, "QUIT Sorry: you must provide player's name.");
+  else if (helper_nameIsEmpty(name, nameLength)) {
+    server_send(game, from, "QUIT Sorry: you must provide player's name.");
+  }
+  else if (server_find_player(game, from) != NULL) {
+    log_v("PLAY from an address that already plays; ignored");
+    game->join = JoinAccepted;
   }
   else {
-    // new player
-    player_t* player = malloc(sizeof(player_t));
-    if (player == NULL) {
-      //out of mem
-    } else {
-      // player IP
-      player->IP = from;
-      // player realname
-      for (int i = 0; i < strlen(name); i++) {
-        if (i < MaxNameLength) {
-          if (isgraph(name[i]) == false && isblank(name[i] == false)) {
-            (player->realName)[i] = '_';
-            (player->realName)[i+1] = '\0';
-          } else {
-            (player->realName)[i] = name[i];
-            (player->realName)[i+1] = '\0';
-          }
+    // new player, on a random empty spot
+    int row, col;
+    if (!server_drop_player(game, &row, &col)) {
+      server_send(game, from, "QUIT Game is full: no more players can join.");
+      return false;
+    }
+    game->join = JoinAccepted;
+    player_t* player = game_alloc(game, sizeof(player_t));
+    player->row = row;
+    player->col = col;
+
+    // player IP
+    player->IP = from;
+    // player realname
+    for (int i = 0; i < nameLength; i++) {
+      if (i < MaxNameLength) {
+        if (isgraph(name[i]) == false && isblank(name[i] == false)) {
+          (player->realName)[i] = '_';
+          (player->realName)[i+1] = '\0';
+        } else {
+          (player->realName)[i] = name[i];
+          (player->realName)[i+1] = '\0';
         }
       }
-    
-      // player alias
-      player->alias = 'A' + GAME.numPlayer;
-    
-      // player gold
-      player->gold = 0;
-      player->justCollected = 0;
-
-      // player location
-      server_drop_player(player);
-    
-      // player seenGrid
-      player->seenGrid = grid_new(GAME.GridRow, GAME.GridCol);
-        
-      // add new player into the players list
-      GAME.players[GAME.numPlayer++] = player;
-      grid_update(GAME.masterGrid, player->row, player->col, player->alias);
-
-      // Message
-      char message[100];
-      // Message 1 OK
-      sprintf(message, "OK %c", player->alias);
-      message_send(from, message);
-      // Message 2 GRID
-      sprintf(message, "GRID %d %d", GAME.GridRow, GAME.GridCol);
-      message_send(from, message);
-
-      // update all clients
-      server_update_all_clients();
     }
+  
+    // player alias
+    player->alias = 'A' + game->numPlayer % 26;
+  
+    // player gold
+    player->gold = 0;
+    player->justCollected = 0;
+    player->goldSent[0] = '\0';
+  
+    // what the player has seen
+    player->seen = grid_seenNew(game->rawGrid);
+    player->dirty = (grid_rect_t){ 0, 0, -1, -1 };
+    view_init(game, &player->view);
+    player->view.caps = caps;
+      
+    // add new player into the players list, and index them by address
+    if (game->numPlayer == game->playersSize) {
+      int size = game->playersSize == 0 ? 32 : 2 * game->playersSize;
+      game->players = game_grow(game, game->players, game->playersSize * sizeof(player_t*),
+                                size * sizeof(player_t*));
+      game->playersSize = size;
+    }
+    player->id = game->numPlayer;
+    game->players[game->numPlayer++] = player;
+    char key[AddrKeyLength];
+    server_addrKey(from, key);
+    hashtable_insert(game->playersByAddr, key, player);
+    grid_update(game->masterGrid, player->row, player->col, player->alias);
+    grid_setOccupant(game->masterGrid, player->row, player->col, player->id);
+
+    // Message
+    char message[100];
+    // Message 1 OK
+    protocol_encodeOK(message, sizeof(message), player->alias);
+    server_send(game, from, message);
+    // Message 2 GRID
+    protocol_encodeGRID(message, sizeof(message), game->GridRow, game->GridCol);
+    server_send(game, from, message);
+
+    // update all clients
+    server_schedule_update(game);
   }
   // game continue
   return false;
 }
 
 /******************************* handleSPECTATE ****************************/
-bool handleSPECTATE(void* arg, const addr_t from) {
-
-  if (message_isAddr(GAME.spectatorIP)) {
-    message_send(GAME.spectatorIP, "QUIT You have been replaced by a new spectator.");
+bool handleSPECTATE(void* arg, const addr_t from, unsigned caps) {
+  game_t* game = arg;
+
+  int index;
+  spectator_t* spectator = server_find_spectator(game, from, &index);
+  if (spectator == NULL) {
+    if (game->numSpectators == MaxSpectators) {
+      server_send(game, from, "QUIT Game is full: no more spectators can join.");
+      game->join = JoinRefused;
+      return false;
+    }
+    // a slot left by one who quit, or a new one
+    spectator = game->freeSpectators;
+    if (spectator != NULL) {
+      game->freeSpectators = spectator->next;
+    } else {
+      spectator = game_alloc(game, sizeof(spectator_t));
+    }
+    spectator->IP = from;
+    if (game->numSpectators == game->spectatorsSize) {
+      int size = game->spectatorsSize == 0 ? 8 : 2 * game->spectatorsSize;
+      game->spectators = game_grow(game, game->spectators,
+                                   game->spectatorsSize * sizeof(spectator_t*),
+                                   size * sizeof(spectator_t*));
+      game->spectatorsSize = size;
+    }
+    game->spectators[game->numSpectators++] = spectator;
   }
 
-  GAME.spectatorIP = from;
+  // the new spectator has no map yet; one joining again starts afresh
+  game->join = JoinAccepted;
+  spectator->caps = caps;
+  spectator->synced = false;
+  spectator->goldSent[0] = '\0';
 
   // Message spectator
   char message[100];
-  sprintf(message, "GRID %d %d", GAME.GridRow, GAME.GridCol);
-  message_send(from, message);
+  protocol_encodeGRID(message, sizeof(message), game->GridRow, game->GridCol);
+  server_send(game, from, message);
   
   // send update to all clients
-  server_update_all_clients();
+  server_schedule_update(game);
 
   // game continue
   return false;
 }
 
 /******************************** handleQUIT *******************************/
-bool handleQUIT(addr_t IP)
+bool handleQUIT(game_t* game, addr_t IP)
 {
-  if (message_eqAddr(GAME.spectatorIP, IP)) {
-    message_send(GAME.spectatorIP, "QUIT Thanks for watching!");
+  int index;
+  spectator_t* spectator = server_find_spectator(game, IP, &index);
+  if (spectator != NULL) {
+    server_send(game, IP, "QUIT Thanks for watching!");
+    spectator->next = game->freeSpectators;
+    game->freeSpectators = spectator;
+    game->spectators[index] = game->spectators[--game->numSpectators];
   }
   
-  for (int i = 0; i < GAME.numPlayer; i++) {
-    player_t* current = GAME.players[i];
-    if (message_eqAddr(IP, current->IP)) {
-      message_send(IP, "QUIT Thanks for playing!");
+  player_t* current = server_find_player(game, IP);
+  if (current != NULL) {
+    server_send(game, IP, "QUIT Thanks for playing!");
      
-      // replace the masterGrid's player symbol
-      char raw_char = grid_getchar(GAME.rawGrid, GAME.players[i]->row, GAME.players[i]->col);
-      grid_update(GAME.masterGrid, GAME.players[i]->row, GAME.players[i]->col, raw_char);
-    
-    }
+    // replace the masterGrid's player symbol
+    char raw_char = grid_getchar(game->rawGrid, current->row, current->col);
+    grid_update(game->masterGrid, current->row, current->col, raw_char);
+    grid_setOccupant(game->masterGrid, current->row, current->col, -1);
   }
 
 /* Make the prorgam easier for other ppl
  
       // delete the player
-      grid_delete(GAME.players[i]->seenGrid);
-      free(GAME.players[i]);
-      for (int j = i + 1; j < GAME.numPlayer; j++) {
-        GAME.players[j-1] = GAME.players[j];
+      grid_seenDelete(game->players[i]->seen);
+      free(game->players[i]);
+      for (int j = i + 1; j < game->numPlayer; j++) {
+        game->players[j-1] = game->players[j];
       }
-      GAME.numPlayer--;
+      game->numPlayer--;
     }
   }
 */
 
   // send update to all clients and game continue
-  server_update_all_clients();
+  server_schedule_update(game);
   return false;
 }
 
 /********************************* handleKEY *******************************/
 bool handleKEY(void* arg, const addr_t from, const char* key)
 {
+  game_t* game = arg;
   char KEY = *key;
   player_t* player = NULL;
   
   // Let the player quit the game; game continue
   if (KEY == 'Q') {
-    handleQUIT(from);
+    handleQUIT(game, from);
     return false;
   }
 
   // figure out which player sent the message
-  for (int i = 0; i < GAME.numPlayer; i++) {
-    player_t* current = GAME.players[i];
-    if (message_eqAddr(from, current->IP)) {
-      player = current;
-    }
-  }
+  player = server_find_player(game, from);
 
   if (player == NULL) {
    //error
@@ -435,119 +2166,108 @@ bool handleKEY(void* arg, const addr_t from, const char* key)
 
   int row = player->row;
   int col = player->col;
+  int start_row = row;
+  int start_col = col;
     
+  // moves only update the grids; one update goes out after the whole move
   switch(KEY)
   {
     case 'h':
       //left
-      player_move(player, row, col-1);
+      player_move(game, player, row, col-1);
       break;
 
     case 'H': 
       //left max
-      while(!player_move(player, row, col-1)) {
-        col--;
-      }
+      player_sprint(game, player, 0, -1);
       break;
               
     case 'l':
       //right
-      player_move(player, row, col+1);
+      player_move(game, player, row, col+1);
       break;
   
     case 'L': 
       //right max
-      while(!player_move(player, row, col+1)) {
-        col++;
-      }
+      player_sprint(game, player, 0, 1);
       break;
     
     case 'j':
       //down
-      player_move(player, row+1, col);
+      player_move(game, player, row+1, col);
       break;
  
     case 'J':
       //down max
-      while(!player_move(player, row+1, col)) {
-        row++;
-      }
+      player_sprint(game, player, 1, 0);
       break;   
     
     case 'k':
       //up
-      player_move(player, row-1, col);
+      player_move(game, player, row-1, col);
       break;
     
     case 'K':
       //up max
-      while(!player_move(player, row-1, col)) {
-        row--;
-      }
+      player_sprint(game, player, -1, 0);
       break;
 
     case 'y':
       //up left
-      player_move(player, row-1, col-1);
+      player_move(game, player, row-1, col-1);
       break;
    
     case 'Y':
       //up left max
-      while(!player_move(player, row-1, col-1)) {
-        row--;
-        col--;
-      }
+      player_sprint(game, player, -1, -1);
       break;
    
      case 'u':
       //up right
-      player_move(player, row-1, col+1);
+      player_move(game, player, row-1, col+1);
       break;
 
      case 'U':
       //up right max
-      while(!player_move(player, row-1, col+1)) {
-        row--;
-        col++;
-      }
+      player_sprint(game, player, -1, 1);
       break;
 
      case 'b':
       //down left
-      player_move(player, row+1, col-1);
+      player_move(game, player, row+1, col-1);
       break;
   
      case 'B':
       //down left max
-      while(!player_move(player, row+1, col-1)) {
-        row++;
-        col--;
-      }
+      player_sprint(game, player, 1, -1);
       break;
       
      case 'n':
       //down right
-      player_move(player, row+1, col+1);
+      player_move(game, player, row+1, col+1);
       break;
 
      case 'N':
       //down right max
-      while(!player_move(player, row+1, col+1)) {
-        row++;
-        col++;
-      }
+      player_sprint(game, player, 1, 1);
       break;
      
      default:
       //invalid key
       log_c("Invalid Key : %c", KEY);
+      char explanation[] = "Unknown Keystroke: ?";
+      explanation[strlen(explanation) - 1] = KEY;
       char messageUnknown[100];
-      snprintf(messageUnknown, 100, "ERROR Unknown Keystroke: %c", KEY);
-      message_send(player->IP, messageUnknown);
+      protocol_encodeERROR(messageUnknown, sizeof(messageUnknown), explanation);
+      server_send(game, player->IP, messageUnknown);
+  }
+
+  if (player->row != start_row || player->col != start_col) {
+    server_schedule_update(game);
   }
 
   // check the # of gold left to determine whether to end the game
-  if (GAME.GoldNumPilesLeft == 0) {
+  if (game->GoldNumPilesLeft == 0) {
     // only time to quit normally
     // No gold left
     return true;
@@ -558,57 +2278,112 @@ bool handleKEY(void* arg, const addr_t from, const char* key)
 }
 
 /******************************** player_move ***********************************/
+/* move the player one step, swapping with or picking up whatever is there.
+ * Only the grids and the mover's view are updated; the caller sends one
+ * update to all clients once the whole move is done.
+ *
+ * return:
+ *  true when the player can not move there
+ *  false when the player moved, and may be able to move further
+ */
 bool
-player_move(player_t* player, int new_row, int new_col)
+player_move(game_t* game, player_t* player, int new_row, int new_col)
 {
   int old_row = player->row;
   int old_col = player->col;
+  uint64_t start = stats_now();
+  stats_hist_t* seeTime = &game->stats.time[TimeSee];
+  bool blocked = false;
 
-  if (grid_canMoveTo(GAME.masterGrid, new_row, new_col)) {
+  if (grid_canMoveTo(game->masterGrid, new_row, new_col)) {
     // ok to move
-    if (grid_isPlayer(GAME.masterGrid, new_row, new_col)) {
+    int other = grid_occupant(game->masterGrid, new_row, new_col);
+    if (grid_isPlayer(game->masterGrid, new_row, new_col) && other >= 0) {
       // switch location
-      for (int i = 0; i < GAME.numPlayer; i++) {
-        player_t* another_player = GAME.players[i];
-        if (another_player->row == new_row && another_player->col == new_col) {
-          another_player->row = old_row;
-          another_player->col = old_col;
-          grid_update(GAME.masterGrid, another_player->row, another_player->col, another_player->alias);
+      player_t* another_player = game->players[other];
+      another_player->row = old_row;
+      another_player->col = old_col;
+      grid_update(game->masterGrid, another_player->row, another_player->col, another_player->alias);
+      grid_setOccupant(game->masterGrid, another_player->row, another_player->col, another_player->id);
           
-          player->row = new_row;
-          player->col = new_col;
-          grid_update(GAME.masterGrid, player->row, player->col, player->alias);
-          server_update_all_clients();
-          return false;
-        }
-      }
-    }
-    else if (grid_isGold(GAME.masterGrid, new_row, new_col)) {
       player->row = new_row;
       player->col = new_col;
-      // find the original char, it actually must be .
-      char raw_char = grid_getchar(GAME.rawGrid, old_row, old_col);
-      grid_update(GAME.masterGrid, old_row, old_col, raw_char);
-      grid_update(GAME.masterGrid, player->row, player->col, player->alias);
-      pickup_gold(player);
-      server_update_all_clients();
+      grid_update(game->masterGrid, player->row, player->col, player->alias);
+      grid_setOccupant(game->masterGrid, player->row, player->col, player->id);
+      player_see(game, player, seeTime);
+    }
+    else if (grid_isGold(game->masterGrid, new_row, new_col)) {
+      player_place(game, player, new_row, new_col);
+      pickup_gold(game, player);
+      player_see(game, player, seeTime);
     }
     else {
       // empty room spot or passage
-      player->row = new_row;
-      player->col = new_col;
-      // find the original char, it can be . or #
-      char raw_char = grid_getchar(GAME.rawGrid, old_row, old_col);
-      grid_update(GAME.masterGrid, old_row, old_col, raw_char);
-      grid_update(GAME.masterGrid, player->row, player->col, player->alias);
-      server_update_all_clients();
+      player_place(game, player, new_row, new_col);
+      player_see(game, player, seeTime);
     }
     // may be able to move further
-    return false;
   } else {
     // can not move
-    return true;
+    blocked = true;
+  }
+  stats_since(&game->stats.time[TimeMove], start);
+  return blocked;
+}
+
+/******************************** player_sprint ***********************************/
+/* move the player as far as they can go in direction (dr,dc), ending where
+ * repeated player_move would. The run is looked up in rawGrid; the player
+ * jumps over the plain spots on the way, only marking what they see from
+ * each, and steps onto gold and other players one at a time.
+ */
+static void
+player_sprint(game_t* game, player_t* player, int dr, int dc)
+{
+  uint64_t start = stats_now();
+  int steps = grid_runLength(game->rawGrid, player->row, player->col, dr, dc);
+  int row = player->row;
+  int col = player->col;
+
+  for (int i = 1; i <= steps; i++) {
+    row += dr;
+    col += dc;
+    if (grid_occupant(game->masterGrid, row, col) >= 0 || grid_isGold(game->masterGrid, row, col)) {
+      if (player->row != row - dr || player->col != col - dc) {
+        player_place(game, player, row - dr, col - dc);
+      }
+      player_move(game, player, row, col);
+    }
+    else if (i < steps) {
+      grid_rect_t dirty;
+      grid_seenMark(player->seen, row, col, &dirty);
+      grid_rectUnion(&player->dirty, &dirty);
+    }
   }
+
+  if (player->row != row || player->col != col) {
+    player_place(game, player, row, col);
+    player_see(game, player, &game->stats.time[TimeSee]);
+  }
+  stats_since(&game->stats.time[TimeSprint], start);
+}
+
+/******************************** player_place ************************************/
+/* move the player to an empty room spot or passage, putting back the raw
+ * character where they were; what they see is left to the caller.
+ */
+static void
+player_place(game_t* game, player_t* player, int new_row, int new_col)
+{
+  int old_row = player->row;
+  int old_col = player->col;
+  player->row = new_row;
+  player->col = new_col;
+  // find the original char, it can be . or #
+  char raw_char = grid_getchar(game->rawGrid, old_row, old_col);
+  grid_update(game->masterGrid, old_row, old_col, raw_char);
+  grid_update(game->masterGrid, player->row, player->col, player->alias);
+  player_occupy(game, player, old_row, old_col);
 }
 
 /********************************** pickup_gold ***********************************/
@@ -620,31 +2395,31 @@ player_move(player_t* player, int new_row, int new_col)
  *
  */ 
 static void
-pickup_gold(player_t* player)
+pickup_gold(game_t* game, player_t* player)
 {
   int minPerPile = 1;
-  int maxPerPile = (GAME.goldLeft) - (GAME.GoldNumPilesLeft) + 1;
+  int maxPerPile = (game->goldLeft) - (game->GoldNumPilesLeft) + 1;
   int gold = 0;
 
-  if (GAME.GoldNumPilesLeft != 1){
-    gold = rand() % (maxPerPile - minPerPile + 1);
+  if (game->GoldNumPilesLeft != 1){
+    gold = server_rand(game) % (maxPerPile - minPerPile + 1);
     gold = gold + minPerPile;
   } else {
-    gold = GAME.goldLeft;
+    gold = game->goldLeft;
   }
 
   player->gold = player->gold + gold;
-  player->justCollected = gold;
+  player->justCollected = player->justCollected + gold; // a run may pass several piles
 
-  GAME.goldCollected = GAME.goldCollected + gold; 
-  GAME.goldLeft = GAME.goldLeft - gold;
-  GAME.GoldNumPilesLeft--;
+  game->goldCollected = game->goldCollected + gold; 
+  game->goldLeft = game->goldLeft - gold;
+  game->GoldNumPilesLeft--;
 }
 
 /******************************** helper_nameIsEmpty *******************************/
 bool
-helper_nameIsEmpty(const char* name) {
-  for (int i = 0; i < strlen(name); i++) {
+helper_nameIsEmpty(const char* name, size_t nameLength) {
+  for (int i = 0; i < nameLength; i++) {
     if (!isspace(name[i])) {
       return false;
     }
@@ -653,56 +2428,42 @@ helper_nameIsEmpty(const char* name) {
 }
 
 /******************************* game_over ***************************************/
+/* send every client the summary, then free the game: what the grid
+ * module made, then the arena with everything else.
+ */
 static void
-game_over(void)
+game_over(game_t* game)
 {
 
-  char message[26000] = "QUIT GAME OVER:\n";
+  // one line per player: alias, gold right-aligned in six columns, real name
+  const int lineSize = MaxNameLength + 16;
+  char* message = game_alloc(game, sizeof("QUIT GAME OVER:\n") + game->numPlayer * lineSize);
+  int len = sprintf(message, "QUIT GAME OVER:\n");
 
-  for (int i = 0; i < GAME.numPlayer; i++) {
-    player_t* player = GAME.players[i];
-    char mc[2];
-    mc[0] = player->alias;
-    mc[1] = '\0';
-    strcat(message, mc);
-    int gold = player->gold;
-    if (gold == 0) {
-      strcat(message, "     0   ");
-    }
-    else if ((gold/10) == 0) {
-      char mn[100];
-      snprintf(mn, 100, "     %d   ", gold);
-      strcat(message, mn);
-    }
-    else if ((gold/100) == 0) {
-      char mn[100];
-      snprintf(mn, 100, "    %d   ", gold);
-      strcat(message, mn);
-    }
-    else if ((gold/1000) == 0) {
-      char mn[100];
-      snprintf(mn, 100, "   %d   ", gold);
-      strcat(message, mn);
-    }
-    strcat(message, player->realName);
-    strcat(message, "\n");
+  for (int i = 0; i < game->numPlayer; i++) {
+    player_t* player = game->players[i];
+    len += snprintf(message + len, lineSize, "%c%6d   %s\n",
+                    player->alias, player->gold, player->realName);
   }
 
-  if (message_isAddr(GAME.spectatorIP)) {
-    message_send(GAME.spectatorIP, message);
+  for (int i = 0; i < game->numSpectators; i++) {
+    server_send(game, game->spectators[i]->IP, message);
   }
 
-  for (int i = 0; i < GAME.numPlayer; i++) {
-    player_t* player = GAME.players[i];
-    message_send(player->IP, message);
+  for (int i = 0; i < game->numPlayer; i++) {
+    player_t* player = game->players[i];
+    server_send(game, player->IP, message);
   }
 
-  for (int i = 0; i < GAME.numPlayer; i++) {    
-    player_t* player = GAME.players[i];
-    grid_delete(player->seenGrid);
-    free(player);
+  for (int i = 0; i < game->numPlayer; i++) {    
+    grid_seenDelete(game->players[i]->seen);
   }
-
-  grid_delete(GAME.masterGrid);
-  grid_delete(GAME.rawGrid);
+  viewPool_delete(game->viewPool);
+  hashtable_delete(game->playersByAddr, NULL);
+  grid_delete(game->masterGrid);
+  grid_delete(game->rawGrid);
+  if (game->journal != NULL && !journal_delete(game->journal)) {
+    log_e("game_over: cannot write the end of the journal");
+  }
+  arena_delete(game->arena);
 }
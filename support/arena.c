@@ -0,0 +1,295 @@
+/*
+ * arena - memory that lives as long as its owner, such as a game
+ *
+ * See arena.h for detailed interface description for each function.
+ *
+ * Compile with -DUNIT_TEST for a standalone unit test; see below.
+ *
+ * hemlock, May 2021
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include "arena.h"
+
+/**************** file-local types ****************/
+/* a block taken from the heap; allocations follow the header */
+typedef struct chunk {
+  struct chunk* next;     // chunk taken before this one
+  size_t size;            // bytes after the header
+  size_t used;            // of them, handed out
+} chunk_t;
+
+/**************** global types ****************/
+struct arena {
+  chunk_t* chunks;        // the chunk allocations come from, then older ones
+  size_t chunkSize;
+  size_t bytes;           // handed out, in every chunk
+  int numChunks;
+  void* last;             // the last allocation, which arena_grow may extend
+};
+
+/**************** file-local constants ****************/
+// every allocation starts on a multiple of this, as malloc's do
+static const size_t Align = _Alignof(max_align_t);
+
+/**************** file-local functions ****************/
+static size_t roundUp(const size_t size);
+static chunk_t* newChunk(arena_t* arena, const size_t size);
+static char* chunkData(chunk_t* chunk);
+
+/**************** arena_new ****************/
+/* see arena.h for description */
+arena_t*
+arena_new(const size_t chunkSize)
+{
+  if (chunkSize == 0) {
+    return NULL;
+  }
+  arena_t* arena = calloc(1, sizeof(arena_t));
+  if (arena != NULL) {
+    arena->chunkSize = roundUp(chunkSize);
+  }
+  return arena;
+}
+
+/**************** arena_alloc ****************/
+/* see arena.h for description */
+void*
+arena_alloc(arena_t* arena, const size_t size)
+{
+  if (arena == NULL) {
+    return NULL;
+  }
+  size_t need = roundUp(size > 0 ? size : 1);
+  if (need == 0) {
+    return NULL;              // too big to round up
+  }
+
+  // a big allocation has a chunk of its own, filed behind the current
+  // one, which keeps its room for the allocations to come
+  if (need > arena->chunkSize) {
+    chunk_t* chunk = newChunk(arena, need);
+    if (chunk == NULL) {
+      return NULL;
+    }
+    chunk->used = need;
+    if (arena->chunks != NULL) {
+      chunk->next = arena->chunks->next;
+      arena->chunks->next = chunk;
+    } else {
+      arena->chunks = chunk;
+    }
+    arena->bytes += need;
+    arena->last = NULL;       // it cannot grow in place
+    return chunkData(chunk);
+  }
+
+  chunk_t* chunk = arena->chunks;
+  if (chunk == NULL || chunk->size - chunk->used < need) {
+    chunk = newChunk(arena, arena->chunkSize);
+    if (chunk == NULL) {
+      return NULL;
+    }
+    chunk->next = arena->chunks;
+    arena->chunks = chunk;
+  }
+  void* ptr = chunkData(chunk) + chunk->used;
+  chunk->used += need;
+  arena->bytes += need;
+  arena->last = ptr;
+  return ptr;
+}
+
+/**************** arena_grow ****************/
+/* see arena.h for description */
+void*
+arena_grow(arena_t* arena, void* ptr, const size_t oldSize, const size_t newSize)
+{
+  if (arena == NULL) {
+    return NULL;
+  }
+  if (ptr == NULL) {
+    return arena_alloc(arena, newSize);
+  }
+  if (newSize <= oldSize) {
+    return ptr;
+  }
+
+  // the last allocation of the current chunk can grow where it is
+  chunk_t* chunk = arena->chunks;
+  size_t oldNeed = roundUp(oldSize > 0 ? oldSize : 1);
+  size_t newNeed = roundUp(newSize);
+  if (ptr == arena->last && newNeed != 0 && chunk->size - chunk->used >= newNeed - oldNeed) {
+    chunk->used += newNeed - oldNeed;
+    arena->bytes += newNeed - oldNeed;
+    return ptr;               // the bytes past oldSize are still zero
+  }
+
+  void* grown = arena_alloc(arena, newSize);
+  if (grown != NULL) {
+    memcpy(grown, ptr, oldSize);
+  }
+  return grown;
+}
+
+/**************** arena_bytes ****************/
+/* see arena.h for description */
+size_t
+arena_bytes(const arena_t* arena)
+{
+  return arena == NULL ? 0 : arena->bytes;
+}
+
+/**************** arena_chunks ****************/
+/* see arena.h for description */
+int
+arena_chunks(const arena_t* arena)
+{
+  return arena == NULL ? 0 : arena->numChunks;
+}
+
+/**************** arena_delete ****************/
+/* see arena.h for description */
+void
+arena_delete(arena_t* arena)
+{
+  if (arena != NULL) {
+    chunk_t* chunk = arena->chunks;
+    while (chunk != NULL) {
+      chunk_t* next = chunk->next;
+      free(chunk);
+      chunk = next;
+    }
+    free(arena);
+  }
+}
+
+/**************** roundUp ****************/
+/* round a size up to a multiple of Align; 0 if that would overflow */
+static size_t
+roundUp(const size_t size)
+{
+  return size > SIZE_MAX - Align ? 0 : (size + Align - 1) / Align * Align;
+}
+
+/**************** newChunk ****************/
+/* take a zeroed chunk of 'size' bytes from the heap, not yet filed */
+static chunk_t*
+newChunk(arena_t* arena, const size_t size)
+{
+  if (size > SIZE_MAX - roundUp(sizeof(chunk_t))) {
+    return NULL;
+  }
+  chunk_t* chunk = calloc(1, roundUp(sizeof(chunk_t)) + size);
+  if (chunk != NULL) {
+    chunk->next = NULL;
+    chunk->size = size;
+    chunk->used = 0;
+    arena->numChunks++;
+  }
+  return chunk;
+}
+
+/**************** chunkData ****************/
+/* the first byte after a chunk's header */
+static char*
+chunkData(chunk_t* chunk)
+{
+  return (char*) chunk + roundUp(sizeof(chunk_t));
+}
+
+
+/* ****************************************************************** */
+/* ************************* UNIT_TEST ****************************** */
+/*
+ * This unit test allocates from small arenas and checks alignment,
+ * zeroing, chunking, growth in place and by copying, and big
+ * allocations. Run it as
+ *   ./arenatest
+ * or under valgrind, which finds no leaks once arena_delete is done.
+ */
+
+#ifdef UNIT_TEST
+
+#include "unittest.h"
+
+static bool allZero(const char* p, const size_t size);
+
+int
+main(const int argc, char* argv[])
+{
+  check(arena_new(0) == NULL, "no arena of zero-sized chunks");
+  check(arena_alloc(NULL, 8) == NULL && arena_grow(NULL, NULL, 0, 8) == NULL,
+        "NULL arena");
+  check(arena_bytes(NULL) == 0 && arena_chunks(NULL) == 0, "NULL arena counts");
+  arena_delete(NULL);
+
+  // allocations are aligned, zeroed, and do not overlap
+  arena_t* arena = arena_new(1000);
+  check(arena != NULL && arena_chunks(arena) == 0, "new arena takes no chunk yet");
+  char* a = arena_alloc(arena, 1);
+  char* b = arena_alloc(arena, 30);
+  char* c = arena_alloc(arena, 0);
+  check(a != NULL && b != NULL && c != NULL, "small allocations");
+  check((uintptr_t) a % _Alignof(max_align_t) == 0 && (uintptr_t) b % _Alignof(max_align_t) == 0
+        && (uintptr_t) c % _Alignof(max_align_t) == 0, "aligned");
+  check(b >= a + 1 && c >= b + 30, "no overlap");
+  check(allZero(b, 30), "zeroed");
+  memset(b, 'b', 30);
+  check(arena_chunks(arena) == 1, "one chunk");
+
+  // filling the chunk takes another
+  int n = 0;
+  while (arena_chunks(arena) == 1) {
+    check(allZero(arena_alloc(arena, 100), 100), "zeroed while filling");
+    n++;
+  }
+  check(n > 5 && n < 12, "a chunk holds about chunkSize bytes");
+
+  // the last allocation grows where it is, if there is room
+  char* d = arena_alloc(arena, 40);
+  memset(d, 'd', 40);
+  char* e = arena_grow(arena, d, 40, 200);
+  check(e == d && e[39] == 'd' && allZero(e + 40, 160), "grow in place");
+  // anything else is copied, the new bytes zero
+  char* f = arena_grow(arena, b, 30, 60);
+  check(f != b && f[0] == 'b' && f[29] == 'b' && allZero(f + 30, 30), "grow by copying");
+  check(arena_grow(arena, f, 60, 10) == f, "shrinking keeps the memory");
+  char* g = arena_grow(arena, NULL, 0, 16);
+  check(g != NULL && allZero(g, 16), "growing NULL allocates");
+
+  // a big allocation gets its own chunk, and the current one keeps its room
+  int chunks = arena_chunks(arena);
+  char* h = arena_alloc(arena, 5000);
+  check(h != NULL && allZero(h, 5000) && arena_chunks(arena) == chunks + 1, "big allocation");
+  memset(h, 'h', 5000);
+  char* i = arena_alloc(arena, 16);
+  check(i == g + 16 && arena_chunks(arena) == chunks + 1, "small ones go on where they were");
+  check(arena_grow(arena, h, 5000, 6000) != h, "a big allocation is copied to grow");
+
+  check(arena_alloc(arena, SIZE_MAX) == NULL && arena_alloc(arena, SIZE_MAX - 8) == NULL,
+        "impossible sizes");
+  check(arena_bytes(arena) >= 1000 + 5000 + 6000, "bytes handed out");
+  arena_delete(arena);
+
+  printf("all arena tests passed\n");
+  return 0;
+}
+
+/* true if size bytes at p are all zero */
+static bool
+allZero(const char* p, const size_t size)
+{
+  for (size_t i = 0; i < size; i++) {
+    if (p[i] != 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+#endif // UNIT_TEST
@@ -0,0 +1,86 @@
+/*
+ * arena - memory that lives as long as its owner, such as a game
+ *
+ * An arena hands out memory from a few large chunks, by bumping a
+ * pointer, and frees it all at once in arena_delete; nothing in it is
+ * freed on its own. So the allocations of one owner sit together, away
+ * from those of other owners and other threads, and many small mallocs
+ * become a few big ones. Memory from an arena starts zeroed, and is
+ * aligned for any type.
+ *
+ * An arena is not thread-safe: give each thread, or each game played by
+ * one thread, its own.
+ *
+ * Typical code looks like this:
+ *   arena_t* arena = arena_new(64 * 1024);
+ *   thing_t* thing = arena_alloc(arena, sizeof(thing_t));
+ *   things = arena_grow(arena, things, oldSize, newSize);
+ *   ...
+ *   arena_delete(arena);   // every thing at once
+ *
+ * hemlock, May 2021
+ */
+
+#ifndef _ARENA_H_
+#define _ARENA_H_
+
+#include <stddef.h>
+
+/****************** types *********************/
+typedef struct arena arena_t;  // opaque to users of the module
+
+/****************** global functions *********************/
+
+/******************************************/
+/* arena_new: make an empty arena.
+ * Caller provides: the size of the chunks it takes from the heap, in
+ *   bytes; allocations bigger than that get a chunk of their own.
+ * Function returns:
+ *   the arena, to be freed with arena_delete;
+ *   NULL if chunkSize is 0 or out of memory.
+ */
+arena_t* arena_new(const size_t chunkSize);
+
+/******************************************/
+/* arena_alloc: allocate zeroed memory from an arena.
+ * Caller provides: an arena, and the number of bytes wanted.
+ * Function returns:
+ *   memory for size bytes, all zero, aligned for any type, valid until
+ *   arena_delete;
+ *   NULL if arena is NULL or out of memory.
+ */
+void* arena_alloc(arena_t* arena, const size_t size);
+
+/******************************************/
+/* arena_grow: make an allocation bigger, as realloc does.
+ * Caller provides:
+ *   an arena, memory it returned (or NULL) with the size asked for then,
+ *   and the size now wanted.
+ * Function returns:
+ *   memory for newSize bytes, starting with the old contents, the rest
+ *   zeroed; the old memory itself if it was the arena's last allocation
+ *   and there is room after it, else new memory, the old left unused;
+ *   NULL if arena is NULL or out of memory, when ptr is left as it was.
+ * Notes: growing by doubling wastes at most as much as it keeps.
+ */
+void* arena_grow(arena_t* arena, void* ptr, const size_t oldSize, const size_t newSize);
+
+/******************************************/
+/* arena_bytes: the bytes an arena has handed out, including padding.
+ * Function returns 0 if arena is NULL.
+ */
+size_t arena_bytes(const arena_t* arena);
+
+/******************************************/
+/* arena_chunks: the chunks an arena has taken from the heap.
+ * Function returns 0 if arena is NULL.
+ */
+int arena_chunks(const arena_t* arena);
+
+/******************************************/
+/* arena_delete: free an arena and everything allocated from it.
+ * Caller provides: an arena, or NULL.
+ */
+void arena_delete(arena_t* arena);
+
+#endif // _ARENA_H_
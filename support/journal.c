@@ -0,0 +1,574 @@
+/*
+ * journal - a compact binary record of the messages a game receives
+ *
+ * See journal.h for detailed interface description for each function.
+ *
+ * Compile with -DUNIT_TEST for a standalone unit test; see below.
+ *
+ * hemlock, May 2021
+ */
+
+#define _POSIX_C_SOURCE 200809L  // open, write
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "journal.h"
+
+/**************** file-local constants ****************/
+static const char Magic[4] = { 'N', 'U', 'G', 'J' };
+static const int Version = 1;
+#define JournalBufBytes 65536       // records buffered between writes
+#define JournalFlushNs 1000000000u  // at most this long between writes
+#define VarintBytes 10              // the longest varint of a uint64_t
+
+/**************** file-local types ****************/
+/* a slot of the table from sender address to slot number */
+typedef struct slotEntry {
+  bool used;
+  uint32_t ip;                 // as in the address, network order
+  uint16_t port;
+  int slot;
+} slotEntry_t;
+
+/**************** global types ****************/
+struct journal {
+  int fd;
+  char* buf;                   // records not yet written
+  size_t used;                 // bytes of them
+  bool started;                // a record has been made
+  bool failed;                 // a write failed; record nothing more
+  uint64_t lastUs;             // time of the last record, microseconds
+  uint64_t writtenNs;          // time of the last write
+  slotEntry_t* table;          // open addressing, at most half full
+  int tableSize;               // a power of two
+  int numSlots;                // senders heard from
+};
+
+struct journal_reader {
+  unsigned char* data;         // the whole file
+  size_t size;
+  size_t pos;                  // of the next record
+  bool damaged;                // reading stopped at a bad record
+  char* text;                  // the message of the last event
+  size_t textSize;
+};
+
+/**************** file-local functions ****************/
+static int findSlot(journal_t* journal, const addr_t from);
+static size_t putVarint(char* buf, uint64_t value);
+static bool getVarint(journal_reader_t* reader, uint64_t* value);
+static bool writeAll(journal_t* journal, const char* buf, size_t size);
+static addr_t slotAddr(const int slot);
+
+/**************** journal_new ****************/
+/* see journal.h for description */
+journal_t*
+journal_new(const char* path, const int seed, const int nrows, const int ncols)
+{
+  if (path == NULL || seed < 0 || nrows < 0 || ncols < 0) {
+    return NULL;
+  }
+  journal_t* journal = calloc(1, sizeof(journal_t));
+  if (journal == NULL) {
+    return NULL;
+  }
+  journal->buf = malloc(JournalBufBytes);
+  journal->tableSize = 64;
+  journal->table = calloc(journal->tableSize, sizeof(slotEntry_t));
+  journal->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (journal->buf == NULL || journal->table == NULL || journal->fd < 0) {
+    if (journal->fd >= 0) {
+      close(journal->fd);
+    }
+    free(journal->buf);
+    free(journal->table);
+    free(journal);
+    return NULL;
+  }
+
+  // the header waits in the buffer with the first records
+  memcpy(journal->buf, Magic, sizeof(Magic));
+  journal->used = sizeof(Magic);
+  journal->buf[journal->used++] = Version;
+  journal->used += putVarint(journal->buf + journal->used, seed);
+  journal->used += putVarint(journal->buf + journal->used, nrows);
+  journal->used += putVarint(journal->buf + journal->used, ncols);
+  return journal;
+}
+
+/**************** journal_record ****************/
+/* see journal.h for description */
+bool
+journal_record(journal_t* journal, const uint64_t now, const addr_t from,
+               const char* message)
+{
+  if (journal == NULL || message == NULL || journal->failed) {
+    return false;
+  }
+  int slot = findSlot(journal, from);
+  if (slot < 0) {
+    journal->failed = true;
+    return false;
+  }
+
+  // microseconds since the last record, never negative
+  uint64_t us = now / 1000;
+  uint64_t delta = journal->started && us > journal->lastUs ? us - journal->lastUs : 0;
+  if (!journal->started) {
+    journal->started = true;
+    journal->writtenNs = now;
+  }
+  if (us > journal->lastUs) {
+    journal->lastUs = us;
+  }
+
+  // the record's head, and its message unless that is a key
+  char head[3 * VarintBytes + 1];
+  size_t length = strlen(message);
+  bool isKey = length == 5 && strncmp(message, "KEY ", 4) == 0;
+  size_t n = putVarint(head, delta);
+  n += putVarint(head + n, (uint64_t) slot * 2 + isKey);
+  if (isKey) {
+    head[n++] = message[4];
+    length = 0;
+  } else {
+    n += putVarint(head + n, length);
+  }
+
+  if (journal->used + n + length > JournalBufBytes && !journal_flush(journal)) {
+    return false;
+  }
+  if (n + length > JournalBufBytes) {
+    // too big to buffer: straight to the file
+    if (!writeAll(journal, head, n) || !writeAll(journal, message, length)) {
+      return false;
+    }
+  } else {
+    memcpy(journal->buf + journal->used, head, n);
+    memcpy(journal->buf + journal->used + n, message, length);
+    journal->used += n + length;
+  }
+
+  if (now > journal->writtenNs && now - journal->writtenNs >= JournalFlushNs) {
+    journal->writtenNs = now;
+    return journal_flush(journal);
+  }
+  return true;
+}
+
+/**************** journal_flush ****************/
+/* see journal.h for description */
+bool
+journal_flush(journal_t* journal)
+{
+  if (journal == NULL || journal->failed) {
+    return false;
+  }
+  bool ok = writeAll(journal, journal->buf, journal->used);
+  journal->used = 0;
+  return ok;
+}
+
+/**************** journal_delete ****************/
+/* see journal.h for description */
+bool
+journal_delete(journal_t* journal)
+{
+  if (journal == NULL) {
+    return false;
+  }
+  bool ok = journal_flush(journal);
+  if (close(journal->fd) != 0) {
+    ok = false;
+  }
+  free(journal->buf);
+  free(journal->table);
+  free(journal);
+  return ok;
+}
+
+/**************** journal_openReader ****************/
+/* see journal.h for description */
+journal_reader_t*
+journal_openReader(const char* path, journal_header_t* header)
+{
+  if (path == NULL || header == NULL) {
+    return NULL;
+  }
+  FILE* fp = fopen(path, "rb");
+  if (fp == NULL) {
+    return NULL;
+  }
+  journal_reader_t* reader = calloc(1, sizeof(journal_reader_t));
+  if (reader == NULL) {
+    fclose(fp);
+    return NULL;
+  }
+  long size = -1;
+  if (fseek(fp, 0, SEEK_END) == 0 && (size = ftell(fp)) >= 0 && fseek(fp, 0, SEEK_SET) == 0) {
+    reader->size = size;
+    reader->data = malloc(size > 0 ? size : 1);
+    if (reader->data == NULL || fread(reader->data, 1, size, fp) != reader->size) {
+      size = -1;
+    }
+  }
+  fclose(fp);
+
+  // the header: magic, version, seed and map size
+  if (size < (long) sizeof(Magic) + 1 || memcmp(reader->data, Magic, sizeof(Magic)) != 0
+      || reader->data[sizeof(Magic)] != Version) {
+    journal_closeReader(reader);
+    return NULL;
+  }
+  reader->pos = sizeof(Magic) + 1;
+  uint64_t seed, nrows, ncols;
+  if (!getVarint(reader, &seed) || !getVarint(reader, &nrows) || !getVarint(reader, &ncols)
+      || seed > INT32_MAX || nrows > INT32_MAX || ncols > INT32_MAX) {
+    journal_closeReader(reader);
+    return NULL;
+  }
+  header->seed = seed;
+  header->nrows = nrows;
+  header->ncols = ncols;
+  return reader;
+}
+
+/**************** journal_next ****************/
+/* see journal.h for description */
+int
+journal_next(journal_reader_t* reader, journal_event_t* event)
+{
+  if (reader == NULL || event == NULL || reader->damaged) {
+    return -1;
+  }
+  if (reader->pos == reader->size) {
+    return 0;
+  }
+
+  uint64_t us, slotKey, length;
+  if (!getVarint(reader, &us) || !getVarint(reader, &slotKey)
+      || us > UINT64_MAX / 1000 || slotKey / 2 > INT32_MAX) {
+    reader->damaged = true;
+    return -1;
+  }
+  bool isKey = slotKey & 1;
+  if (isKey) {
+    length = 5;
+    if (reader->pos == reader->size) {
+      reader->damaged = true;
+      return -1;
+    }
+  } else if (!getVarint(reader, &length) || length > reader->size - reader->pos) {
+    reader->damaged = true;
+    return -1;
+  }
+
+  // the message, with room for its NUL
+  if (length + 1 > reader->textSize) {
+    size_t size = reader->textSize == 0 ? 64 : reader->textSize;
+    while (size < length + 1) {
+      size *= 2;
+    }
+    char* text = realloc(reader->text, size);
+    if (text == NULL) {
+      reader->damaged = true;
+      return -1;
+    }
+    reader->text = text;
+    reader->textSize = size;
+  }
+  if (isKey) {
+    memcpy(reader->text, "KEY ", 4);
+    reader->text[4] = reader->data[reader->pos++];
+  } else {
+    memcpy(reader->text, reader->data + reader->pos, length);
+    reader->pos += length;
+  }
+  reader->text[length] = '\0';
+
+  event->ns = us * 1000;
+  event->slot = slotKey / 2;
+  event->from = slotAddr(event->slot);
+  event->message = reader->text;
+  return 1;
+}
+
+/**************** journal_closeReader ****************/
+/* see journal.h for description */
+void
+journal_closeReader(journal_reader_t* reader)
+{
+  if (reader != NULL) {
+    free(reader->data);
+    free(reader->text);
+    free(reader);
+  }
+}
+
+/**************** findSlot ****************/
+/* the slot of a sender, given the next one if it is new; -1 if out of memory */
+static int
+findSlot(journal_t* journal, const addr_t from)
+{
+  uint32_t ip = from.sin_addr.s_addr;
+  uint16_t port = from.sin_port;
+  uint64_t hash = (((uint64_t) ip << 16) | port) * 0x9E3779B97F4A7C15u;
+  int mask = journal->tableSize - 1;
+  for (int i = (hash >> 32) & mask; ; i = (i + 1) & mask) {
+    slotEntry_t* entry = &journal->table[i];
+    if (entry->used && entry->ip == ip && entry->port == port) {
+      return entry->slot;
+    }
+    if (!entry->used) {
+      if (2 * (journal->numSlots + 1) <= journal->tableSize) {
+        *entry = (slotEntry_t){ true, ip, port, journal->numSlots };
+        return journal->numSlots++;
+      }
+      break;
+    }
+  }
+
+  // the table is half full: double it, and look again
+  slotEntry_t* old = journal->table;
+  int oldSize = journal->tableSize;
+  slotEntry_t* table = calloc(2 * oldSize, sizeof(slotEntry_t));
+  if (table == NULL) {
+    return -1;
+  }
+  journal->table = table;
+  journal->tableSize = 2 * oldSize;
+  mask = journal->tableSize - 1;
+  for (int j = 0; j < oldSize; j++) {
+    if (old[j].used) {
+      uint64_t h = (((uint64_t) old[j].ip << 16) | old[j].port) * 0x9E3779B97F4A7C15u;
+      int i = (h >> 32) & mask;
+      while (table[i].used) {
+        i = (i + 1) & mask;
+      }
+      table[i] = old[j];
+    }
+  }
+  free(old);
+  return findSlot(journal, from);
+}
+
+/**************** slotAddr ****************/
+/* an address standing for a slot: 127.0.0.1 and up, ports 1 to 65535 */
+static addr_t
+slotAddr(const int slot)
+{
+  addr_t addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(0x7f000001u + slot / 65535);
+  addr.sin_port = htons(1 + slot % 65535);
+  return addr;
+}
+
+/**************** putVarint ****************/
+/* write value as an unsigned LEB128 varint; return the bytes written */
+static size_t
+putVarint(char* buf, uint64_t value)
+{
+  size_t n = 0;
+  while (value >= 0x80) {
+    buf[n++] = (char) (value & 0x7f) | 0x80;
+    value >>= 7;
+  }
+  buf[n++] = (char) value;
+  return n;
+}
+
+/**************** getVarint ****************/
+/* read a varint at the reader's position; false if cut short or too long */
+static bool
+getVarint(journal_reader_t* reader, uint64_t* value)
+{
+  *value = 0;
+  for (int shift = 0; shift < 64 && reader->pos < reader->size; shift += 7) {
+    unsigned char byte = reader->data[reader->pos++];
+    *value |= (uint64_t) (byte & 0x7f) << shift;
+    if ((byte & 0x80) == 0) {
+      return shift < 63 || byte <= 1;
+    }
+  }
+  return false;
+}
+
+/**************** writeAll ****************/
+/* write all size bytes, or mark the journal failed and return false */
+static bool
+writeAll(journal_t* journal, const char* buf, size_t size)
+{
+  while (size > 0) {
+    ssize_t n = write(journal->fd, buf, size);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      journal->failed = true;
+      return false;
+    }
+    buf += n;
+    size -= n;
+  }
+  return true;
+}
+
+
+/* ****************************************************************** */
+/* ************************* UNIT_TEST ****************************** */
+/*
+ * This unit test records a made-up game from three addresses, reads it
+ * back, and checks every event; then the size of the records, writes
+ * after a second, a message too big for the buffer, and journals cut
+ * short or not journals at all. Run it as
+ *   ./journaltest
+ * It writes and removes journaltest.jnl in the current directory.
+ */
+
+#ifdef UNIT_TEST
+
+#include <sys/stat.h>
+#include "unittest.h"
+
+static addr_t testAddr(const uint32_t ip, const uint16_t port);
+static long fileSize(const char* path);
+
+#define TestPath "journaltest.jnl"
+#define TestKeys 5000  // about half a second of them
+
+int
+main(const int argc, char* argv[])
+{
+  addr_t alice = testAddr(0x0a000001, 4000);
+  addr_t bob = testAddr(0x0a000002, 4000);
+  addr_t carol = testAddr(0x0a000001, 4001);   // alice's host, another port
+  check(journal_new(NULL, 1, 2, 3) == NULL, "no path");
+  check(journal_new("no/such/dir/x.jnl", 1, 2, 3) == NULL, "cannot create");
+
+  // a game: two players join, a spectator, many keys, a long key, a stats
+  journal_t* journal = journal_new(TestPath, 42, 21, 79);
+  check(journal != NULL, "journal_new");
+  uint64_t t = 5000000000u;
+  check(journal_record(journal, t, alice, "PLAY Alice\nrle"), "record PLAY");
+  check(journal_record(journal, t + 1500000, bob, "SPECTATE"), "record SPECTATE");
+  check(journal_record(journal, t + 1500999, carol, "PLAY Carol"), "record a third sender");
+  const char* keys = "hjklyubnHJKLYUBNQ";
+  uint64_t when = t + 1500999;
+  for (int i = 0; i < TestKeys; i++) {
+    when += 100000 + (i % 7) * 1000;           // 100 to 106 us apart
+    char key[6] = "KEY x";
+    key[4] = keys[i % 17];
+    journal_record(journal, when, i % 2 ? carol : alice, key);
+  }
+  check(journal_record(journal, when, alice, "KEY hh"), "record a long key");
+  check(journal_record(journal, when - 5000, bob, "STATS"), "record, the clock gone back");
+  check(fileSize(TestPath) == 0, "nothing written yet...");
+  check(journal_record(journal, when + JournalFlushNs, bob, "STATS"), "record a second on");
+  long size = fileSize(TestPath);
+  check(size > 0, "...until a second has gone by");
+  // a key is its delta, slot and byte: 3 bytes here
+  check(size < 20 + 40 + 3 * TestKeys + 40 && size > 3 * TestKeys, "keys take 3 bytes each");
+
+  // a message bigger than the buffer goes straight to the file
+  size_t bigSize = 3 * JournalBufBytes;
+  char* big = malloc(bigSize + 1);
+  for (size_t i = 0; i < bigSize; i++) {
+    big[i] = 'a' + i % 26;
+  }
+  big[bigSize] = '\0';
+  check(journal_record(journal, when + JournalFlushNs, alice, big), "record a huge message");
+  check(fileSize(TestPath) > size + bigSize, "written at once");
+  check(journal_delete(journal), "journal_delete");
+  journal_delete(NULL);
+
+  // read it all back
+  journal_header_t header;
+  journal_reader_t* reader = journal_openReader(TestPath, &header);
+  check(reader != NULL && header.seed == 42 && header.nrows == 21 && header.ncols == 79,
+        "header");
+  journal_event_t event;
+  check(journal_next(reader, &event) == 1 && event.ns == 0 && event.slot == 0
+        && strcmp(event.message, "PLAY Alice\nrle") == 0, "first event at time 0");
+  addr_t aliceAddr = event.from;
+  check(journal_next(reader, &event) == 1 && event.ns == 1500000 && event.slot == 1
+        && strcmp(event.message, "SPECTATE") == 0, "second event, 1.5 ms on");
+  check(event.from.sin_family == AF_INET
+        && (event.from.sin_addr.s_addr != aliceAddr.sin_addr.s_addr
+            || event.from.sin_port != aliceAddr.sin_port), "slots stand for distinct addresses");
+  check(journal_next(reader, &event) == 1 && event.ns == 0 && event.slot == 2
+        && strcmp(event.message, "PLAY Carol") == 0, "microseconds, rounded down");
+  bool same = true;
+  for (int i = 0; i < TestKeys; i++) {
+    char key[6] = "KEY x";
+    key[4] = keys[i % 17];
+    same = same && journal_next(reader, &event) == 1 && strcmp(event.message, key) == 0
+           && event.slot == (i % 2 ? 2 : 0) && event.ns == 100000 + (i % 7) * 1000
+           && (i % 2 == 1 || (event.from.sin_addr.s_addr == aliceAddr.sin_addr.s_addr
+                              && event.from.sin_port == aliceAddr.sin_port));
+  }
+  check(same, "every key, its sender and its time");
+  check(journal_next(reader, &event) == 1 && strcmp(event.message, "KEY hh") == 0, "long key");
+  check(journal_next(reader, &event) == 1 && event.ns == 0 && event.slot == 1
+        && strcmp(event.message, "STATS") == 0, "time never goes back");
+  check(journal_next(reader, &event) == 1 && event.ns == JournalFlushNs
+        && strcmp(event.message, "STATS") == 0, "a second on");
+  check(journal_next(reader, &event) == 1 && strcmp(event.message, big) == 0, "huge message");
+  check(journal_next(reader, &event) == 0 && journal_next(reader, &event) == 0, "the end");
+  journal_closeReader(reader);
+  journal_closeReader(NULL);
+
+  // cut short in the middle of the huge message: the rest still reads
+  check(truncate(TestPath, fileSize(TestPath) - 1) == 0, "truncate");
+  reader = journal_openReader(TestPath, &header);
+  int events = 0, last;
+  while ((last = journal_next(reader, &event)) == 1) {
+    events++;
+  }
+  check(last == -1 && events == 3 + TestKeys + 3 && journal_next(reader, &event) == -1,
+        "a journal cut short reads up to the damage");
+  journal_closeReader(reader);
+
+  // not journals
+  check(journal_openReader("no/such/file", &header) == NULL, "no file");
+  check(truncate(TestPath, 6) == 0 && journal_openReader(TestPath, &header) == NULL,
+        "header cut short");
+  FILE* fp = fopen(TestPath, "w");
+  fputs("NUGX\001abc", fp);
+  fclose(fp);
+  check(journal_openReader(TestPath, &header) == NULL, "wrong magic");
+  remove(TestPath);
+  free(big);
+
+  printf("all journal tests passed\n");
+  return 0;
+}
+
+/* an address of ip and port, both in host order */
+static addr_t
+testAddr(const uint32_t ip, const uint16_t port)
+{
+  addr_t addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(ip);
+  addr.sin_port = htons(port);
+  return addr;
+}
+
+/* the size of a file in bytes */
+static long
+fileSize(const char* path)
+{
+  struct stat st;
+  return stat(path, &st) == 0 ? st.st_size : -1;
+}
+
+#endif // UNIT_TEST
@@ -0,0 +1,126 @@
+/*
+ * journal - a compact binary record of the messages a game receives
+ *
+ * A game is deterministic given its seed and the messages it receives,
+ * in order; a journal records those messages so the game can be played
+ * again offline, as a benchmark or to profile real traffic. Each record
+ * is the time since the previous one, in microseconds, the slot of the
+ * sender (0 for the first address heard from, 1 for the next, and so on)
+ * and the message. A single-character KEY, nearly every record, takes
+ * the key byte alone, so most records are three or four bytes.
+ *
+ * Records go into a buffer written out when it fills, a second after it
+ * was last written, and when the journal is deleted; a server killed
+ * outright loses at most the last second or so. A journal is not
+ * thread-safe: give each game its own.
+ *
+ * Typical code, recording, looks like this:
+ *   journal_t* journal = journal_new(path, seed, nrows, ncols);
+ *   journal_record(journal, stats_now(), from, message);  // per message
+ *   journal_delete(journal);
+ * and replaying:
+ *   journal_reader_t* reader = journal_openReader(path, &header);
+ *   journal_event_t event;
+ *   while (journal_next(reader, &event) > 0) {
+ *     handleMessage(game, event.from, event.message);
+ *   }
+ *   journal_closeReader(reader);
+ *
+ * File format, integers as unsigned LEB128 varints:
+ *   "NUGJ", version byte 1, seed, nrows, ncols
+ *   then per record: microseconds, slot*2 + isKey, and either the key
+ *   byte (isKey) or the message length and its bytes
+ *
+ * hemlock, May 2021
+ */
+
+#ifndef _JOURNAL_H_
+#define _JOURNAL_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "message.h"
+
+/****************** types *********************/
+typedef struct journal journal_t;               // opaque to users of the module
+typedef struct journal_reader journal_reader_t; // opaque to users of the module
+
+/* what a journal says of the game it was recorded from */
+typedef struct journal_header {
+  int seed;                    // the game's seed
+  int nrows, ncols;            // the size of its map, as a check
+} journal_header_t;
+
+/* one message read back from a journal */
+typedef struct journal_event {
+  uint64_t ns;                 // since the previous event; a multiple of 1000
+  int slot;                    // sender, numbered in the order first heard from
+  addr_t from;                 // an address standing for the slot
+  const char* message;         // valid until the next journal_next
+} journal_event_t;
+
+/****************** global functions *********************/
+
+/******************************************/
+/* journal_new: create (or truncate) a journal file and write its header.
+ * Caller provides: a pathname, the game's seed and the size of its map.
+ * Function returns:
+ *   the journal, to be closed with journal_delete;
+ *   NULL if the file cannot be created or out of memory.
+ */
+journal_t* journal_new(const char* path, const int seed, const int nrows, const int ncols);
+
+/******************************************/
+/* journal_record: append one received message.
+ * Caller provides:
+ *   a journal; the time now, in nanoseconds on a clock that only goes
+ *   forward (stats_now), the same clock for every record; the sender;
+ *   and the message.
+ * We write nothing until the buffer fills, or a second has gone by
+ *   since the last write; the first record is at time 0.
+ * Function returns false if a write failed, when the journal is left
+ *   as it was up to the last good write and records nothing more.
+ */
+bool journal_record(journal_t* journal, const uint64_t now, const addr_t from,
+                    const char* message);
+
+/******************************************/
+/* journal_flush: write out whatever is buffered.
+ * Function returns false if the write failed.
+ */
+bool journal_flush(journal_t* journal);
+
+/******************************************/
+/* journal_delete: flush and close a journal, and free it.
+ * Caller provides: a journal, or NULL.
+ * Function returns false if the last write failed.
+ */
+bool journal_delete(journal_t* journal);
+
+/******************************************/
+/* journal_openReader: read a whole journal into memory, to replay it.
+ * Caller provides: a pathname, and a header to fill in.
+ * Function returns:
+ *   a reader, positioned at the first record, to be closed with
+ *   journal_closeReader;
+ *   NULL if the file cannot be read, or is not a journal.
+ */
+journal_reader_t* journal_openReader(const char* path, journal_header_t* header);
+
+/******************************************/
+/* journal_next: read the next record.
+ * Caller provides: a reader, and an event to fill in.
+ * Function returns:
+ *   1 with the event filled in;
+ *   0 at the end of the journal;
+ *   -1 at a record cut short or damaged, where reading stops.
+ */
+int journal_next(journal_reader_t* reader, journal_event_t* event);
+
+/******************************************/
+/* journal_closeReader: free a reader.
+ * Caller provides: a reader, or NULL.
+ */
+void journal_closeReader(journal_reader_t* reader);
+
+#endif // _JOURNAL_H_
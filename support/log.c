@@ -1,15 +1,58 @@
-/* 
+/*
  * log module - a simple way to log messages to a file
- * 
+ *
+ * Messages are written at once, unless log_startAsync has been called;
+ * then they go through a ring of fixed-size slots, which a background
+ * thread writes out.
+ *
  * David Kotz, May 2019
  */
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <pthread.h>
 #include <sys/errno.h>
 #include "log.h"
 
+/**************** constants ****************/
+#define LogSlots 4096         // messages the ring holds
+#define LogSlotBytes 256      // longest message in the ring, newline included
+
+/**************** local types ****************/
+/* one message waiting in the ring, newline included */
+typedef struct logSlot {
+  FILE* fp;
+  int length;
+  char text[LogSlotBytes];
+} logSlot_t;
+
+/**************** global variables ****************/
+log_level_t flog_threshold = log_DEBUG;
+
+/* the ring of messages, written out by the writer thread;
+ * head and tail only grow, and index the ring modulo LogSlots.
+ */
+static struct {
+  pthread_mutex_t lock;
+  pthread_cond_t ready;          // the ring has messages, or the writer should stop
+  pthread_t writer;
+  logSlot_t* slots;
+  unsigned long head;            // next slot to fill
+  unsigned long tail;            // next slot to write
+  unsigned long dropped;         // messages that found the ring full
+  FILE* droppedFP;               // where the last of them was going
+  atomic_bool running;           // changed only under the lock
+  bool stop;                     // the writer should finish
+  bool atExit;                   // log_stopAsync is registered with atexit
+} ring = { .lock = PTHREAD_MUTEX_INITIALIZER, .ready = PTHREAD_COND_INITIALIZER };
+
+/**************** local functions ****************/
+static void logLine(FILE* fp, const char* format, ...);
+static void* writeRing(void* arg);
+
 /**************** flog_init ****************/
 /* Initialize the logging module.
  */
@@ -18,8 +61,16 @@ void flog_init(FILE* fp)
   flog_v(fp, "START OF LOG");
 }
 
+/**************** log_setLevel ****************/
+/* see log.h for description */
+void
+log_setLevel(const log_level_t level)
+{
+  flog_threshold = level;
+}
+
 /**************** flog_s ****************/
-/* 
+/*
  * log a string to the logfile, if logging is enabled.
  * The string `format` can reference '%s' to incorporate `str`.
  */
@@ -27,14 +78,12 @@ void
 flog_s(FILE* fp, const char* format, const char* str)
 {
   if (fp != NULL && format != NULL && str != NULL) {
-    fprintf(fp, format, str);
-    fputc('\n', fp);
-    fflush(fp);
+    logLine(fp, format, str);
   }
 }
 
 /**************** flog_d ****************/
-/* 
+/*
  * log an integer to the logfile, if logging is enabled.
  * The string `format` can reference '%d' to incorporate `num`.
  */
@@ -42,14 +91,12 @@ void
 flog_d(FILE* fp, const char* format, const int num)
 {
   if (fp != NULL && format != NULL) {
-    fprintf(fp, format, num);
-    fputc('\n', fp);
-    fflush(fp);
+    logLine(fp, format, num);
   }
 }
 
 /**************** flog_c ****************/
-/* 
+/*
  * log a character to the logfile, if logging is enabled.
  * The string `format` can reference '%c' to incorporate `ch`.
  */
@@ -57,28 +104,24 @@ void
 flog_c(FILE* fp, const char* format, const char ch)
 {
   if (fp != NULL && format != NULL) {
-    fprintf(fp, format, ch);
-    fputc('\n', fp);
-    fflush(fp);
+    logLine(fp, format, ch);
   }
 }
 
 /**************** flog_v ****************/
-/* 
+/*
  * log a message to the logfile, if logging is enabled.
  */
 void
 flog_v(FILE* fp, const char* str)
 {
   if (fp != NULL && str != NULL) {
-    fputs(str, fp);
-    fputc('\n', fp);
-    fflush(fp);
+    logLine(fp, "%s", str);
   }
 }
 
 /**************** flog_e ****************/
-/* 
+/*
  * log an error to the logfile, if logging is enabled.
  * Expects the global variable errno (sys/errno.h) to indicate the error,
  * so this is best used immediately after a system call.
@@ -87,17 +130,311 @@ void
 flog_e(FILE* fp, const char* str)
 {
   if (fp != NULL && str != NULL) {
-    fprintf(fp, "%s: %s\n", str, strerror(errno));
-    fflush(fp);
+    logLine(fp, "%s: %s", str, strerror(errno));
+  }
+}
+
+/**************** flog_payload ****************/
+/*
+ * log a line, and no more than LOG_PAYLOAD_BYTES of the payload after it.
+ * The string `format` can reference '%s' to incorporate `str`.
+ */
+void
+flog_payload(FILE* fp, const char* format, const char* str,
+             const char* payload, const size_t length)
+{
+  if (fp != NULL && format != NULL && str != NULL && payload != NULL) {
+    char header[LogSlotBytes];
+    snprintf(header, sizeof(header), format, str);
+    if (length <= LOG_PAYLOAD_BYTES) {
+      logLine(fp, "%s\n%.*s", header, (int) length, payload);
+    } else {
+      logLine(fp, "%s\n%.*s\n... (%zu bytes in all)", header, LOG_PAYLOAD_BYTES, payload, length);
+    }
   }
 }
 
 /**************** flog_done ****************/
-/* 
- * Done with logging.  Notes this, then disables logging. 
+/*
+ * Done with logging.  Notes this, then disables logging.
  */
 void
 flog_done(FILE* fp)
 {
   flog_v(fp, "END OF LOG");
 }
+
+/**************** log_startAsync ****************/
+/* see log.h for description */
+bool
+log_startAsync(void)
+{
+  pthread_mutex_lock(&ring.lock);
+  if (atomic_load(&ring.running)) {
+    pthread_mutex_unlock(&ring.lock);
+    return true;
+  }
+  if (ring.slots == NULL) {
+    ring.slots = malloc(LogSlots * sizeof(logSlot_t));
+  }
+  ring.stop = false;
+  bool started = ring.slots != NULL
+    && pthread_create(&ring.writer, NULL, writeRing, NULL) == 0;
+  atomic_store(&ring.running, started);
+  if (started && !ring.atExit) {
+    ring.atExit = atexit(log_stopAsync) == 0;
+  }
+  pthread_mutex_unlock(&ring.lock);
+  return started;
+}
+
+/**************** log_stopAsync ****************/
+/* see log.h for description */
+void
+log_stopAsync(void)
+{
+  pthread_mutex_lock(&ring.lock);
+  if (!atomic_load(&ring.running)) {
+    pthread_mutex_unlock(&ring.lock);
+    return;
+  }
+  atomic_store(&ring.running, false);  // from now on, messages are written at once
+  ring.stop = true;
+  pthread_cond_signal(&ring.ready);
+  pthread_mutex_unlock(&ring.lock);
+  pthread_join(ring.writer, NULL);
+}
+
+/**************** logLine ****************/
+/*
+ * Format one message and add a newline, then write it to fp and flush,
+ * or put it in the ring if the writer is running.
+ */
+static void
+logLine(FILE* fp, const char* format, ...)
+{
+  va_list args;
+  va_start(args, format);
+
+  if (atomic_load_explicit(&ring.running, memory_order_relaxed)) {
+    char text[LogSlotBytes];
+    int length = vsnprintf(text, sizeof(text) - 1, format, args);
+    va_end(args);
+    if (length < 0) {
+      return;
+    }
+    if (length > sizeof(text) - 2) {
+      length = sizeof(text) - 2;   // cut off to fit the slot
+    }
+    text[length++] = '\n';
+
+    pthread_mutex_lock(&ring.lock);
+    if (atomic_load(&ring.running)) {
+      if (ring.head - ring.tail == LogSlots) {
+        ring.dropped++;
+        ring.droppedFP = fp;
+      } else {
+        logSlot_t* slot = &ring.slots[ring.head % LogSlots];
+        slot->fp = fp;
+        slot->length = length;
+        memcpy(slot->text, text, length);
+        if (ring.head++ == ring.tail) {
+          pthread_cond_signal(&ring.ready);  // the writer may be waiting
+        }
+      }
+      pthread_mutex_unlock(&ring.lock);
+      return;
+    }
+    pthread_mutex_unlock(&ring.lock);
+    fwrite(text, 1, length, fp);   // stopped meanwhile
+    fflush(fp);
+    return;
+  }
+
+  vfprintf(fp, format, args);
+  va_end(args);
+  fputc('\n', fp);
+  fflush(fp);
+}
+
+/**************** writeRing ****************/
+/*
+ * The writer thread: write out the messages in the ring, batch by batch,
+ * flushing a file when the next message goes elsewhere or the batch ends.
+ * The slots of a batch are not refilled until the batch is written.
+ */
+static void*
+writeRing(void* arg)
+{
+  pthread_mutex_lock(&ring.lock);
+  while (true) {
+    while (ring.head == ring.tail && ring.dropped == 0 && !ring.stop) {
+      pthread_cond_wait(&ring.ready, &ring.lock);
+    }
+    if (ring.head == ring.tail && ring.dropped == 0) {
+      break;  // stopping, and nothing is left
+    }
+    unsigned long start = ring.tail;
+    unsigned long end = ring.head;
+    unsigned long dropped = ring.dropped;
+    FILE* droppedFP = ring.droppedFP;
+    ring.dropped = 0;
+    pthread_mutex_unlock(&ring.lock);
+
+    FILE* fp = NULL;
+    for (unsigned long i = start; i != end; i++) {
+      logSlot_t* slot = &ring.slots[i % LogSlots];
+      if (fp != NULL && fp != slot->fp) {
+        fflush(fp);
+      }
+      fp = slot->fp;
+      fwrite(slot->text, 1, slot->length, fp);
+    }
+    if (fp != NULL) {
+      fflush(fp);
+    }
+    if (dropped > 0) {
+      fprintf(droppedFP, "log: %lu messages dropped; the log could not keep up\n", dropped);
+      fflush(droppedFP);
+    }
+
+    pthread_mutex_lock(&ring.lock);
+    ring.tail = end;
+  }
+  pthread_mutex_unlock(&ring.lock);
+  return NULL;
+}
+
+/* ***************************************************************** */
+/* ************************* UNIT_TEST ***************************** */
+/*
+ * Logs to a temporary file and reads it back: levels, payloads cut
+ * short, and several threads logging at once through the ring.
+ */
+#ifdef UNIT_TEST
+
+#include "unittest.h"
+
+#define TestThreads 4
+#define TestMessages 20000
+
+static char* readBack(FILE* fp);
+static void* logMany(void* arg);
+
+int
+main(const int argc, char* argv[])
+{
+  FILE* fp = tmpfile();
+  check(fp != NULL, "tmpfile");
+  log_init(fp);
+
+  // levels
+  log_s("name %s", "Alice");
+  log_setLevel(log_INFO);
+  log_lv(log_DEBUG, "hidden");
+  log_ld(log_INFO, "shown %d", 7);
+  log_setLevel(log_ERROR);
+  log_v("hidden");
+  errno = ENOENT;
+  log_e("open");
+  log_setLevel(log_DEBUG);
+  check(log_enabled(log_DEBUG), "debug enabled");
+  char* text = readBack(fp);
+  check(strcmp(text, "START OF LOG\nname Alice\nshown 7\nopen: No such file or directory\n") == 0,
+        "levels");
+  free(text);
+
+  // payloads
+  char payload[500];
+  memset(payload, 'x', sizeof(payload));
+  log_payload("TO %s", "there", "KEY h", 5);
+  log_payload("TO %s", "there", payload, sizeof(payload));
+  text = readBack(fp);
+  check(strncmp(text, "TO there\nKEY h\nTO there\n", 24) == 0
+        && strspn(text + 24, "x") == LOG_PAYLOAD_BYTES
+        && strcmp(text + 24 + LOG_PAYLOAD_BYTES, "\n... (500 bytes in all)\n") == 0,
+        "payload cut short");
+  free(text);
+
+  // through the ring, from several threads; a message too long is cut off
+  check(log_startAsync(), "start the writer");
+  check(log_startAsync(), "start again");
+  pthread_t threads[TestThreads];
+  for (long t = 0; t < TestThreads; t++) {
+    pthread_create(&threads[t], NULL, logMany, (void*) t);
+  }
+  for (int t = 0; t < TestThreads; t++) {
+    pthread_join(threads[t], NULL);
+  }
+  char longText[2 * LogSlotBytes];
+  memset(longText, 'y', sizeof(longText) - 1);
+  longText[sizeof(longText) - 1] = '\0';
+  log_v(longText);
+  log_stopAsync();
+  log_stopAsync();
+  log_v("after");
+  text = readBack(fp);
+
+  // each thread's messages in order, the ones missing counted as dropped
+  int next[TestThreads] = { 0 };
+  int written = 0;
+  long dropped = 0;
+  bool inOrder = true;
+  char* line = strtok(text, "\n");
+  for (; line != NULL && line[0] != 'y'; line = strtok(NULL, "\n")) {
+    int t, n;
+    long count;
+    if (sscanf(line, "thread %d message %d", &t, &n) == 2 && t >= 0 && t < TestThreads) {
+      inOrder = inOrder && n >= next[t];
+      next[t] = n + 1;
+      written++;
+    } else if (sscanf(line, "log: %ld messages dropped", &count) == 1) {
+      dropped += count;
+    } else {
+      inOrder = false;
+    }
+  }
+  check(inOrder, "messages in order");
+  check(written + dropped == TestThreads * TestMessages, "every message written or counted");
+  check(line != NULL && strlen(line) == LogSlotBytes - 2, "long message cut off");
+  line = strtok(NULL, "\n");
+  check(line != NULL && strcmp(line, "after") == 0 && strtok(NULL, "\n") == NULL,
+        "written at once after stopping");
+  free(text);
+
+  log_done();
+  fclose(fp);
+  printf("all log tests passed (%d of %d written through the ring)\n",
+         written, TestThreads * TestMessages);
+  return 0;
+}
+
+/* log TestMessages numbered messages */
+static void*
+logMany(void* arg)
+{
+  int t = (int)(long) arg;
+  char format[40];
+  snprintf(format, sizeof(format), "thread %d message %%d", t);
+  for (int n = 0; n < TestMessages; n++) {
+    log_d(format, n);
+  }
+  return NULL;
+}
+
+/* everything written to fp since the last call, as a new string */
+static char*
+readBack(FILE* fp)
+{
+  static long start = 0;
+  fflush(fp);
+  long end = ftell(fp);
+  char* text = calloc(end - start + 1, 1);
+  fseek(fp, start, SEEK_SET);
+  check(fread(text, 1, end - start, fp) == end - start, "read back");
+  fseek(fp, end, SEEK_SET);
+  start = end;
+  return text;
+}
+
+#endif // UNIT_TEST
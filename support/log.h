@@ -9,6 +9,18 @@
  * If the user of the module does not call log_init(), or calls log_init(NULL),
  * the log_x functions will be ignored and nothing will be logged.
  * 
+ * Each message has a level: log_e logs an error, the other log_x functions
+ * log information, and the log_lx functions take the level as their first
+ * argument. A message is logged only if its level is no higher than both
+ * the threshold set by log_setLevel (default log_DEBUG, everything) and
+ * LOG_LEVEL, a compile-time ceiling; compile with -DLOG_LEVEL=1 to drop
+ * the debug messages, and the cost of their arguments, altogether.
+ * log_payload logs a message received or sent, cut to LOG_PAYLOAD_BYTES.
+ * 
+ * After log_startAsync(), messages are formatted by the caller into a ring
+ * buffer and written by a background thread, so logging never waits for
+ * the output; see log_startAsync.
+ * 
  * The flog_x functions should not be called by the module user.
  * 
  * See the note below about file-local global variables; if log.h is included
@@ -24,6 +36,23 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdbool.h>
+
+/*********** levels ****************/
+typedef enum log_level {
+  log_ERROR = 0,                // failures; what log_e logs
+  log_INFO = 1,                 // events worth a line; what log_s, log_d, log_c, log_v log
+  log_DEBUG = 2,                // every datagram, and its payload
+} log_level_t;
+
+#ifndef LOG_LEVEL
+#define LOG_LEVEL 2             // compile-time ceiling on the level logged
+#endif
+
+#define LOG_PAYLOAD_BYTES 120   // bytes of a payload that log_payload shows
+
+/* the runtime threshold, shared by every file; set it with log_setLevel */
+extern log_level_t flog_threshold;
 
 /*********** file-local global variable ****************/
 /* Here is an example of a judicious use of a global variable.
@@ -49,8 +78,19 @@ static inline void log_init(FILE* fp) { logFP = fp; flog_init(logFP); }
  * Call log_done() before the program exits.
  */
 
+static inline bool log_enabled(const log_level_t level)
+{ return logFP != NULL && level <= LOG_LEVEL && level <= flog_threshold; }
+/* log_enabled: true if a message of this level would be logged by this file.
+ * Check it before doing any work just to build a log message.
+ */
+
+void log_setLevel(const log_level_t level);
+/* log_setLevel: log only messages of this level or lower, in every file;
+ * call it before starting any thread that logs.
+ */
+
 void flog_s(FILE* fp, const char* format, const char* str);
-static inline void log_s(const char* f, const char* s) { flog_s(logFP, f, s); }
+static inline void log_s(const char* f, const char* s) { if (log_enabled(log_INFO)) flog_s(logFP, f, s); }
 /* log_s: printf a string to the log, using the given format string.
  * Expects exactly one format specifier within the string,
  * corresponding to the one argument.  A newline is added.
@@ -59,30 +99,65 @@ static inline void log_s(const char* f, const char* s) { flog_s(logFP, f, s); }
  */
 
 void flog_d(FILE* fp, const char* format, const int  num);
-static inline void log_d(const char* f, const int n) { flog_d(logFP, f, n); }
+static inline void log_d(const char* f, const int n) { if (log_enabled(log_INFO)) flog_d(logFP, f, n); }
 /* log_c: like the above, but to print an integer. Example:
  *   int age = ...;        log_d("You are %d years old.", age);
  */
 
 void flog_c(FILE* fp, const char* format, const char ch);
-static inline void log_c(const char* f, const char c) { flog_c(logFP, f, c); }
+static inline void log_c(const char* f, const char c) { if (log_enabled(log_INFO)) flog_c(logFP, f, c); }
 /* log_c: like the above, but to print a character. Example:
  *   char player = ...;    log_c("Player %c is winning.", player);
  */
 
 void flog_v(FILE* fp, const char* str);
-static inline void log_v(const char* str) { flog_v(logFP, str); }
+static inline void log_v(const char* str) { if (log_enabled(log_INFO)) flog_v(logFP, str); }
 /* log_v: like the above, but used when no additional argument is needed.
  * Thus v stands for 'void'.
  */
 
+static inline void log_ls(const log_level_t l, const char* f, const char* s)
+{ if (log_enabled(l)) flog_s(logFP, f, s); }
+static inline void log_ld(const log_level_t l, const char* f, const int n)
+{ if (log_enabled(l)) flog_d(logFP, f, n); }
+static inline void log_lv(const log_level_t l, const char* str)
+{ if (log_enabled(l)) flog_v(logFP, str); }
+/* log_ls, log_ld, log_lv: like log_s, log_d and log_v, at the given level.
+ * Example:
+ *   log_lv(log_DEBUG, "message_loop: message ready on socket");
+ */
+
+void flog_payload(FILE* fp, const char* format, const char* str,
+                  const char* payload, const size_t length);
+static inline void log_payload(const char* f, const char* s,
+                               const char* payload, const size_t length)
+{ if (log_enabled(log_DEBUG)) flog_payload(logFP, f, s, payload, length); }
+/* log_payload: at debug level, log a line as log_s does, then the payload
+ * of the given length on the lines after it: its first LOG_PAYLOAD_BYTES
+ * bytes, and if there are more, a last line with its full length. Example:
+ *   log_payload("message_send: TO %s", stringAddr(to), message, length);
+ */
+
 void flog_e(FILE* fp, const char* str);
-static inline void log_e(const char* str) { flog_e(logFP, str); }
+static inline void log_e(const char* str) { if (log_enabled(log_ERROR)) flog_e(logFP, str); }
 /* log_e: print the given string to the log, with a message representing
  * an internal error.  See 'man errno' and 'man perror';
  * This function is best used immediately after a system call.
  */
 
+bool log_startAsync(void);
+void log_stopAsync(void);
+/* log_startAsync: from now on, every log_x call formats its message into
+ * a slot of a ring buffer and returns, and a background thread writes the
+ * messages out in order, flushing once per batch rather than per message.
+ * A message longer than a slot is cut off, and if the ring is ever full,
+ * the messages that find it so are dropped and counted, and the count is
+ * logged, rather than holding up the caller. Returns false if the thread
+ * cannot start, when logging goes on as before.
+ * log_stopAsync: write out whatever is in the ring, and go back to
+ * writing each message as it is logged. Called at exit as well.
+ */
+
 void flog_done(FILE* fp);
 static inline void log_done(void) { flog_done(logFP); logFP = NULL; }
 /* log_done: call this when finished logging, or when you want to pause
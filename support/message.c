@@ -10,9 +10,27 @@
  * 
  * Compile with -DUNIT_TEST for a standalone unit test; see below.
  *
+ * On Linux, datagrams are received and sent in batches with recvmmsg
+ * and sendmmsg; elsewhere one recvfrom or sendto is made per datagram.
+ * Likewise message_loop waits with epoll on Linux, and select elsewhere.
+ *
+ * A message too long for one datagram is sent as a sequence of fragments,
+ * each a binary header and a slice of the message, and reassembled per
+ * sender before it reaches the handler; see handleFragment.
+ *
+ * Besides the socket of message_init, a program may open more sockets
+ * with message_openSocket, each with its own handler; a load generator
+ * uses one per simulated client.
+ *
  * David Kotz - May 2019
  */
 
+#ifdef __linux__
+#define _GNU_SOURCE      // recvmmsg, sendmmsg
+#define MESSAGE_MMSG
+#define MESSAGE_EPOLL
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
@@ -23,7 +41,13 @@
 #include <netdb.h>
 #include <arpa/inet.h>
 #include <sys/select.h>
+#include <stdint.h>
+#include <stdatomic.h>
 #include <math.h>
+#ifdef MESSAGE_EPOLL
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#endif
 #include "message.h"
 #include "log.h"
 
@@ -35,6 +59,60 @@
 static const int MinPort = 1024;
 static const int MaxPort = 65535;
 
+/* Number of datagrams received, or sent, per system call in batched mode.
+ */
+#define RecvBatch 16
+#define SendBatch 64
+
+/* Most extra fds, timers and sockets that may be watched, and events per wait.
+ */
+#define MaxWatches 1024
+#define MaxEvents 64
+
+/* Fragments of a long message: a header, then a slice of the message.
+ * Header: FragMark, then in network order the 32-bit sequence number of
+ * the message, 16-bit fragment index and count, and 32-bit message length.
+ * A whole datagram must fit in a receive buffer, less the NUL we add.
+ */
+#define FragHeader 13
+static const char FragMark = '\001';
+static const int MaxDatagram = message_MaxBytes - 1;
+static const int FragPayload = message_MaxBytes - 1 - FragHeader;
+
+/* Number of senders whose fragments can be reassembled at once.
+ */
+#define ReassemblySlots 16
+
+/**************** file-local types ****************/
+/* An extra fd watched by message_loop: a caller's fd, one of our
+ * timerfds, or a socket of message_openSocket, told apart by which
+ * handler is set.
+ */
+typedef struct watch {
+  int fd;
+  bool (*handleReady)(void* arg, int fd);  // for message_watch
+  bool (*handleTimer)(void* arg);          // for message_addTimer
+  bool (*handleMessage)(void* arg,         // for message_openSocket
+                        const addr_t from, const char* buf);
+  void* arg;
+} watch_t;
+
+/* A long message being reassembled from one sender's fragments, which
+ * must arrive in order: on any gap the partial message is dropped.
+ */
+typedef struct reassembly {
+  int socket;             // socket the fragments arrive on
+  addr_t from;            // sender; unused slots have no address
+  bool partial;           // whether a message is under way
+  uint32_t seq;           // its sequence number
+  int count;              // fragments in the message
+  int next;               // index of the next fragment expected
+  size_t length;          // length of the message
+  char* buf;              // the message so far; capacity+1 bytes
+  size_t capacity;
+  unsigned long used;     // when the slot was last used, for eviction
+} reassembly_t;
+
 /**************** file-local global variables ****************/
 /* This is an example of a judicious use of a global variable.
  * This module provides init() and done() functions that allow it
@@ -43,16 +121,66 @@ static const int MaxPort = 65535;
  * socket number (a file descriptor) here inside the module, unseen by
  * any code outside this module, but convenient for use internally.
  * One disadvantage to this approach is that all users of this module
- * must work with the same socket, and thus the same port number,
- * but a more flexible approach would require a much more complex interface.
+ * must work with the same socket, and thus the same port number;
+ * message_openSocket gives a program that needs more of them, such as
+ * a load generator, extra sockets addressed by their fd.
  */
 static int ourSocket = 0;     // socket on which to receive messages
+#ifdef MESSAGE_MMSG
+static char* recvBufs = NULL; // RecvBatch buffers of message_MaxBytes; allocated by message_loop
+#endif
+#ifdef MESSAGE_EPOLL
+static int epollFd = -1;      // epoll set, while message_loop runs
+#endif
+static watch_t watches[MaxWatches]; // extra fds and timers watched by message_loop
+static int numWatches = 0;
+static atomic_uint nextSeq = 0;     // sequence number of the next fragmented message
+static reassembly_t slots[ReassemblySlots]; // used only by message_loop
+static unsigned long slotClock = 0;
+static void (*flushHandler)(void* arg) = NULL; // called before each wait
+static void* flushArg = NULL;
 
 /**************** file-local functions ****************/
 /* stringAddr: format a string representation of an address.
  * Returns pointer to static storage and thus should not be retained.
  */
 static const char* stringAddr(const addr_t addr);
+static bool handleDatagram(void* arg, struct sockaddr_in sender,
+                           char* buf, const size_t length,
+                           bool (*handleMessage)(void* arg,
+                                                 const addr_t from, const char* buf));
+static void logSent(const addr_t to, const char* message, const size_t length);
+static void sendMessage(const int socket, const addr_t to, const char* message);
+static void sendFragments(const int socket, const addr_t to,
+                          const char* message, const size_t length);
+static bool handleFragment(const int socket, void* arg, struct sockaddr_in sender,
+                           const char* buf, const size_t length,
+                           bool (*handleMessage)(void* arg,
+                                                 const addr_t from, const char* buf));
+static reassembly_t* findSlot(const int socket, const addr_t from);
+static bool readSocket(const int socket, void* arg,
+                       bool (*handleMessage)(void* arg,
+                                             const addr_t from, const char* buf));
+static bool addWatch(const int fd, bool (*handleReady)(void* arg, int fd),
+                     bool (*handleTimer)(void* arg),
+                     bool (*handleMessage)(void* arg,
+                                           const addr_t from, const char* buf),
+                     void* arg);
+static bool runWatch(const int fd);
+#ifdef MESSAGE_EPOLL
+static bool loopEpoll(void* arg, const float timeout,
+                      bool (*handleTimeout)(void* arg),
+                      bool (*handleInput)  (void* arg),
+                      bool (*handleMessage)(void* arg,
+                                            const addr_t from, const char* buf));
+static bool epollAdd(const int fd, const uint32_t events);
+#else
+static bool loopSelect(void* arg, const float timeout,
+                       bool (*handleTimeout)(void* arg),
+                       bool (*handleInput)  (void* arg),
+                       bool (*handleMessage)(void* arg,
+                                             const addr_t from, const char* buf));
+#endif
 
 
 /***********************************************************************/
@@ -205,7 +333,7 @@ stringAddr(const addr_t addr)
 {
   // Maximum string length to hold an IP address and port, plus null.
   // e.g., 255.255.255.255:65507
-  static char addrString[22]; // constant appears in snprintf below
+  static _Thread_local char addrString[22]; // constant appears in snprintf below; one per thread
 
   snprintf(addrString, 22, "%s:%05d",
 	   inet_ntoa(addr.sin_addr), ntohs(addr.sin_port));
@@ -213,36 +341,6 @@ stringAddr(const addr_t addr)
   return addrString;
 }
 
-/**************** numLines ****************/
-/*
- * Return number of lines needed to print the string:
- * 0 if string is NULL or empty;
- * Otherwise return number of newline characters,
- *  plus 1 if string does not end with newline.
- */
-static const int
-numLines(const char* string)
-{
-  if (string == NULL || *string == '\0') {
-    // string is null or empty
-    return 0;
-  } else {
-    // string is not empty; count newlines
-    int n = 0;
-    const char* p;
-    for (p = string; *p != '\0'; p++) {
-      if (*p == '\n') {
-	n++;
-      }
-    }
-    // if the string does not end with newline, count the partial line
-    if (*(p-1) != '\n') {
-      n++;
-    }
-    return n;
-  }
-}
-
 /**************** message_send ****************/
 /* 
  * Send a string message to the correspondent address.
@@ -259,14 +357,408 @@ message_send(const addr_t to, const char* message)
     log_v("message_send: called with null message");
     return; // error in usage of this function.
   }
-  if (sendto(ourSocket, message, strlen(message), 0,
+  sendMessage(ourSocket, to, message);
+}
+
+/**************** message_sendOn ****************/
+/* 
+ * Send a string message to the correspondent address,
+ * from a socket of message_openSocket.
+ * See message.h for detailed description.
+ */
+void
+message_sendOn(const int socket, const addr_t to, const char* message)
+{
+  if (socket <= 0 || message == NULL) {
+    log_v("message_sendOn: called with bad socket or null message");
+    return; // error in usage of this function.
+  }
+  sendMessage(socket, to, message);
+}
+
+/**************** sendMessage ****************/
+/*
+ * Send one message from the given socket, in fragments if need be.
+ */
+static void
+sendMessage(const int socket, const addr_t to, const char* message)
+{
+  size_t length = strlen(message);
+  if (length > MaxDatagram) {
+    sendFragments(socket, to, message, length);
+    return;
+  }
+  if (sendto(socket, message, length, 0,
              (struct sockaddr *) &to, sizeof(to)) < 0) {
     log_e("message_send: error sending to datagram socket");
   } else {
-    log_s("message_send: TO %s", stringAddr(to));
-    log_d("message_send: %d lines:", numLines(message));
-    log_s("%s", message);
+    logSent(to, message, length);
+  }
+}
+
+/**************** message_send_batch ****************/
+/* 
+ * Send messages[i] to to[i] for each i < n, in order,
+ * in as few system calls as the platform allows.
+ * See message.h for detailed description.
+ */
+void
+message_send_batch(const addr_t to[], const char* messages[], const int n)
+{
+  if (ourSocket == 0) {
+    log_v("message_send_batch: called before message_init");
+    return; // error in usage of this function.
+  }
+  if (to == NULL || messages == NULL) {
+    log_v("message_send_batch: called with null array");
+    return; // error in usage of this function.
+  }
+
+#ifdef MESSAGE_MMSG
+  struct mmsghdr msgs[SendBatch];
+  struct iovec iovs[SendBatch];
+  int i = 0;
+  while (i < n) {
+    // gather up to SendBatch messages, skipping null ones,
+    // and stopping at one that must be sent in fragments
+    int count = 0;
+    int first = i;
+    size_t longLength = 0;
+    for (; i < n && count < SendBatch; i++) {
+      if (messages[i] == NULL) {
+        log_v("message_send_batch: skipping null message");
+        continue;
+      }
+      size_t length = strlen(messages[i]);
+      if (length > MaxDatagram) {
+        longLength = length;
+        break;
+      }
+      iovs[count].iov_base = (void*) messages[i];
+      iovs[count].iov_len = length;
+      memset(&msgs[count].msg_hdr, 0, sizeof(msgs[count].msg_hdr));
+      msgs[count].msg_hdr.msg_name = (void*) &to[i];
+      msgs[count].msg_hdr.msg_namelen = sizeof(to[i]);
+      msgs[count].msg_hdr.msg_iov = &iovs[count];
+      msgs[count].msg_hdr.msg_iovlen = 1;
+      count++;
+    }
+
+    // sendmmsg may stop short; resume after the ones it sent,
+    // and skip over a datagram it could not send at all
+    int done = 0;
+    while (done < count) {
+      int sent = sendmmsg(ourSocket, msgs + done, count - done, 0);
+      if (sent < 0) {
+        if (errno != EINTR) {
+          log_e("message_send_batch: error sending to datagram socket");
+          done++;
+        }
+      } else {
+        done += sent;
+      }
+    }
+
+    for (int j = first, k = 0; j < i; j++) {
+      if (messages[j] != NULL) {
+        logSent(to[j], messages[j], iovs[k++].iov_len);
+      }
+    }
+
+    // the long message, now that the ones before it are out
+    if (longLength > 0) {
+      sendFragments(ourSocket, to[i], messages[i], longLength);
+      i++;
+    }
+  }
+#else
+  for (int i = 0; i < n; i++) {
+    message_send(to[i], messages[i]);
+  }
+#endif
+}
+
+/**************** logSent ****************/
+/*
+ * Log a message that has just been sent, at debug level, cut short.
+ */
+static void
+logSent(const addr_t to, const char* message, const size_t length)
+{
+  if (log_enabled(log_DEBUG)) {
+    log_payload("message_send: TO %s", stringAddr(to), message, length);
+  }
+}
+
+/**************** sendFragments ****************/
+/*
+ * Send a message too long for one datagram as a sequence of fragments.
+ * Each fragment is sent from the message itself, after its own header.
+ */
+static void
+sendFragments(const int socket, const addr_t to,
+              const char* message, const size_t length)
+{
+  int count = (length + FragPayload - 1) / FragPayload;
+  if (length > message_MaxFrameBytes) {
+    log_d("message_send: message of %d bytes is too long; not sent", (int) length);
+    return;
+  }
+  uint32_t seq = htonl(atomic_fetch_add(&nextSeq, 1));
+  uint16_t count16 = htons(count);
+  uint32_t length32 = htonl(length);
+
+  for (int first = 0; first < count; first += SendBatch) {
+    int batch = count - first < SendBatch ? count - first : SendBatch;
+    char headers[SendBatch][FragHeader];
+    struct iovec iovs[SendBatch][2];
+    struct msghdr hdrs[SendBatch];
+    for (int j = 0; j < batch; j++) {
+      int index = first + j;
+      uint16_t index16 = htons(index);
+      headers[j][0] = FragMark;
+      memcpy(headers[j] + 1, &seq, 4);
+      memcpy(headers[j] + 5, &index16, 2);
+      memcpy(headers[j] + 7, &count16, 2);
+      memcpy(headers[j] + 9, &length32, 4);
+      size_t offset = (size_t) index * FragPayload;
+      iovs[j][0].iov_base = headers[j];
+      iovs[j][0].iov_len = FragHeader;
+      iovs[j][1].iov_base = (void*) (message + offset);
+      iovs[j][1].iov_len = length - offset < FragPayload ? length - offset : FragPayload;
+      memset(&hdrs[j], 0, sizeof(hdrs[j]));
+      hdrs[j].msg_name = (void*) &to;
+      hdrs[j].msg_namelen = sizeof(to);
+      hdrs[j].msg_iov = iovs[j];
+      hdrs[j].msg_iovlen = 2;
+    }
+#ifdef MESSAGE_MMSG
+    struct mmsghdr msgs[SendBatch];
+    for (int j = 0; j < batch; j++) {
+      msgs[j].msg_hdr = hdrs[j];
+    }
+    int done = 0;
+    while (done < batch) {
+      int sent = sendmmsg(socket, msgs + done, batch - done, 0);
+      if (sent < 0) {
+        if (errno != EINTR) {
+          log_e("message_send: error sending to datagram socket");
+          return; // the receiver will drop what it has of this message
+        }
+      } else {
+        done += sent;
+      }
+    }
+#else
+    for (int j = 0; j < batch; j++) {
+      if (sendmsg(socket, &hdrs[j], 0) < 0) {
+        log_e("message_send: error sending to datagram socket");
+        return; // the receiver will drop what it has of this message
+      }
+    }
+#endif
+  }
+  log_ld(log_DEBUG, "message_send: in %d fragments", count);
+  logSent(to, message, length);
+}
+
+/**************** message_watch ****************/
+/* 
+ * Register an extra file descriptor with message_loop.
+ * See message.h for detailed description.
+ */
+bool
+message_watch(const int fd, bool (*handleReady)(void* arg, int fd), void* arg)
+{
+  if (fd < 0 || handleReady == NULL) {
+    log_v("message_watch: called with bad fd or null handler");
+    return false;
+  }
+  return addWatch(fd, handleReady, NULL, NULL, arg);
+}
+
+/**************** message_unwatch ****************/
+/* 
+ * Stop watching a file descriptor registered by message_watch.
+ * See message.h for detailed description.
+ */
+void
+message_unwatch(const int fd)
+{
+  for (int i = 0; i < numWatches; i++) {
+    if (watches[i].fd == fd) {
+#ifdef MESSAGE_EPOLL
+      if (epollFd >= 0) {
+        epoll_ctl(epollFd, EPOLL_CTL_DEL, fd, NULL);
+      }
+#endif
+      if (watches[i].handleTimer != NULL) {
+        close(fd); // our own timerfd
+      }
+      watches[i] = watches[--numWatches];
+      return;
+    }
+  }
+  log_d("message_unwatch: fd %d is not watched", fd);
+}
+
+/**************** message_addTimer ****************/
+/* 
+ * Call handleTimer every 'interval' seconds, using a timerfd.
+ * See message.h for detailed description.
+ */
+int
+message_addTimer(const float interval, bool (*handleTimer)(void* arg), void* arg)
+{
+  if (interval <= 0.0 || handleTimer == NULL) {
+    log_v("message_addTimer: called with bad interval or null handler");
+    return -1;
+  }
+#ifdef MESSAGE_EPOLL
+  int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+  if (fd < 0) {
+    log_e("message_addTimer: timerfd_create");
+    return -1;
+  }
+  struct itimerspec spec;
+  spec.it_interval.tv_sec = (int)interval;
+  spec.it_interval.tv_nsec = (interval - (int)interval) * 1000000000L;
+  spec.it_value = spec.it_interval;
+  if (timerfd_settime(fd, 0, &spec, NULL) < 0 || !addWatch(fd, NULL, handleTimer, NULL, arg)) {
+    log_e("message_addTimer: timerfd_settime");
+    close(fd);
+    return -1;
+  }
+  return fd;
+#else
+  log_v("message_addTimer: timers need the epoll backend");
+  return -1;
+#endif
+}
+
+/**************** message_openSocket ****************/
+/* 
+ * Open another socket, on a port of its own, watched by message_loop.
+ * See message.h for detailed description.
+ */
+int
+message_openSocket(bool (*handleMessage)(void* arg,
+                                         const addr_t from, const char* message),
+                   void* arg)
+{
+  if (handleMessage == NULL) {
+    log_v("message_openSocket: called with null handler");
+    return -1;
+  }
+  int fd = socket(AF_INET, SOCK_DGRAM, 0);
+  if (fd < 0) {
+    log_e("message_openSocket: error opening datagram socket");
+    return -1;
+  }
+  struct sockaddr_in self;  // any address, any port
+  memset(&self, 0, sizeof(self));
+  self.sin_family = AF_INET;
+  self.sin_addr.s_addr = INADDR_ANY;
+  self.sin_port = 0;
+  if (bind(fd, (struct sockaddr *) &self, sizeof(self))
+      || !addWatch(fd, NULL, NULL, handleMessage, arg)) {
+    log_e("message_openSocket: binding socket name");
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+/**************** message_closeSocket ****************/
+/* 
+ * Stop watching and close a socket of message_openSocket.
+ * See message.h for detailed description.
+ */
+void
+message_closeSocket(const int socket)
+{
+  message_unwatch(socket);
+  for (int i = 0; i < ReassemblySlots; i++) {
+    if (slots[i].socket == socket) {
+      slots[i].from = message_noAddr(); // a later socket may reuse the fd
+      slots[i].partial = false;
+    }
+  }
+  close(socket);
+}
+
+/**************** message_setFlush ****************/
+/* see message.h for description */
+void
+message_setFlush(void (*handleFlush)(void* arg), void* arg)
+{
+  flushHandler = handleFlush;
+  flushArg = arg;
+}
+
+/**************** addWatch ****************/
+/*
+ * Add an entry to the watch table, and to the running epoll set if any.
+ * Exactly one of handleReady, handleTimer and handleMessage is non-NULL.
+ */
+static bool
+addWatch(const int fd, bool (*handleReady)(void* arg, int fd),
+         bool (*handleTimer)(void* arg),
+         bool (*handleMessage)(void* arg,
+                               const addr_t from, const char* buf),
+         void* arg)
+{
+  if (numWatches == MaxWatches) {
+    log_v("message_watch: too many watched fds");
+    return false;
   }
+#ifndef MESSAGE_EPOLL
+  if (fd >= FD_SETSIZE) {
+    log_v("message_watch: fd too large for select");
+    return false;
+  }
+#endif
+  watch_t* watch = &watches[numWatches++];
+  watch->fd = fd;
+  watch->handleReady = handleReady;
+  watch->handleTimer = handleTimer;
+  watch->handleMessage = handleMessage;
+  watch->arg = arg;
+#ifdef MESSAGE_EPOLL
+  if (epollFd >= 0 && !epollAdd(fd, EPOLLIN | EPOLLET)) {
+    numWatches--;
+    return false;
+  }
+#endif
+  return true;
+}
+
+/**************** runWatch ****************/
+/*
+ * A watched fd is ready: call its handler, first reading the expiration
+ * count of a timer, or the datagrams waiting on a socket.
+ * Returns true if the handler says to exit the loop.
+ */
+static bool
+runWatch(const int fd)
+{
+  for (int i = 0; i < numWatches; i++) {
+    if (watches[i].fd == fd) {
+      watch_t watch = watches[i]; // the handler may unwatch itself
+      if (watch.handleTimer != NULL) {
+        uint64_t expirations;
+        if (read(fd, &expirations, sizeof(expirations)) != sizeof(expirations)) {
+          return false; // spurious wakeup
+        }
+        return (*watch.handleTimer)(watch.arg);
+      }
+      if (watch.handleMessage != NULL) {
+        return readSocket(fd, watch.arg, watch.handleMessage);
+      }
+      return (*watch.handleReady)(watch.arg, fd);
+    }
+  }
+  return false;
 }
 
 /**************** message_loop ****************/
@@ -290,7 +782,8 @@ message_loop(void* arg, const float timeout,
   }
 
   // check parameters
-  if (handleTimeout == NULL && handleInput == NULL && handleMessage == NULL) {
+  if (handleTimeout == NULL && handleInput == NULL && handleMessage == NULL
+      && numWatches == 0) {
     log_v("message_loop called with all handlers null");
     return false; // error in usage of this function.
   }
@@ -303,13 +796,135 @@ message_loop(void* arg, const float timeout,
     return false; // error in usage of this function.
   }
 
+#ifdef MESSAGE_EPOLL
+  return loopEpoll(arg, timeout, handleTimeout, handleInput, handleMessage);
+#else
+  return loopSelect(arg, timeout, handleTimeout, handleInput, handleMessage);
+#endif
+}
+
+#ifdef MESSAGE_EPOLL
+/**************** loopEpoll ****************/
+/*
+ * The epoll backend of message_loop. The socket and watched fds are
+ * edge-triggered, so each is drained when it becomes ready; stdin stays
+ * level-triggered because handleInput reads only once per call.
+ * epoll refuses a regular file or /dev/null (EPERM); select finds those
+ * always ready, so we do too, calling handleInput on every pass.
+ */
+static bool
+loopEpoll(void* arg, const float timeout,
+          bool (*handleTimeout)(void* arg),
+          bool (*handleInput)  (void* arg),
+          bool (*handleMessage)(void* arg,
+                                const addr_t from, const char* buf))
+{
+  epollFd = epoll_create1(0);
+  if (epollFd < 0) {
+    log_e("message_loop: epoll_create1");
+    return false; // error
+  }
+  bool ok = true;
+  bool stdinFile = false;       // stdin is a file, always ready
+  if (handleInput != NULL) {
+    struct epoll_event event = { .events = EPOLLIN, .data.fd = 0 };
+    if (epoll_ctl(epollFd, EPOLL_CTL_ADD, 0, &event) < 0) {
+      stdinFile = errno == EPERM;
+      if (!stdinFile) {
+        log_e("message_loop: epoll_ctl");
+        ok = false;
+      }
+    }
+  }
+  ok = ok && (handleMessage == NULL || epollAdd(ourSocket, EPOLLIN | EPOLLET));
+  for (int i = 0; ok && i < numWatches; i++) {
+    ok = epollAdd(watches[i].fd, EPOLLIN | EPOLLET);
+  }
+
+  int timeoutms = timeout > 0.0 ? (int)(timeout * 1000) : -1;
+  while (ok) {
+    if (flushHandler != NULL) {
+      (*flushHandler)(flushArg);
+    }
+    struct epoll_event events[MaxEvents];
+    int nevents = epoll_wait(epollFd, events, MaxEvents, stdinFile ? 0 : timeoutms);
+
+    if (nevents < 0) {
+      if (errno == EINTR) {
+        // interrupted by a signal - most likely SIGWINCH; just wait again.
+        log_e("message_loop: epoll_wait() EINTR: interrupted by signal");
+      } else {
+        log_e("message_loop: epoll_wait()");
+        ok = false; // error
+      }
+    } else if (nevents == 0 && !stdinFile) {
+      // timeout occurred
+      log_lv(log_DEBUG, "message_loop: epoll_wait() timed out");
+      if (handleTimeout != NULL && (*handleTimeout)(arg)) {
+        break; // handler says to exit loop 
+      }
+    } else {
+      bool quit = stdinFile && (*handleInput)(arg);
+      for (int i = 0; i < nevents && !quit; i++) {
+        int fd = events[i].data.fd;
+        if (fd == 0) {
+          log_lv(log_DEBUG, "message_loop: input ready on stdin");
+          quit = (*handleInput)(arg);
+        } else if (fd == ourSocket) {
+          log_lv(log_DEBUG, "message_loop: message ready on socket");
+          quit = readSocket(ourSocket, arg, handleMessage);
+        } else {
+          quit = runWatch(fd);
+        }
+      }
+      if (quit) {
+        break; // handler says to exit loop 
+      }
+    }
+  }
+
+  close(epollFd);
+  epollFd = -1;
+  return ok;
+}
+
+/**************** epollAdd ****************/
+/*
+ * Add fd to the running epoll set, for the given events.
+ */
+static bool
+epollAdd(const int fd, const uint32_t events)
+{
+  struct epoll_event event;
+  memset(&event, 0, sizeof(event));
+  event.events = events;
+  event.data.fd = fd;
+  if (epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event) < 0) {
+    log_e("message_loop: epoll_ctl");
+    return false;
+  }
+  return true;
+}
+
+#else
+/**************** loopSelect ****************/
+/*
+ * The portable select backend of message_loop.
+ */
+static bool
+loopSelect(void* arg, const float timeout,
+           bool (*handleTimeout)(void* arg),
+           bool (*handleInput)  (void* arg),
+           bool (*handleMessage)(void* arg,
+                                 const addr_t from, const char* buf))
+{
   // set up for timeouts, if desired
   struct timeval* timerp = NULL; // stays null if no timeout desired
   struct timeval  timer;          // timerp = &timer if timeout desired
   struct timeval  timeoutval;     // timeval equivalent of parameter 'timeout'
   if (timeout > 0.0) {
     timeoutval.tv_sec  = (int)timeout;
-    timeoutval.tv_usec = timeout - (int)timeout;
+    timeoutval.tv_usec = (timeout - (int)timeout) * 1000000;
   }
 
   // loop until error or some handler indicates time to quit looping
@@ -317,7 +932,7 @@ message_loop(void* arg, const float timeout,
     // for use with select()
     fd_set rfds;        // set of file descriptors we want to read
     
-    // Watch stdin (fd 0) and the socket to see when either has input.
+    // Watch stdin (fd 0), the socket, and any watched fds to see when they have input.
     int nfds = 0;             // number of file descriptors to monitor
     FD_ZERO(&rfds);           // default to none
     if (handleInput != NULL) {
@@ -328,6 +943,12 @@ message_loop(void* arg, const float timeout,
       FD_SET(ourSocket, &rfds); // monitor the socket
       nfds = ourSocket+1;       // highest-numbered fd in rfds
     }
+    for (int i = 0; i < numWatches; i++) {
+      FD_SET(watches[i].fd, &rfds);
+      if (watches[i].fd >= nfds) {
+        nfds = watches[i].fd+1;
+      }
+    }
     if (timeout > 0.0) {      // is timeout desired?
       timer = timeoutval;     // set the timer to the timeout value
       timerp = &timer;        // pass that timer to select
@@ -335,6 +956,10 @@ message_loop(void* arg, const float timeout,
       timerp = NULL;          // no timeout is desired
     }
 
+    if (flushHandler != NULL) {
+      (*flushHandler)(flushArg);
+    }
+
     // Wait for input on either source
     int select_response = select(nfds, &rfds, NULL, NULL, timerp);
     // note: 'rfds' updated
@@ -351,7 +976,7 @@ message_loop(void* arg, const float timeout,
       }
     } else if (select_response == 0) {
       // timeout occurred
-      log_v("message_loop: select() timed out");
+      log_lv(log_DEBUG, "message_loop: select() timed out");
       if (handleTimeout != NULL && (*handleTimeout)(arg)) {
         break; // handler says to exit loop 
       }
@@ -360,46 +985,240 @@ message_loop(void* arg, const float timeout,
 
       if (FD_ISSET(0, &rfds)) {
         // stdin has input ready
-        log_v("message_loop: input ready on stdin");
+        log_lv(log_DEBUG, "message_loop: input ready on stdin");
         if (handleInput != NULL && (*handleInput)(arg)) {
           break; // handler says to exit loop 
         }
       }
       if (FD_ISSET(ourSocket, &rfds)) {
         // socket has input ready
-        log_v("message_loop: message ready on socket");
-        struct sockaddr_in sender;     // sender of this message
-        struct sockaddr *senderp = (struct sockaddr *) &sender;
-        socklen_t senderlen = sizeof(sender);  // must pass address to length
-        char buf[message_MaxBytes]; // buffer for reading data from socket
-        int nbytes = recvfrom(ourSocket, buf, message_MaxBytes-1, 
-                              0, senderp, &senderlen);
-        if (nbytes < 0) {
-          // error, ignore it
-          log_e("message_loop: receiving from socket");
-        } else {
-          buf[nbytes] = '\0';     // null terminate message string
-          // where was it from?
-          if (sender.sin_family != AF_INET) {
-            // ignore it
-            log_d("message_loop: non-Internet family %d\n", sender.sin_family);
-          } else {
-	    // record it
-	    log_s("message_loop: FROM %s", stringAddr(sender));
-	    log_d("message_loop: %d lines:", numLines(buf));
-	    log_s("%s", buf);
-
-            // handle it
-            if (handleMessage != NULL && (*handleMessage)(arg, sender, buf)) {
-              break; // handler says to exit loop 
-            }
-          }
+        log_lv(log_DEBUG, "message_loop: message ready on socket");
+        if (readSocket(ourSocket, arg, handleMessage)) {
+          break; // handler says to exit loop 
         }
       }
+      bool quit = false;
+      for (int i = numWatches - 1; i >= 0 && !quit; i--) {
+        if (i < numWatches && FD_ISSET(watches[i].fd, &rfds)) {
+          quit = runWatch(watches[i].fd);
+        }
+      }
+      if (quit) {
+        break; // handler says to exit loop 
+      }
     }
   }
   return true;
 }
+#endif
+
+/**************** readSocket ****************/
+/*
+ * A socket has input ready: receive and handle it, draining every
+ * datagram already waiting where recvmmsg is available.
+ * Returns true if the handler says to exit the loop.
+ */
+static bool
+readSocket(const int socket, void* arg,
+           bool (*handleMessage)(void* arg,
+                                 const addr_t from, const char* buf))
+{
+#ifdef MESSAGE_MMSG
+  if (recvBufs == NULL) {
+    recvBufs = malloc(RecvBatch * message_MaxBytes); // buffers for reading data from socket
+    if (recvBufs == NULL) {
+      log_v("message_loop: out of memory");
+      return false;
+    }
+  }
+  struct sockaddr_in senders[RecvBatch];       // senders of these messages
+  struct mmsghdr msgs[RecvBatch];
+  struct iovec iovs[RecvBatch];
+  bool quit = false;
+  int nmsgs = RecvBatch;
+  while (!quit && nmsgs == RecvBatch) {
+    for (int i = 0; i < RecvBatch; i++) {
+      iovs[i].iov_base = recvBufs + i * message_MaxBytes;
+      iovs[i].iov_len = message_MaxBytes-1;
+      memset(&msgs[i].msg_hdr, 0, sizeof(msgs[i].msg_hdr));
+      msgs[i].msg_hdr.msg_name = &senders[i];
+      msgs[i].msg_hdr.msg_namelen = sizeof(senders[i]);
+      msgs[i].msg_hdr.msg_iov = &iovs[i];
+      msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    nmsgs = recvmmsg(socket, msgs, RecvBatch, MSG_DONTWAIT, NULL);
+    if (nmsgs < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        // error, ignore it
+        log_e("message_loop: receiving from socket");
+      }
+      break;
+    }
+    for (int i = 0; i < nmsgs && !quit; i++) {
+      char* buf = recvBufs + i * message_MaxBytes;
+      buf[msgs[i].msg_len] = '\0'; // null terminate message string
+      if (msgs[i].msg_len >= FragHeader && buf[0] == FragMark) {
+        quit = handleFragment(socket, arg, senders[i], buf, msgs[i].msg_len, handleMessage);
+      } else {
+        quit = handleDatagram(arg, senders[i], buf, msgs[i].msg_len, handleMessage);
+      }
+    }
+  }
+  return quit;
+#else
+  struct sockaddr_in sender;     // sender of this message
+  struct sockaddr *senderp = (struct sockaddr *) &sender;
+  socklen_t senderlen = sizeof(sender);  // must pass address to length
+  char buf[message_MaxBytes]; // buffer for reading data from socket
+  int nbytes = recvfrom(socket, buf, message_MaxBytes-1, 
+                        0, senderp, &senderlen);
+  if (nbytes < 0) {
+    // error, ignore it
+    log_e("message_loop: receiving from socket");
+    return false;
+  }
+  buf[nbytes] = '\0';     // null terminate message string
+  if (nbytes >= FragHeader && buf[0] == FragMark) {
+    return handleFragment(socket, arg, sender, buf, nbytes, handleMessage);
+  }
+  return handleDatagram(arg, sender, buf, nbytes, handleMessage);
+#endif
+}
+
+/**************** handleDatagram ****************/
+/*
+ * Log one received datagram and pass it to the handler.
+ * Returns true if the handler says to exit the loop.
+ */
+static bool
+handleDatagram(void* arg, struct sockaddr_in sender,
+               char* buf, const size_t length,
+               bool (*handleMessage)(void* arg,
+                                     const addr_t from, const char* buf))
+{
+  // where was it from?
+  if (sender.sin_family != AF_INET) {
+    // ignore it
+    log_d("message_loop: non-Internet family %d\n", sender.sin_family);
+    return false;
+  }
+
+  // record it, cut short
+  if (log_enabled(log_DEBUG)) {
+    log_payload("message_loop: FROM %s", stringAddr(sender), buf, length);
+  }
+
+  // handle it
+  return handleMessage != NULL && (*handleMessage)(arg, sender, buf);
+}
+
+/**************** handleFragment ****************/
+/*
+ * Add one fragment to its sender's message; once the message is whole,
+ * pass it to handleDatagram. A fragment that does not follow the one
+ * before it, in the same message, drops the message under way; a first
+ * fragment starts a new one, so the next whole message still gets through.
+ * Returns true if the handler says to exit the loop.
+ */
+static bool
+handleFragment(const int socket, void* arg, struct sockaddr_in sender,
+               const char* buf, const size_t length,
+               bool (*handleMessage)(void* arg,
+                                     const addr_t from, const char* buf))
+{
+  uint32_t seq, length32;
+  uint16_t index16, count16;
+  memcpy(&seq, buf + 1, 4);
+  memcpy(&index16, buf + 5, 2);
+  memcpy(&count16, buf + 7, 2);
+  memcpy(&length32, buf + 9, 4);
+  seq = ntohl(seq);
+  int index = ntohs(index16);
+  int count = ntohs(count16);
+  size_t total = ntohl(length32);
+  const char* payload = buf + FragHeader;
+  size_t payloadLength = length - FragHeader;
+
+  // the fragment must be the size its place in the message implies
+  size_t offset = (size_t) index * FragPayload;
+  if (total > message_MaxFrameBytes || index >= count
+      || count != (total + FragPayload - 1) / FragPayload
+      || payloadLength != (total - offset < FragPayload ? total - offset : FragPayload)
+      || memchr(payload, '\0', payloadLength) != NULL) {
+    log_s("message_loop: malformed fragment from %s; ignored", stringAddr(sender));
+    return false;
+  }
+
+  reassembly_t* slot = findSlot(socket, sender);
+  if (index == 0) {
+    if (slot->partial) {
+      log_s("message_loop: dropping an unfinished message from %s", stringAddr(slot->from));
+    }
+    if (slot->capacity < total) {
+      char* bigger = realloc(slot->buf, total + 1);
+      if (bigger == NULL) {
+        log_v("message_loop: out of memory for a fragmented message");
+        slot->partial = false;
+        return false;
+      }
+      slot->buf = bigger;
+      slot->capacity = total;
+    }
+    slot->partial = true;
+    slot->seq = seq;
+    slot->count = count;
+    slot->next = 0;
+    slot->length = total;
+  }
+  else if (!slot->partial || slot->seq != seq || slot->next != index) {
+    if (slot->partial) {
+      log_s("message_loop: gap in a message from %s; dropped", stringAddr(sender));
+    }
+    slot->partial = false;
+    return false;
+  }
+
+  memcpy(slot->buf + offset, payload, payloadLength);
+  if (++slot->next < slot->count) {
+    return false;
+  }
+  slot->buf[slot->length] = '\0';
+  slot->partial = false;
+  log_ld(log_DEBUG, "message_loop: reassembled from %d fragments", slot->count);
+  return handleDatagram(arg, sender, slot->buf, slot->length, handleMessage);
+}
+
+/**************** findSlot ****************/
+/*
+ * The reassembly slot of a sender on a socket, taking over the least
+ * recently used slot, and dropping anything unfinished in it, for a new one.
+ */
+static reassembly_t*
+findSlot(const int socket, const addr_t from)
+{
+  reassembly_t* slot = NULL;
+  for (int i = 0; i < ReassemblySlots && slot == NULL; i++) {
+    if (slots[i].socket == socket && message_eqAddr(slots[i].from, from)) {
+      slot = &slots[i];
+    }
+  }
+  if (slot == NULL) {
+    slot = &slots[0];
+    for (int i = 1; i < ReassemblySlots; i++) {
+      if (slots[i].used < slot->used) {
+        slot = &slots[i];
+      }
+    }
+    if (slot->partial) {
+      log_s("message_loop: dropping an unfinished message from %s", stringAddr(slot->from));
+    }
+    slot->socket = socket;
+    slot->from = from;
+    slot->partial = false;
+  }
+  slot->used = ++slotClock;
+  return slot;
+}
 
 /**************** message_done ****************/
 /* 
@@ -413,6 +1232,23 @@ message_done(void)
     close(ourSocket);
     ourSocket = 0;
   }
+  while (numWatches > 0) {
+    if (watches[0].handleMessage != NULL) {
+      message_closeSocket(watches[0].fd);
+    } else {
+      message_unwatch(watches[0].fd); // closes our timerfds
+    }
+  }
+#ifdef MESSAGE_MMSG
+  free(recvBufs);
+  recvBufs = NULL;
+#endif
+  for (int i = 0; i < ReassemblySlots; i++) {
+    free(slots[i].buf);
+    slots[i] = (reassembly_t){ .buf = NULL };
+  }
+  flushHandler = NULL;
+  flushArg = NULL;
   log_v("message_done: message module closing down.");
 }
 
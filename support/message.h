@@ -50,6 +50,9 @@ typedef struct sockaddr_in addr_t;
 // https://en.wikipedia.org/wiki/User_Datagram_Protocol
 static const int message_MaxBytes = 65507;
 
+// Maximum length of a message sent in fragments; see message_send
+static const int message_MaxFrameBytes = 16*1024*1024;
+
 /****************** global functions *********************/
 
 /******************************************/
@@ -112,12 +115,35 @@ bool message_setAddr(const char* hostname, const char* portStr, addr_t* addr);
  *   a string containing the message.
  * Function returns: none
  * Assumptions: message_init() has already been called.
+ * Notes:
+ *   A message longer than one datagram (message_MaxBytes, less one) is
+ *   sent as a series of fragments, up to message_MaxFrameBytes in all,
+ *   and reassembled by message_loop at the other end. If a fragment is
+ *   lost or reordered, the receiver drops that whole message.
  * Logs:
  *   errors in arguments,
  *   errors in sending the message.
  */
 void message_send(const addr_t to, const char* message);
 
+/******************************************/
+/* message_send_batch: send several messages at once.
+ * Caller provides:
+ *   an array of n valid addresses,
+ *   an array of n strings; messages[i] is sent to to[i].
+ * Function returns: none
+ * Assumptions: message_init() has already been called.
+ * Notes:
+ *   Messages are sent in array order, as if by message_send, but with
+ *   as few system calls as possible (sendmmsg, where available).
+ *   The strings need only remain valid for the duration of the call.
+ *   Long messages are sent in fragments, as by message_send.
+ * Logs:
+ *   errors in arguments,
+ *   errors in sending the messages.
+ */
+void message_send_batch(const addr_t to[], const char* messages[], const int n);
+
 /******************************************/
 /* message_loop: loop, handling input and incoming messages.
  * Caller provides:
@@ -135,6 +161,11 @@ void message_send(const addr_t to, const char* message);
  *   handleMessage: provided the address from which the message arrived,
  *     and a string containing the contents of the message. The handler should
  *     realize the string's memory will be reused upon return from the handler.
+ *     Where the platform allows, every datagram already waiting is handled,
+ *     one after another, before the loop waits again.
+ *     A message sent in fragments is handled once, when it is whole.
+ *   Fds registered with message_watch and message_addTimer are watched too.
+ *   On Linux the loop waits with epoll; elsewhere with select.
  *   All are provided 'arg', passed-through untouched.
  *   Handlers should return true to terminate looping, false to keep looping.
  * Notes:
@@ -151,6 +182,112 @@ bool message_loop(void* arg, const float timeout,
                                         const addr_t from, 
                                         const char* message));
 
+/******************************************/
+/* message_watch: have message_loop also watch another file descriptor.
+ * Caller provides:
+ *   an open file descriptor, such as another socket,
+ *   a function called when the fd has input ready (not NULL),
+ *   a pointer passed through to that function (may be NULL).
+ * Function returns:
+ *   true if the fd is now watched; false on error.
+ * Notes:
+ *   May be called before or while message_loop runs.
+ *   With the epoll backend the fd is edge-triggered: the handler is only
+ *   called again once new input arrives, so it should read until the fd
+ *   would block. Make the fd non-blocking for that.
+ *   Like the other handlers, handleReady returns true to end the loop.
+ *   At most 1024 fds, timers and sockets can be watched at once.
+ * Logs: errors in arguments or in registering the fd.
+ */
+bool message_watch(const int fd, bool (*handleReady)(void* arg, int fd), void* arg);
+
+/******************************************/
+/* message_unwatch: stop watching an fd, or cancel a timer.
+ * Caller provides: an fd given to message_watch, or a timer returned by
+ *   message_addTimer. A watched fd is left open; a timer is closed.
+ * Function returns: none
+ * Logs: if the fd was not watched.
+ */
+void message_unwatch(const int fd);
+
+/******************************************/
+/* message_addTimer: have message_loop call a function periodically.
+ * Caller provides:
+ *   the interval in seconds (> 0),
+ *   a function to call every interval (not NULL),
+ *   a pointer passed through to that function (may be NULL).
+ * Function returns:
+ *   the timer, to pass to message_unwatch; -1 on error, or if the
+ *   platform has no timerfd (the select backend); callers can then
+ *   fall back to the timeout of message_loop.
+ * Notes:
+ *   Unlike the message_loop timeout, which only fires after a quiet
+ *   period, the timer fires every interval however busy the loop is.
+ *   handleTimer returns true to end the loop.
+ * Logs: errors in arguments or in creating the timer.
+ */
+int message_addTimer(const float interval, bool (*handleTimer)(void* arg), void* arg);
+
+/******************************************/
+/* message_openSocket: open another socket, for message_loop to watch.
+ * Caller provides:
+ *   a function for handling an inbound message on this socket (not NULL),
+ *   a pointer passed through to that function (may be NULL).
+ * Function returns:
+ *   the socket, to pass to message_sendOn and message_closeSocket;
+ *   -1 on error.
+ * Notes:
+ *   The socket has its own port, chosen by the system, much as for
+ *   message_init, so one program can act as many correspondents; a load
+ *   generator opens one per simulated client. Its messages reach its own
+ *   handler, in place of the handleMessage of message_loop, and long
+ *   messages are reassembled as for the message_init socket.
+ *   May be called before or while message_loop runs; counts toward the
+ *   limit of message_watch.
+ * Logs: errors in arguments or in opening the socket.
+ */
+int message_openSocket(bool (*handleMessage)(void* arg,
+                                             const addr_t from,
+                                             const char* message),
+                       void* arg);
+
+/******************************************/
+/* message_sendOn: send a message from a socket of message_openSocket.
+ * Caller provides:
+ *   a socket returned by message_openSocket,
+ *   a valid address to which to send the message,
+ *   a string containing the message.
+ * Function returns: none
+ * Notes: as for message_send; the receiver sees the socket's own port.
+ * Logs:
+ *   errors in arguments,
+ *   errors in sending the message.
+ */
+void message_sendOn(const int socket, const addr_t to, const char* message);
+
+/******************************************/
+/* message_closeSocket: stop watching a socket and close it.
+ * Caller provides: a socket returned by message_openSocket.
+ * Function returns: none
+ * Notes: message_done closes any sockets still open.
+ */
+void message_closeSocket(const int socket);
+
+/******************************************/
+/* message_setFlush: have message_loop call a function before each wait.
+ * Caller provides:
+ *   a function to call once the loop has handled everything that was
+ *   ready, just before it waits again (NULL for none),
+ *   a pointer passed through to that function (may be NULL).
+ * Function returns: none
+ * Notes:
+ *   For work that should be done once per batch of input rather than
+ *   once per message, such as a client drawing the screen after a burst
+ *   of updates; it is also called before the first wait.
+ *   May be called before or while message_loop runs.
+ */
+void message_setFlush(void (*handleFlush)(void* arg), void* arg);
+
 /******************************************/
 /* message_done: shut down the module.
  * Caller provides: nothing.
@@ -0,0 +1,655 @@
+/*
+ * protocol - parse and build the messages of the nuggets game
+ *
+ * See protocol.h for detailed interface description for each function.
+ *
+ * Compile with -DUNIT_TEST for a standalone unit test; see below.
+ *
+ * CS50 project Spring 2019
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <limits.h>
+#include "protocol.h"
+
+/**************** file-local types ****************/
+/* a message being written into a caller's buffer */
+typedef struct writer {
+  char* buf;
+  size_t size;
+  size_t len;    // characters written so far
+  bool fits;     // false once something did not fit
+} writer_t;
+
+/**************** file-local constants ****************/
+static const char RunMark = '~';    // starts a run in an RDISPLAY
+static const int MinRun = 4;        // shorter runs are cheaper written out
+
+/* the words of the capability line, indexed by bit number */
+static const char* capWords[] = { "rle" };
+static const int NumCaps = sizeof(capWords) / sizeof(capWords[0]);
+
+/* each keyword with its separator, and its name, indexed by protocol_type_t */
+static const struct {
+  const char* word;
+  size_t length;
+  const char* name;
+} keywords[] = {
+  [protocol_UNKNOWN]  = { "",          0, "UNKNOWN" },
+  [protocol_OK]       = { "OK ",       3, "OK" },
+  [protocol_GRID]     = { "GRID ",     5, "GRID" },
+  [protocol_GOLD]     = { "GOLD ",     5, "GOLD" },
+  [protocol_DISPLAY]  = { "DISPLAY\n", 8, "DISPLAY" },
+  [protocol_RDISPLAY] = { "RDISPLAY\n",9, "RDISPLAY" },
+  [protocol_DELTA]    = { "DELTA\n",   6, "DELTA" },
+  [protocol_QUIT]     = { "QUIT ",     5, "QUIT" },
+  [protocol_ERROR]    = { "ERROR ",    6, "ERROR" },
+  [protocol_KEY]      = { "KEY ",      4, "KEY" },
+  [protocol_PLAY]     = { "PLAY ",     5, "PLAY" },
+  [protocol_SPECTATE] = { "SPECTATE",  8, "SPECTATE" },
+  [protocol_STATS]    = { "STATS",     5, "STATS" },
+};
+
+/**************** file-local functions ****************/
+static bool readInt(const char** cursor, int* value);
+static bool readChar(const char** cursor, char ch);
+static unsigned readCaps(const char* line);
+static void putChars(writer_t* w, const char* chars, size_t n);
+static void putInt(writer_t* w, int value);
+static void putRepeat(writer_t* w, char ch, size_t n);
+static void putCaps(writer_t* w, unsigned caps);
+static int finish(writer_t* w);
+
+/**************** protocol_parse ****************/
+/* see protocol.h for description */
+protocol_type_t
+protocol_parse(const char* message, protocol_msg_t* msg)
+{
+  if (msg == NULL) {
+    return protocol_UNKNOWN;
+  }
+  msg->type = protocol_UNKNOWN;
+  msg->text = NULL;
+  msg->length = 0;
+  msg->caps = 0;
+  if (message == NULL) {
+    return protocol_UNKNOWN;
+  }
+
+  protocol_type_t type = protocol_keyword(message);
+  const char* p = message + keywords[type].length;
+  switch (type) {
+    case protocol_OK:
+      if (p[0] == '\0') {
+        return protocol_UNKNOWN;
+      }
+      msg->letter = p[0];
+      break;
+    case protocol_GRID:
+      if (!readInt(&p, &msg->grid.nrows) || !readChar(&p, ' ')
+          || !readInt(&p, &msg->grid.ncols) || *p != '\0') {
+        return protocol_UNKNOWN;
+      }
+      p = message + keywords[type].length;
+      break;
+    case protocol_GOLD:
+      if (!readInt(&p, &msg->gold.n) || !readChar(&p, ' ')
+          || !readInt(&p, &msg->gold.p) || !readChar(&p, ' ')
+          || !readInt(&p, &msg->gold.r) || *p != '\0') {
+        return protocol_UNKNOWN;
+      }
+      p = message + keywords[type].length;
+      break;
+    case protocol_KEY:
+      msg->key = p[0];
+      break;
+    case protocol_SPECTATE:
+      if (p[0] != '\0' && p[0] != ' ' && p[0] != '\n') {
+        return protocol_UNKNOWN;
+      }
+      // fall through, for the capability line
+    case protocol_PLAY: {
+      const char* newline = strchr(p, '\n');
+      msg->length = newline != NULL ? newline - p : strlen(p);
+      msg->caps = newline != NULL ? readCaps(newline + 1) : 0;
+      break;
+    }
+    case protocol_STATS:
+      if (p[0] == '\n') {
+        p++;   // the report of an answer
+      } else if (p[0] != '\0') {
+        return protocol_UNKNOWN;
+      }
+      break;
+    default:
+      break; // the rest is text, or the keyword was unknown
+  }
+  msg->type = type;
+  msg->text = type == protocol_UNKNOWN ? NULL : p;
+  return type;
+}
+
+/**************** protocol_keyword ****************/
+/* see protocol.h for description.
+ * One switch on the first character leaves at most two keywords to compare.
+ */
+protocol_type_t
+protocol_keyword(const char* message)
+{
+  if (message == NULL) {
+    return protocol_UNKNOWN;
+  }
+  protocol_type_t first = protocol_UNKNOWN, second = protocol_UNKNOWN;
+  switch (message[0]) {
+    case 'O': first = protocol_OK; break;
+    case 'G': first = protocol_GRID; second = protocol_GOLD; break;
+    case 'D': first = protocol_DISPLAY; second = protocol_DELTA; break;
+    case 'R': first = protocol_RDISPLAY; break;
+    case 'Q': first = protocol_QUIT; break;
+    case 'E': first = protocol_ERROR; break;
+    case 'K': first = protocol_KEY; break;
+    case 'P': first = protocol_PLAY; break;
+    case 'S': first = protocol_SPECTATE; second = protocol_STATS; break;
+    default: return protocol_UNKNOWN;
+  }
+  // strncmp stops at the message's NUL, so a short message is safe
+  if (strncmp(message, keywords[first].word, keywords[first].length) == 0) {
+    return first;
+  }
+  if (second != protocol_UNKNOWN
+      && strncmp(message, keywords[second].word, keywords[second].length) == 0) {
+    return second;
+  }
+  return protocol_UNKNOWN;
+}
+
+/**************** protocol_name ****************/
+/* see protocol.h for description */
+const char*
+protocol_name(protocol_type_t type)
+{
+  if (type <= protocol_UNKNOWN || type >= protocol_NumTypes) {
+    return keywords[protocol_UNKNOWN].name;
+  }
+  return keywords[type].name;
+}
+
+/**************** protocol_nextRun ****************/
+/* see protocol.h for description */
+bool
+protocol_nextRun(const char** cursor, protocol_run_t* run)
+{
+  if (cursor == NULL || *cursor == NULL || run == NULL) {
+    return false;
+  }
+  const char* p = *cursor;
+  if (!readInt(&p, &run->row) || !readChar(&p, ' ')
+      || !readInt(&p, &run->col) || !readChar(&p, ' ')
+      || !readInt(&p, &run->count) || !readChar(&p, ':')) {
+    return false;
+  }
+  // the run's characters must all be there, whatever they are
+  for (int i = 0; i < run->count; i++) {
+    if (p[i] == '\0') {
+      return false;
+    }
+  }
+  run->chars = p;
+  p += run->count;
+  if (*p == '\n') {
+    p++;
+  }
+  *cursor = p;
+  return true;
+}
+
+/**************** readInt ****************/
+/* read a non-negative decimal integer at the cursor, and move past it.
+ * false, leaving the cursor, if there are no digits or it overflows an int.
+ */
+static bool
+readInt(const char** cursor, int* value)
+{
+  const char* p = *cursor;
+  if (*p < '0' || *p > '9') {
+    return false;
+  }
+  int v = 0;
+  for (; *p >= '0' && *p <= '9'; p++) {
+    int digit = *p - '0';
+    if (v > (INT_MAX - digit) / 10) {
+      return false;
+    }
+    v = v*10 + digit;
+  }
+  *value = v;
+  *cursor = p;
+  return true;
+}
+
+/**************** readChar ****************/
+/* move past ch, if it is the character at the cursor */
+static bool
+readChar(const char** cursor, char ch)
+{
+  if (**cursor != ch) {
+    return false;
+  }
+  (*cursor)++;
+  return true;
+}
+
+/**************** readCaps ****************/
+/* the capability bits of the words on a capability line; others are ignored */
+static unsigned
+readCaps(const char* line)
+{
+  unsigned caps = 0;
+  const char* p = line;
+  while (*p != '\0' && *p != '\n') {
+    size_t n = strcspn(p, " \n");
+    for (int bit = 0; bit < NumCaps; bit++) {
+      if (strlen(capWords[bit]) == n && strncmp(p, capWords[bit], n) == 0) {
+        caps |= 1u << bit;
+      }
+    }
+    p += n;
+    if (*p == ' ') {
+      p++;
+    }
+  }
+  return caps;
+}
+
+/**************** protocol_encodeHeader ****************/
+/* see protocol.h for description */
+int
+protocol_encodeHeader(char* buf, size_t size, protocol_type_t type)
+{
+  bool known = type > protocol_UNKNOWN && type < protocol_NumTypes;
+  writer_t w = { buf, size, 0, known };
+  putChars(&w, keywords[known ? type : protocol_UNKNOWN].word,
+           keywords[known ? type : protocol_UNKNOWN].length);
+  return finish(&w);
+}
+
+/**************** protocol_encodeOK ****************/
+/* see protocol.h for description */
+int
+protocol_encodeOK(char* buf, size_t size, char letter)
+{
+  writer_t w = { buf, size, 0, true };
+  putChars(&w, keywords[protocol_OK].word, keywords[protocol_OK].length);
+  putChars(&w, &letter, 1);
+  return finish(&w);
+}
+
+/**************** protocol_encodeGRID ****************/
+/* see protocol.h for description */
+int
+protocol_encodeGRID(char* buf, size_t size, int nrows, int ncols)
+{
+  writer_t w = { buf, size, 0, true };
+  putChars(&w, keywords[protocol_GRID].word, keywords[protocol_GRID].length);
+  putInt(&w, nrows);
+  putChars(&w, " ", 1);
+  putInt(&w, ncols);
+  return finish(&w);
+}
+
+/**************** protocol_encodeGOLD ****************/
+/* see protocol.h for description */
+int
+protocol_encodeGOLD(char* buf, size_t size, int n, int p, int r)
+{
+  writer_t w = { buf, size, 0, true };
+  putChars(&w, keywords[protocol_GOLD].word, keywords[protocol_GOLD].length);
+  putInt(&w, n);
+  putChars(&w, " ", 1);
+  putInt(&w, p);
+  putChars(&w, " ", 1);
+  putInt(&w, r);
+  return finish(&w);
+}
+
+/**************** protocol_encodeQUIT ****************/
+/* see protocol.h for description */
+int
+protocol_encodeQUIT(char* buf, size_t size, const char* explanation)
+{
+  writer_t w = { buf, size, 0, explanation != NULL };
+  putChars(&w, keywords[protocol_QUIT].word, keywords[protocol_QUIT].length);
+  if (explanation != NULL) {
+    putChars(&w, explanation, strlen(explanation));
+  }
+  return finish(&w);
+}
+
+/**************** protocol_encodeERROR ****************/
+/* see protocol.h for description */
+int
+protocol_encodeERROR(char* buf, size_t size, const char* explanation)
+{
+  writer_t w = { buf, size, 0, explanation != NULL };
+  putChars(&w, keywords[protocol_ERROR].word, keywords[protocol_ERROR].length);
+  if (explanation != NULL) {
+    putChars(&w, explanation, strlen(explanation));
+  }
+  return finish(&w);
+}
+
+/**************** protocol_encodeKEY ****************/
+/* see protocol.h for description */
+int
+protocol_encodeKEY(char* buf, size_t size, char key)
+{
+  writer_t w = { buf, size, 0, true };
+  putChars(&w, keywords[protocol_KEY].word, keywords[protocol_KEY].length);
+  putChars(&w, &key, 1);
+  return finish(&w);
+}
+
+/**************** protocol_encodePLAY ****************/
+/* see protocol.h for description */
+int
+protocol_encodePLAY(char* buf, size_t size, const char* name, unsigned caps)
+{
+  writer_t w = { buf, size, 0, name != NULL && strchr(name, '\n') == NULL };
+  putChars(&w, keywords[protocol_PLAY].word, keywords[protocol_PLAY].length);
+  if (name != NULL) {
+    putChars(&w, name, strlen(name));
+  }
+  putCaps(&w, caps);
+  return finish(&w);
+}
+
+/**************** protocol_encodeSPECTATE ****************/
+/* see protocol.h for description */
+int
+protocol_encodeSPECTATE(char* buf, size_t size, unsigned caps)
+{
+  writer_t w = { buf, size, 0, true };
+  putChars(&w, keywords[protocol_SPECTATE].word, keywords[protocol_SPECTATE].length);
+  putCaps(&w, caps);
+  return finish(&w);
+}
+
+/**************** protocol_encodeRDISPLAY ****************/
+/* see protocol.h for description */
+int
+protocol_encodeRDISPLAY(char* buf, size_t size, const char* map, size_t length)
+{
+  writer_t w = { buf, size, 0, map != NULL };
+  putChars(&w, keywords[protocol_RDISPLAY].word, keywords[protocol_RDISPLAY].length);
+  // stop as soon as it no longer fits; the caller then sends the DISPLAY
+  for (size_t i = 0; i < length && w.fits; ) {
+    char ch = map[i];
+    size_t run = 1;
+    while (i + run < length && map[i + run] == ch) {
+      run++;
+    }
+    if (ch == RunMark || (run >= MinRun && (ch < '0' || ch > '9'))) {
+      putChars(&w, &RunMark, 1);
+      putInt(&w, run);
+      putChars(&w, &ch, 1);
+    } else {
+      putChars(&w, map + i, run);
+    }
+    i += run;
+  }
+  return finish(&w);
+}
+
+/**************** protocol_decodeRDISPLAY ****************/
+/* see protocol.h for description */
+int
+protocol_decodeRDISPLAY(const char* text, char* map, size_t size)
+{
+  writer_t w = { map, size, 0, text != NULL };
+  const char* p = text;
+  while (w.fits && *p != '\0') {
+    if (*p != RunMark) {
+      size_t n = strcspn(p, "~");
+      putChars(&w, p, n);
+      p += n;
+      continue;
+    }
+    p++;
+    int count;
+    if (!readInt(&p, &count) || *p == '\0') {
+      w.fits = false; // malformed run
+      break;
+    }
+    putRepeat(&w, *p++, count);
+  }
+  return finish(&w);
+}
+
+/**************** protocol_encodeRun ****************/
+/* see protocol.h for description */
+int
+protocol_encodeRun(char* buf, size_t size, int row, int col, int count, const char* chars)
+{
+  writer_t w = { buf, size, 0, chars != NULL && count >= 0 };
+  putInt(&w, row);
+  putChars(&w, " ", 1);
+  putInt(&w, col);
+  putChars(&w, " ", 1);
+  putInt(&w, count);
+  putChars(&w, ":", 1);
+  if (chars != NULL && count >= 0) {
+    putChars(&w, chars, count);
+  }
+  putChars(&w, "\n", 1);
+  return finish(&w);
+}
+
+/**************** putChars ****************/
+/* append n characters, if they fit with room left for the NUL */
+static void
+putChars(writer_t* w, const char* chars, size_t n)
+{
+  if (!w->fits || w->buf == NULL || w->size - w->len <= n) {
+    w->fits = false;
+    return;
+  }
+  memcpy(w->buf + w->len, chars, n);
+  w->len += n;
+}
+
+/**************** putRepeat ****************/
+/* append n copies of ch, if they fit with room left for the NUL */
+static void
+putRepeat(writer_t* w, char ch, size_t n)
+{
+  if (!w->fits || w->buf == NULL || w->size - w->len <= n) {
+    w->fits = false;
+    return;
+  }
+  memset(w->buf + w->len, ch, n);
+  w->len += n;
+}
+
+/**************** putCaps ****************/
+/* append the capability line for caps, if there are any */
+static void
+putCaps(writer_t* w, unsigned caps)
+{
+  const char* separator = "\n";
+  for (int bit = 0; bit < NumCaps; bit++) {
+    if (caps & (1u << bit)) {
+      putChars(w, separator, 1);
+      putChars(w, capWords[bit], strlen(capWords[bit]));
+      separator = " ";
+    }
+  }
+}
+
+/**************** putInt ****************/
+/* append a decimal integer */
+static void
+putInt(writer_t* w, int value)
+{
+  char digits[12];               // enough for INT_MIN
+  int i = sizeof(digits);
+  unsigned int v = value < 0 ? -(unsigned int)value : (unsigned int)value;
+  do {
+    digits[--i] = '0' + v % 10;
+    v /= 10;
+  } while (v > 0);
+  if (value < 0) {
+    digits[--i] = '-';
+  }
+  putChars(w, digits + i, sizeof(digits) - i);
+}
+
+/**************** finish ****************/
+/* terminate the message; its length, or -1 if it did not fit */
+static int
+finish(writer_t* w)
+{
+  if (!w->fits) {
+    if (w->buf != NULL && w->size > 0) {
+      w->buf[0] = '\0';
+    }
+    return -1;
+  }
+  w->buf[w->len] = '\0';
+  return w->len;
+}
+
+/* ************************* UNIT_TEST ****************************** */
+/*
+ * This unit test round-trips every kind of message through its encoder
+ * and protocol_parse, and checks that malformed messages are rejected.
+ * Run it as
+ *   ./protocoltest
+ */
+
+#ifdef UNIT_TEST
+
+#include "unittest.h"
+
+int
+main(const int argc, char* argv[])
+{
+  char buf[100];
+  protocol_msg_t msg;
+
+  check(protocol_encodeOK(buf, sizeof(buf), 'C') == 4 && strcmp(buf, "OK C") == 0,
+        "encode OK");
+  check(protocol_parse(buf, &msg) == protocol_OK && msg.letter == 'C', "parse OK");
+
+  check(protocol_encodeGRID(buf, sizeof(buf), 21, 79) > 0 && strcmp(buf, "GRID 21 79") == 0,
+        "encode GRID");
+  check(protocol_parse(buf, &msg) == protocol_GRID
+        && msg.grid.nrows == 21 && msg.grid.ncols == 79, "parse GRID");
+
+  check(protocol_encodeGOLD(buf, sizeof(buf), 0, 12, 238) > 0
+        && strcmp(buf, "GOLD 0 12 238") == 0, "encode GOLD");
+  check(protocol_parse(buf, &msg) == protocol_GOLD
+        && msg.gold.n == 0 && msg.gold.p == 12 && msg.gold.r == 238, "parse GOLD");
+
+  check(protocol_encodeKEY(buf, sizeof(buf), 'h') == 5 && strcmp(buf, "KEY h") == 0,
+        "encode KEY");
+  check(protocol_parse(buf, &msg) == protocol_KEY && msg.key == 'h', "parse KEY");
+
+  check(protocol_encodePLAY(buf, sizeof(buf), "Alice Smith", 0) > 0
+        && strcmp(buf, "PLAY Alice Smith") == 0, "encode PLAY");
+  check(protocol_parse(buf, &msg) == protocol_PLAY && strcmp(msg.text, "Alice Smith") == 0
+        && msg.text == buf + 5 && msg.length == 11 && msg.caps == 0, "parse PLAY, in place");
+
+  // capabilities
+  check(protocol_encodePLAY(buf, sizeof(buf), "Alice Smith", protocol_CapRLE) > 0
+        && strcmp(buf, "PLAY Alice Smith\nrle") == 0, "encode PLAY with caps");
+  check(protocol_parse(buf, &msg) == protocol_PLAY && msg.length == 11
+        && strncmp(msg.text, "Alice Smith", msg.length) == 0 && msg.caps == protocol_CapRLE,
+        "parse PLAY with caps");
+  check(protocol_encodePLAY(buf, sizeof(buf), "Alice\nrle", 0) == -1, "name with a newline");
+  check(protocol_encodeSPECTATE(buf, sizeof(buf), protocol_CapRLE) > 0
+        && strcmp(buf, "SPECTATE\nrle") == 0
+        && protocol_parse(buf, &msg) == protocol_SPECTATE && msg.caps == protocol_CapRLE,
+        "SPECTATE with caps");
+  check(protocol_parse("SPECTATE\nzstd rle later", &msg) == protocol_SPECTATE
+        && msg.caps == protocol_CapRLE, "unknown capabilities ignored");
+  check(protocol_parse("SPECTATE\nrles", &msg) == protocol_SPECTATE && msg.caps == 0,
+        "capabilities are whole words");
+
+  check(protocol_encodeQUIT(buf, sizeof(buf), "Thanks for playing!") > 0
+        && protocol_parse(buf, &msg) == protocol_QUIT
+        && strcmp(msg.text, "Thanks for playing!") == 0, "QUIT");
+  check(protocol_encodeERROR(buf, sizeof(buf), "Unknown Keystroke: x") > 0
+        && protocol_parse(buf, &msg) == protocol_ERROR
+        && strcmp(msg.text, "Unknown Keystroke: x") == 0, "ERROR");
+  check(protocol_encodeSPECTATE(buf, sizeof(buf), 0) == 8 && strcmp(buf, "SPECTATE") == 0
+        && protocol_parse(buf, &msg) == protocol_SPECTATE && msg.caps == 0, "SPECTATE");
+  check(protocol_encodeHeader(buf, sizeof(buf), protocol_STATS) == 5
+        && protocol_parse(buf, &msg) == protocol_STATS && *msg.text == '\0', "STATS request");
+  check(protocol_parse("STATS\ngame id=0\n", &msg) == protocol_STATS
+        && strcmp(msg.text, "game id=0\n") == 0, "STATS answer");
+  check(protocol_parse("STATSX", &msg) == protocol_UNKNOWN, "STATSX");
+  check(protocol_keyword("STATSX") == protocol_STATS && protocol_keyword("GOLD x") == protocol_GOLD
+        && protocol_keyword("DELTA\n") == protocol_DELTA && protocol_keyword("GO") == protocol_UNKNOWN
+        && protocol_keyword(NULL) == protocol_UNKNOWN, "protocol_keyword");
+  check(strcmp(protocol_name(protocol_DELTA), "DELTA") == 0
+        && strcmp(protocol_name(protocol_STATS), "STATS") == 0
+        && strcmp(protocol_name(protocol_NumTypes), "UNKNOWN") == 0, "protocol_name");
+  check(protocol_parse("DISPLAY\n+--+\n", &msg) == protocol_DISPLAY
+        && strcmp(msg.text, "+--+\n") == 0, "DISPLAY");
+
+  // a DELTA built run by run, then decoded
+  int len = protocol_encodeHeader(buf, sizeof(buf), protocol_DELTA);
+  len += protocol_encodeRun(buf + len, sizeof(buf) - len, 3, 10, 2, "@*xyz");
+  len += protocol_encodeRun(buf + len, sizeof(buf) - len, 14, 0, 1, ".");
+  check(strcmp(buf, "DELTA\n3 10 2:@*\n14 0 1:.\n") == 0, "encode DELTA");
+  check(protocol_parse(buf, &msg) == protocol_DELTA, "parse DELTA");
+  const char* cursor = msg.text;
+  protocol_run_t run;
+  check(protocol_nextRun(&cursor, &run) && run.row == 3 && run.col == 10 && run.count == 2
+        && strncmp(run.chars, "@*", 2) == 0, "first run");
+  check(protocol_nextRun(&cursor, &run) && run.row == 14 && run.col == 0 && run.count == 1
+        && run.chars[0] == '.', "second run");
+  check(!protocol_nextRun(&cursor, &run) && *cursor == '\0', "end of runs");
+  cursor = "3 4 5:ab";
+  check(!protocol_nextRun(&cursor, &run) && *cursor == '3', "short run");
+
+  // run-length maps: long runs shrink, '~' and runs of digits survive
+  const char* map = "          +---+   \n~~ 1111 ....  *\n                \n";
+  char rle[100], out[100];
+  int rleLen = protocol_encodeRDISPLAY(rle, sizeof(rle), map, strlen(map));
+  check(rleLen > 0 && rleLen < strlen("DISPLAY\n") + strlen(map), "encode RDISPLAY");
+  check(protocol_parse(rle, &msg) == protocol_RDISPLAY
+        && protocol_decodeRDISPLAY(msg.text, out, sizeof(out)) == strlen(map)
+        && strcmp(out, map) == 0, "RDISPLAY round trip");
+  check(protocol_encodeRDISPLAY(rle, rleLen, map, strlen(map)) == -1,
+        "RDISPLAY one byte short");
+  check(protocol_decodeRDISPLAY("ab~4", out, sizeof(out)) == -1, "RDISPLAY run without char");
+  check(protocol_decodeRDISPLAY("ab~x", out, sizeof(out)) == -1, "RDISPLAY run without count");
+  check(protocol_decodeRDISPLAY("~50 ", out, 50) == -1, "RDISPLAY map too big");
+  check(protocol_decodeRDISPLAY("~49 ", out, 50) == 49, "RDISPLAY map just fits");
+
+  // malformed or unknown messages
+  check(protocol_parse("GRID 21", &msg) == protocol_UNKNOWN, "GRID missing a field");
+  check(protocol_parse("GOLD 1 2 x", &msg) == protocol_UNKNOWN, "GOLD not a number");
+  check(protocol_parse("GOLD 1 2 99999999999", &msg) == protocol_UNKNOWN, "GOLD overflow");
+  check(protocol_parse("OK ", &msg) == protocol_UNKNOWN, "OK without letter");
+  check(protocol_parse("SPECTATOR", &msg) == protocol_UNKNOWN, "SPECTATOR");
+  check(protocol_parse("PLAYER x", &msg) == protocol_UNKNOWN, "PLAYER");
+  check(protocol_parse("G", &msg) == protocol_UNKNOWN, "short message");
+  check(protocol_parse("", &msg) == protocol_UNKNOWN && msg.text == NULL, "empty message");
+  check(protocol_parse(NULL, &msg) == protocol_UNKNOWN, "NULL message");
+
+  // encoders report what does not fit
+  check(protocol_encodeGOLD(buf, 8, 1, 2, 3) == -1 && buf[0] == '\0', "GOLD too big");
+  check(protocol_encodeGOLD(buf, 10, 1, 2, 3) == -1, "GOLD with no room for the NUL");
+  check(protocol_encodeGOLD(buf, 11, 1, 2, 3) == 10, "GOLD just fits");
+  check(protocol_encodeHeader(buf, sizeof(buf), protocol_UNKNOWN) == -1, "no header");
+
+  printf("all protocol tests passed\n");
+  return 0;
+}
+
+#endif // UNIT_TEST
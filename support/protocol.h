@@ -0,0 +1,195 @@
+/*
+ * protocol - parse and build the messages of the nuggets game
+ *
+ * Decodes a received message in one pass, without copying or changing it:
+ * the keyword is dispatched on its first character, and any text after
+ * the keyword is left in place for the caller, pointed to by the result.
+ * The encoders write a message into a caller's buffer, without sprintf,
+ * and report its length, so callers can append to it or send it as is.
+ *
+ * A client may list the optional features it understands, its capabilities,
+ * on a second line of PLAY or SPECTATE ("PLAY Alice\nrle"); a server only
+ * sends what the client asked for. Unknown capability words are ignored.
+ *
+ * Typical receiving code looks like this:
+ *   protocol_msg_t msg;
+ *   switch (protocol_parse(message, &msg)) {
+ *     case protocol_GOLD: ... msg.gold.n, msg.gold.p, msg.gold.r ...
+ *     case protocol_PLAY: ... msg.text is the real name ...
+ *     ...
+ *   }
+ *
+ * CS50 project Spring 2019
+ */
+
+#ifndef _PROTOCOL_H_
+#define _PROTOCOL_H_
+
+#include <stdio.h>
+#include <stdbool.h>
+
+/****************** constants *********************/
+// capability bits, and their words on the capability line
+static const unsigned protocol_CapRLE = 0x1;  // "rle": accepts RDISPLAY
+
+/****************** types *********************/
+/* the kinds of message; protocol_UNKNOWN for anything not well formed */
+typedef enum protocol_type {
+  protocol_UNKNOWN = 0,
+  protocol_OK,         // OK L
+  protocol_GRID,       // GRID nrows ncols
+  protocol_GOLD,       // GOLD n p r
+  protocol_DISPLAY,    // DISPLAY\nstring
+  protocol_RDISPLAY,   // RDISPLAY\nstring, run-length encoded; see protocol_encodeRDISPLAY
+  protocol_DELTA,      // DELTA\nr c n:chars\n...
+  protocol_QUIT,       // QUIT explanation
+  protocol_ERROR,      // ERROR explanation
+  protocol_KEY,        // KEY k
+  protocol_PLAY,       // PLAY real name[\ncapabilities]
+  protocol_SPECTATE,   // SPECTATE[\ncapabilities]
+  protocol_STATS,      // STATS, a request; STATS\nreport, the server's answer
+  protocol_NumTypes    // not a type: the number of them
+} protocol_type_t;
+
+/* a parsed message. 'text' points into the parsed message, just past the
+ * keyword and its separator: the map of a DISPLAY or RDISPLAY, the runs of
+ * a DELTA, the explanation of a QUIT or ERROR, the name of a PLAY, the key
+ * of a KEY, the report of a STATS answer (empty for a request). It is valid only as long as the message is.
+ * For PLAY and SPECTATE, the text ends at 'length', where any capability
+ * line begins, and 'caps' holds the capabilities listed; for other types
+ * the text runs to the NUL, and length and caps are 0.
+ */
+typedef struct protocol_msg {
+  protocol_type_t type;
+  const char* text;
+  size_t length;
+  unsigned caps;
+  union {
+    char letter;                       // OK
+    char key;                          // KEY
+    struct { int nrows, ncols; } grid; // GRID
+    struct { int n, p, r; } gold;      // GOLD
+  };
+} protocol_msg_t;
+
+/* one run of changed cells in a DELTA: 'count' characters from 'chars'
+ * replace those of row 'row' from column 'col'. 'chars' points into the
+ * message and is not NUL-terminated after the run.
+ */
+typedef struct protocol_run {
+  int row, col, count;
+  const char* chars;
+} protocol_run_t;
+
+/****************** global functions *********************/
+
+/******************************************/
+/* protocol_parse: decode a message.
+ * Caller provides:
+ *   a NUL-terminated message (may be NULL),
+ *   a pointer to a protocol_msg_t to fill in.
+ * Function returns:
+ *   the type of the message, also stored in msg->type;
+ *   protocol_UNKNOWN if the keyword is unknown or its fields malformed.
+ * Notes:
+ *   The message is neither copied nor changed, and nothing is allocated.
+ *   The numbers of GRID and GOLD must be non-negative decimal integers.
+ *   KEY takes the first character after "KEY " (NUL if there is none);
+ *   SPECTATE may be followed by a space and further text, ignored.
+ *   A capability line starts after the first newline of PLAY or SPECTATE.
+ */
+protocol_type_t protocol_parse(const char* message, protocol_msg_t* msg);
+
+/******************************************/
+/* protocol_keyword: the type a message's keyword names, its fields
+ * unchecked; cheaper than protocol_parse where the message is known to
+ * be well formed, as when counting the server's own messages.
+ * Caller provides: a message, or NULL.
+ * Function returns: the type, or protocol_UNKNOWN if no keyword begins it.
+ */
+protocol_type_t protocol_keyword(const char* message);
+
+/******************************************/
+/* protocol_name: the keyword of a type, without its separator, such as
+ * "DELTA"; "UNKNOWN" for protocol_UNKNOWN or a value out of range.
+ */
+const char* protocol_name(protocol_type_t type);
+
+/******************************************/
+/* protocol_nextRun: decode the next run of a DELTA.
+ * Caller provides:
+ *   a cursor into the runs, initially the 'text' of a parsed DELTA,
+ *   a pointer to a protocol_run_t to fill in.
+ * Function returns:
+ *   true if a run was decoded, and the cursor moved past it;
+ *   false at the end of the runs, or at a malformed run, where the cursor
+ *   is left; **cursor is NUL only in the first case.
+ * Notes:
+ *   Bounds against a particular map are for the caller to check.
+ */
+bool protocol_nextRun(const char** cursor, protocol_run_t* run);
+
+/******************************************/
+/* The encoders below each write one message into buf, NUL-terminated.
+ * Caller provides:
+ *   a buffer and its size in bytes, then the fields of the message.
+ * Function returns:
+ *   the length of the message, not counting the NUL;
+ *   -1 if it does not fit in size bytes, when buf holds no message.
+ */
+
+/* protocol_encodeHeader: the keyword of a message and its separator alone,
+ * such as "DISPLAY\n" or "SPECTATE"; the caller appends the rest, if any.
+ */
+int protocol_encodeHeader(char* buf, size_t size, protocol_type_t type);
+
+/* OK L */
+int protocol_encodeOK(char* buf, size_t size, char letter);
+
+/* GRID nrows ncols */
+int protocol_encodeGRID(char* buf, size_t size, int nrows, int ncols);
+
+/* GOLD n p r */
+int protocol_encodeGOLD(char* buf, size_t size, int n, int p, int r);
+
+/* QUIT explanation */
+int protocol_encodeQUIT(char* buf, size_t size, const char* explanation);
+
+/* ERROR explanation */
+int protocol_encodeERROR(char* buf, size_t size, const char* explanation);
+
+/* KEY k */
+int protocol_encodeKEY(char* buf, size_t size, char key);
+
+/* PLAY real name, then a capability line if caps is not 0 */
+int protocol_encodePLAY(char* buf, size_t size, const char* name, unsigned caps);
+
+/* SPECTATE, then a capability line if caps is not 0 */
+int protocol_encodeSPECTATE(char* buf, size_t size, unsigned caps);
+
+/* RDISPLAY: the first 'length' characters of a map, runs of four or more of
+ * the same character written as '~', the run length in decimal, and the
+ * character. Runs of digits are left alone, and a '~' is always written
+ * as a run. Maps are mostly unseen rock, so this is usually far smaller
+ * than the DISPLAY; with size no bigger than the DISPLAY, -1 means the
+ * DISPLAY is the better message.
+ */
+int protocol_encodeRDISPLAY(char* buf, size_t size, const char* map, size_t length);
+
+/* one DELTA run, "r c n:chars\n", where chars holds at least n characters;
+ * to be appended after protocol_encodeHeader(buf, size, protocol_DELTA).
+ */
+int protocol_encodeRun(char* buf, size_t size, int row, int col, int count, const char* chars);
+
+/******************************************/
+/* protocol_decodeRDISPLAY: expand the text of a parsed RDISPLAY.
+ * Caller provides:
+ *   the 'text' of a parsed RDISPLAY,
+ *   a buffer for the map and its size in bytes.
+ * Function returns:
+ *   the length of the map written into buf, NUL-terminated;
+ *   -1 if the text is malformed or the map does not fit in size bytes.
+ */
+int protocol_decodeRDISPLAY(const char* text, char* map, size_t size);
+
+#endif // _PROTOCOL_H_
@@ -0,0 +1,200 @@
+/*
+ * stats - latency histograms cheap enough for a server's hot paths
+ *
+ * See stats.h for detailed interface description for each function.
+ *
+ * Compile with -DUNIT_TEST for a standalone unit test; see below.
+ *
+ * hemlock, May 2021
+ */
+
+#define _POSIX_C_SOURCE 200809L  // clock_gettime
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include "stats.h"
+
+/**************** file-local functions ****************/
+static uint64_t bucketTop(const int bucket);
+
+/**************** stats_now ****************/
+/* see stats.h for description */
+uint64_t
+stats_now(void)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t) now.tv_sec * 1000000000u + now.tv_nsec;
+}
+
+/**************** stats_merge ****************/
+/* see stats.h for description */
+void
+stats_merge(stats_hist_t* into, const stats_hist_t* from)
+{
+  into->count += from->count;
+  into->sum += from->sum;
+  if (from->max > into->max) {
+    into->max = from->max;
+  }
+  for (int b = 0; b < stats_Buckets; b++) {
+    into->buckets[b] += from->buckets[b];
+  }
+}
+
+/**************** stats_quantile ****************/
+/* see stats.h for description */
+uint64_t
+stats_quantile(const stats_hist_t* hist, const double q)
+{
+  if (hist->count == 0) {
+    return 0;
+  }
+  // the rank of the quantile, from 1 to count
+  uint64_t rank = (uint64_t) (q * hist->count);
+  if (rank < q * hist->count) {
+    rank++;
+  }
+  if (rank < 1) {
+    rank = 1;
+  }
+  if (rank > hist->count) {
+    rank = hist->count;
+  }
+  uint64_t seen = 0;
+  for (int b = 0; b < stats_Buckets; b++) {
+    seen += hist->buckets[b];
+    if (seen >= rank) {
+      uint64_t top = bucketTop(b);
+      return top < hist->max ? top : hist->max;
+    }
+  }
+  return hist->max;
+}
+
+/**************** bucketTop ****************/
+/* the longest duration a bucket holds: b significant bits, all set */
+static uint64_t
+bucketTop(const int bucket)
+{
+  return bucket >= 64 ? UINT64_MAX : ((uint64_t) 1 << bucket) - 1;
+}
+
+/**************** stats_formatHist ****************/
+/* see stats.h for description */
+int
+stats_formatHist(char* buf, const size_t size, const char* name,
+                 const stats_hist_t* hist)
+{
+  int len = snprintf(buf, size,
+                     "%s calls=%llu total_ns=%llu max_ns=%llu p50_ns=%llu p90_ns=%llu p99_ns=%llu\n",
+                     name,
+                     (unsigned long long) hist->count,
+                     (unsigned long long) hist->sum,
+                     (unsigned long long) hist->max,
+                     (unsigned long long) stats_quantile(hist, 0.50),
+                     (unsigned long long) stats_quantile(hist, 0.90),
+                     (unsigned long long) stats_quantile(hist, 0.99));
+  if (len < 0 || len >= size) {
+    if (size > 0) {
+      buf[0] = '\0';
+    }
+    return -1;
+  }
+  return len;
+}
+
+
+/* ****************************************************************** */
+/* ************************* UNIT_TEST ****************************** */
+/*
+ * This unit test records known durations and checks the buckets, the
+ * quantiles, merging and the formatted line. Run it as
+ *   ./statstest
+ */
+
+#ifdef UNIT_TEST
+
+#include "unittest.h"
+
+int
+main(const int argc, char* argv[])
+{
+  stats_hist_t hist;
+  memset(&hist, 0, sizeof(hist));
+  check(stats_quantile(&hist, 0.5) == 0, "empty histogram");
+
+  // bucket b holds durations of b significant bits
+  stats_record(&hist, 0);
+  stats_record(&hist, 1);
+  stats_record(&hist, 2);
+  stats_record(&hist, 3);
+  stats_record(&hist, 1024);
+  stats_record(&hist, UINT64_MAX >> 1);
+  stats_record(&hist, UINT64_MAX);
+  check(hist.buckets[0] == 1 && hist.buckets[1] == 1 && hist.buckets[2] == 2
+        && hist.buckets[11] == 1 && hist.buckets[63] == 1 && hist.buckets[64] == 1,
+        "buckets");
+  check(hist.count == 7 && hist.max == UINT64_MAX, "count and max");
+
+  // the top two buckets end at 2^63 - 1 and 2^64 - 1
+  memset(&hist, 0, sizeof(hist));
+  stats_record(&hist, (uint64_t) 1 << 62);
+  stats_record(&hist, UINT64_MAX);
+  check(stats_quantile(&hist, 0.5) == UINT64_MAX >> 1, "top of bucket 63");
+  check(stats_quantile(&hist, 1.0) == UINT64_MAX, "top of bucket 64");
+
+  // a thousand events of 100 ns and ten of 1 ms: the quantiles are the
+  // tops of their buckets, 127 ns and 1048575 ns, but never above the max
+  memset(&hist, 0, sizeof(hist));
+  for (int i = 0; i < 1000; i++) {
+    stats_record(&hist, 100);
+  }
+  for (int i = 0; i < 10; i++) {
+    stats_record(&hist, 1000000);
+  }
+  check(stats_quantile(&hist, 0.50) == 127, "p50");
+  check(stats_quantile(&hist, 0.99) == 127, "p99 of 1010 events, 1000 of them short");
+  check(stats_quantile(&hist, 0.995) == 1000000, "p99.5 is capped at the max");
+  check(stats_quantile(&hist, 0.0) == 127 && stats_quantile(&hist, 1.0) == 1000000,
+        "p0 and p100");
+  check(hist.sum == 1000 * 100 + 10 * 1000000, "sum");
+
+  // merging two halves gives the whole
+  stats_hist_t a, b;
+  memset(&a, 0, sizeof(a));
+  memset(&b, 0, sizeof(b));
+  for (int i = 0; i < 500; i++) {
+    stats_record(&a, 100);
+    stats_record(&b, 100);
+  }
+  for (int i = 0; i < 10; i++) {
+    stats_record(&b, 1000000);
+  }
+  stats_merge(&a, &b);
+  check(memcmp(&a, &hist, sizeof(hist)) == 0, "merge");
+
+  // the clock goes forward, and a timed stretch lands in the histogram
+  memset(&a, 0, sizeof(a));
+  uint64_t start = stats_now();
+  struct timespec pause = { 0, 2000000 };
+  nanosleep(&pause, NULL);
+  stats_since(&a, start);
+  check(a.count == 1 && a.max >= 2000000 && a.max < 1000000000, "stats_since");
+
+  // the formatted line, and one too long for its buffer
+  char buf[200];
+  int len = stats_formatHist(buf, sizeof(buf), "work", &hist);
+  check(len > 0 && strcmp(buf, "work calls=1010 total_ns=10100000 max_ns=1000000"
+                          " p50_ns=127 p90_ns=127 p99_ns=127\n") == 0, "format");
+  check(stats_formatHist(buf, len, "work", &hist) == -1 && buf[0] == '\0', "format too long");
+  check(stats_formatHist(buf, len + 1, "work", &hist) == len, "format just fits");
+
+  printf("all stats tests passed\n");
+  return 0;
+}
+
+#endif // UNIT_TEST
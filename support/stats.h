@@ -0,0 +1,97 @@
+/*
+ * stats - latency histograms cheap enough for a server's hot paths
+ *
+ * A histogram counts events and sums their durations, in nanoseconds on
+ * the monotonic clock, into power-of-two buckets: bucket b holds the
+ * durations with b significant bits, from 2^(b-1) up to 2^b - 1 ns.
+ * Recording is a clock read, a count of leading zeros and a few adds,
+ * and nothing is ever allocated. Quantiles are read off the buckets, so
+ * they are upper bounds within a factor of two, which is plenty to see
+ * where time goes and how it moves.
+ *
+ * A histogram is not thread-safe: give each thread its own, and add them
+ * up with stats_merge when reporting.
+ *
+ * Typical code looks like this:
+ *   uint64_t start = stats_now();
+ *   ... the work being timed ...
+ *   stats_since(&hist, start);
+ *   ...
+ *   stats_formatHist(buf, size, "work", &hist);
+ *
+ * hemlock, May 2021
+ */
+
+#ifndef _STATS_H_
+#define _STATS_H_
+
+#include <stdio.h>
+#include <stdint.h>
+
+/****************** constants *********************/
+#define stats_Buckets 65      // 0 to 64 significant bits: any uint64_t
+
+/****************** types *********************/
+typedef struct stats_hist {
+  uint64_t count;              // events recorded
+  uint64_t sum;                // their total duration, ns
+  uint64_t max;                // the longest, ns
+  uint64_t buckets[stats_Buckets];
+} stats_hist_t;
+
+/****************** global functions *********************/
+
+/******************************************/
+/* stats_now: the monotonic clock, in nanoseconds.
+ */
+uint64_t stats_now(void);
+
+/******************************************/
+/* stats_record: add one event of the given duration to a histogram.
+ */
+static inline void
+stats_record(stats_hist_t* hist, const uint64_t ns)
+{
+  hist->count++;
+  hist->sum += ns;
+  if (ns > hist->max) {
+    hist->max = ns;
+  }
+  hist->buckets[ns == 0 ? 0 : 64 - __builtin_clzll(ns)]++;
+}
+
+/******************************************/
+/* stats_since: record the time since 'start', a value of stats_now.
+ */
+static inline void
+stats_since(stats_hist_t* hist, const uint64_t start)
+{
+  stats_record(hist, stats_now() - start);
+}
+
+/******************************************/
+/* stats_merge: add every event of 'from' into 'into'.
+ */
+void stats_merge(stats_hist_t* into, const stats_hist_t* from);
+
+/******************************************/
+/* stats_quantile: an upper bound on the q-quantile of a histogram.
+ * Caller provides: a histogram, and q between 0 and 1.
+ * Function returns:
+ *   the top of the bucket holding the q-quantile, no more than the max;
+ *   0 for an empty histogram.
+ */
+uint64_t stats_quantile(const stats_hist_t* hist, const double q);
+
+/******************************************/
+/* stats_formatHist: one line describing a histogram,
+ *   "name calls=N total_ns=N max_ns=N p50_ns=N p90_ns=N p99_ns=N\n".
+ * Caller provides: a buffer and its size in bytes, a name, a histogram.
+ * Function returns:
+ *   the length of the line, not counting the NUL;
+ *   -1 if it does not fit in size bytes, when buf holds no line.
+ */
+int stats_formatHist(char* buf, const size_t size, const char* name,
+                     const stats_hist_t* hist);
+
+#endif // _STATS_H_
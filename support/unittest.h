@@ -0,0 +1,33 @@
+/*
+ * unittest - the check shared by the support modules' unit tests
+ *
+ * Each module's UNIT_TEST main includes this header and states what it
+ * expects with check(); the test prints a line per check and exits
+ * non-zero at the first one that fails.
+ *
+ * hemlock, May 2021
+ */
+
+#ifndef _UNITTEST_H_
+#define _UNITTEST_H_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+
+/**************** check ****************/
+/* Print whether a check held, and exit at the first that does not.
+ *
+ * Caller provides:
+ *   the outcome of the check, and a few words saying what was checked.
+ */
+static inline void
+check(const bool ok, const char* what)
+{
+  printf("%s: %s\n", ok ? "ok" : "FAILED", what);
+  if (!ok) {
+    exit(1);
+  }
+}
+
+#endif // _UNITTEST_H_